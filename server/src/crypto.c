@@ -8,6 +8,485 @@
 
 #include "crypto.h"
 
+#include <errno.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/**************
+ * STRUCTURES *
+ **************/
+/*
+ * The records of a seal made so far, in an unnamed
+ * temporary file; record i is at i * (DP_SEAL_RECORD_LEN +
+ * DP_SEAL_TAG_LEN).
+ */
+struct dp_seal_spill {
+	pthread_mutex_t lock;
+	unsigned char *made;	/* One bit per record, set once it is in the file */
+	FILE *fptr;
+	uint64_t count;
+};
+
+struct dp_seal_stream {
+	unsigned char nonce[DP_SEAL_NONCE_LEN];
+	EVP_CIPHER_CTX *ctx;
+	uint64_t count;		/* Records so far */
+	int encrypt;
+	int final;		/* Set once the last record went through */
+};
+/**********************/
+
+/**********************
+ * Private Prototypes
+ **********************/
+int seal_record_get(const struct dp_seal *, struct dp_seal_stream **, const struct data64 *, uint64_t, unsigned char *);
+/**********************/
+
+
+void seal_free(struct dp_seal **seal)
+{
+	if (seal &&
+	    *seal) {
+		if ((*seal)->spill) {
+			pthread_mutex_destroy(&(*seal)->spill->lock);
+			fclose((*seal)->spill->fptr);
+			free((*seal)->spill->made);
+			free((*seal)->spill);
+		}
+		
+		OPENSSL_cleanse((*seal)->key, DP_SEAL_KEY_LEN);
+		free(*seal);
+		*seal = NULL;
+	}
+}
+
+/*
+ * Wraps the seal's key for one recipient and puts it
+ * together with what else they need to open the seal.
+ * Followed by the records, this makes up the sealed
+ * payload sent to them; the records themselves are the
+ * same for everyone.
+ * Only RSA keys can wrap (RSA-OAEP).
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int seal_head_make(const struct dp_seal *seal, EVP_PKEY *pkey, struct data64 **out)
+{
+	EVP_PKEY_CTX *ctx;
+	size_t wrapped_len;
+	int pos;
+	
+	if (!seal ||
+	    !pkey ||
+	    !out)
+		return 1;
+	
+	*out = NULL;
+	
+	if (!(ctx = EVP_PKEY_CTX_new(pkey, NULL)))
+		return -1;
+	
+	if (EVP_PKEY_encrypt_init(ctx) <= 0 ||
+	    EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING) <= 0 ||
+	    EVP_PKEY_encrypt(ctx, NULL, &wrapped_len, seal->key, DP_SEAL_KEY_LEN) <= 0 ||
+	    wrapped_len > UINT16_MAX) {
+		EVP_PKEY_CTX_free(ctx);
+		return -1;
+	}
+	
+	pos = 0;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Magic number (8 bytes)
+	 * 2) Wrapped key size (2 bytes)
+	 * 3) Wrapped key
+	 * 4) Nonce (12 bytes)
+	 * 5) Record size (4 bytes)
+	 * ...followed by the records; see seal_record().
+	 */
+	*out = (struct data64 *)malloc(sizeof(**out));
+	(*out)->len = DP_SEAL_MAGIC_LEN + sizeof(uint16_t) + wrapped_len + DP_SEAL_NONCE_LEN + sizeof(uint32_t);
+	(*out)->bytes = (unsigned char *)calloc((*out)->len, sizeof(unsigned char));
+	
+	/* 1) Magic number (8 bytes) */
+	memcpy((*out)->bytes, DP_SEAL_MAGIC, DP_SEAL_MAGIC_LEN);
+	pos += DP_SEAL_MAGIC_LEN;
+	
+	/* 3) Wrapped key */
+	if (EVP_PKEY_encrypt(ctx, &(*out)->bytes[pos + sizeof(uint16_t)], &wrapped_len, seal->key, DP_SEAL_KEY_LEN) <= 0) {
+		EVP_PKEY_CTX_free(ctx);
+		free((*out)->bytes);
+		free(*out);
+		*out = NULL;
+		
+		return -1;
+	}
+	
+	EVP_PKEY_CTX_free(ctx);
+	
+	/* 2) Wrapped key size (2 bytes) */
+	(*out)->bytes[pos]   = (wrapped_len >> 8) & 0xff;
+	(*out)->bytes[++pos] = wrapped_len & 0xff;
+	pos += 1 + wrapped_len;
+	
+	/* 4) Nonce (12 bytes) */
+	memcpy(&(*out)->bytes[pos], seal->nonce, DP_SEAL_NONCE_LEN);
+	pos += DP_SEAL_NONCE_LEN;
+	
+	/* 5) Record size (4 bytes) */
+	(*out)->bytes[pos]   = (DP_SEAL_RECORD_LEN >> 24) & 0xff;
+	(*out)->bytes[++pos] = (DP_SEAL_RECORD_LEN >> 16) & 0xff;
+	(*out)->bytes[++pos] = (DP_SEAL_RECORD_LEN >> 8) & 0xff;
+	(*out)->bytes[++pos] = DP_SEAL_RECORD_LEN & 0xff;
+	
+	/* The actual wrapped key may be shorter than the estimate. */
+	(*out)->len = ++pos;
+	
+	return 0;
+}
+
+/*
+ * Returns how many bytes the records of a payload of
+ * len bytes take up.
+ */
+uint64_t seal_len(uint64_t len)
+{
+	uint64_t count;
+	
+	/* An empty payload still gets its (empty) final record. */
+	count = len / DP_SEAL_RECORD_LEN + (len % DP_SEAL_RECORD_LEN || len == 0);
+	
+	return len + count * DP_SEAL_TAG_LEN;
+}
+
+/*
+ * Draws a fresh random key to seal a payload of len
+ * bytes under, along with the spill file its records
+ * are kept in. Without one, every read of a record
+ * seals it again.
+ * It is the caller's responsibility to free the
+ * returned pointer with seal_free().
+ */
+int seal_make(uint64_t len, struct dp_seal **out)
+{
+	struct dp_seal_spill *spill;
+	
+	if (!out)
+		return 1;
+	
+	*out = (struct dp_seal *)calloc(1, sizeof(**out));
+	
+	if (RAND_bytes((*out)->key, DP_SEAL_KEY_LEN) != 1 ||
+	    RAND_bytes((*out)->nonce, DP_SEAL_NONCE_LEN) != 1) {
+		seal_free(out);
+		return -1;
+	}
+	
+	if (!(spill = (struct dp_seal_spill *)calloc(1, sizeof(*spill))))
+		return 0;
+	
+	spill->count = len / DP_SEAL_RECORD_LEN + (len % DP_SEAL_RECORD_LEN || len == 0);
+	
+	if (!(spill->made = (unsigned char *)calloc((spill->count + 7) / 8, 1)) ||
+	    !(spill->fptr = tmpfile())) {
+		free(spill->made);
+		free(spill);
+		
+		return 0;
+	}
+	
+	pthread_mutex_init(&spill->lock, NULL);
+	(*out)->spill = spill;
+	
+	return 0;
+}
+
+/*
+ * Opens a sealed payload (see seal_head_make()) with the
+ * recipient's private key, checking each record as it
+ * goes.
+ * Returns -1 if the key is not the one the payload was
+ * sealed for, or the payload was tampered with, cut
+ * short or reordered.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int seal_open(const struct data64 *sealed, EVP_PKEY *pkey, struct data64 **out)
+{
+	unsigned char *key;
+	const unsigned char *nonce;
+	EVP_PKEY_CTX *pkey_ctx;
+	struct dp_seal_stream *stream;
+	size_t key_len;
+	uint64_t offset;
+	uint64_t pos;
+	uint32_t record_len;
+	uint16_t wrapped_len;
+	int final;
+	
+	if (!sealed ||
+	    !pkey ||
+	    !out)
+		return 1;
+	
+	*out = NULL;
+	
+	if (sealed->len < DP_SEAL_MAGIC_LEN + sizeof(uint16_t) ||
+	    memcmp(sealed->bytes, DP_SEAL_MAGIC, DP_SEAL_MAGIC_LEN) != 0)
+		return -1;
+	
+	pos = DP_SEAL_MAGIC_LEN;
+	wrapped_len = sealed->bytes[pos + 1] |
+		( (uint16_t)sealed->bytes[pos] << 8 );
+	pos += sizeof(uint16_t);
+	
+	if (sealed->len < pos + wrapped_len + DP_SEAL_NONCE_LEN + sizeof(uint32_t))
+		return -1;
+	
+	if (!(pkey_ctx = EVP_PKEY_CTX_new(pkey, NULL)))
+		return -1;
+	
+	/* RSA wants room for a whole block even though only the key comes out. */
+	key = (unsigned char *)malloc(wrapped_len ? wrapped_len : 1);
+	key_len = wrapped_len;
+	
+	if (EVP_PKEY_decrypt_init(pkey_ctx) <= 0 ||
+	    EVP_PKEY_CTX_set_rsa_padding(pkey_ctx, RSA_PKCS1_OAEP_PADDING) <= 0 ||
+	    EVP_PKEY_decrypt(pkey_ctx, key, &key_len, &sealed->bytes[pos], wrapped_len) <= 0 ||
+	    key_len != DP_SEAL_KEY_LEN) {
+		EVP_PKEY_CTX_free(pkey_ctx);
+		OPENSSL_cleanse(key, wrapped_len);
+		free(key);
+		
+		return -1;
+	}
+	
+	EVP_PKEY_CTX_free(pkey_ctx);
+	pos += wrapped_len;
+	nonce = &sealed->bytes[pos];
+	pos += DP_SEAL_NONCE_LEN;
+	record_len = sealed->bytes[pos + 3] |
+		( (uint32_t)sealed->bytes[pos + 2] << 8 ) |
+		( (uint32_t)sealed->bytes[pos + 1] << 16 ) |
+		( (uint32_t)sealed->bytes[pos] << 24 );
+	pos += sizeof(uint32_t);
+	stream = seal_stream_make(key, nonce, 0);
+	OPENSSL_cleanse(key, DP_SEAL_KEY_LEN);
+	free(key);
+	
+	if (!stream ||
+	    record_len == 0 ||
+	    record_len > DP_SEAL_RECORD_MAX) {
+		seal_stream_free(&stream);
+		return -1;
+	}
+	
+	*out = (struct data64 *)malloc(sizeof(**out));
+	(*out)->bytes = (unsigned char *)malloc(sealed->len - pos + 1);
+	(*out)->len = 0;
+	final = 0;
+	offset = pos;
+	
+	/* Only the last record is marked final, so one that is missing shows. */
+	while (final == 0) {
+		size_t len;
+		
+		if (sealed->len - offset < DP_SEAL_TAG_LEN)
+			break;
+		
+		len = sealed->len - offset - DP_SEAL_TAG_LEN;
+		
+		if (len > record_len)
+			len = record_len;
+		
+		final = offset + len + DP_SEAL_TAG_LEN == sealed->len;
+		
+		if (seal_record(stream, &sealed->bytes[offset], len, final, &(*out)->bytes[(*out)->len]) != 0) {
+			final = 0;
+			break;
+		}
+		
+		offset += len + DP_SEAL_TAG_LEN;
+		(*out)->len += len;
+	}
+	
+	seal_stream_free(&stream);
+	
+	if (final == 0) {
+		OPENSSL_cleanse((*out)->bytes, (*out)->len);
+		free((*out)->bytes);
+		free(*out);
+		*out = NULL;
+		
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Encrypts or decrypts the stream's next record, of len
+ * payload bytes, depending on what the stream was made
+ * for. Sealed, a record is its ciphertext followed by
+ * its tag, so out needs room for len + DP_SEAL_TAG_LEN
+ * bytes when encrypting; when decrypting, in holds that
+ * much and len bytes come out.
+ * Every record gets its own nonce, the stream's nonce
+ * with the record number added in, and whether it is
+ * the last one is authenticated along with it. Records
+ * therefore can be neither reordered nor dropped.
+ * Returns -1 if a record fails to authenticate.
+ */
+int seal_record(struct dp_seal_stream *stream, const unsigned char *in, size_t len, int final, unsigned char *out)
+{
+	unsigned char nonce[DP_SEAL_NONCE_LEN];
+	unsigned char flag;
+	uint64_t counter;
+	int out_len;
+	
+	if (!stream ||
+	    len > DP_SEAL_RECORD_MAX ||
+	    stream->final)
+		return 1;
+	
+	memcpy(nonce, stream->nonce, DP_SEAL_NONCE_LEN);
+	counter = stream->count;
+	
+	/* The record number goes into the last 8 bytes of the nonce (big-endian). */
+	for (int i = DP_SEAL_NONCE_LEN - 1; i >= DP_SEAL_NONCE_LEN - 8; i--) {
+		nonce[i] ^= counter & 0xff;
+		counter >>= 8;
+	}
+	
+	flag = final ? 1 : 0;
+	
+	/* Only the nonce changes between records; the key schedule is kept. */
+	if (EVP_CipherInit_ex(stream->ctx, NULL, NULL, NULL, nonce, -1) != 1 ||
+	    EVP_CipherUpdate(stream->ctx, NULL, &out_len, &flag, 1) != 1)
+		return -1;
+	
+	if (stream->encrypt) {
+		if (EVP_CipherUpdate(stream->ctx, out, &out_len, in, (int)len) != 1 ||
+		    EVP_CipherFinal_ex(stream->ctx, out + len, &out_len) != 1 ||
+		    EVP_CIPHER_CTX_ctrl(stream->ctx, EVP_CTRL_GCM_GET_TAG, DP_SEAL_TAG_LEN, out + len) != 1)
+			return -1;
+	} else {
+		if (EVP_CIPHER_CTX_ctrl(stream->ctx, EVP_CTRL_GCM_SET_TAG, DP_SEAL_TAG_LEN, (void *)(in + len)) != 1 ||
+		    EVP_CipherUpdate(stream->ctx, out, &out_len, in, (int)len) != 1 ||
+		    EVP_CipherFinal_ex(stream->ctx, out + len, &out_len) != 1) {
+			OPENSSL_cleanse(out, len);
+			return -1;
+		}
+	}
+	
+	stream->count++;
+	stream->final = final;
+	
+	return 0;
+}
+
+/*
+ * Puts record index of the payload, sealed, in out,
+ * which needs room for DP_SEAL_RECORD_LEN +
+ * DP_SEAL_TAG_LEN bytes. It comes from the spill file
+ * if it was made before; otherwise it is sealed with
+ * the stream (made if *stream is NULL) and kept.
+ * Returns -1 if sealing failed.
+ */
+int seal_record_get(const struct dp_seal *seal, struct dp_seal_stream **stream, const struct data64 *payload, uint64_t index, unsigned char *out)
+{
+	struct dp_seal_spill *spill;
+	uint64_t count;
+	size_t len;
+	off_t offset;
+	int made;
+	
+	count = payload->len / DP_SEAL_RECORD_LEN + (payload->len % DP_SEAL_RECORD_LEN || payload->len == 0);
+	len = index + 1 < count ? DP_SEAL_RECORD_LEN : (size_t)(payload->len - index * DP_SEAL_RECORD_LEN);
+	offset = (off_t)(index * (DP_SEAL_RECORD_LEN + DP_SEAL_TAG_LEN));
+	spill = seal->spill;
+	made = 0;
+	
+	if (spill) {
+		pthread_mutex_lock(&spill->lock);
+		made = spill->made[index / 8] & (1 << (index % 8));
+		pthread_mutex_unlock(&spill->lock);
+	}
+	
+	if (made &&
+	    pread(fileno(spill->fptr), out, len + DP_SEAL_TAG_LEN, offset) == (ssize_t)(len + DP_SEAL_TAG_LEN))
+		return 0;
+	
+	if (!*stream &&
+	    !(*stream = seal_stream_make(seal->key, seal->nonce, 1)))
+		return -1;
+	
+	/* The stream is moved to the record; its nonce only depends on where it is. */
+	(*stream)->count = index;
+	(*stream)->final = 0;
+	
+	if (seal_record(*stream, &payload->bytes[index * DP_SEAL_RECORD_LEN], len, index + 1 == count, out) != 0)
+		return -1;
+	
+	/* Whoever reads it next only sees it once it is all in the file. */
+	if (spill &&
+	    !made &&
+	    pwrite(fileno(spill->fptr), out, len + DP_SEAL_TAG_LEN, offset) == (ssize_t)(len + DP_SEAL_TAG_LEN)) {
+		pthread_mutex_lock(&spill->lock);
+		spill->made[index / 8] |= 1 << (index % 8);
+		pthread_mutex_unlock(&spill->lock);
+	}
+	
+	return 0;
+}
+
+void seal_stream_free(struct dp_seal_stream **stream)
+{
+	if (stream &&
+	    *stream) {
+		EVP_CIPHER_CTX_free((*stream)->ctx);
+		free(*stream);
+		*stream = NULL;
+	}
+}
+
+/*
+ * Sets up the encryption (or, if encrypt is 0, the
+ * decryption) of a stream of records under the key;
+ * see seal_record().
+ * OpenSSL picks the AES-NI (or ARMv8) code path
+ * wherever the CPU has one.
+ * It is the caller's responsibility to free the
+ * returned pointer with seal_stream_free().
+ */
+struct dp_seal_stream *seal_stream_make(const unsigned char key[], const unsigned char nonce[], int encrypt)
+{
+	struct dp_seal_stream *stream;
+	
+	if (!key ||
+	    !nonce)
+		return NULL;
+	
+	stream = (struct dp_seal_stream *)calloc(1, sizeof(*stream));
+	stream->encrypt = encrypt ? 1 : 0;
+	memcpy(stream->nonce, nonce, DP_SEAL_NONCE_LEN);
+	
+	if (!(stream->ctx = EVP_CIPHER_CTX_new()) ||
+	    EVP_CipherInit_ex(stream->ctx, EVP_aes_256_gcm(), NULL, key, NULL, stream->encrypt) != 1) {
+		seal_stream_free(&stream);
+		return NULL;
+	}
+	
+	return stream;
+}
 
 /*
  * Generates the double SHA-256 hash of the given bytes.
@@ -20,3 +499,245 @@ void sha(const unsigned char *data, size_t len, unsigned char digest[])
 	SHA256(data, len, tmp);
 	SHA256(tmp, SHA256_DIGEST_LENGTH, digest);
 }
+
+/*
+ * Same as sha(), over the first len bytes of an open
+ * file, which are read in chunks rather than loaded.
+ * Returns -1 if the file is shorter than len.
+ */
+int sha_file(int fd, uint64_t len, unsigned char digest[])
+{
+	unsigned char buffer[DP_SHA_BUF_LEN];
+	unsigned char tmp[SHA256_DIGEST_LENGTH];
+	EVP_MD_CTX *ctx;
+	uint64_t offset;
+	
+	if (!(ctx = EVP_MD_CTX_new()))
+		return -1;
+	
+	offset = 0;
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+	
+	while (offset < len) {
+		ssize_t bytes_read;
+		size_t chunk;
+		
+		chunk = len - offset < DP_SHA_BUF_LEN ? (size_t)(len - offset) : DP_SHA_BUF_LEN;
+		
+		if ((bytes_read = pread(fd, buffer, chunk, offset)) <= 0) {
+			if (bytes_read == -1 &&
+			    errno == EINTR)
+				continue;
+			
+			EVP_MD_CTX_free(ctx);
+			
+			return -1;
+		}
+		
+		EVP_DigestUpdate(ctx, buffer, bytes_read);
+		offset += bytes_read;
+	}
+	
+	EVP_DigestFinal_ex(ctx, tmp, NULL);
+	EVP_MD_CTX_free(ctx);
+	SHA256(tmp, SHA256_DIGEST_LENGTH, digest);
+	
+	return 0;
+}
+
+/*
+ * Same as sha(), over the bytes of the tail; a sealed
+ * payload's records are sealed (or read back) along
+ * the way.
+ */
+int sha_tail(const struct dp_tail *tail, unsigned char digest[])
+{
+	unsigned char tmp[SHA256_DIGEST_LENGTH];
+	EVP_MD_CTX *ctx;
+	
+	if (!(ctx = EVP_MD_CTX_new()))
+		return -1;
+	
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+	
+	if (tail_digest(tail, ctx) != 0) {
+		EVP_MD_CTX_free(ctx);
+		return -1;
+	}
+	
+	EVP_DigestFinal_ex(ctx, tmp, NULL);
+	EVP_MD_CTX_free(ctx);
+	SHA256(tmp, SHA256_DIGEST_LENGTH, digest);
+	
+	return 0;
+}
+
+/*
+ * Returns how many of the tail's bytes, from pos on,
+ * can be read before crossing out of the seal head or
+ * the record pos is in. Reading a sealed tail in such
+ * chunks fetches every record exactly once.
+ */
+size_t tail_chunk_get(const struct dp_tail *tail, uint64_t pos)
+{
+	uint64_t at;
+	uint64_t chunk;
+	uint64_t head_len;
+	
+	if (!tail ||
+	    pos >= tail->len)
+		return 0;
+	
+	if (!tail->seal)
+		return (size_t)(tail->len - pos);
+	
+	at = tail->offset + pos;
+	head_len = tail->seal_head ? tail->seal_head->len : 0;
+	
+	if (at < head_len)
+		chunk = head_len - at;
+	else
+		chunk = DP_SEAL_RECORD_LEN + DP_SEAL_TAG_LEN - (at - head_len) % (DP_SEAL_RECORD_LEN + DP_SEAL_TAG_LEN);
+	
+	return (size_t)(chunk < tail->len - pos ? chunk : tail->len - pos);
+}
+
+/*
+ * Feeds the bytes of the tail to the digest, one
+ * record at a time if the payload is sealed.
+ */
+int tail_digest(const struct dp_tail *tail, EVP_MD_CTX *ctx)
+{
+	unsigned char *buffer;
+	uint64_t pos;
+	
+	if (!tail ||
+	    !tail->payload ||
+	    !ctx)
+		return 1;
+	
+	if (!tail->seal) {
+		EVP_DigestUpdate(ctx, &tail->payload->bytes[tail->offset], tail->len);
+		return 0;
+	}
+	
+	buffer = (unsigned char *)malloc(DP_SEAL_RECORD_LEN + DP_SEAL_TAG_LEN);
+	pos = 0;
+	
+	while (pos < tail->len) {
+		size_t chunk;
+		
+		chunk = tail_chunk_get(tail, pos);
+		
+		if (tail_read(tail, pos, buffer, chunk) != 0) {
+			free(buffer);
+			return -1;
+		}
+		
+		EVP_DigestUpdate(ctx, buffer, chunk);
+		pos += chunk;
+	}
+	
+	free(buffer);
+	
+	return 0;
+}
+
+/*
+ * Copies len of the tail's bytes, from pos on, to out.
+ * Records of a sealed payload are sealed the first
+ * time they are needed, in whatever order, and read
+ * back from the seal's spill file after that; see
+ * tail_chunk_get() to read them a record at a time.
+ * Returns -1 if sealing failed.
+ */
+int tail_read(const struct dp_tail *tail, uint64_t pos, unsigned char *out, size_t len)
+{
+	unsigned char *scratch;
+	struct dp_seal_stream *stream;
+	uint64_t at;
+	uint64_t count;
+	uint64_t head_len;
+	int status;
+	
+	if (!tail ||
+	    !tail->payload ||
+	    !out ||
+	    pos + len > tail->len)
+		return 1;
+	
+	at = tail->offset + pos;
+	
+	if (!tail->seal) {
+		memcpy(out, &tail->payload->bytes[at], len);
+		return 0;
+	}
+	
+	head_len = tail->seal_head ? tail->seal_head->len : 0;
+	
+	if (at < head_len) {
+		size_t chunk;
+		
+		chunk = head_len - at < len ? (size_t)(head_len - at) : len;
+		memcpy(out, &tail->seal_head->bytes[at], chunk);
+		out += chunk;
+		at += chunk;
+		len -= chunk;
+	}
+	
+	if (len == 0)
+		return 0;
+	
+	at -= head_len;
+	count = tail->payload->len / DP_SEAL_RECORD_LEN + (tail->payload->len % DP_SEAL_RECORD_LEN || tail->payload->len == 0);
+	scratch = NULL;
+	status = 0;
+	stream = NULL;
+	
+	while (len > 0) {
+		unsigned char *record;
+		uint64_t index;
+		size_t chunk;
+		size_t record_len;
+		size_t within;
+		
+		index = at / (DP_SEAL_RECORD_LEN + DP_SEAL_TAG_LEN);
+		within = (size_t)(at % (DP_SEAL_RECORD_LEN + DP_SEAL_TAG_LEN));
+		
+		if (index >= count) {
+			status = 1;
+			break;
+		}
+		
+		record_len = index + 1 < count ? DP_SEAL_RECORD_LEN : (size_t)(tail->payload->len - index * DP_SEAL_RECORD_LEN);
+		chunk = record_len + DP_SEAL_TAG_LEN - within < len ? record_len + DP_SEAL_TAG_LEN - within : len;
+		
+		/* A record wanted whole is put in place. */
+		if (within == 0 &&
+		    chunk == record_len + DP_SEAL_TAG_LEN) {
+			record = out;
+		} else {
+			if (!scratch)
+				scratch = (unsigned char *)malloc(DP_SEAL_RECORD_LEN + DP_SEAL_TAG_LEN);
+			
+			record = scratch;
+		}
+		
+		if (seal_record_get(tail->seal, &stream, tail->payload, index, record) != 0) {
+			status = -1;
+			break;
+		}
+		
+		if (record != out)
+			memcpy(out, &scratch[within], chunk);
+		
+		out += chunk;
+		at += chunk;
+		len -= chunk;
+	}
+	
+	free(scratch);
+	seal_stream_free(&stream);
+	
+	return status;
+}
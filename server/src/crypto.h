@@ -10,13 +10,76 @@
 #define CRYPTO_H
 
 
+#include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <stdint.h>
+#include "types.h"
 
 
+#define DP_SEAL_KEY_LEN		32		/* AES-256 */
+#define DP_SEAL_MAGIC		"DPSEAL01"
+#define DP_SEAL_MAGIC_LEN	8
+#define DP_SEAL_NONCE_LEN	12
+#define DP_SEAL_RECORD_LEN	65536		/* Payload bytes per record */
+#define DP_SEAL_RECORD_MAX	16777216	/* Largest record size accepted when opening */
+#define DP_SEAL_TAG_LEN		16
+#define DP_SHA_BUF_LEN		65536		/* Read size when hashing files */
+
+/**************
+ * STRUCTURES *
+ **************/
+struct dp_seal_spill;
+struct dp_seal_stream;
+
+/*
+ * What a payload is encrypted under with AES-256-GCM,
+ * as a run of records that can each be checked on their
+ * own; see seal_record(). A record is made the first
+ * time it is read (see tail_read()) and kept in the
+ * seal's spill file, which every later read of it is
+ * served from, so that the payload is encrypted once
+ * however many recipients, signatures and retries it
+ * goes out to, and is never held whole. Recipients each
+ * get the key wrapped with their public key; see
+ * seal_head_make().
+ */
+struct dp_seal {
+	unsigned char key[DP_SEAL_KEY_LEN];
+	unsigned char nonce[DP_SEAL_NONCE_LEN];
+	struct dp_seal_spill *spill;	/* NULL if records cannot be kept */
+};
+
+/*
+ * Bytes [offset, offset + len) of what follows a message
+ * on the wire: the payload as it is or, if seal is set,
+ * the seal head (if any) followed by the payload's
+ * records.
+ */
+struct dp_tail {
+	const struct data64 *payload;
+	const struct data64 *seal_head;
+	const struct dp_seal *seal;
+	uint64_t len;
+	uint64_t offset;
+};
+
 /*************
  * FUNCTIONS *
  *************/
+void seal_free(struct dp_seal **);
+int seal_head_make(const struct dp_seal *, EVP_PKEY *, struct data64 **);
+uint64_t seal_len(uint64_t);
+int seal_make(uint64_t, struct dp_seal **);
+int seal_open(const struct data64 *, EVP_PKEY *, struct data64 **);
+int seal_record(struct dp_seal_stream *, const unsigned char *, size_t, int, unsigned char *);
+void seal_stream_free(struct dp_seal_stream **);
+struct dp_seal_stream *seal_stream_make(const unsigned char[], const unsigned char[], int);
 void sha(const unsigned char *, size_t, unsigned char[]);
+int sha_file(int, uint64_t, unsigned char[]);
+int sha_tail(const struct dp_tail *, unsigned char[]);
+size_t tail_chunk_get(const struct dp_tail *, uint64_t);
+int tail_digest(const struct dp_tail *, EVP_MD_CTX *);
+int tail_read(const struct dp_tail *, uint64_t, unsigned char *, size_t);
 
 
 #endif /* CRYPTO_H */
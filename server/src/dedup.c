@@ -0,0 +1,612 @@
+//
+//  dedup.c
+//  server
+//
+
+#include "dedup.h"
+
+#include "disk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "trace.h"
+#include <unistd.h>
+#include "util.h"
+
+
+/*
+ * Entry indices are stored off by one so that 0 can
+ * stand for "none".
+ */
+#define DEDUP_NONE	0
+#define DEDUP_RESERVED_BUCKETS	256	/* Hash chains over the reserved UUIDs; must be a power of 2. */
+
+/**************
+ * STRUCTURES *
+ **************/
+/*
+ * Remembers which parcels were already received so
+ * that retried copies can be acknowledged and dropped
+ * without touching the disk.
+ *
+ * There are two tiers:
+ * 1) An exact LRU over the most recent UUIDs.
+ * 2) A cuckoo filter of 32-bit fingerprints, split
+ *    into time partitions. New UUIDs go into the
+ *    current partition and lookups check all of them.
+ *    When a partition's time is up (or it fills up),
+ *    the oldest one is cleared and takes its place.
+ *    Each partition has a victim slot for the one
+ *    fingerprint left without a bucket when relocating
+ *    gives up; once that is taken, the partition counts
+ *    as full and nothing more is displaced.
+ *    With 32-bit fingerprints the chance of a new
+ *    parcel being mistaken for a duplicate is around
+ *    1 in 10^8.
+ *
+ * The table lives in a file mapping so that it
+ * survives restarts.
+ *
+ * A parcel is only added once it is delivered, which
+ * can be a while after it was received (see order.c).
+ * In the meantime its UUID is reserved, so that a
+ * retried copy coming in over another connection waits
+ * to see how the first one fares instead of being
+ * delivered a second time.
+ */
+struct dedup_entry {
+	uuid_t uuid;
+	uint32_t chain;	/* Next entry in the same hash bucket */
+	uint32_t next;	/* Next (older) entry in the LRU */
+	uint32_t prev;	/* Previous (newer) entry in the LRU */
+};
+
+/*
+ * A fingerprint that did not fit in a filter partition,
+ * along with one of its two buckets.
+ */
+struct dedup_victim {
+	uint32_t fingerprint;	/* 0 if there is none */
+	uint32_t i_bucket;
+};
+
+struct dedup_table {
+	char magic[8];
+	int64_t partition_start;	/* When the current partition started (UNIX time) */
+	uint32_t version;
+	uint32_t partition;		/* Index of the current partition */
+	uint32_t lru_count;
+	uint32_t lru_head;		/* Most recently seen */
+	uint32_t lru_tail;		/* Least recently seen */
+	uint32_t buckets[DP_DEDUP_LRU_BUCKETS];
+	struct dedup_entry entries[DP_DEDUP_LRU_LEN];
+	uint32_t filters[DP_DEDUP_PARTITIONS][DP_DEDUP_FILTER_LEN][DP_DEDUP_FILTER_SLOTS];
+	struct dedup_victim victims[DP_DEDUP_PARTITIONS];
+};
+
+/*
+ * A parcel on its way to being delivered.
+ */
+struct dedup_reservation {
+	uuid_t uuid;
+	struct dedup_reservation *next;
+};
+/**********************/
+
+/********************
+ * Global Variables
+ ********************/
+pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dedup_released = PTHREAD_COND_INITIALIZER;
+struct dedup_reservation *dedup_reserved[DEDUP_RESERVED_BUCKETS];
+struct dedup_table *dedup_table;
+/**********************/
+
+/**********************
+ * Private Prototypes
+ **********************/
+void *dedup_sync(void *);
+int filter_contains(const uint32_t, const uint32_t, const uint32_t);
+int filter_insert(uint32_t, uint32_t, uint32_t);
+uint32_t filter_alt_index(const uint32_t, const uint32_t);
+void lru_add(const uuid_t, const uint64_t);
+uint32_t lru_find(const uuid_t, const uint64_t);
+void lru_touch(uint32_t);
+void lru_unlink(uint32_t);
+uint64_t mix(uint64_t);
+void partition_rotate(void);
+struct dedup_reservation **reservation_find(const uuid_t, const uint64_t);
+void table_add(const uuid_t, const uint64_t);
+int table_contains(const uuid_t, const uint64_t);
+void table_reset(void);
+uint64_t uuid_hash(const uuid_t);
+/**********************/
+
+
+/*
+ * Maps the table file in the config directory and
+ * starts the thread that writes it back. If this
+ * fails, duplicate suppression is simply off.
+ */
+int dedup_bootstrap(void)
+{
+	const char *path_str_seen;
+	struct path *path_file_seen;
+	struct stat file_stat;
+	pthread_t thread;
+	void *map;
+	int fd;
+	int result;
+	
+	path_file_seen = home_dir_get();
+	path_append(&path_file_seen, DP_DIR_CONF);
+	path_append(&path_file_seen, DP_FILE_SEEN);
+	path_str_seen = path_cstr(path_file_seen);
+	fd = open(path_str_seen, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	
+	path_free(&path_file_seen);
+	
+	if (fd == -1) {
+		trace_write(DP_TRACE_ERROR, "dedup_bootstrap(0), open(3): %s", strerror(errno));
+		return -1;
+	}
+	
+	if (fstat(fd, &file_stat) == -1 ||
+	    (file_stat.st_size != sizeof(*dedup_table) &&
+	     ftruncate(fd, sizeof(*dedup_table)) == -1)) {
+		trace_write(DP_TRACE_ERROR, "dedup_bootstrap(0), ftruncate(2): %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	map = mmap(NULL, sizeof(*dedup_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	
+	if (map == MAP_FAILED) {
+		trace_write(DP_TRACE_ERROR, "dedup_bootstrap(0), mmap(6): %s", strerror(errno));
+		return -1;
+	}
+	
+	dedup_table = (struct dedup_table *)map;
+	
+	if (file_stat.st_size != sizeof(*dedup_table) ||
+	    memcmp(dedup_table->magic, DP_DEDUP_MAGIC, sizeof(DP_DEDUP_MAGIC)) != 0 ||
+	    dedup_table->version != DP_DEDUP_VER)
+		table_reset();
+	
+	/* Without it, the table is still written back by the kernel in its own time. */
+	if ((result = pthread_create(&thread, NULL, dedup_sync, NULL)) != 0)
+		trace_write(DP_TRACE_WARN, "Unable to start writing the seen table back: %s", strerror(result));
+	else
+		pthread_detach(thread);
+	
+	return 0;
+}
+
+/*
+ * Returns 1 if the parcel with the given UUID was
+ * already delivered, otherwise 0.
+ */
+int dedup_check(const uuid_t uuid)
+{
+	int seen;
+	
+	if (!dedup_table)
+		return 0;
+	
+	pthread_mutex_lock(&dedup_lock);
+	seen = table_contains(uuid, uuid_hash(uuid));
+	pthread_mutex_unlock(&dedup_lock);
+	
+	return seen;
+}
+
+/*
+ * Called once delivery of a parcel is over; delivered
+ * is 1 if it made it. Its reservation, if it had one,
+ * is lifted, and whoever waits on it is woken up.
+ */
+void dedup_release(const uuid_t uuid, int delivered)
+{
+	struct dedup_reservation **link;
+	struct dedup_reservation *reservation;
+	uint64_t hash;
+	
+	if (!dedup_table)
+		return;
+	
+	hash = uuid_hash(uuid);
+	pthread_mutex_lock(&dedup_lock);
+	
+	if (delivered)
+		table_add(uuid, hash);
+	
+	if (*(link = reservation_find(uuid, hash))) {
+		reservation = *link;
+		*link = reservation->next;
+		free(reservation);
+		pthread_cond_broadcast(&dedup_released);
+	}
+	
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+/*
+ * Reserves the UUID of a parcel about to be handed over
+ * for delivery. If another copy holds the reservation,
+ * this waits for it to be released. Returns 1 if the
+ * parcel was already delivered, otherwise 0, in which
+ * case the caller holds the reservation until it calls
+ * dedup_release(2).
+ */
+int dedup_reserve(const uuid_t uuid)
+{
+	struct dedup_reservation **link;
+	struct dedup_reservation *reservation;
+	uint64_t hash;
+	int seen;
+	
+	if (!dedup_table)
+		return 0;
+	
+	hash = uuid_hash(uuid);
+	pthread_mutex_lock(&dedup_lock);
+	
+	while (!(seen = table_contains(uuid, hash)) &&
+	       *(link = reservation_find(uuid, hash)))
+		pthread_cond_wait(&dedup_released, &dedup_lock);
+	
+	if (!seen) {
+		reservation = (struct dedup_reservation *)malloc(sizeof(*reservation));
+		uuid_copy(reservation->uuid, uuid);
+		reservation->next = NULL;
+		*link = reservation;
+	}
+	
+	pthread_mutex_unlock(&dedup_lock);
+	
+	return seen;
+}
+
+/*
+ * Schedules the table's dirty pages to be written
+ * back every DP_DEDUP_SYNC_INT ms, for as long as the
+ * server runs.
+ */
+void *dedup_sync(void *args)
+{
+	struct timespec interval;
+	
+	interval.tv_sec = DP_DEDUP_SYNC_INT / 1000;
+	interval.tv_nsec = (DP_DEDUP_SYNC_INT % 1000) * 1000000;
+	
+	while (1) {
+		nanosleep(&interval, NULL);
+		msync(dedup_table, sizeof(*dedup_table), MS_ASYNC);
+	}
+	
+	return 0;
+}
+
+uint32_t filter_alt_index(const uint32_t fingerprint, const uint32_t i_bucket)
+{
+	return (i_bucket ^ (uint32_t)mix(fingerprint)) & (DP_DEDUP_FILTER_LEN - 1);
+}
+
+/*
+ * Checks every partition for the fingerprint.
+ */
+int filter_contains(const uint32_t fingerprint, const uint32_t i_bucket_1, const uint32_t i_bucket_2)
+{
+	for (int p = 0; p < DP_DEDUP_PARTITIONS; p++) {
+		if (dedup_table->victims[p].fingerprint == fingerprint &&
+		    (dedup_table->victims[p].i_bucket == i_bucket_1 ||
+		     dedup_table->victims[p].i_bucket == i_bucket_2))
+			return 1;
+		
+		for (int s = 0; s < DP_DEDUP_FILTER_SLOTS; s++) {
+			if (dedup_table->filters[p][i_bucket_1][s] == fingerprint ||
+			    dedup_table->filters[p][i_bucket_2][s] == fingerprint)
+				return 1;
+		}
+	}
+	
+	return 0;
+}
+
+/*
+ * Inserts into the current partition, relocating
+ * fingerprints to their alternate buckets as needed.
+ * Returns -1, with the partition left as it was, if it
+ * is too full.
+ */
+int filter_insert(uint32_t fingerprint, uint32_t i_bucket_1, uint32_t i_bucket_2)
+{
+	uint32_t (*filter)[DP_DEDUP_FILTER_SLOTS];
+	struct dedup_victim *victim_slot;
+	uint32_t i_bucket;
+	
+	filter = dedup_table->filters[dedup_table->partition];
+	victim_slot = &dedup_table->victims[dedup_table->partition];
+	
+	for (int s = 0; s < DP_DEDUP_FILTER_SLOTS; s++) {
+		if (filter[i_bucket_1][s] == 0) {
+			filter[i_bucket_1][s] = fingerprint;
+			return 0;
+		}
+		
+		if (filter[i_bucket_2][s] == 0) {
+			filter[i_bucket_2][s] = fingerprint;
+			return 0;
+		}
+	}
+	
+	/* Relocating could leave a fingerprint with nowhere to go. */
+	if (victim_slot->fingerprint != 0)
+		return -1;
+	
+	i_bucket = (fingerprint & 1) ? i_bucket_1 : i_bucket_2;
+	
+	for (int kick = 0; kick < DP_DEDUP_KICKS_MAX; kick++) {
+		uint32_t victim;
+		int slot;
+		
+		slot = kick % DP_DEDUP_FILTER_SLOTS;
+		victim = filter[i_bucket][slot];
+		filter[i_bucket][slot] = fingerprint;
+		fingerprint = victim;
+		i_bucket = filter_alt_index(fingerprint, i_bucket);
+		
+		for (int s = 0; s < DP_DEDUP_FILTER_SLOTS; s++) {
+			if (filter[i_bucket][s] == 0) {
+				filter[i_bucket][s] = fingerprint;
+				return 0;
+			}
+		}
+	}
+	
+	/* Still one of its buckets, so lookups find it. */
+	victim_slot->fingerprint = fingerprint;
+	victim_slot->i_bucket = i_bucket;
+	
+	return 0;
+}
+
+/*
+ * Adds the UUID as the most recent entry, evicting
+ * the least recent one if the LRU is full.
+ */
+void lru_add(const uuid_t uuid, const uint64_t hash)
+{
+	struct dedup_entry *entry;
+	uint32_t i_chain;
+	uint32_t i_entry;
+	
+	if (dedup_table->lru_count < DP_DEDUP_LRU_LEN) {
+		dedup_table->lru_count++;
+		i_entry = dedup_table->lru_count;
+	} else {
+		i_entry = dedup_table->lru_tail;
+		lru_unlink(i_entry);
+	}
+	
+	entry = &dedup_table->entries[i_entry - 1];
+	i_chain = (uint32_t)(hash >> 16) & (DP_DEDUP_LRU_BUCKETS - 1);
+	
+	uuid_copy(entry->uuid, uuid);
+	entry->chain = dedup_table->buckets[i_chain];
+	entry->next = dedup_table->lru_head;
+	entry->prev = DEDUP_NONE;
+	dedup_table->buckets[i_chain] = i_entry;
+	
+	if (dedup_table->lru_head != DEDUP_NONE)
+		dedup_table->entries[dedup_table->lru_head - 1].prev = i_entry;
+	else
+		dedup_table->lru_tail = i_entry;
+	
+	dedup_table->lru_head = i_entry;
+}
+
+uint32_t lru_find(const uuid_t uuid, const uint64_t hash)
+{
+	uint32_t i_entry;
+	
+	i_entry = dedup_table->buckets[(uint32_t)(hash >> 16) & (DP_DEDUP_LRU_BUCKETS - 1)];
+	
+	while (i_entry != DEDUP_NONE) {
+		if (uuid_compare(dedup_table->entries[i_entry - 1].uuid, uuid) == 0)
+			return i_entry;
+		
+		i_entry = dedup_table->entries[i_entry - 1].chain;
+	}
+	
+	return DEDUP_NONE;
+}
+
+/*
+ * Moves the entry to the front of the LRU.
+ */
+void lru_touch(uint32_t i_entry)
+{
+	struct dedup_entry *entry;
+	
+	if (dedup_table->lru_head == i_entry)
+		return;
+	
+	entry = &dedup_table->entries[i_entry - 1];
+	
+	/* Detach from the list (but not the hash chain). */
+	dedup_table->entries[entry->prev - 1].next = entry->next;
+	
+	if (entry->next != DEDUP_NONE)
+		dedup_table->entries[entry->next - 1].prev = entry->prev;
+	else
+		dedup_table->lru_tail = entry->prev;
+	
+	entry->prev = DEDUP_NONE;
+	entry->next = dedup_table->lru_head;
+	dedup_table->entries[dedup_table->lru_head - 1].prev = i_entry;
+	dedup_table->lru_head = i_entry;
+}
+
+/*
+ * Removes the entry from both the LRU and its hash
+ * chain so that its slot can be reused.
+ */
+void lru_unlink(uint32_t i_entry)
+{
+	struct dedup_entry *entry;
+	uint32_t *link;
+	
+	entry = &dedup_table->entries[i_entry - 1];
+	link = &dedup_table->buckets[(uint32_t)(uuid_hash(entry->uuid) >> 16) & (DP_DEDUP_LRU_BUCKETS - 1)];
+	
+	while (*link != DEDUP_NONE &&
+	       *link != i_entry)
+		link = &dedup_table->entries[*link - 1].chain;
+	
+	if (*link == i_entry)
+		*link = entry->chain;
+	
+	if (entry->prev != DEDUP_NONE)
+		dedup_table->entries[entry->prev - 1].next = entry->next;
+	else
+		dedup_table->lru_head = entry->next;
+	
+	if (entry->next != DEDUP_NONE)
+		dedup_table->entries[entry->next - 1].prev = entry->prev;
+	else
+		dedup_table->lru_tail = entry->prev;
+}
+
+/*
+ * 64-bit finaliser from SplitMix64.
+ */
+uint64_t mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	
+	return x;
+}
+
+/*
+ * Clears the oldest partition and makes it the
+ * current one.
+ */
+void partition_rotate(void)
+{
+	dedup_table->partition = (dedup_table->partition + 1) % DP_DEDUP_PARTITIONS;
+	memset(dedup_table->filters[dedup_table->partition], 0, sizeof(dedup_table->filters[0]));
+	memset(&dedup_table->victims[dedup_table->partition], 0, sizeof(dedup_table->victims[0]));
+}
+
+/*
+ * Returns the link to the UUID's reservation, or the
+ * link at the end of its chain if it has none. The
+ * caller holds dedup_lock.
+ */
+struct dedup_reservation **reservation_find(const uuid_t uuid, const uint64_t hash)
+{
+	struct dedup_reservation **link;
+	
+	link = &dedup_reserved[(uint32_t)(hash >> 8) & (DEDUP_RESERVED_BUCKETS - 1)];
+	
+	while (*link &&
+	       uuid_compare((*link)->uuid, uuid) != 0)
+		link = &(*link)->next;
+	
+	return link;
+}
+
+/*
+ * Adds the UUID to both tiers. The caller holds
+ * dedup_lock.
+ */
+void table_add(const uuid_t uuid, const uint64_t hash)
+{
+	uint32_t fingerprint;
+	uint32_t i_bucket;
+	int64_t now;
+	
+	fingerprint = (uint32_t)(hash >> 32);
+	i_bucket = (uint32_t)hash & (DP_DEDUP_FILTER_LEN - 1);
+	now = timestamp();
+	
+	/* A fingerprint of 0 marks an empty slot. */
+	if (fingerprint == 0)
+		fingerprint = 1;
+	
+	/* Catch up on any partitions whose time is up. */
+	for (int i = 0; i < DP_DEDUP_PARTITIONS &&
+	     now - dedup_table->partition_start >= DP_DEDUP_PARTITION_INT; i++) {
+		partition_rotate();
+		dedup_table->partition_start += DP_DEDUP_PARTITION_INT;
+	}
+	
+	/* Everything has expired. */
+	if (now - dedup_table->partition_start >= DP_DEDUP_PARTITION_INT)
+		dedup_table->partition_start = now;
+	
+	if (lru_find(uuid, hash) == DEDUP_NONE)
+		lru_add(uuid, hash);
+	
+	if (filter_contains(fingerprint, i_bucket, filter_alt_index(fingerprint, i_bucket)) != 1 &&
+	    filter_insert(fingerprint, i_bucket, filter_alt_index(fingerprint, i_bucket)) != 0) {
+		/* The partition is full; start a fresh one early. */
+		partition_rotate();
+		dedup_table->partition_start = now;
+		filter_insert(fingerprint, i_bucket, filter_alt_index(fingerprint, i_bucket));
+	}
+}
+
+/*
+ * The caller holds dedup_lock.
+ */
+int table_contains(const uuid_t uuid, const uint64_t hash)
+{
+	uint32_t fingerprint;
+	uint32_t i_bucket;
+	uint32_t i_entry;
+	
+	fingerprint = (uint32_t)(hash >> 32);
+	i_bucket = (uint32_t)hash & (DP_DEDUP_FILTER_LEN - 1);
+	
+	if (fingerprint == 0)
+		fingerprint = 1;
+	
+	if ((i_entry = lru_find(uuid, hash)) != DEDUP_NONE) {
+		lru_touch(i_entry);
+		return 1;
+	}
+	
+	return filter_contains(fingerprint, i_bucket, filter_alt_index(fingerprint, i_bucket));
+}
+
+void table_reset(void)
+{
+	memset(dedup_table, 0, sizeof(*dedup_table));
+	memcpy(dedup_table->magic, DP_DEDUP_MAGIC, sizeof(DP_DEDUP_MAGIC));
+	dedup_table->version = DP_DEDUP_VER;
+	dedup_table->partition_start = timestamp();
+}
+
+uint64_t uuid_hash(const uuid_t uuid)
+{
+	uint64_t hi;
+	uint64_t lo;
+	
+	memcpy(&hi, uuid, sizeof(hi));
+	memcpy(&lo, uuid + sizeof(hi), sizeof(lo));
+	
+	return mix(hi ^ mix(lo));
+}
@@ -0,0 +1,38 @@
+//
+//  dedup.h
+//  server
+//
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+
+#include <stdint.h>
+#include <uuid/uuid.h>
+
+
+#define DP_DEDUP_FILTER_LEN	16384	/* Buckets per filter partition; must be a power of 2. */
+#define DP_DEDUP_FILTER_SLOTS	4	/* Fingerprints per bucket. */
+#define DP_DEDUP_LRU_LEN	8192	/* UUIDs remembered exactly. */
+#define DP_DEDUP_LRU_BUCKETS	16384	/* Hash chains over the exact UUIDs; must be a power of 2. */
+#define DP_DEDUP_PARTITIONS	4	/* Filter partitions; the oldest one is cleared on rotation. */
+
+/*************
+ * CONSTANTS *
+ *************/
+static const char DP_DEDUP_MAGIC[8] 		= { 'D', 'P', 'S', 'E', 'E', 'N', 0, 0 };
+static const uint32_t DP_DEDUP_VER 		= 3;
+static const int DP_DEDUP_KICKS_MAX 		= 500;			/* Relocations tried before a filter partition counts as full. */
+static const int DP_DEDUP_PARTITION_INT 	= 6 * 60 * 60;		/* How long (in seconds) a filter partition takes new UUIDs for. */
+static const int DP_DEDUP_SYNC_INT 		= 3000;			/* How often (in milliseconds) the table's dirty pages are written back. */
+
+/*************
+ * FUNCTIONS *
+ *************/
+int dedup_bootstrap(void);
+int dedup_check(const uuid_t);
+void dedup_release(const uuid_t, int);
+int dedup_reserve(const uuid_t);
+
+
+#endif /* DEDUP_H */
@@ -0,0 +1,637 @@
+//
+//  delta.c
+//  server
+//
+
+#include "delta.h"
+
+#include "disk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "transfer.h"
+#include <unistd.h>
+
+
+/*
+ * DELTA TRANSFERS
+ * --
+ * When the recipient already has a copy of a file (the
+ * basis), typically an older version of it, only what
+ * changed needs to go over the wire. The recipient cuts
+ * the basis into blocks and describes each with a weak,
+ * rolling checksum and a strong one. The sender rolls
+ * the weak checksum along its payload one byte at a
+ * time, looking for blocks it has in common with the
+ * basis, and sends instructions for rebuilding the
+ * payload out of them:
+ *
+ * Literal: DP_DELTA_OP_LITERAL (1 byte), length (4 bytes), bytes
+ * Copy: DP_DELTA_OP_COPY (1 byte), first block (4 bytes), block count (4 bytes)
+ *
+ * The recipient follows the instructions into a staging
+ * file and checks it against the checksum of the whole
+ * payload before it is delivered over the basis.
+ */
+
+/**********************
+ * Private Prototypes
+ **********************/
+int delta_apply(int, uint64_t, uint32_t, const struct data64 *, uint64_t, int, uint64_t *);
+void delta_copy_put(struct data64 *, size_t *, uint32_t, uint32_t);
+void delta_literal_put(struct data64 *, size_t *, const unsigned char *, uint32_t);
+void instructions_put(struct data64 *, size_t *, const unsigned char *, size_t);
+void strong_get(const unsigned char *, uint32_t, unsigned char[]);
+uint32_t weak_get(const unsigned char *, uint32_t, uint32_t *, uint32_t *);
+int write_all(int, const unsigned char *, size_t);
+/**********************/
+
+
+/*
+ * Follows the instructions, writing the rebuilt payload
+ * to fd. Returns 0 on success, 1 if the instructions
+ * are malformed or would make more than size bytes, or
+ * -1 on failure.
+ */
+int delta_apply(int fd_basis, uint64_t basis_size, uint32_t block_len, const struct data64 *instructions, uint64_t size, int fd, uint64_t *written)
+{
+	unsigned char buffer[DP_DELTA_BUF_LEN];
+	uint64_t pos;
+	
+	*written = 0;
+	pos = 0;
+	
+	while (pos < instructions->len) {
+		unsigned char op;
+		
+		op = instructions->bytes[pos++];
+		
+		if (op == DP_DELTA_OP_LITERAL) {
+			uint32_t len;
+			
+			if (instructions->len - pos < sizeof(uint32_t))
+				return 1;
+			
+			len = instructions->bytes[pos + 3] |
+				( (uint32_t)instructions->bytes[pos + 2] << 8 ) |
+				( (uint32_t)instructions->bytes[pos + 1] << 16 ) |
+				( (uint32_t)instructions->bytes[pos] << 24 );
+			pos += sizeof(uint32_t);
+			
+			if (instructions->len - pos < len ||
+			    len > size - *written)
+				return 1;
+			
+			if (write_all(fd, &instructions->bytes[pos], len) != 0)
+				return -1;
+			
+			pos += len;
+			*written += len;
+		} else if (op == DP_DELTA_OP_COPY) {
+			uint64_t end;
+			uint64_t offset;
+			uint32_t count;
+			uint32_t first;
+			
+			if (instructions->len - pos < sizeof(uint32_t) + sizeof(uint32_t))
+				return 1;
+			
+			first = instructions->bytes[pos + 3] |
+				( (uint32_t)instructions->bytes[pos + 2] << 8 ) |
+				( (uint32_t)instructions->bytes[pos + 1] << 16 ) |
+				( (uint32_t)instructions->bytes[pos] << 24 );
+			pos += sizeof(uint32_t);
+			count = instructions->bytes[pos + 3] |
+				( (uint32_t)instructions->bytes[pos + 2] << 8 ) |
+				( (uint32_t)instructions->bytes[pos + 1] << 16 ) |
+				( (uint32_t)instructions->bytes[pos] << 24 );
+			pos += sizeof(uint32_t);
+			offset = (uint64_t)first * block_len;
+			end = offset + (uint64_t)count * block_len;
+			
+			if (end > basis_size ||
+			    end - offset > size - *written)
+				return 1;
+			
+			while (offset < end) {
+				ssize_t bytes_read;
+				size_t chunk;
+				
+				chunk = end - offset < DP_DELTA_BUF_LEN ? (size_t)(end - offset) : DP_DELTA_BUF_LEN;
+				
+				if ((bytes_read = pread(fd_basis, buffer, chunk, offset)) <= 0) {
+					if (bytes_read == -1 &&
+					    errno == EINTR)
+						continue;
+					
+					trace_write(DP_TRACE_WARN, "delta_apply(6), pread(4): %s", strerror(errno));
+					return -1;
+				}
+				
+				if (write_all(fd, buffer, bytes_read) != 0)
+					return -1;
+				
+				offset += bytes_read;
+				*written += bytes_read;
+			}
+		} else {
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+/*
+ * Picks the block length for a basis of the given size:
+ * roughly its square root, as rsync does, which keeps
+ * the signatures and the instructions in balance.
+ */
+uint32_t delta_block_len_get(uint64_t size)
+{
+	uint64_t len;
+	
+	len = DP_DELTA_BLOCK_MIN;
+	
+	while (len < DP_DELTA_BLOCK_MAX &&
+	       len * len < size)
+		len <<= 1;
+	
+	return (uint32_t)len;
+}
+
+void delta_copy_put(struct data64 *instructions, size_t *capacity, uint32_t first, uint32_t count)
+{
+	unsigned char op[1 + sizeof(uint32_t) + sizeof(uint32_t)];
+	
+	op[0] = DP_DELTA_OP_COPY;
+	op[1] = (first >> 24) & 0xff;
+	op[2] = (first >> 16) & 0xff;
+	op[3] = (first >> 8) & 0xff;
+	op[4] = first & 0xff;
+	op[5] = (count >> 24) & 0xff;
+	op[6] = (count >> 16) & 0xff;
+	op[7] = (count >> 8) & 0xff;
+	op[8] = count & 0xff;
+	instructions_put(instructions, capacity, op, sizeof(op));
+}
+
+void delta_literal_put(struct data64 *instructions, size_t *capacity, const unsigned char *bytes, uint32_t len)
+{
+	unsigned char op[1 + sizeof(uint32_t)];
+	
+	if (len == 0)
+		return;
+	
+	op[0] = DP_DELTA_OP_LITERAL;
+	op[1] = (len >> 24) & 0xff;
+	op[2] = (len >> 16) & 0xff;
+	op[3] = (len >> 8) & 0xff;
+	op[4] = len & 0xff;
+	instructions_put(instructions, capacity, op, sizeof(op));
+	instructions_put(instructions, capacity, bytes, len);
+}
+
+/*
+ * Works out the instructions for rebuilding the payload
+ * out of the basis described by the signatures. Returns
+ * 1 if they would take more than max bytes, in which
+ * case the payload is better off sent as it is.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int delta_make(const struct data64 *payload, uint32_t block_len, const struct dp_signature *signatures, uint32_t count, uint64_t max, struct data64 **out)
+{
+	unsigned char strong[DP_PROTO_HOST_STRONG_LEN];
+	struct data64 *instructions;
+	int32_t *chain;
+	int32_t *table;
+	size_t capacity;
+	uint64_t literal_start;
+	uint64_t pos;
+	uint32_t a;
+	uint32_t b;
+	uint32_t copy_count;
+	uint32_t copy_first;
+	uint32_t table_len;
+	uint32_t weak;
+	
+	if (!payload ||
+	    !signatures ||
+	    !out ||
+	    count == 0 ||
+	    block_len == 0)
+		return -1;
+	
+	*out = NULL;
+	
+	/* Chain the blocks by weak checksum. */
+	table_len = 16;
+	
+	while (table_len < count * 2)
+		table_len <<= 1;
+	
+	table = (int32_t *)malloc(table_len * sizeof(*table));
+	chain = (int32_t *)malloc(count * sizeof(*chain));
+	memset(table, 0xff, table_len * sizeof(*table));
+	
+	for (uint32_t i = count; i > 0; i--) {
+		uint32_t slot;
+		
+		slot = (signatures[i - 1].weak ^ (signatures[i - 1].weak >> 16)) & (table_len - 1);
+		chain[i - 1] = table[slot];
+		table[slot] = (int32_t)(i - 1);
+	}
+	
+	capacity = 4096;
+	instructions = (struct data64 *)malloc(sizeof(*instructions));
+	instructions->bytes = (unsigned char *)malloc(capacity);
+	instructions->len = 0;
+	copy_count = 0;
+	copy_first = 0;
+	literal_start = 0;
+	pos = 0;
+	weak = 0;
+	a = 0;
+	b = 0;
+	
+	if (payload->len >= block_len)
+		weak = weak_get(payload->bytes, block_len, &a, &b);
+	
+	while (pos + block_len <= payload->len &&
+	       instructions->len + (pos - literal_start) <= max) {
+		int32_t match;
+		int strong_done;
+		
+		match = -1;
+		strong_done = 0;
+		
+		for (int32_t i = table[(weak ^ (weak >> 16)) & (table_len - 1)]; i != -1; i = chain[i]) {
+			if (signatures[i].weak != weak)
+				continue;
+			
+			if (!strong_done) {
+				strong_get(&payload->bytes[pos], block_len, strong);
+				strong_done = 1;
+			}
+			
+			if (memcmp(strong, signatures[i].strong, DP_PROTO_HOST_STRONG_LEN) == 0) {
+				/* Prefer the block that carries on the copy in progress. */
+				if (match == -1 ||
+				    (copy_count > 0 &&
+				     (uint32_t)i == copy_first + copy_count))
+					match = i;
+			}
+		}
+		
+		if (match != -1) {
+			if (literal_start < pos) {
+				if (copy_count > 0) {
+					delta_copy_put(instructions, &capacity, copy_first, copy_count);
+					copy_count = 0;
+				}
+				
+				delta_literal_put(instructions, &capacity, &payload->bytes[literal_start], (uint32_t)(pos - literal_start));
+			}
+			
+			if (copy_count > 0 &&
+			    (uint32_t)match != copy_first + copy_count) {
+				delta_copy_put(instructions, &capacity, copy_first, copy_count);
+				copy_count = 0;
+			}
+			
+			if (copy_count == 0)
+				copy_first = (uint32_t)match;
+			
+			copy_count++;
+			pos += block_len;
+			literal_start = pos;
+			
+			if (pos + block_len <= payload->len)
+				weak = weak_get(&payload->bytes[pos], block_len, &a, &b);
+		} else {
+			if (pos + block_len < payload->len) {
+				unsigned char in;
+				unsigned char out_byte;
+				
+				/* Roll the window one byte on. */
+				out_byte = payload->bytes[pos];
+				in = payload->bytes[pos + block_len];
+				a = a - out_byte + in;
+				b = b - block_len * out_byte + a;
+				weak = (a & 0xffff) | (b << 16);
+			}
+			
+			pos++;
+			
+			/* Literals are sent in runs that fit their length field. */
+			if (pos - literal_start == UINT32_MAX) {
+				if (copy_count > 0) {
+					delta_copy_put(instructions, &capacity, copy_first, copy_count);
+					copy_count = 0;
+				}
+				
+				delta_literal_put(instructions, &capacity, &payload->bytes[literal_start], (uint32_t)(pos - literal_start));
+				literal_start = pos;
+			}
+		}
+	}
+	
+	if (copy_count > 0)
+		delta_copy_put(instructions, &capacity, copy_first, copy_count);
+	
+	while (literal_start < payload->len) {
+		uint64_t len;
+		
+		len = payload->len - literal_start < UINT32_MAX ? payload->len - literal_start : UINT32_MAX;
+		delta_literal_put(instructions, &capacity, &payload->bytes[literal_start], (uint32_t)len);
+		literal_start += len;
+	}
+	
+	free(table);
+	free(chain);
+	
+	if (instructions->len > max) {
+		free(instructions->bytes);
+		free(instructions);
+		
+		return 1;
+	}
+	
+	*out = instructions;
+	
+	return 0;
+}
+
+/*
+ * Rebuilds a delta's payload out of the recipient's copy
+ * into a staging file. Returns DP_REQOK along with the
+ * parcel, which is taken over from the delta and ready
+ * for delivery. DP_REQERR_CONFLICT means the basis is not
+ * the one the delta was made against, and the parcel
+ * should be sent in full instead.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+struct dp_reqstatus delta_patch(struct dp_delta *delta, struct dp_parcel **out)
+{
+	unsigned char checksum[SHA256_DIGEST_LENGTH];
+	char *path_str_patched;
+	struct path *path_basis;
+	struct dp_reqstatus status;
+	struct stat info;
+	uint64_t written;
+	int fd;
+	int fd_basis;
+	int result;
+	
+	if (!delta ||
+	    !out)
+		return DP_REQERR_INT_BADARG;
+	
+	*out = NULL;
+	status = parcel_path_get(delta->parcel, 0, &path_basis);
+	
+	if (status.code != DP_REQOK.code)
+		return status;
+	
+	fd_basis = open(path_cstr(path_basis), O_RDONLY);
+	path_free(&path_basis);
+	
+	if (fd_basis == -1 ||
+	    fstat(fd_basis, &info) == -1 ||
+	    !S_ISREG(info.st_mode) ||
+	    (uint64_t)info.st_size != delta->basis_size) {
+		if (fd_basis != -1)
+			close(fd_basis);
+		
+		return DP_REQERR_CONFLICT;
+	}
+	
+	if (!(path_str_patched = transfer_path_get(delta->parcel->head.uuid, DP_DELTA_EXT)) ||
+	    (fd = open(path_str_patched, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+		trace_write(DP_TRACE_WARN, "delta_patch(2), open(3): %s", strerror(errno));
+		close(fd_basis);
+		
+		if (path_str_patched)
+			free(path_str_patched);
+		
+		return DP_REQERR_INTERNAL;
+	}
+	
+	/* Nothing has been written yet; the file only tells space_check(2) which disk it is on. */
+	if (space_check(fd, delta->size) != 0) {
+		trace_write(DP_TRACE_WARN, "delta_patch(2), space_check(2): %s", strerror(errno));
+		close(fd);
+		close(fd_basis);
+		unlink(path_str_patched);
+		free(path_str_patched);
+		
+		return DP_REQERR_INTERNAL;
+	}
+	
+	result = delta_apply(fd_basis, delta->basis_size, delta->block_len, &delta->instructions, delta->size, fd, &written);
+	
+	if (result == -1)
+		status = DP_REQERR_INTERNAL;
+	else if (result == 1 ||
+		 written != delta->size)
+		status = DP_REQERR_BADREQ;
+	else if (sha_file(fd, delta->size, checksum) != 0 ||
+		 memcmp(checksum, delta->checksum, SHA256_DIGEST_LENGTH) != 0)
+		status = DP_REQERR_CONFLICT;
+	
+	close(fd);
+	close(fd_basis);
+	
+	if (status.code != DP_REQOK.code) {
+		unlink(path_str_patched);
+		free(path_str_patched);
+		
+		return status;
+	}
+	
+	*out = delta->parcel;
+	(*out)->payload_file = path_str_patched;
+	delta->parcel = NULL;
+	
+	return status;
+}
+
+/*
+ * Describes the recipient's copy of the parcel's file,
+ * block by block. A count of 0 means there is none.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int delta_signatures_get(const struct dp_parcel *parcel, uint64_t *basis_size, uint32_t *block_len, struct dp_signature **signatures, uint32_t *count)
+{
+	unsigned char *buffer;
+	struct path *path_basis;
+	struct stat info;
+	uint64_t blocks;
+	int fd;
+	int status;
+	
+	if (!parcel ||
+	    !basis_size ||
+	    !block_len ||
+	    !signatures ||
+	    !count)
+		return 1;
+	
+	*basis_size = 0;
+	*block_len = 0;
+	*count = 0;
+	*signatures = NULL;
+	
+	if (parcel_path_get(parcel, 0, &path_basis).code != DP_REQOK.code)
+		return 0;
+	
+	fd = open(path_cstr(path_basis), O_RDONLY);
+	path_free(&path_basis);
+	
+	if (fd == -1)
+		return 0;
+	
+	if (fstat(fd, &info) == -1 ||
+	    !S_ISREG(info.st_mode)) {
+		close(fd);
+		return 0;
+	}
+	
+	*basis_size = info.st_size;
+	*block_len = delta_block_len_get(*basis_size);
+	blocks = *basis_size / *block_len;
+	
+	/* Whatever lies past the last signature can still be sent as literals. */
+	if (blocks > DP_PROTO_HOST_SIGNATURES_MAX)
+		blocks = DP_PROTO_HOST_SIGNATURES_MAX;
+	
+	if (blocks == 0) {
+		close(fd);
+		return 0;
+	}
+	
+	buffer = (unsigned char *)malloc(*block_len);
+	*signatures = (struct dp_signature *)malloc(blocks * sizeof(**signatures));
+	status = 0;
+	
+	for (uint64_t i = 0; i < blocks; i++) {
+		uint32_t a;
+		uint32_t b;
+		size_t total;
+		
+		total = 0;
+		
+		while (total < *block_len) {
+			ssize_t bytes_read;
+			
+			if ((bytes_read = pread(fd, buffer + total, *block_len - total, i * *block_len + total)) <= 0) {
+				if (bytes_read == -1 &&
+				    errno == EINTR)
+					continue;
+				
+				break;
+			}
+			
+			total += bytes_read;
+		}
+		
+		if (total != *block_len) {
+			trace_write(DP_TRACE_WARN, "delta_signatures_get(5), pread(4): %s", strerror(errno));
+			status = -1;
+			break;
+		}
+		
+		(*signatures)[i].weak = weak_get(buffer, *block_len, &a, &b);
+		strong_get(buffer, *block_len, (*signatures)[i].strong);
+	}
+	
+	free(buffer);
+	close(fd);
+	
+	if (status != 0) {
+		free(*signatures);
+		*signatures = NULL;
+		
+		return status;
+	}
+	
+	*count = (uint32_t)blocks;
+	
+	return 0;
+}
+
+/*
+ * Appends to the instructions, growing them as needed.
+ */
+void instructions_put(struct data64 *instructions, size_t *capacity, const unsigned char *bytes, size_t len)
+{
+	if (instructions->len + len > *capacity) {
+		while (instructions->len + len > *capacity)
+			*capacity *= 2;
+		
+		instructions->bytes = (unsigned char *)realloc(instructions->bytes, *capacity);
+	}
+	
+	memcpy(&instructions->bytes[instructions->len], bytes, len);
+	instructions->len += len;
+}
+
+void strong_get(const unsigned char *block, uint32_t len, unsigned char strong[])
+{
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	
+	SHA256(block, len, digest);
+	memcpy(strong, digest, DP_PROTO_HOST_STRONG_LEN);
+}
+
+/*
+ * The rsync checksum: a is the sum of the bytes and b
+ * the sum of the running values of a, both kept to 16
+ * bits. Both are handed back so that the checksum can
+ * be rolled on by a byte without going over the block
+ * again.
+ */
+uint32_t weak_get(const unsigned char *block, uint32_t len, uint32_t *a, uint32_t *b)
+{
+	*a = 0;
+	*b = 0;
+	
+	for (uint32_t i = 0; i < len; i++) {
+		*a += block[i];
+		*b += (len - i) * block[i];
+	}
+	
+	return (*a & 0xffff) | (*b << 16);
+}
+
+/*
+ * Keeps writing until all len bytes are out.
+ */
+int write_all(int fd, const unsigned char *bytes, size_t len)
+{
+	size_t written;
+	
+	written = 0;
+	
+	while (written < len) {
+		ssize_t result;
+		
+		if ((result = write(fd, bytes + written, len - written)) == -1) {
+			if (errno == EINTR)
+				continue;
+			
+			trace_write(DP_TRACE_WARN, "write_all(3), write(3): %s", strerror(errno));
+			return -1;
+		}
+		
+		written += result;
+	}
+	
+	return 0;
+}
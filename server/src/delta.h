@@ -0,0 +1,33 @@
+//
+//  delta.h
+//  server
+//
+
+#ifndef DELTA_H
+#define DELTA_H
+
+
+#include "protocol.h"
+
+
+#define DP_DELTA_BUF_LEN	65536	/* Basis bytes are copied in chunks of this size. */
+#define DP_DELTA_EXT		".delta"
+
+/*************
+ * CONSTANTS *
+ *************/
+static const uint32_t DP_DELTA_BLOCK_MIN 		= 1024;
+static const uint32_t DP_DELTA_BLOCK_MAX 		= 128 * 1024;
+static const unsigned char DP_DELTA_OP_COPY 		= 1;
+static const unsigned char DP_DELTA_OP_LITERAL 		= 0;
+
+/*************
+ * FUNCTIONS *
+ *************/
+uint32_t delta_block_len_get(uint64_t);
+int delta_make(const struct data64 *, uint32_t, const struct dp_signature *, uint32_t, uint64_t, struct data64 **);
+struct dp_reqstatus delta_patch(struct dp_delta *, struct dp_parcel **);
+int delta_signatures_get(const struct dp_parcel *, uint64_t *, uint32_t *, struct dp_signature **, uint32_t *);
+
+
+#endif /* DELTA_H */
@@ -6,19 +6,71 @@
 //  Copyright © 2017 Ali Mahouk. All rights reserved.
 //
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* O_TMPFILE and fallocate(2) */
+#endif
 #include "disk.h"
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include <sys/types.h>
+#include "trace.h"
 #include <unistd.h>
 #include "util.h"
 
 
+/**************
+ * STRUCTURES *
+ **************/
+#ifdef __linux__
+/*
+ * What getdents64(2) fills its buffer with; glibc does not
+ * always declare it.
+ */
+struct dp_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#endif
+
+/*
+ * A file mapped by file_get(2). Should the file be cut
+ * short while it is mapped, the pages past its new end
+ * are swapped for zeroes and cut is set.
+ */
+struct dp_file_map {
+	unsigned char *_Atomic start;
+	size_t len;
+	volatile sig_atomic_t cut;
+};
+
+/********************
+ * Global Variables
+ ********************/
+struct token *config_cached;	/* dp.conf as last read */
+pthread_mutex_t config_cached_lock = PTHREAD_MUTEX_INITIALIZER;
+struct stat config_cached_stat;	/* dp.conf when it was last read; zeroed if it was not there */
+pthread_mutex_t file_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t file_maps_once = PTHREAD_ONCE_INIT;
+long file_maps_page;
+struct dp_file_map file_maps[DP_FILE_MAPS_MAX];
+/**********************/
+
 /**********************
  * Private Prototypes
  **********************/
@@ -33,11 +85,17 @@ int config_file_make(const struct path *);
 int config_file_validate(const struct path *);
 void config_file_verify(const struct path *);
 void config_list_deserialise(const char *, struct token **);
+void config_list_free(struct token **);
 void config_list_serialise(const struct token *, char **);
+char *config_value_get(const char *, const char *);
 struct path *default_dir_get(struct path *);
-struct path *errlog_file_get(void);
 int errlog_file_make(const struct path *);
 void errlog_file_verify(const struct path *);
+size_t fd_readb(int, size_t, unsigned char **);
+void file_map_fault(int, siginfo_t *, void *);
+void file_maps_trap(void);
+int filearray_add(struct filearray *, struct arena *, int, const char *, uint64_t, unsigned char);
+int fileentry_compare(const void *, const void *);
 char *property_name_get(const char *);
 char *property_val_get(const char *);
 struct path *readme_file_get(struct path *);
@@ -118,14 +176,16 @@ const char *config_default(void)
 	if (config_list)
 		free(config_list);
 	
-	if (config_docroot)
+	if (config_docroot) {
+		free(config_docroot->val);
 		free(config_docroot);
+	}
 	
 	if (path_dir_config)
-		free(path_dir_config);
+		path_free(&path_dir_config);
 	
 	if (path_dir_docroot)
-		free(path_dir_docroot);
+		path_free(&path_dir_docroot);
 	
 	return config;
 }
@@ -276,6 +336,27 @@ void config_list_deserialise(const char *list, struct token **out)
 		config_list->next = NULL;
 }
 
+void config_list_free(struct token **list)
+{
+	if (!list)
+		return;
+	
+	while (*list) {
+		struct token *tmp;
+		
+		tmp = *list;
+		*list = (*list)->next;
+		
+		if (tmp->name)
+			free(tmp->name);
+		
+		if (tmp->val)
+			free(tmp->val);
+		
+		free(tmp);
+	}
+}
+
 void config_list_serialise(const struct token *list, char **out)
 {
 	struct token *iter;
@@ -327,6 +408,201 @@ void config_list_serialise(const struct token *list, char **out)
 	}
 }
 
+/*
+ * Returns the port the host listens on, or 0 if dp.conf
+ * does not say. A PORT line naming the host wins over
+ * one for "*". The local machine is DP_DIR_DEFAULT, so
+ * its line sets the port this daemon listens on.
+ */
+int config_port_get(const char *host)
+{
+	char *value;
+	int port;
+	
+	port = 0;
+	
+	if ((value = config_value_get(DP_CKEY_PORT, host ? host : "*"))) {
+		port = atoi(value);
+		free(value);
+	}
+	
+	if (port < 1 ||
+	    port > 65535)
+		port = 0;
+	
+	return port;
+}
+
+/*
+ * Returns the number of parcels covered by one batch
+ * signature, or 0 if parcels are not to be signed.
+ */
+int config_sign_get(void)
+{
+	char *value;
+	int sign;
+	
+	sign = 0;
+	
+	if ((value = config_value_get(DP_CKEY_SIGN, NULL))) {
+		sign = atoi(value);
+		free(value);
+	}
+	
+	if (sign < 0)
+		sign = 0;
+	else if (sign > DP_SIGN_MAX)
+		sign = DP_SIGN_MAX;
+	
+	return sign;
+}
+
+/*
+ * Returns how many connections a large parcel to the
+ * host should be spread over. A STREAMS line naming the
+ * host wins over one for "*"; without either, it is
+ * DP_STREAMS_DEFAULT.
+ */
+int config_streams_get(const char *host)
+{
+	char *value;
+	int streams;
+	
+	streams = 0;
+	
+	if ((value = config_value_get(DP_CKEY_STREAMS, host ? host : "*"))) {
+		streams = atoi(value);
+		free(value);
+	}
+	
+	if (streams < 1)
+		streams = DP_STREAMS_DEFAULT;
+	else if (streams > DP_STREAMS_MAX)
+		streams = DP_STREAMS_MAX;
+	
+	return streams;
+}
+
+/*
+ * Returns 1 if connections to the host are to go over
+ * TLS.
+ */
+int config_tls_get(const char *host)
+{
+	char *value;
+	int tls;
+	
+	tls = 0;
+	
+	if ((value = config_value_get(DP_CKEY_TLS, host ? host : "*"))) {
+		tls = strcmp(value, "on") == 0;
+		free(value);
+	}
+	
+	return tls;
+}
+
+/*
+ * Returns the value of the key's last line in dp.conf.
+ * The file is parsed once and again only once it
+ * changes. With a host, the key's lines read "<host>
+ * <value>", and one naming the host wins over one for
+ * "*". The host is not part of the returned value.
+ * Returns NULL if there is no such line.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+char *config_value_get(const char *key, const char *host)
+{
+	char *config;
+	char *value;
+	char *value_any;
+	struct path *path_file_config;
+	struct stat file_stat;
+	struct token *iter;
+	
+	if (!key)
+		return NULL;
+	
+	path_file_config = config_file_get();
+	value = NULL;
+	value_any = NULL;
+	
+	if (stat(path_cstr(path_file_config), &file_stat) != 0)
+		memset(&file_stat, 0, sizeof(file_stat));
+	
+	pthread_mutex_lock(&config_cached_lock);
+	
+	if (file_stat.st_ino != config_cached_stat.st_ino ||
+	    file_stat.st_size != config_cached_stat.st_size ||
+	    file_stat.st_mtime != config_cached_stat.st_mtime ||
+	    file_stat.st_ctime != config_cached_stat.st_ctime) {
+		config = NULL;
+		config_list_free(&config_cached);
+		readt(path_file_config, &config);
+		config_list_deserialise(config, &config_cached);
+		config_cached_stat = file_stat;
+		
+		if (config)
+			free(config);
+	}
+	
+	for (iter = config_cached; iter; iter = iter->next) {
+		char *line_host;
+		char *line_value;
+		
+		if (!iter->name ||
+		    !iter->val ||
+		    strcmp(iter->name, key) != 0)
+			continue;
+		
+		if (!host) {
+			if (value)
+				free(value);
+			
+			value = strdup(iter->val);
+			continue;
+		}
+		
+		line_host = property_name_get(iter->val);
+		line_value = property_val_get(iter->val);
+		
+		if (line_host &&
+		    line_value) {
+			if (strcmp(line_host, host) == 0) {
+				if (value)
+					free(value);
+				
+				value = line_value;
+				line_value = NULL;
+			} else if (strcmp(line_host, "*") == 0) {
+				if (value_any)
+					free(value_any);
+				
+				value_any = line_value;
+				line_value = NULL;
+			}
+		}
+		
+		if (line_host)
+			free(line_host);
+		
+		if (line_value)
+			free(line_value);
+	}
+	
+	pthread_mutex_unlock(&config_cached_lock);
+	path_free(&path_file_config);
+	
+	if (!value)
+		return value_any;
+	
+	if (value_any)
+		free(value_any);
+	
+	return value;
+}
+
 struct path *default_dir_get(struct path *root)
 {
 	struct path *path_dir_root;
@@ -419,7 +695,7 @@ int directory_exists(const struct path *path)
 	if (!path)
 		return -1;
 	
-	dir = opendir(path_str(path));
+	dir = opendir(path_cstr(path));
 	
 	if (dir) { /* Directory exists. */
 		closedir(dir);
@@ -447,8 +723,12 @@ int directory_make(const struct path *path)
 		 * Read/write/search permissions for owner and group; read/search
 		 * permissions for others.
 		 */
-		if (mkdir(path_str(path), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0) {
-			perror ("make_directory(1), mkdir(2)");
+		if (mkdir(path_cstr(path), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0) {
+			/* Another delivery worker may have just made it. */
+			if (errno == EEXIST)
+				return 1;
+			
+			trace_write(DP_TRACE_WARN, "directory_make(1), mkdir(2): %s", strerror(errno));
 			return -1;
 		}
 		
@@ -458,6 +738,64 @@ int directory_make(const struct path *path)
 	return 1;
 }
 
+/*
+ * Opens the directory name relative to the one open at
+ * dirfd (or the working directory for AT_FDCWD) so that
+ * the walk down from there is not repeated. It is the
+ * caller's responsibility to close the returned
+ * descriptor.
+ */
+int directory_open(int dirfd, const char *name)
+{
+	int fd;
+	
+	if (!name)
+		return -1;
+	
+	if ((fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		trace_write(DP_TRACE_WARN, "directory_open(2), openat(3): %s", strerror(errno));
+	
+	return fd;
+}
+
+/*
+ * Reads len bytes from the start of the file. Returns
+ * the number of bytes read, with out set to NULL if
+ * they fell short of len.
+ */
+size_t fd_readb(int fd, size_t len, unsigned char **out)
+{
+	size_t bytes_read;
+	ssize_t result;
+	
+	bytes_read = 0;
+	
+	if (!(*out = (unsigned char *)malloc(len ? len : 1)))
+		return 0;
+	
+	while (bytes_read < len) {
+		if ((result = pread(fd, &(*out)[bytes_read], len - bytes_read, bytes_read)) == -1) {
+			if (errno == EINTR)
+				continue;
+			
+			trace_write(DP_TRACE_WARN, "fd_readb(3), pread(4): %s", strerror(errno));
+			
+			break;
+		} else if (result == 0) {
+			break;
+		}
+		
+		bytes_read += result;
+	}
+	
+	if (bytes_read != len) {
+		free(*out);
+		*out = NULL;
+	}
+	
+	return bytes_read;
+}
+
 /*
  * This function only works on empty directories.
  */
@@ -466,7 +804,36 @@ int directory_remove(const struct path *path)
 	if (!path)
 		return 1;
 	
-	return rmdir(path_str(path));
+	return rmdir(path_cstr(path));
+}
+
+/*
+ * Flushes the directory's entries to disk, so that a
+ * file just named in it survives a crash.
+ */
+int directory_sync(const struct path *path)
+{
+	int fd;
+	int status;
+	
+	if (!path)
+		return 1;
+	
+	if ((fd = open(path_cstr(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		trace_write(DP_TRACE_WARN, "directory_sync(1), open(2): %s", strerror(errno));
+		return -1;
+	}
+	
+	status = 0;
+	
+	if (fsync(fd) != 0) {
+		trace_write(DP_TRACE_WARN, "directory_sync(1), fsync(1): %s", strerror(errno));
+		status = -1;
+	}
+	
+	close(fd);
+	
+	return status;
 }
 
 void empty_file_make(const struct path *path, int overwrite)
@@ -484,7 +851,7 @@ void empty_file_make(const struct path *path, int overwrite)
 	else
 		mode = "a";
 	
-	fptr = fopen(path_str(path), mode);
+	fptr = fopen(path_cstr(path), mode);
 	fclose(fptr);
 }
 
@@ -522,7 +889,7 @@ int file_exists(const struct path *path)
 	if (!path)
 		return -1;
 	
-	if (access(path_str(path), F_OK) != -1)
+	if (access(path_cstr(path), F_OK) != -1)
 		return 1;
 	
 	return 0;
@@ -541,43 +908,102 @@ FILE *file_handle(const struct path *path)
 	if (!path)
 		return fptr;
 	
-	fptr = fopen(path_str(path), "r");
+	fptr = fopen(path_cstr(path), "r");
 	
 	return fptr;
 }
 
 /*
- * Reads the file in binary mode and places
- * the bytes in the data structure. It is the
- * caller's responsibility to free the returned
- * pointer.
+ * Places the bytes of the file in the data structure.
+ * Files of DP_FILE_MAP_MIN bytes or more are mapped
+ * read-only rather than read, so large payloads are
+ * sent straight out of the page cache; once
+ * DP_FILE_MAPS_MAX are mapped, the rest are read.
+ * Either way, the caller has to hand the returned
+ * pointer to file_release(1) rather than free it, and
+ * must not write to its bytes.
  */
 int file_get(const struct path *path, struct data64 **out)
 {
 	unsigned char *buffer;
+	void *map;
+	struct stat info;
 	size_t byte_len;
+	int fd;
+	int slot;
 	
 	if (!path ||
 	    !out)
 		return 1;
 	
-	byte_len = readb(path, &buffer);
 	*out = NULL;
 	
-	if (buffer) {
-		if (byte_len > 0) {
-			*out = (struct data64 *)malloc(sizeof(**out));
-			(*out)->bytes = buffer;
-			(*out)->len = byte_len;
-			
-			return 0;
-		} else {
-			free(buffer);
-			buffer = NULL;
+	if ((fd = open(path_cstr(path), O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	
+	if (fstat(fd, &info) == -1) {
+		trace_write(DP_TRACE_WARN, "file_get(2), fstat(2): %s", strerror(errno));
+		close(fd);
+		
+		return -1;
+	}
+	
+	if (!S_ISREG(info.st_mode) ||
+	    info.st_size <= 0) {
+		close(fd);
+		
+		return -1;
+	}
+	
+	map = MAP_FAILED;
+	slot = -1;
+	
+	if ((size_t)info.st_size >= DP_FILE_MAP_MIN) {
+		pthread_once(&file_maps_once, file_maps_trap);
+		pthread_mutex_lock(&file_maps_lock);
+		
+		for (int i = 0; i < DP_FILE_MAPS_MAX && slot == -1; i++) {
+			if (!file_maps[i].start)
+				slot = i;
 		}
+		
+		if (slot != -1 &&
+		    (map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+			trace_write(DP_TRACE_WARN, "file_get(2), mmap(6): %s", strerror(errno));
+		
+		if (map != MAP_FAILED) {
+			file_maps[slot].len = info.st_size;
+			file_maps[slot].cut = 0;
+			file_maps[slot].start = (unsigned char *)map;
+		}
+		
+		pthread_mutex_unlock(&file_maps_lock);
 	}
 	
-	return -1;
+	if (map == MAP_FAILED) {
+		byte_len = fd_readb(fd, info.st_size, &buffer);
+		close(fd);
+		
+		if (!buffer)
+			return -1;
+		
+		*out = (struct data64 *)malloc(sizeof(**out));
+		(*out)->bytes = buffer;
+		(*out)->len = byte_len;
+		
+		return 0;
+	}
+	
+	close(fd);
+	
+	/* Payloads are read front to back, once. */
+	madvise(map, info.st_size, MADV_SEQUENTIAL);
+	
+	*out = (struct data64 *)malloc(sizeof(**out));
+	(*out)->bytes = (unsigned char *)map;
+	(*out)->len = info.st_size;
+	
+	return 0;
 }
 
 /*
@@ -593,85 +1019,327 @@ FILE *file_make(const struct path *path)
 	if (!path)
 		return fptr;
 	
-	fptr = fopen(path_str(path), "w+");
+	fptr = fopen(path_cstr(path), "w+");
 	
 	return fptr;
 }
 
+/*
+ * Stands zeroes in for the pages of a mapped file
+ * that were cut off its end, so that whoever is
+ * reading it carries on rather than the daemon being
+ * killed. Any other SIGBUS kills it as before.
+ */
+void file_map_fault(int sig, siginfo_t *info, void *context)
+{
+	unsigned char *addr;
+	
+	addr = (unsigned char *)info->si_addr;
+	
+	for (int i = 0; i < DP_FILE_MAPS_MAX; i++) {
+		unsigned char *start;
+		
+		start = file_maps[i].start;
+		
+		if (!start ||
+		    addr < start ||
+		    addr >= start + file_maps[i].len)
+			continue;
+		
+		if (mmap(addr - (uintptr_t)addr % file_maps_page, file_maps_page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+			file_maps[i].cut = 1;
+			return;
+		}
+		
+		break;
+	}
+	
+	/* The faulting access is retried and gets the default. */
+	signal(SIGBUS, SIG_DFL);
+}
+
+/*
+ * Catches reads past the end of a file that has been
+ * truncated while file_get(2) has it mapped.
+ */
+void file_maps_trap(void)
+{
+	struct sigaction action;
+	
+	file_maps_page = sysconf(_SC_PAGESIZE);
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = file_map_fault;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	
+	if (sigaction(SIGBUS, &action, NULL) == -1)
+		trace_write(DP_TRACE_ERROR, "file_maps_trap(0), sigaction(3): %s", strerror(errno));
+}
+
+/*
+ * Gives back the memory of a file_get(2) result,
+ * unmapping it if it was mapped. Returns -1 if the
+ * file was cut short while it was mapped, in which
+ * case what was read past its new end was zeroes.
+ */
+int file_release(struct data64 **data)
+{
+	int slot;
+	int status;
+	
+	if (!data ||
+	    !*data)
+		return 1;
+	
+	slot = -1;
+	status = 0;
+	
+	if ((*data)->len >= DP_FILE_MAP_MIN) {
+		pthread_mutex_lock(&file_maps_lock);
+		
+		for (int i = 0; i < DP_FILE_MAPS_MAX && slot == -1; i++) {
+			if (file_maps[i].start == (*data)->bytes)
+				slot = i;
+		}
+		
+		if (slot != -1) {
+			if (file_maps[slot].cut)
+				status = -1;
+			
+			file_maps[slot].start = NULL;
+			munmap((*data)->bytes, (*data)->len);
+		}
+		
+		pthread_mutex_unlock(&file_maps_lock);
+	}
+	
+	if (slot == -1 &&
+	    (*data)->bytes)
+		free((*data)->bytes);
+	
+	free(*data);
+	*data = NULL;
+	
+	return status;
+}
+
+/*
+ * Moves a file, copying it over if it has to cross
+ * into another file system.
+ */
+int file_move(const char *from, const char *to)
+{
+	unsigned char buffer[DP_COPY_BUF_LEN];
+	FILE *fptr_from;
+	FILE *fptr_to;
+	size_t len;
+	int status;
+	
+	if (!from ||
+	    !to)
+		return 1;
+	
+	if (rename(from, to) == 0)
+		return 0;
+	
+	if (errno != EXDEV) {
+		trace_write(DP_TRACE_WARN, "file_move(2), rename(2): %s", strerror(errno));
+		return -1;
+	}
+	
+	fptr_from = fopen(from, "rb");
+	fptr_to = fopen(to, "wb");
+	status = 0;
+	
+	if (!fptr_from ||
+	    !fptr_to) {
+		trace_write(DP_TRACE_WARN, "file_move(2), fopen(2): %s", strerror(errno));
+		status = -1;
+	} else {
+		while ((len = fread(buffer, 1, DP_COPY_BUF_LEN, fptr_from)) > 0) {
+			if (fwrite(buffer, 1, len, fptr_to) != len) {
+				trace_write(DP_TRACE_WARN, "file_move(2), fwrite(4): %s", strerror(errno));
+				status = -1;
+				break;
+			}
+		}
+		
+		if (ferror(fptr_from))
+			status = -1;
+	}
+	
+	if (fptr_from)
+		fclose(fptr_from);
+	
+	if (fptr_to &&
+	    fclose(fptr_to) != 0)
+		status = -1;
+	
+	if (status == 0)
+		unlink(from);
+	else
+		unlink(to);
+	
+	return status;
+}
+
 int file_remove(const struct path *path)
 {
 	if (!path)
 		return 1;
 	
-	return remove(path_str(path));
+	return remove(path_cstr(path));
 }
 
-void filelist_free(struct filelist **list)
+/*
+ * Adds an entry to the end of the array, growing it in
+ * the arena if it is full. Entries of an unknown type
+ * and links are looked up relative to dirfd.
+ */
+int filearray_add(struct filearray *array, struct arena *arena, int dirfd, const char *name, uint64_t inode, unsigned char type)
 {
-	if (list) {
-		while (*list) {
-			struct filelist *next;
-			
-			next = (*list)->next;
-			
-			if ((*list)->path)
-				path_free(&(*list)->path);
-			
-			free(*list);
+	struct fileentry *entries;
+	struct fileentry *entry;
+	struct stat info;
+	size_t count_max;
+	size_t len;
+	
+	if (array->count == array->count_max) {
+		count_max = array->count_max ? array->count_max * 2 : DP_FILEARRAY_INIT;
+		
+		if (!(entries = (struct fileentry *)arena_alloc(arena, count_max * sizeof(*entries))))
+			return -1;
+		
+		if (array->count)
+			memcpy(entries, array->entries, array->count * sizeof(*entries));
+		
+		array->count_max = count_max;
+		array->entries = entries;
+	}
+	
+	len = strlen(name);
+	entry = &array->entries[array->count];
+	
+	if (!(entry->name = (char *)arena_alloc(arena, len + 1)))
+		return -1;
+	
+	memcpy(entry->name, name, len + 1);
+	entry->inode = inode;
+	entry->type = type;
+	
+	if (type == DT_UNKNOWN ||
+	    type == DT_LNK) {
+		if (fstatat(dirfd, name, &info, 0) == -1) {
+			entry->type = DT_UNKNOWN;
+		} else {
+			entry->inode = info.st_ino;
 			
-			*list = next;
+			if (S_ISDIR(info.st_mode))
+				entry->type = DT_DIR;
+			else if (S_ISREG(info.st_mode))
+				entry->type = DT_REG;
 		}
-		
-		*list = NULL;
 	}
+	
+	array->count++;
+	
+	return 0;
 }
 
 /*
- * The returned file list entries must be freed
- * by the caller by calling filelist_free(1).
+ * Lists the directory open at dirfd into the arena, with
+ * the entries sorted by name. On Linux the entries
+ * are read in bulk with getdents64(2) rather than one by
+ * one, into a buffer that is also taken from the arena.
  */
-void filelist_get(const struct path *path, struct filelist **out)
+int filearray_at_get(int dirfd, struct arena *arena, struct filearray *out)
 {
+#ifdef __linux__
+	unsigned char *buffer;
+	struct dp_dirent64 *ent;
+	long len;
+#else
 	DIR *dir;
 	struct dirent *ent;
-	struct filelist *list;
+#endif
+	int fd;
+	int status;
 	
-	if (!path ||
+	if (!arena ||
 	    !out)
-		return;
+		return 1;
 	
-	list = NULL;
-	*out = NULL;
+	out->count = 0;
+	out->count_max = 0;
+	out->entries = NULL;
+	status = 0;
+	
+	/* A fresh descriptor so that the caller's keeps its own offset. */
+	if ((fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		trace_write(DP_TRACE_WARN, "filearray_at_get(3), openat(3): %s", strerror(errno));
+		return -1;
+	}
 	
-	if ((dir = opendir(path_str(path))) != NULL) {
-		while ((ent = readdir(dir)) != NULL) {
+#ifdef __linux__
+	if (!(buffer = (unsigned char *)arena_alloc(arena, DP_DIRENTS_BUF_LEN))) {
+		close(fd);
+		return -1;
+	}
+	
+	while (status == 0 &&
+	       (len = syscall(SYS_getdents64, fd, buffer, DP_DIRENTS_BUF_LEN)) > 0) {
+		for (long i = 0; i < len; i += ent->d_reclen) {
+			ent = (struct dp_dirent64 *)(buffer + i);
+			
 			/* Ignore working and upper directory files. */
-			if (strcmp(ent->d_name, ".") != 0 &&
-			    strcmp(ent->d_name, "..") != 0) {
-				if (!list) {
-					*out = (struct filelist *)malloc(sizeof(**out));
-					(*out)->path = path_make(ent->d_name);
-					list = *out;
-				} else {
-					struct filelist *entry;
-					
-					/* Append a new entry. */
-					entry = (struct filelist *)malloc(sizeof(*entry));
-					entry->path = path_make(ent->d_name);
-					list->next = entry;
-					list = entry;
-				}
+			if (strcmp(ent->d_name, ".") == 0 ||
+			    strcmp(ent->d_name, "..") == 0)
+				continue;
+			
+			if (filearray_add(out, arena, dirfd, ent->d_name, ent->d_ino, ent->d_type) != 0) {
+				status = -1;
+				break;
 			}
 		}
+	}
+	
+	if (len == -1) {
+		trace_write(DP_TRACE_WARN, "filearray_at_get(3), getdents64(3): %s", strerror(errno));
+		status = -1;
+	}
+	
+	close(fd);
+#else
+	if (!(dir = fdopendir(fd))) {
+		trace_write(DP_TRACE_WARN, "filearray_at_get(3), fdopendir(1): %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	while (status == 0 &&
+	       (ent = readdir(dir)) != NULL) {
+		/* Ignore working and upper directory files. */
+		if (strcmp(ent->d_name, ".") == 0 ||
+		    strcmp(ent->d_name, "..") == 0)
+			continue;
 		
-		/* 8<-- Snip off the list. -- */
-		if (list)
-			list->next = NULL;
-		
-		closedir (dir);
-	} else { /* Could not open directory. */
-		perror ("get_files(1), opendir(1)");
+		if (filearray_add(out, arena, dirfd, ent->d_name, ent->d_ino, ent->d_type) != 0)
+			status = -1;
 	}
+	
+	/* Also closes fd. */
+	closedir(dir);
+#endif
+	
+	if (out->count > 1)
+		qsort(out->entries, out->count, sizeof(*out->entries), fileentry_compare);
+	
+	return status;
+}
+
+int fileentry_compare(const void *a, const void *b)
+{
+	return strcmp(((const struct fileentry *)a)->name, ((const struct fileentry *)b)->name);
 }
 
 struct path *home_dir_get(void)
@@ -684,132 +1352,222 @@ struct path *home_dir_get(void)
 	return path_make(homedir);
 }
 
-int is_directory(const struct path *path)
+/*
+ * Allocates a single-component path, from the arena if
+ * one is given or on the heap otherwise. Either way it
+ * is released with path_free(1).
+ */
+struct path *path_alloc(struct arena *arena, const char *str)
 {
-	struct stat path_stat;
+	struct path *path;
+	size_t len;
 	
-	stat(path_str(path), &path_stat);
+	if (!str)
+		return NULL;
 	
-	return S_ISDIR(path_stat.st_mode);
-}
-
-int is_file(const struct path *path)
-{
-	struct stat path_stat;
+	if (arena)
+		path = (struct path *)arena_alloc(arena, sizeof(*path));
+	else
+		path = (struct path *)malloc(sizeof(*path));
+	
+	if (!path)
+		return NULL;
 	
-	stat(path_str(path), &path_stat);
+	len = strlen(str);
+	path->arena = arena;
+	path->buf = NULL;
+	path->count = 0;
+	path->count_max = 0;
+	path->len = 0;
+	path->len_max = 0;
+	path->offsets = NULL;
+	
+	if (path_reserve(path, len, 1) != 0) {
+		path_free(&path);
+		return NULL;
+	}
 	
-	return S_ISREG(path_stat.st_mode);
+	memcpy(path->buf, str, len + 1);
+	path->count = 1;
+	path->len = len;
+	path->offsets[0] = 0;
+	
+	return path;
 }
 
 /*
- * Appends the given component to the path and
- * returns a pointer to the new component.
+ * Appends the given component to the path in place.
  */
 void path_append(struct path **path, const char *component)
 {
-	struct path *new_comp;
+	struct path *p;
+	size_t len;
 	
-	new_comp = NULL;
+	if (!path ||
+	    !*path ||
+	    !component)
+		return;
 	
-	if (path &&
-	    component) {
-		new_comp = path_make(component);
-		new_comp->previous = *path;
-		(*path)->next = new_comp;
-		*path = new_comp;
-	}
+	p = *path;
+	len = strlen(component);
+	
+	if (path_reserve(p, p->len + 1 + len, p->count + 1) != 0)
+		return;
+	
+	p->buf[p->len] = '/';
+	memcpy(p->buf + p->len + 1, component, len + 1);
+	p->offsets[p->count++] = p->len + 1;
+	p->len += 1 + len;
 }
 
+/*
+ * The copy is always made on the heap.
+ */
 struct path *path_copy(const struct path *path)
 {
 	struct path *copy;
-	struct path *iter;
 	
-	copy = NULL;
-	iter = (struct path *)path;
+	if (!path ||
+	    !(copy = path_alloc(NULL, "")))
+		return NULL;
 	
-	if (path) {
-		if (!iter->next &&
-		    iter->previous) {
-			/* Last path component; rewind to the beginning. */
-			while (iter->previous)
-				iter = iter->previous;
-		}
-		
-		while (iter) {
-			if (copy) {
-				struct path *component;
-				
-				component = path_make(iter->component);
-				component->previous = copy;
-				copy->next = component;
-				copy = component;
-			} else {
-				copy = path_make(iter->component);
-			}
-			
-			iter = iter->next;
-		}
+	if (path_reserve(copy, path->len, path->count) != 0) {
+		path_free(&copy);
+		return NULL;
 	}
 	
+	memcpy(copy->buf, path->buf, path->len + 1);
+	memcpy(copy->offsets, path->offsets, path->count * sizeof(*path->offsets));
+	copy->count = path->count;
+	copy->len = path->len;
+	
 	return copy;
 }
 
+/*
+ * Paths that live in an arena are only detached; their
+ * memory goes back when the arena is rewound or freed.
+ */
 void path_free(struct path **path)
 {
-	if (path) {
-		if ((*path)->component) {
-			free((*path)->component);
-			(*path)->component = NULL;
-		}
-		
-		/* Free subsequent path components.*/
-		if ((*path)->next)
-			path_free(&(*path)->next);
-		
-		if ((*path)->previous)
-			(*path)->previous->next = NULL;
-			
+	if (!path ||
+	    !*path)
+		return;
+	
+	if (!(*path)->arena) {
+		free((*path)->buf);
+		free((*path)->offsets);
 		free(*path);
-		*path = NULL;
 	}
+	
+	*path = NULL;
 }
 
 struct path *path_make(const char *str)
 {
-	struct path *path;
+	return path_alloc(NULL, str);
+}
+
+/*
+ * Returns the last component of the path.
+ */
+const char *path_name_get(const struct path *path)
+{
+	if (!path ||
+	    path->count == 0)
+		return NULL;
 	
-	path = NULL;
+	return path->buf + path->offsets[path->count - 1];
+}
+
+/*
+ * Removes the last path component. The path
+ * becomes null if it contains only one component.
+ */
+void path_pop(struct path **path)
+{
+	struct path *p;
 	
-	if (str) {
-		path = (struct path *)malloc(sizeof(*path));
-		path->component = (char *)calloc(strlen(str) + 1, sizeof(*str));
-		path->next = NULL;
-		path->previous = NULL;
-		strcpy(path->component, str);
+	if (!path ||
+	    !*path)
+		return;
+	
+	p = *path;
+	
+	if (p->count <= 1) {
+		path_free(path);
+		return;
 	}
 	
-	return path;
+	p->count--;
+	/* -1 for the '/' in front of the component. */
+	p->len = p->offsets[p->count] - 1;
+	p->buf[p->len] = '\0';
 }
 
 /*
- * Seeks to the end of a path and removes
- * the last path component. The path becomes
- * null if it contains only one component.
+ * Makes room for a path of len characters (not counting
+ * the terminator) made of count components. Buffers at
+ * least double when they grow so that appending stays
+ * cheap.
  */
-void path_pop(struct path **path)
+int path_reserve(struct path *path, size_t len, size_t count)
 {
-	struct path *prev;
+	char *buf;
+	size_t *offsets;
+	size_t count_max;
+	size_t len_max;
 	
-	/* Seek to the end. */
-	while ((*path)->next)
-		*path = (*path)->next;
+	if (!path)
+		return 1;
 	
-	prev = (*path)->previous;
+	if (len + 1 > path->len_max) {
+		len_max = path->len_max ? path->len_max * 2 : DP_PATH_LEN_INIT;
+		
+		while (len_max < len + 1)
+			len_max *= 2;
+		
+		if (path->arena) {
+			if ((buf = (char *)arena_alloc(path->arena, len_max)) &&
+			    path->buf)
+				memcpy(buf, path->buf, path->len + 1);
+		} else {
+			buf = (char *)realloc(path->buf, len_max);
+		}
+		
+		if (!buf) {
+			trace_write(DP_TRACE_ERROR, "path_reserve(3), alloc(1): %s", strerror(errno));
+			return -1;
+		}
+		
+		path->buf = buf;
+		path->len_max = len_max;
+	}
 	
-	path_free(path);
-	*path = prev;
+	if (count > path->count_max) {
+		count_max = path->count_max ? path->count_max * 2 : DP_PATH_COMPONENTS_INIT;
+		
+		while (count_max < count)
+			count_max *= 2;
+		
+		if (path->arena) {
+			if ((offsets = (size_t *)arena_alloc(path->arena, count_max * sizeof(*offsets))) &&
+			    path->offsets)
+				memcpy(offsets, path->offsets, path->count * sizeof(*offsets));
+		} else {
+			offsets = (size_t *)realloc(path->offsets, count_max * sizeof(*offsets));
+		}
+		
+		if (!offsets) {
+			trace_write(DP_TRACE_ERROR, "path_reserve(3), alloc(1): %s", strerror(errno));
+			return -1;
+		}
+		
+		path->count_max = count_max;
+		path->offsets = offsets;
+	}
+	
+	return 0;
 }
 
 char *property_name_get(const char *property)
@@ -901,45 +1659,29 @@ const char *value_get(const char *key, const struct token *list)
  */
 size_t readb(const struct path *path, unsigned char **out)
 {
-	FILE *fptr;
+	struct stat info;
+	size_t bytes_read;
+	int fd;
 	
 	*out = NULL;
-	fptr = NULL;
 	
 	if (!path)
 		return 0;
 	
-	fptr = fopen(path_str(path), "rb");
+	if ((fd = open(path_cstr(path), O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
 	
-	if (fptr) {
-		size_t bytes_read;
-		size_t len;
-		
-		/* Obtain the file's size. */
-		fseek(fptr, 0, SEEK_END);
+	if (fstat(fd, &info) == -1) {
+		trace_write(DP_TRACE_WARN, "readb(2), fstat(2): %s", strerror(errno));
+		close(fd);
 		
-		bytes_read = 0;
-		len = ftell(fptr);
-		*out = (unsigned char *)malloc(len * sizeof(**out));
-		rewind(fptr);
-		bytes_read = fread(*out, sizeof(**out), len, fptr);
-		
-		if (bytes_read != len) {
-			/*
-			 * Something went wrong; throw away the memory and set
-			 * the buffer to NULL.
-			 */
-			perror("file_readb(2)");
-			free(*out);
-			*out = NULL;
-		}
-		
-		fclose(fptr);
-		
-		return bytes_read;
+		return -1;
 	}
 	
-	return -1;
+	bytes_read = fd_readb(fd, info.st_size, out);
+	close(fd);
+	
+	return bytes_read;
 }
 
 struct path *readme_file_get(struct path *root_dir_path)
@@ -978,7 +1720,7 @@ size_t readt(const struct path *path, char **out)
 	if (!path)
 		return 0;
 	
-	fptr = fopen(path_str(path), "r");
+	fptr = fopen(path_cstr(path), "r");
 	
 	if (fptr) {
 		size_t text_read;
@@ -996,7 +1738,7 @@ size_t readt(const struct path *path, char **out)
 			 * Something went wrong; throw away the memory and set
 			 * the buffer to NULL.
 			 */
-			perror("file_readb(2)");
+			trace_write(DP_TRACE_WARN, "readt(2), fread(4): %s read short", path_cstr(path));
 			free(*out);
 			*out = NULL;
 		}
@@ -1009,6 +1751,219 @@ size_t readt(const struct path *path, char **out)
 	return -1;
 }
 
+/*
+ * Checks that size more bytes fit on the disk the
+ * file is on, with DP_FILE_SPARE_MIN left over, so
+ * that what a host says it will send cannot fill it.
+ * Returns 0 if they fit, or -1 with errno set to
+ * ENOSPC if they do not.
+ */
+int space_check(int fd, uint64_t size)
+{
+	struct statvfs info;
+	uint64_t avail;
+	
+	/* Nothing to go by; the writes themselves will tell. */
+	if (fstatvfs(fd, &info) != 0)
+		return 0;
+	
+	avail = (uint64_t)info.f_bavail * info.f_frsize;
+	
+	if (avail < DP_FILE_SPARE_MIN ||
+	    size > avail - DP_FILE_SPARE_MIN) {
+		errno = ENOSPC;
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Gives the file opened by tmpfile_open(3) its name at
+ * path, replacing any file already there, in one step
+ * so that readers never see it half written. Both the
+ * file and its name are on disk by the time it returns
+ * 0, so that the parcel can be acknowledged.
+ */
+int tmpfile_link(int fd, const struct path *path)
+{
+	char path_fd[32];
+	char name_tmp[64];
+	struct path *path_dir;
+	struct path *path_tmp;
+	int status;
+	
+	if (fd == -1 ||
+	    !path)
+		return 1;
+	
+	/* The name must not reach the disk ahead of the bytes. */
+	if (fdatasync(fd) != 0) {
+		trace_write(DP_TRACE_WARN, "tmpfile_link(2), fdatasync(1): %s", strerror(errno));
+		return -1;
+	}
+	
+	snprintf(path_fd, sizeof(path_fd), "/proc/self/fd/%d", fd);
+	path_dir = path_copy(path);
+	path_pop(&path_dir);
+	
+	if (linkat(AT_FDCWD, path_fd, AT_FDCWD, path_cstr(path), AT_SYMLINK_FOLLOW) == 0) {
+		status = directory_sync(path_dir);
+		path_free(&path_dir);
+		
+		return status;
+	}
+	
+	if (errno != EEXIST) {
+		trace_write(DP_TRACE_WARN, "tmpfile_link(2), linkat(5): %s", strerror(errno));
+		path_free(&path_dir);
+		
+		return -1;
+	}
+	
+	/*
+	 * linkat(2) does not replace an existing file, so the
+	 * file is linked under a hidden name first and renamed
+	 * over it. The descriptor makes the name unique within
+	 * the daemon for as long as the file is open.
+	 */
+	snprintf(name_tmp, sizeof(name_tmp), DP_FILE_TMP_LINK, (int)getpid(), fd);
+	path_tmp = path_copy(path_dir);
+	path_append(&path_tmp, name_tmp);
+	status = 0;
+	
+	if (linkat(AT_FDCWD, path_fd, AT_FDCWD, path_cstr(path_tmp), AT_SYMLINK_FOLLOW) != 0) {
+		trace_write(DP_TRACE_WARN, "tmpfile_link(2), linkat(5): %s", strerror(errno));
+		status = -1;
+	} else if (rename(path_cstr(path_tmp), path_cstr(path)) != 0) {
+		trace_write(DP_TRACE_WARN, "tmpfile_link(2), rename(2): %s", strerror(errno));
+		unlink(path_cstr(path_tmp));
+		status = -1;
+	} else {
+		status = directory_sync(path_dir);
+	}
+	
+	path_free(&path_dir);
+	path_free(&path_tmp);
+	
+	return status;
+}
+
+/*
+ * Opens an unnamed file in the directory for size bytes
+ * to be written into, reserving the space up front. It
+ * only appears once tmpfile_link(2) gives it a name, and
+ * goes away if it is closed before then. Where the file
+ * system cannot make unnamed files, it is a hidden one
+ * instead and out is set to its path, to be renamed into
+ * place; out is set to NULL otherwise.
+ * Returns the file descriptor, or -1 on failure. It is
+ * the caller's responsibility to free the returned path.
+ */
+int tmpfile_open(const struct path *dir, uint64_t size, char **out)
+{
+	struct path *path_tmp;
+	int fd;
+	int result;
+	
+	if (!dir ||
+	    !out)
+		return -1;
+	
+	*out = NULL;
+	fd = -1;
+	
+#ifdef O_TMPFILE
+	if ((fd = open(path_cstr(dir), O_TMPFILE | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1 &&
+	    errno != EOPNOTSUPP &&
+	    errno != EISDIR) {
+		trace_write(DP_TRACE_WARN, "tmpfile_open(3), open(3): %s", strerror(errno));
+		return -1;
+	}
+#endif
+	
+	if (fd == -1) {
+		path_tmp = path_copy(dir);
+		path_append(&path_tmp, DP_FILE_TMP);
+		*out = path_str(path_tmp);
+		path_free(&path_tmp);
+		
+		if ((fd = mkstemp(*out)) == -1) {
+			trace_write(DP_TRACE_WARN, "tmpfile_open(3), mkstemp(1): %s", strerror(errno));
+			free(*out);
+			*out = NULL;
+			
+			return -1;
+		}
+		
+		fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	}
+	
+	result = 0;
+	
+	if (space_check(fd, size) != 0) {
+		trace_write(DP_TRACE_WARN, "tmpfile_open(3), space_check(2): %s", strerror(errno));
+		result = -1;
+	}
+	
+#ifdef __linux__
+	if (result == 0 &&
+	    size > 0 &&
+	    fallocate(fd, 0, 0, size) != 0)
+		result = errno;
+	
+	/* Not every file system supports it. */
+	if (result == EOPNOTSUPP)
+		result = 0;
+#endif
+	
+	if (result != 0) {
+		if (result != -1) {
+			errno = result;
+			trace_write(DP_TRACE_WARN, "tmpfile_open(3), fallocate(4): %s", strerror(errno));
+		}
+		
+		close(fd);
+		
+		if (*out) {
+			unlink(*out);
+			free(*out);
+			*out = NULL;
+		}
+		
+		return -1;
+	}
+	
+	return fd;
+}
+
+/*
+ * Writes the bytes into the file at offset.
+ * Returns -1 on failure.
+ */
+int tmpfile_write(int fd, uint64_t offset, const unsigned char *buffer, size_t len)
+{
+	size_t total;
+	ssize_t result;
+	
+	total = 0;
+	
+	while (total < len) {
+		if ((result = pwrite(fd, &buffer[total], len - total, offset + total)) == -1) {
+			if (errno == EINTR)
+				continue;
+			
+			trace_write(DP_TRACE_WARN, "tmpfile_write(4), pwrite(4): %s", strerror(errno));
+			
+			return -1;
+		}
+		
+		total += result;
+	}
+	
+	return 0;
+}
+
 size_t writeb(const struct path *path, const unsigned char *buffer, const size_t size)
 {
 	FILE *fptr;
@@ -1019,7 +1974,7 @@ size_t writeb(const struct path *path, const unsigned char *buffer, const size_t
 	
 	if (path &&
 	    buffer) {
-		fptr = fopen(path_str(path), "wb+");
+		fptr = fopen(path_cstr(path), "wb+");
 		
 		if (fptr) {
 			bytes_written = fwrite(buffer, 1, size, fptr);
@@ -1040,7 +1995,7 @@ size_t writet(const struct path *path, const char *buffer)
 	
 	if (path &&
 	    buffer) {
-		fptr = fopen(path_str(path), "w+");
+		fptr = fopen(path_cstr(path), "w+");
 		
 		if (fptr) {
 			text_written = fwrite(buffer, 1, strlen(buffer), fptr);
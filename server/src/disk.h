@@ -14,55 +14,89 @@
 #include "types.h"
 
 
+#define DP_COPY_BUF_LEN	65536
+#define DP_DIRENTS_BUF_LEN	65536	/* Directory entries read per system call */
+#define DP_FILE_MAPS_MAX	64	/* Files file_get(2) keeps mapped at once; any more are read */
+#define DP_FILE_SPARE_MIN	(64 * 1024 * 1024)	/* Disk space a file being received may not eat into; see space_check(2) */
+
 /*************
  * CONSTANTS *
  *************/
+static const char *DP_CKEY_PORT 	= "PORT";	/* "PORT <host> <port>": the port that host listens on; "*" matches any host, and DP_DIR_DEFAULT is this daemon */
 static const char *DP_CKEY_ROOT 	= "DOCROOT";
+static const char *DP_CKEY_SIGN 	= "SIGN";	/* "SIGN <n>": parcels to a host are signed in batches of up to n, with one signature per batch */
+static const char *DP_CKEY_STREAMS 	= "STREAMS";	/* "STREAMS <host> <n>": connections per large parcel to that host; "*" matches any host */
+static const char *DP_CKEY_TLS 		= "TLS";	/* "TLS <host> on": connections to that host go over TLS, checked against <root>/<host>/.pubkey; "*" matches any host */
 static const char  DP_CONF_COMMENT 	= '#';
 static const char *DP_CONF_HEADER 	= "!DP_CONFIG";
 static const char *DP_DIR_CONF 		= ".dispatch";
 static const char *DP_DIR_DEFAULT 	= "localhost";	/* Default domain that maps to the local machine */
 static const char *DP_DIR_DOCROOT 	= "Dispatch";	/* The top-level Dispatch directory */
+static const char *DP_DIR_PARTIAL 	= "partial";	/* Large parcels still being received */
 static const int   DP_DIR_SCAN_INT	= 3 * 1000;	/* Directory tree scanning interval (in milliseconds). */
 static const char *DP_FILE_ABOUT	= "About.txt";	/* Contains 1 line which will be used as the local machine's display name */
 static const char *DP_FILE_ADDRRULES 	= "dp.rules";	/* Black/whitelisted addresses */
 static const char *DP_FILE_AUTOFORWARD	= "dp.forward";	/* Auto-forwards new parcels to addresses in this file; can be made more specific by being placed in deeper directories. */
 static const char *DP_FILE_AUTORESPONSE = "auto";	/* This file (with any extension) can be sent as an automatic response to new parcels */
 static const char *DP_FILE_CONF 	= "dp.conf";	/* Daemon config file */
+static const char *DP_FILE_EPOCH 	= "dp.epoch";	/* The epoch of the daemon's sequence numbers; see order.c */
 static const char *DP_FILE_ERRLOG 	= "dp.log";	/* Error log */
 static const char *DP_FILE_INDEX 	= ".index";	/* Index of files in the directory */
 static const char *DP_FILE_LIST 	= "dp.list";	/* Dispatch address list */
 static const char *DP_FILE_LOG 		= ".log";	/* Event log */
+static const size_t DP_FILE_MAP_MIN 	= 1024 * 1024;	/* Files this large or larger are mapped by file_get(2) rather than read */
 static const char *DP_FILE_PRIVKEY 	= "id.pem";	/* Local machine's private key */
 static const char *DP_FILE_PUBKEY 	= ".pubkey";	/* A public key */
 static const char *DP_FILE_README 	= "Instructions.txt";
-
+static const char *DP_FILE_SCAN 	= "dp.scan";	/* What each directory looked like at the end of the last full scan */
+static const char *DP_FILE_SEEN 	= "dp.seen";	/* UUIDs of recently received parcels */
+static const char *DP_FILE_TMP 		= ".dp.XXXXXX";	/* A file still being received, where unnamed files cannot be made */
+static const char *DP_FILE_TMP_LINK 	= ".dp.%d.%d";	/* A received file about to replace another; see tmpfile_link(2) */
+static const size_t DP_FILEARRAY_INIT 	= 64;
+static const size_t DP_PATH_COMPONENTS_INIT 	= 8;
+static const size_t DP_PATH_LEN_INIT 		= 256;	/* Enough for most paths under the root directory */
+static const int   DP_SIGN_MAX 		= 65536;
+static const int   DP_STREAMS_DEFAULT 	= 4;
+static const int   DP_STREAMS_MAX 	= 16;
 
 /*************
  * FUNCTIONS *
  *************/
+int config_port_get(const char *);
+int config_sign_get(void);
+int config_streams_get(const char *);
+int config_tls_get(const char *);
 struct path *directories_bootstrap(void);
 int directory_exists(const struct path *);
 int directory_make(const struct path *);
+int directory_open(int, const char *);
 int directory_remove(const struct path *);
+int directory_sync(const struct path *);
 void empty_file_make(const struct path *, int);
+struct path *errlog_file_get(void);
 int file_exists(const struct path *);
 int file_get(const struct path *, struct data64 **);
 FILE *file_handle(const struct path *);
 FILE *file_make(const struct path *);
+int file_move(const char *, const char *);
+int file_release(struct data64 **);
 int file_remove(const struct path *);
-void filelist_free(struct filelist **);
-void filelist_get(const struct path *, struct filelist **);
+int filearray_at_get(int, struct arena *, struct filearray *);
 struct path *home_dir_get(void);
-int is_directory(const struct path *);
-int is_file(const struct path *);
+struct path *path_alloc(struct arena *, const char *);
 void path_append(struct path **, const char *);
 struct path *path_copy(const struct path *);
 void path_free(struct path **);
 struct path *path_make(const char *);
+const char *path_name_get(const struct path *);
 void path_pop(struct path **);
+int path_reserve(struct path *, size_t, size_t);
 size_t readb(const struct path *, unsigned char **);
 size_t readt(const struct path *, char **);
+int space_check(int, uint64_t);
+int tmpfile_link(int, const struct path *);
+int tmpfile_open(const struct path *, uint64_t, char **);
+int tmpfile_write(int, uint64_t, const unsigned char *, size_t);
 size_t writeb(const struct path *, const unsigned char *, const size_t);
 size_t writet(const struct path *, const char *);
 
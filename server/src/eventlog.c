@@ -0,0 +1,581 @@
+//
+//  eventlog.c
+//  server
+//
+
+#include "eventlog.h"
+
+#include "disk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include <unistd.h>
+#include "util.h"
+
+
+/*
+ * EVENT LOGS
+ * --
+ * Every contact and list directory keeps a .log of what
+ * happened in it, one line per event:
+ * <UNIX time>\t<event>\t<user>@<host>\t<file name>
+ * Backslashes and control characters in the user, host
+ * and file name are escaped as in C (\\, \t, \n, \r or
+ * \xNN), so that a name cannot break a line in two.
+ *
+ * A busy directory sees a great many events, so they are
+ * not written as they happen. Appending an event only
+ * buffers it in memory, and a single writer thread
+ * commits the buffers in groups: each log gets one
+ * write(2) and one fdatasync(2) for all of its events
+ * since the last commit. A group is committed once its
+ * first event is DP_EVENTLOG_COMMIT_INT ms old, or
+ * sooner if DP_EVENTLOG_BATCH_LEN bytes pile up.
+ * Events that fail to commit are put back and tried
+ * again DP_EVENTLOG_RETRY_INT ms later, along with
+ * whatever was appended since; after
+ * DP_EVENTLOG_RETRY_MAX failures in a row they are
+ * dropped and their loss traced.
+ *
+ * The logs stay open between commits, up to
+ * DP_EVENTLOG_OPEN_MAX of them, and are closed after
+ * DP_EVENTLOG_IDLE_MAX ms without events.
+ */
+
+/**************
+ * STRUCTURES *
+ **************/
+struct dp_eventlog {
+	char *path;
+	struct dp_eventlog *next;	/* Next log in the same hash bucket */
+	struct dp_eventlog *dirty_next;	/* Next log with events to commit */
+	unsigned char *buffer;		/* Events not yet handed to the writer */
+	size_t len;
+	size_t len_max;
+	uint64_t hash;
+	uint64_t time_used;		/* When events were last committed to it */
+	int dirty;
+	int failures;			/* Failed commits in a row */
+	int fd;				/* -1 while closed; only touched by the writer */
+};
+
+/*
+ * The events of one log, taken out of it for the writer
+ * to commit without holding the lock.
+ */
+struct dp_eventlog_commit {
+	struct dp_eventlog *log;
+	unsigned char *bytes;
+	size_t done;			/* Bytes written out */
+	size_t len;
+	size_t len_max;
+	int result;			/* What eventlog_commit() made of them */
+};
+/**********************/
+
+/********************
+ * Global Variables
+ ********************/
+struct dp_eventlog *eventlog_buckets[DP_EVENTLOG_BUCKETS];
+pthread_cond_t eventlog_committed = PTHREAD_COND_INITIALIZER;
+struct dp_eventlog *eventlog_dirty;
+pthread_cond_t eventlog_dirtied = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t eventlog_lock = PTHREAD_MUTEX_INITIALIZER;
+int eventlog_open_count;
+size_t eventlog_pending;		/* Bytes buffered across all logs */
+int eventlog_running;
+pthread_t eventlog_thread;
+uint64_t eventlog_time_first;		/* When the oldest uncommitted event was appended */
+uint64_t eventlog_time_swept;
+/**********************/
+
+/**********************
+ * Private Prototypes
+ **********************/
+int eventlog_commit(struct dp_eventlog_commit *);
+void eventlog_escape(char *, size_t, const char *);
+struct dp_eventlog *eventlog_get(const char *);
+int eventlog_requeue(struct dp_eventlog_commit *);
+void *eventlog_run(void *);
+void eventlog_sweep(uint64_t);
+/**********************/
+
+
+/*
+ * Appends an event to the .log in the directory about
+ * the file name to or from user@host. It is committed
+ * to disk shortly after; see above.
+ * Returns -1 if the event could not be buffered.
+ */
+int eventlog_append(const struct path *dir, const char *event, const char *user, const char *host, const char *name)
+{
+	char host_escaped[DP_EVENTLOG_LINE_MAX];
+	char line[DP_EVENTLOG_LINE_MAX];
+	char name_escaped[DP_EVENTLOG_LINE_MAX];
+	char user_escaped[DP_EVENTLOG_LINE_MAX];
+	struct dp_eventlog *log;
+	struct path *path_log;
+	size_t len;
+	int result;
+	
+	if (!dir ||
+	    !event ||
+	    !user)
+		return 1;
+	
+	if (!eventlog_running)
+		return -1;
+	
+	eventlog_escape(user_escaped, sizeof(user_escaped), user);
+	eventlog_escape(host_escaped, sizeof(host_escaped), host ? host : DP_DIR_DEFAULT);
+	eventlog_escape(name_escaped, sizeof(name_escaped), name ? name : "");
+	result = snprintf(line, sizeof(line), "%lld\t%s\t%s@%s\t%s\n", (long long)timestamp(), event, user_escaped, host_escaped, name_escaped);
+	
+	if (result < 0)
+		return -1;
+	
+	/* An overlong line is cut short but still ends the event. */
+	if ((size_t)result >= sizeof(line)) {
+		line[sizeof(line) - 2] = '\n';
+		len = sizeof(line) - 1;
+	} else {
+		len = (size_t)result;
+	}
+	
+	path_log = path_copy(dir);
+	path_append(&path_log, DP_FILE_LOG);
+	
+	pthread_mutex_lock(&eventlog_lock);
+	
+	if (!(log = eventlog_get(path_cstr(path_log)))) {
+		pthread_mutex_unlock(&eventlog_lock);
+		path_free(&path_log);
+		
+		return -1;
+	}
+	
+	path_free(&path_log);
+	
+	/* Hold off a log whose writer is falling behind. */
+	while (log->len + len > DP_EVENTLOG_BUF_MAX)
+		pthread_cond_wait(&eventlog_committed, &eventlog_lock);
+	
+	if (log->len + len > log->len_max) {
+		unsigned char *buffer;
+		size_t len_max;
+		
+		len_max = log->len_max ? log->len_max * 2 : DP_EVENTLOG_BUF_INIT;
+		
+		while (len_max < log->len + len)
+			len_max *= 2;
+		
+		if (!(buffer = (unsigned char *)realloc(log->buffer, len_max))) {
+			pthread_mutex_unlock(&eventlog_lock);
+			return -1;
+		}
+		
+		log->buffer = buffer;
+		log->len_max = len_max;
+	}
+	
+	memcpy(&log->buffer[log->len], line, len);
+	log->len += len;
+	
+	if (!log->dirty) {
+		log->dirty = 1;
+		log->dirty_next = eventlog_dirty;
+		eventlog_dirty = log;
+	}
+	
+	if (eventlog_pending == 0)
+		eventlog_time_first = time_ms();
+	
+	eventlog_pending += len;
+	
+	/* The writer only needs waking for the first event of a group, or a full one. */
+	if (eventlog_pending == len ||
+	    eventlog_pending >= DP_EVENTLOG_BATCH_LEN)
+		pthread_cond_signal(&eventlog_dirtied);
+	
+	pthread_mutex_unlock(&eventlog_lock);
+	
+	return 0;
+}
+
+int eventlog_bootstrap(void)
+{
+	int result;
+	
+	eventlog_time_swept = time_ms();
+	
+	if ((result = pthread_create(&eventlog_thread, NULL, eventlog_run, NULL)) != 0) {
+		trace_write(DP_TRACE_ERROR, "eventlog_bootstrap(0), pthread_create(4): %s", strerror(result));
+		return -1;
+	}
+	
+	eventlog_running = 1;
+	
+	return 0;
+}
+
+/*
+ * Writes the events out to their log and waits for them
+ * to reach the disk. Runs on the writer thread only.
+ * Returns -1 on failure, with commit->done set to what
+ * was written out before it.
+ */
+int eventlog_commit(struct dp_eventlog_commit *commit)
+{
+	struct dp_eventlog *log;
+	
+	log = commit->log;
+	commit->done = 0;
+	
+	if (log->fd == -1) {
+		if ((log->fd = open(log->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+			trace_write(DP_TRACE_WARN, "eventlog_commit(1), open(3): %s", strerror(errno));
+			return -1;
+		}
+		
+		eventlog_open_count++;
+	}
+	
+	while (commit->done < commit->len) {
+		ssize_t written;
+		
+		if ((written = write(log->fd, &commit->bytes[commit->done], commit->len - commit->done)) == -1) {
+			if (errno == EINTR)
+				continue;
+			
+			trace_write(DP_TRACE_WARN, "eventlog_commit(1), write(3): %s", strerror(errno));
+			
+			/* It is opened afresh for the retry. */
+			close(log->fd);
+			log->fd = -1;
+			eventlog_open_count--;
+			
+			return -1;
+		}
+		
+		commit->done += written;
+	}
+	
+	if (fdatasync(log->fd) != 0) {
+		trace_write(DP_TRACE_WARN, "eventlog_commit(1), fdatasync(1): %s", strerror(errno));
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Copies the field into out, escaping backslashes and
+ * control characters. What does not fit is left off.
+ */
+void eventlog_escape(char *out, size_t len, const char *field)
+{
+	size_t pos;
+	
+	pos = 0;
+	
+	for (; *field; field++) {
+		unsigned char c;
+		char escaped[5];
+		size_t len_escaped;
+		
+		c = (unsigned char)*field;
+		
+		if (c == '\\')
+			len_escaped = (size_t)snprintf(escaped, sizeof(escaped), "\\\\");
+		else if (c == '\t')
+			len_escaped = (size_t)snprintf(escaped, sizeof(escaped), "\\t");
+		else if (c == '\n')
+			len_escaped = (size_t)snprintf(escaped, sizeof(escaped), "\\n");
+		else if (c == '\r')
+			len_escaped = (size_t)snprintf(escaped, sizeof(escaped), "\\r");
+		else if (c < 0x20 ||
+			 c == 0x7f)
+			len_escaped = (size_t)snprintf(escaped, sizeof(escaped), "\\x%02x", c);
+		else
+			len_escaped = (size_t)snprintf(escaped, sizeof(escaped), "%c", c);
+		
+		if (pos + len_escaped >= len)
+			break;
+		
+		memcpy(&out[pos], escaped, len_escaped);
+		pos += len_escaped;
+	}
+	
+	out[pos] = '\0';
+}
+
+/*
+ * Finds the log at path, or starts keeping track of it.
+ * Called with the lock held.
+ */
+struct dp_eventlog *eventlog_get(const char *path)
+{
+	struct dp_eventlog *log;
+	uint64_t hash;
+	uint32_t i_bucket;
+	
+	hash = path_hash(path);
+	i_bucket = (uint32_t)hash & (DP_EVENTLOG_BUCKETS - 1);
+	
+	for (log = eventlog_buckets[i_bucket]; log; log = log->next) {
+		if (log->hash == hash &&
+		    strcmp(log->path, path) == 0)
+			return log;
+	}
+	
+	if (!(log = (struct dp_eventlog *)calloc(1, sizeof(*log))))
+		return NULL;
+	
+	if (!(log->path = (char *)calloc(strlen(path) + 1, sizeof(char)))) {
+		free(log);
+		return NULL;
+	}
+	
+	strcpy(log->path, path);
+	log->fd = -1;
+	log->hash = hash;
+	log->time_used = time_ms();
+	log->next = eventlog_buckets[i_bucket];
+	eventlog_buckets[i_bucket] = log;
+	
+	return log;
+}
+
+/*
+ * Puts back what a failed commit did not write out,
+ * ahead of the events appended since, to be tried
+ * again DP_EVENTLOG_RETRY_INT ms from now. The commit
+ * gives up its buffer.
+ * Called by the writer with the lock held. Returns -1
+ * if the events could not be kept.
+ */
+int eventlog_requeue(struct dp_eventlog_commit *commit)
+{
+	struct dp_eventlog *log;
+	unsigned char *buffer;
+	size_t left;
+	size_t len_max;
+	
+	log = commit->log;
+	left = commit->len - commit->done;
+	len_max = commit->len_max;
+	
+	while (len_max < left + log->len)
+		len_max *= 2;
+	
+	if (!(buffer = (unsigned char *)realloc(commit->bytes, len_max)))
+		return -1;
+	
+	memmove(buffer, &buffer[commit->done], left);
+	
+	if (log->len > 0)
+		memcpy(&buffer[left], log->buffer, log->len);
+	
+	free(log->buffer);
+	log->buffer = buffer;
+	log->len += left;
+	log->len_max = len_max;
+	commit->bytes = NULL;
+	
+	if (!log->dirty) {
+		log->dirty = 1;
+		log->dirty_next = eventlog_dirty;
+		eventlog_dirty = log;
+	}
+	
+	/* Nothing else is due, so the group waits for the retry. */
+	if (eventlog_pending == 0)
+		eventlog_time_first = time_ms() + DP_EVENTLOG_RETRY_INT;
+	
+	eventlog_pending += left;
+	
+	return 0;
+}
+
+/*
+ * The writer: commits each group of events as it
+ * becomes due.
+ */
+void *eventlog_run(void *args)
+{
+	struct dp_eventlog_commit *commits;
+	size_t count;
+	size_t count_max;
+	uint64_t now;
+	
+	commits = NULL;
+	count_max = 0;
+	
+	while (1) {
+		struct dp_eventlog *log;
+		
+		pthread_mutex_lock(&eventlog_lock);
+		
+		while (!eventlog_dirty) {
+			struct timespec deadline;
+			
+			/* Wake up now and then to close idle logs. */
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += DP_EVENTLOG_IDLE_MAX / 1000;
+			
+			if (pthread_cond_timedwait(&eventlog_dirtied, &eventlog_lock, &deadline) != 0)
+				break;
+		}
+		
+		/* Let the group fill up until its first event is due. */
+		while (eventlog_dirty &&
+		       eventlog_pending < DP_EVENTLOG_BATCH_LEN &&
+		       (now = time_ms()) < eventlog_time_first + DP_EVENTLOG_COMMIT_INT) {
+			struct timespec deadline;
+			uint64_t wait;
+			
+			wait = eventlog_time_first + DP_EVENTLOG_COMMIT_INT - now;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += wait / 1000;
+			deadline.tv_nsec += (wait % 1000) * 1000000;
+			
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			
+			pthread_cond_timedwait(&eventlog_dirtied, &eventlog_lock, &deadline);
+		}
+		
+		/* Take the whole group in one go; appends carry on into fresh buffers. */
+		count = 0;
+		
+		for (log = eventlog_dirty; log; log = log->dirty_next)
+			count++;
+		
+		if (count > count_max) {
+			free(commits);
+			count_max = count * 2;
+			commits = (struct dp_eventlog_commit *)calloc(count_max, sizeof(*commits));
+		}
+		
+		count = 0;
+		
+		for (log = eventlog_dirty; log; log = log->dirty_next) {
+			commits[count].log = log;
+			commits[count].bytes = log->buffer;
+			commits[count].len = log->len;
+			commits[count].len_max = log->len_max;
+			log->buffer = NULL;
+			log->len = 0;
+			log->len_max = 0;
+			log->dirty = 0;
+			count++;
+		}
+		
+		eventlog_dirty = NULL;
+		eventlog_pending = 0;
+		
+		pthread_mutex_unlock(&eventlog_lock);
+		
+		for (size_t i = 0; i < count; i++)
+			commits[i].result = eventlog_commit(&commits[i]);
+		
+		now = time_ms();
+		
+		pthread_mutex_lock(&eventlog_lock);
+		
+		for (size_t i = 0; i < count; i++) {
+			log = commits[i].log;
+			log->time_used = now;
+			
+			if (commits[i].result == 0) {
+				log->failures = 0;
+			} else if (commits[i].done == commits[i].len) {
+				/* Written out, but the disk would not say it has them. */
+				trace_write(DP_TRACE_ERROR, "%s: %lu byte(s) of events may not have reached the disk", log->path, commits[i].len);
+				log->failures = 0;
+			} else if (++log->failures < DP_EVENTLOG_RETRY_MAX &&
+				   eventlog_requeue(&commits[i]) == 0) {
+				trace_write(DP_TRACE_WARN, "%s: unable to commit %lu byte(s) of events; trying again", log->path, commits[i].len - commits[i].done);
+			} else {
+				trace_write(DP_TRACE_ERROR, "%s: %lu byte(s) of events lost", log->path, commits[i].len - commits[i].done);
+				log->failures = 0;
+			}
+			
+			/* The buffer is reused unless events already went into a new one. */
+			if (!log->buffer) {
+				log->buffer = commits[i].bytes;
+				log->len_max = commits[i].len_max;
+			} else {
+				free(commits[i].bytes);
+			}
+		}
+		
+		pthread_cond_broadcast(&eventlog_committed);
+		eventlog_sweep(now);
+		
+		pthread_mutex_unlock(&eventlog_lock);
+	}
+	
+	return 0;
+}
+
+/*
+ * Closes logs that have been idle for too long, or that
+ * were not just committed to if too many are open, and
+ * forgets closed ones with nothing buffered.
+ * Called by the writer with the lock held.
+ */
+void eventlog_sweep(uint64_t now)
+{
+	int over;
+	
+	over = eventlog_open_count > DP_EVENTLOG_OPEN_MAX;
+	
+	if (!over &&
+	    now - eventlog_time_swept < DP_EVENTLOG_IDLE_MAX / 2)
+		return;
+	
+	eventlog_time_swept = now;
+	
+	for (uint32_t i = 0; i < DP_EVENTLOG_BUCKETS; i++) {
+		struct dp_eventlog **link;
+		
+		link = &eventlog_buckets[i];
+		
+		while (*link) {
+			struct dp_eventlog *log;
+			
+			log = *link;
+			
+			if (log->fd != -1 &&
+			    (now - log->time_used >= DP_EVENTLOG_IDLE_MAX ||
+			     (over &&
+			      log->time_used != now))) {
+				close(log->fd);
+				log->fd = -1;
+				eventlog_open_count--;
+			}
+			
+			if (log->fd == -1 &&
+			    !log->dirty &&
+			    log->len == 0 &&
+			    now - log->time_used >= DP_EVENTLOG_IDLE_MAX) {
+				*link = log->next;
+				free(log->buffer);
+				free(log->path);
+				free(log);
+				
+				continue;
+			}
+			
+			link = &log->next;
+		}
+	}
+}
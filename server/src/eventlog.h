@@ -0,0 +1,38 @@
+//
+//  eventlog.h
+//  server
+//
+
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+
+#include "types.h"
+
+
+#define DP_EVENTLOG_BUCKETS	1024	/* Hash buckets over the logs; must be a power of 2. */
+
+/*************
+ * CONSTANTS *
+ *************/
+static const size_t DP_EVENTLOG_BATCH_LEN 	= 256 * 1024;		/* Buffered bytes that get committed without waiting out DP_EVENTLOG_COMMIT_INT. */
+static const size_t DP_EVENTLOG_BUF_INIT 	= 4096;
+static const size_t DP_EVENTLOG_BUF_MAX 	= 1024 * 1024;		/* Buffered bytes per log past which appending waits for a commit. */
+static const int DP_EVENTLOG_COMMIT_INT 	= 10;			/* How long (in milliseconds) an event waits at most before it is committed. */
+static const int DP_EVENTLOG_IDLE_MAX 		= 60 * 1000;		/* How long (in milliseconds) before an idle log is closed. */
+static const size_t DP_EVENTLOG_LINE_MAX 	= 1024;
+static const int DP_EVENTLOG_OPEN_MAX 		= 256;			/* Logs kept open at once. */
+static const char *DP_EVENTLOG_RECEIVED 	= "RECEIVED";		/* A parcel was delivered here */
+static const int DP_EVENTLOG_RETRY_INT 		= 1000;			/* How long (in milliseconds) events that failed to commit wait before they are tried again. */
+static const int DP_EVENTLOG_RETRY_MAX 		= 5;			/* Failed commits in a row after which a log's events are dropped. */
+static const char *DP_EVENTLOG_SENT 		= "SENT";		/* A file was sent to the contact */
+static const char *DP_EVENTLOG_SYNCED 		= "SYNCED";		/* A file was brought up to date by a sync */
+
+/*************
+ * FUNCTIONS *
+ *************/
+int eventlog_append(const struct path *, const char *, const char *, const char *, const char *);
+int eventlog_bootstrap(void);
+
+
+#endif /* EVENTLOG_H */
@@ -0,0 +1,817 @@
+//
+//  index.c
+//  server
+//
+
+#include "index.h"
+
+#include "crypto.h"
+#include <dirent.h>
+#include "disk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include "merkle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "trace.h"
+#include <unistd.h>
+#include "util.h"
+
+
+/*
+ * INDEX
+ * --
+ * The .index file of a directory holds the size,
+ * modification time and checksum of every file in it,
+ * keyed by a hash of the file's name. It is a header
+ * followed by an open-addressed hash table of fixed-size
+ * entries and is used through a shared mapping, so a
+ * lookup is O(1) and an update rewrites one entry in
+ * place. A sync only hashes the files whose size or
+ * modification time moved.
+ *
+ * Subdirectories get an entry too, whose checksum is
+ * the tree hash of the subdirectory's own index. The
+ * tree hash of a directory is SHA256(0x01 || entries),
+ * over its live entries in name hash order, so it
+ * stands for everything below it: two trees are the
+ * same if their top hashes are, and where they differ
+ * is found by following the entries whose checksums
+ * differ, one level at a time. When a directory's tree
+ * hash moves, index_propagate() carries it up through
+ * its parents' indexes.
+ *
+ * Crashes: only the tree hash of the header changes
+ * once the file is made, and it and every entry carry
+ * their own check value. An
+ * entry torn by a crash fails its check and is treated
+ * as removed, so its file is simply hashed again; a
+ * torn tree hash is worked out again on the next sync. The
+ * table is only ever grown by writing a new file next to
+ * it and renaming it over the old one.
+ *
+ * Hidden files (.index itself, .log, .pubkey) are not
+ * indexed. Only one thread works on a directory's index
+ * at a time; see index_open().
+ */
+
+/**********************
+ * Private Prototypes
+ **********************/
+uint32_t entry_check(const struct dp_index_entry *);
+int entry_empty(const struct dp_index_entry *);
+int entry_live(const struct dp_index_entry *);
+int hash_compare(const void *, const void *);
+uint32_t head_check(const struct dp_index_head *);
+int index_map(struct dp_index *, int);
+int index_put(struct dp_index *, int, struct dp_index_entry *);
+int index_rebuild(struct dp_index *, int, uint32_t);
+long index_slot_get(const struct dp_index *, uint64_t, int);
+int index_tree_update(struct dp_index *);
+void index_unmap(struct dp_index *);
+/**********************/
+
+
+/*
+ * FNV-1a over everything in the entry but the check
+ * itself.
+ */
+uint32_t entry_check(const struct dp_index_entry *entry)
+{
+	const unsigned char *bytes;
+	uint32_t check;
+	
+	bytes = (const unsigned char *)entry;
+	check = 0x811c9dc5;
+	
+	for (size_t i = 0; i < offsetof(struct dp_index_entry, check); i++) {
+		check ^= bytes[i];
+		check *= 0x01000193;
+	}
+	
+	return check;
+}
+
+int entry_empty(const struct dp_index_entry *entry)
+{
+	return entry->name_hash == 0 &&
+	       entry->flags == 0 &&
+	       entry->check == 0;
+}
+
+int entry_live(const struct dp_index_entry *entry)
+{
+	return (entry->flags & DP_INDEX_LIVE) &&
+	       entry->check == entry_check(entry);
+}
+
+int hash_compare(const void *a, const void *b)
+{
+	uint64_t hash_a;
+	uint64_t hash_b;
+	
+	hash_a = *(const uint64_t *)a;
+	hash_b = *(const uint64_t *)b;
+	
+	return hash_a < hash_b ? -1 : hash_a > hash_b;
+}
+
+/*
+ * FNV-1a over everything in the header before the check
+ * of its tree hash.
+ */
+uint32_t head_check(const struct dp_index_head *head)
+{
+	const unsigned char *bytes;
+	uint32_t check;
+	
+	bytes = (const unsigned char *)head;
+	check = 0x811c9dc5;
+	
+	for (size_t i = 0; i < offsetof(struct dp_index_head, tree_check); i++) {
+		check ^= bytes[i];
+		check *= 0x01000193;
+	}
+	
+	return check;
+}
+
+/*
+ * Flushes the index and unlocks it.
+ */
+void index_close(struct dp_index **index)
+{
+	if (!index ||
+	    !*index)
+		return;
+	
+	index_unmap(*index);
+	free(*index);
+	*index = NULL;
+}
+
+/*
+ * Returns the entry of the file called name, or NULL if
+ * it is not in the index.
+ */
+const struct dp_index_entry *index_find(const struct dp_index *index, const char *name)
+{
+	uint64_t name_hash;
+	long slot;
+	
+	if (!index ||
+	    !name)
+		return NULL;
+	
+	if ((name_hash = path_hash(name)) == 0)
+		name_hash = 1;
+	
+	if ((slot = index_slot_get(index, name_hash, 0)) == -1)
+		return NULL;
+	
+	return &index->entries[slot];
+}
+
+/*
+ * Maps the index file open at fd, which must be locked.
+ * Returns -1 if it is not a valid index.
+ */
+int index_map(struct dp_index *index, int fd)
+{
+	struct dp_index_head *head;
+	struct stat info;
+	void *map;
+	
+	if (fstat(fd, &info) == -1 ||
+	    (size_t)info.st_size < sizeof(*head))
+		return -1;
+	
+	if ((map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		trace_write(DP_TRACE_WARN, "index_map(2), mmap(6): %s", strerror(errno));
+		return -1;
+	}
+	
+	head = (struct dp_index_head *)map;
+	
+	if (memcmp(head->magic, DP_INDEX_MAGIC, sizeof(DP_INDEX_MAGIC)) != 0 ||
+	    head->version != DP_INDEX_VER ||
+	    head->slots == 0 ||
+	    (head->slots & (head->slots - 1)) != 0 ||
+	    (size_t)info.st_size != sizeof(*head) + (size_t)head->slots * sizeof(struct dp_index_entry)) {
+		munmap(map, info.st_size);
+		return -1;
+	}
+	
+	index->count = 0;
+	index->entries = (struct dp_index_entry *)(head + 1);
+	index->fd = fd;
+	index->head = head;
+	index->map_len = info.st_size;
+	index->used = 0;
+	
+	/* Torn entries take up their slot like removed ones. */
+	for (uint32_t i = 0; i < head->slots; i++) {
+		if (entry_empty(&index->entries[i]))
+			continue;
+		
+		index->used++;
+		
+		if (entry_live(&index->entries[i]))
+			index->count++;
+	}
+	
+	return 0;
+}
+
+/*
+ * Opens (or makes) the index of the directory open at
+ * dirfd. The index is locked until index_close(1), so
+ * that two threads never work on it at once. It is the
+ * caller's responsibility to close the returned index.
+ */
+int index_open(int dirfd, struct dp_index **out)
+{
+	struct stat info;
+	struct stat info_path;
+	struct dp_index *index;
+	int fd;
+	
+	if (!out)
+		return 1;
+	
+	*out = NULL;
+	
+	if (!(index = (struct dp_index *)calloc(1, sizeof(*index))))
+		return -1;
+	
+	index->fd = -1;
+	
+	for (;;) {
+		if ((fd = openat(dirfd, DP_FILE_INDEX, O_RDWR | O_CLOEXEC)) == -1) {
+			if (errno != ENOENT)
+				trace_write(DP_TRACE_WARN, "index_open(2), openat(3): %s", strerror(errno));
+			
+			break;
+		}
+		
+		if (flock(fd, LOCK_EX) == -1) {
+			close(fd);
+			fd = -1;
+			break;
+		}
+		
+		/* Whoever held the lock may have replaced the file. */
+		if (fstat(fd, &info) == 0 &&
+		    fstatat(dirfd, DP_FILE_INDEX, &info_path, 0) == 0 &&
+		    info.st_ino == info_path.st_ino &&
+		    info.st_dev == info_path.st_dev)
+			break;
+		
+		close(fd);
+	}
+	
+	if (fd != -1 &&
+	    index_map(index, fd) != 0) {
+		/* Not an index we can read; start over. */
+		close(fd);
+		fd = -1;
+	}
+	
+	if (fd == -1 &&
+	    index_rebuild(index, dirfd, DP_INDEX_SLOTS_INIT) != 0) {
+		free(index);
+		return -1;
+	}
+	
+	*out = index;
+	
+	return 0;
+}
+
+/*
+ * Carries the tree hash of the directory open at dirfd,
+ * at the given depth, up into the indexes of its parents
+ * for as long as it changes theirs.
+ */
+void index_propagate(int dirfd, int depth)
+{
+	unsigned char tree[SHA256_DIGEST_LENGTH];
+	struct dp_index_entry entry;
+	struct filearray files;
+	struct stat info;
+	struct arena *arena;
+	struct arena_mark mark;
+	struct dp_index *index;
+	const char *name;
+	int changed;
+	int fd;
+	int fd_parent;
+	
+	if (depth <= DP_INDEX_DEPTH ||
+	    !(arena = arena_make(0)))
+		return;
+	
+	fd = dirfd;
+	mark = arena_mark_get(arena);
+	
+	for (; depth > DP_INDEX_DEPTH; depth--) {
+		if (fstat(fd, &info) == -1 ||
+		    (fd_parent = directory_open(fd, "..")) == -1)
+			break;
+		
+		if (fd != dirfd)
+			close(fd);
+		
+		fd = fd_parent;
+		name = NULL;
+		
+		/* A directory does not know its own name; look it up by inode. */
+		arena_rewind(arena, mark);
+		
+		if (filearray_at_get(fd, arena, &files) == 0) {
+			for (size_t i = 0; i < files.count; i++) {
+				if (files.entries[i].inode == info.st_ino &&
+				    files.entries[i].type == DT_DIR) {
+					name = files.entries[i].name;
+					break;
+				}
+			}
+		}
+		
+		if (!name ||
+		    name[0] == '.' ||
+		    index_tree_read(fd, name, tree) != 0 ||
+		    index_open(fd, &index) != 0)
+			break;
+		
+		memset(&entry, 0, sizeof(entry));
+		
+		if ((entry.name_hash = path_hash(name)) == 0)
+			entry.name_hash = 1;
+		
+		entry.flags = DP_INDEX_LIVE | DP_INDEX_DIR;
+		memcpy(entry.checksum, tree, sizeof(tree));
+		changed = 0;
+		
+		if (index_put(index, fd, &entry) != -1 &&
+		    index_tree_update(index) == 1) {
+			changed = 1;
+			
+			if (msync(index->head, index->map_len, MS_SYNC) == -1)
+				trace_write(DP_TRACE_WARN, "index_propagate(2), msync(3): %s", strerror(errno));
+		}
+		
+		index_close(&index);
+		
+		if (!changed)
+			break;
+	}
+	
+	if (fd != dirfd)
+		close(fd);
+	
+	arena_free(&arena);
+}
+
+/*
+ * Puts entry in the index in place of the entry with the
+ * same name hash, if any, growing the table if needed.
+ * Returns 1 if the index changed, 0 if the entry was
+ * already there as it is, or -1 on failure.
+ */
+int index_put(struct dp_index *index, int dirfd, struct dp_index_entry *entry)
+{
+	struct dp_index_entry *slot_entry;
+	long slot;
+	uint32_t slots;
+	
+	slot = index_slot_get(index, entry->name_hash, 1);
+	
+	/* A new entry that would fill the table too much; make room first. */
+	if (slot == -1 ||
+	    (entry_empty(&index->entries[slot]) &&
+	     (uint64_t)(index->used + 1) * 100 > (uint64_t)index->head->slots * DP_INDEX_LOAD_PERCENT)) {
+		slots = index->head->slots;
+		
+		while ((uint64_t)(index->count + 1) * 100 * 2 > (uint64_t)slots * DP_INDEX_LOAD_PERCENT)
+			slots *= 2;
+		
+		if (index_rebuild(index, dirfd, slots) != 0 ||
+		    (slot = index_slot_get(index, entry->name_hash, 1)) == -1)
+			return -1;
+	}
+	
+	slot_entry = &index->entries[slot];
+	entry->check = entry_check(entry);
+	
+	if (memcmp(slot_entry, entry, sizeof(*entry)) == 0)
+		return 0;
+	
+	if (!entry_live(slot_entry))
+		index->count++;
+	
+	if (entry_empty(slot_entry))
+		index->used++;
+	
+	*slot_entry = *entry;
+	
+	return 1;
+}
+
+/*
+ * Writes a new index file with the given number of slots
+ * and the live entries of the current one, if any, then
+ * moves it in place of the current one.
+ */
+int index_rebuild(struct dp_index *index, int dirfd, uint32_t slots)
+{
+	char name_tmp[32];
+	struct dp_index_entry *entries;
+	struct dp_index_head *head;
+	struct stat info;
+	struct stat info_path;
+	size_t len;
+	uint32_t count;
+	uint32_t slot;
+	int fd;
+	
+	snprintf(name_tmp, sizeof(name_tmp), "%s.tmp", DP_FILE_INDEX);
+	len = sizeof(*head) + (size_t)slots * sizeof(*entries);
+	
+	if ((fd = openat(dirfd, name_tmp, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+		trace_write(DP_TRACE_WARN, "index_rebuild(3), openat(4): %s", strerror(errno));
+		return -1;
+	}
+	
+	/* Also keeps another rebuild of the same directory out. */
+	if (flock(fd, LOCK_EX) == -1 ||
+	    fstat(fd, &info) == -1 ||
+	    fstatat(dirfd, name_tmp, &info_path, 0) == -1 ||
+	    info.st_ino != info_path.st_ino) {
+		/* Another rebuild got there first and moved it. */
+		close(fd);
+		return -1;
+	}
+	
+	if (ftruncate(fd, 0) == -1 ||
+	    ftruncate(fd, len) == -1 ||
+	    (head = (struct dp_index_head *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		trace_write(DP_TRACE_WARN, "index_rebuild(3), mmap(6): %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	memcpy(head->magic, DP_INDEX_MAGIC, sizeof(DP_INDEX_MAGIC));
+	head->slots = slots;
+	head->version = DP_INDEX_VER;
+	
+	/* The entries stay the same, and so does their tree hash. */
+	if (index->head &&
+	    index_tree_get(index, head->tree) == 0)
+		head->tree_check = head_check(head);
+	entries = (struct dp_index_entry *)(head + 1);
+	count = 0;
+	
+	for (uint32_t i = 0; index->head && i < index->head->slots; i++) {
+		if (!entry_live(&index->entries[i]))
+			continue;
+		
+		slot = index->entries[i].name_hash & (slots - 1);
+		
+		while (!entry_empty(&entries[slot]))
+			slot = (slot + 1) & (slots - 1);
+		
+		entries[slot] = index->entries[i];
+		count++;
+	}
+	
+	if (msync(head, len, MS_SYNC) == -1 ||
+	    renameat(dirfd, name_tmp, dirfd, DP_FILE_INDEX) == -1) {
+		trace_write(DP_TRACE_WARN, "index_rebuild(3), renameat(4): %s", strerror(errno));
+		munmap(head, len);
+		unlinkat(dirfd, name_tmp, 0);
+		close(fd);
+		return -1;
+	}
+	
+	/* Make the rename itself stick. */
+	fsync(dirfd);
+	index_unmap(index);
+	
+	index->count = count;
+	index->entries = entries;
+	index->fd = fd;
+	index->head = head;
+	index->map_len = len;
+	index->used = count;
+	
+	return 0;
+}
+
+/*
+ * Returns the slot of the entry with the given name hash
+ * or -1 if there is none. If insert is set, the slot to
+ * put a new entry in is returned instead of -1.
+ */
+long index_slot_get(const struct dp_index *index, uint64_t name_hash, int insert)
+{
+	struct dp_index_entry *entry;
+	uint32_t mask;
+	uint32_t slot;
+	long free_slot;
+	
+	free_slot = -1;
+	mask = index->head->slots - 1;
+	slot = name_hash & mask;
+	
+	for (uint32_t i = 0; i < index->head->slots; i++) {
+		entry = &index->entries[slot];
+		
+		if (entry_empty(entry)) {
+			if (free_slot == -1)
+				free_slot = slot;
+			
+			break;
+		}
+		
+		if (!entry_live(entry)) {
+			if (free_slot == -1)
+				free_slot = slot;
+		} else if (entry->name_hash == name_hash) {
+			return slot;
+		}
+		
+		slot = (slot + 1) & mask;
+	}
+	
+	return insert ? free_slot : -1;
+}
+
+/*
+ * Brings the index of the directory open at dirfd in line
+ * with its files and subdirectories, as listed in files,
+ * and works out its tree hash again. Only files whose
+ * size or modification time changed are hashed again.
+ * Returns the number of entries that changed, counting
+ * a tree hash that had to be made from scratch as one,
+ * or -1.
+ */
+int index_sync(struct dp_index *index, int dirfd, const struct filearray *files)
+{
+	struct dp_index_entry entry;
+	struct dp_index_entry *slot_entry;
+	struct stat info;
+	uint64_t *hashes;
+	size_t count;
+	long slot;
+	time_t now;
+	int changed;
+	int fd;
+	int listed;
+	int result;
+	int status;
+	unsigned char type;
+	
+	if (!index ||
+	    !files)
+		return 1;
+	
+	if (!(hashes = (uint64_t *)malloc((files->count ? files->count : 1) * sizeof(*hashes))))
+		return -1;
+	
+	changed = 0;
+	count = 0;
+	listed = 1;
+	now = time(NULL);
+	
+	for (size_t i = 0; i < files->count; i++) {
+		type = files->entries[i].type;
+		
+		if ((type != DT_REG &&
+		     type != DT_DIR) ||
+		    files->entries[i].name[0] == '.')
+			continue;
+		
+		memset(&entry, 0, sizeof(entry));
+		
+		if ((entry.name_hash = path_hash(files->entries[i].name)) == 0)
+			entry.name_hash = 1;
+		
+		hashes[count++] = entry.name_hash;
+		slot = index_slot_get(index, entry.name_hash, 0);
+		slot_entry = slot == -1 ? NULL : &index->entries[slot];
+		
+		if (type == DT_DIR) {
+			/* A subdirectory without an index yet is added once it has one. */
+			if (index_tree_read(dirfd, files->entries[i].name, entry.checksum) != 0)
+				continue;
+			
+			entry.flags = DP_INDEX_LIVE | DP_INDEX_DIR;
+			
+			if (slot_entry &&
+			    (slot_entry->flags & DP_INDEX_DIR) &&
+			    memcmp(slot_entry->checksum, entry.checksum, sizeof(entry.checksum)) == 0)
+				continue;
+		} else {
+			if (fstatat(dirfd, files->entries[i].name, &info, 0) == -1)
+				continue;
+			
+			if (slot_entry &&
+			    !(slot_entry->flags & (DP_INDEX_DIR | DP_INDEX_UNSETTLED)) &&
+			    slot_entry->size == (uint64_t)info.st_size &&
+			    slot_entry->mtime == info.st_mtime)
+				continue;
+			
+			if ((fd = openat(dirfd, files->entries[i].name, O_RDONLY | O_CLOEXEC)) == -1)
+				continue;
+			
+			status = sha_file(fd, info.st_size, entry.checksum);
+			close(fd);
+			
+			if (status != 0)
+				continue;
+			
+			entry.flags = DP_INDEX_LIVE;
+			entry.mtime = info.st_mtime;
+			entry.size = info.st_size;
+			
+			/* A change within the same second would not show next time. */
+			if (info.st_mtime >= now - DP_INDEX_SETTLE)
+				entry.flags |= DP_INDEX_UNSETTLED;
+		}
+		
+		if ((result = index_put(index, dirfd, &entry)) == -1) {
+			listed = 0;
+			break;
+		}
+		
+		changed += result;
+	}
+	
+	/* Then drop the entries that are gone, if all of them were seen. */
+	qsort(hashes, count, sizeof(*hashes), hash_compare);
+	
+	for (uint32_t i = 0; listed && i < index->head->slots; i++) {
+		slot_entry = &index->entries[i];
+		
+		if (!entry_live(slot_entry) ||
+		    bsearch(&slot_entry->name_hash, hashes, count, sizeof(*hashes), hash_compare))
+			continue;
+		
+		slot_entry->flags = DP_INDEX_DEAD;
+		slot_entry->check = entry_check(slot_entry);
+		index->count--;
+		changed++;
+	}
+	
+	free(hashes);
+	
+	if (changed == 0 &&
+	    index_tree_get(index, NULL) != 0)
+		changed = 1;
+	
+	if (changed > 0) {
+		index_tree_update(index);
+		
+		if (msync(index->head, index->map_len, MS_SYNC) == -1)
+			trace_write(DP_TRACE_WARN, "index_sync(3), msync(3): %s", strerror(errno));
+	}
+	
+	return changed;
+}
+
+/*
+ * Copies the tree hash of the index into tree, which may
+ * be NULL to only check that it is there. Returns -1 if
+ * the index has none yet.
+ */
+int index_tree_get(const struct dp_index *index, unsigned char tree[])
+{
+	if (!index ||
+	    !index->head ||
+	    index->head->tree_check != head_check(index->head))
+		return -1;
+	
+	if (tree)
+		memcpy(tree, index->head->tree, SHA256_DIGEST_LENGTH);
+	
+	return 0;
+}
+
+/*
+ * Reads the tree hash of the index of the subdirectory
+ * called name of the directory open at dirfd, without
+ * locking it. Returns -1 if it has no index or its tree
+ * hash is being written.
+ */
+int index_tree_read(int dirfd, const char *name, unsigned char tree[])
+{
+	struct dp_index_head head;
+	int fd;
+	int fd_dir;
+	ssize_t len;
+	
+	if (!name ||
+	    !tree)
+		return 1;
+	
+	if ((fd_dir = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return -1;
+	
+	fd = openat(fd_dir, DP_FILE_INDEX, O_RDONLY | O_CLOEXEC);
+	close(fd_dir);
+	
+	if (fd == -1)
+		return -1;
+	
+	len = pread(fd, &head, sizeof(head), 0);
+	close(fd);
+	
+	if (len != sizeof(head) ||
+	    memcmp(head.magic, DP_INDEX_MAGIC, sizeof(DP_INDEX_MAGIC)) != 0 ||
+	    head.version != DP_INDEX_VER ||
+	    head.tree_check != head_check(&head))
+		return -1;
+	
+	memcpy(tree, head.tree, SHA256_DIGEST_LENGTH);
+	
+	return 0;
+}
+
+/*
+ * Works out the tree hash of the index from its live
+ * entries: SHA256(0x01 || entries), each entry being its
+ * name hash (big-endian), 1 if it is a subdirectory or 0
+ * otherwise, and its checksum. Returns 1 if the hash
+ * changed, 0 if it did not or -1.
+ */
+int index_tree_update(struct dp_index *index)
+{
+	unsigned char record[sizeof(uint64_t) + 1 + SHA256_DIGEST_LENGTH];
+	unsigned char tree[SHA256_DIGEST_LENGTH];
+	EVP_MD_CTX *ctx;
+	struct dp_index_entry *live;
+	uint32_t count;
+	
+	if (!(live = (struct dp_index_entry *)malloc((index->head->slots) * sizeof(*live))))
+		return -1;
+	
+	if (!(ctx = EVP_MD_CTX_new())) {
+		free(live);
+		return -1;
+	}
+	
+	count = 0;
+	
+	for (uint32_t i = 0; i < index->head->slots; i++) {
+		if (entry_live(&index->entries[i]))
+			live[count++] = index->entries[i];
+	}
+	
+	/* The name hash leads the entry, so entries sort by it. */
+	qsort(live, count, sizeof(*live), hash_compare);
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+	EVP_DigestUpdate(ctx, &DP_MERKLE_PREFIX_NODE, 1);
+	
+	for (uint32_t i = 0; i < count; i++) {
+		for (int j = 0; j < 8; j++)
+			record[j] = (live[i].name_hash >> (56 - j * 8)) & 0xff;
+		
+		record[8] = (live[i].flags & DP_INDEX_DIR) ? 1 : 0;
+		memcpy(&record[9], live[i].checksum, SHA256_DIGEST_LENGTH);
+		EVP_DigestUpdate(ctx, record, sizeof(record));
+	}
+	
+	EVP_DigestFinal_ex(ctx, tree, NULL);
+	EVP_MD_CTX_free(ctx);
+	free(live);
+	
+	if (index->head->tree_check == head_check(index->head) &&
+	    memcmp(index->head->tree, tree, sizeof(tree)) == 0)
+		return 0;
+	
+	memcpy(index->head->tree, tree, sizeof(tree));
+	index->head->tree_check = head_check(index->head);
+	
+	return 1;
+}
+
+void index_unmap(struct dp_index *index)
+{
+	if (index->head) {
+		munmap(index->head, index->map_len);
+		index->entries = NULL;
+		index->head = NULL;
+	}
+	
+	/* Closing the file also releases the lock. */
+	if (index->fd != -1) {
+		close(index->fd);
+		index->fd = -1;
+	}
+}
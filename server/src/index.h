@@ -0,0 +1,80 @@
+//
+//  index.h
+//  server
+//
+
+#ifndef INDEX_H
+#define INDEX_H
+
+
+#include <openssl/sha.h>
+#include <stddef.h>
+#include "types.h"
+
+
+#define DP_INDEX_MAGIC	"DPINDEX"	/* Starts every .index; includes the terminator */
+
+/*************
+ * CONSTANTS *
+ *************/
+static const uint32_t DP_INDEX_DEAD 		= 2;	/* Entry was removed; lookups carry on past it */
+static const int DP_INDEX_DEPTH 		= 4;	/* Recipients' directories; everything at this depth and below is indexed */
+static const uint32_t DP_INDEX_DIR 		= 8;	/* Entry is a subdirectory; its checksum is the subdirectory's tree hash */
+static const uint32_t DP_INDEX_LIVE 		= 1;
+static const int DP_INDEX_LOAD_PERCENT 		= 70;	/* How full the table gets before it is rebuilt bigger */
+static const int DP_INDEX_SETTLE 		= 2;	/* Files changed less than this many seconds before they were hashed are hashed again next time. */
+static const uint32_t DP_INDEX_SLOTS_INIT 	= 64;
+static const uint32_t DP_INDEX_UNSETTLED 	= 4;
+static const uint32_t DP_INDEX_VER 		= 2;
+
+/**************
+ * STRUCTURES *
+ **************/
+/*
+ * One 64-byte slot of the table. check covers everything
+ * before it, so an entry torn by a crash is seen as such.
+ */
+struct dp_index_entry {
+	uint64_t name_hash;
+	uint64_t size;
+	int64_t mtime;
+	unsigned char checksum[SHA256_DIGEST_LENGTH];
+	uint32_t flags;
+	uint32_t check;
+};
+
+/*
+ * tree_check covers everything before it, so a tree hash
+ * torn by a crash is seen as such.
+ */
+struct dp_index_head {
+	char magic[8];
+	uint32_t version;
+	uint32_t slots;		/* A power of 2 */
+	unsigned char tree[SHA256_DIGEST_LENGTH];
+	uint32_t tree_check;
+	unsigned char reserved[12];
+};
+
+struct dp_index {
+	struct dp_index_entry *entries;
+	struct dp_index_head *head;
+	size_t map_len;
+	uint32_t count;		/* Live entries */
+	uint32_t used;		/* Live and dead entries */
+	int fd;
+};
+
+/*************
+ * FUNCTIONS *
+ *************/
+void index_close(struct dp_index **);
+const struct dp_index_entry *index_find(const struct dp_index *, const char *);
+int index_open(int, struct dp_index **);
+void index_propagate(int, int);
+int index_sync(struct dp_index *, int, const struct filearray *);
+int index_tree_get(const struct dp_index *, unsigned char []);
+int index_tree_read(int, const char *, unsigned char []);
+
+
+#endif /* INDEX_H */
@@ -0,0 +1,248 @@
+//
+//  keyring.c
+//  server
+//
+
+#include "keyring.h"
+
+#include <errno.h>
+#include <openssl/pem.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "util.h"
+
+
+/*
+ * KEYRING
+ * --
+ * Keys are read out of their PEM files (.pubkey, id.pem)
+ * once and kept, parsed, for every thread to use. They
+ * are indexed by the path of their file, which is what
+ * an address resolves to in the directory tree.
+ *
+ * A cached key is handed out as is for up to
+ * DP_KEYRING_CHECK_INT ms. After that, the next lookup
+ * stats the file and reloads the key only if the file
+ * was replaced or modified. A missing file is cached
+ * too, so addresses without a key cost no more than
+ * those with one. keyring_invalidate() drops a key
+ * straight away.
+ */
+
+/**************
+ * STRUCTURES *
+ **************/
+struct dp_key {
+	char *path;
+	struct dp_key *next;
+	EVP_PKEY *pkey;			/* NULL if there is no (readable) key in the file */
+	time_t ctime;
+	time_t mtime;
+	uint64_t time_checked;
+	ino_t inode;
+	off_t size;
+	int private;
+};
+/**********************/
+
+/********************
+ * Global Variables
+ ********************/
+struct dp_key *keyring_keys[DP_KEYRING_BUCKETS];
+pthread_mutex_t keyring_lock = PTHREAD_MUTEX_INITIALIZER;
+/**********************/
+
+/**********************
+ * Private Prototypes
+ **********************/
+struct dp_key *key_find(const char *, uint64_t);
+int key_identical(const struct dp_key *, const struct stat *);
+EVP_PKEY *key_read(const char *, int, struct stat *);
+/**********************/
+
+
+struct dp_key *key_find(const char *path, uint64_t hash)
+{
+	struct dp_key *key;
+	
+	for (key = keyring_keys[hash & (DP_KEYRING_BUCKETS - 1)]; key; key = key->next) {
+		if (strcmp(key->path, path) == 0)
+			return key;
+	}
+	
+	return NULL;
+}
+
+/*
+ * Returns 1 if the file is still the one the key was
+ * read from.
+ */
+int key_identical(const struct dp_key *key, const struct stat *file_stat)
+{
+	return key->inode == file_stat->st_ino &&
+	    key->size == file_stat->st_size &&
+	    key->mtime == file_stat->st_mtime &&
+	    key->ctime == file_stat->st_ctime;
+}
+
+/*
+ * Reads a PEM key file. file_stat is filled in from the
+ * same open file, or zeroed if there is none.
+ * It is the caller's responsibility to free the
+ * returned pointer with EVP_PKEY_free().
+ */
+EVP_PKEY *key_read(const char *path, int private, struct stat *file_stat)
+{
+	EVP_PKEY *pkey;
+	FILE *fptr;
+	
+	memset(file_stat, 0, sizeof(*file_stat));
+	
+	if (!(fptr = fopen(path, "r"))) {
+		if (errno != ENOENT)
+			trace_write(DP_TRACE_WARN, "key_read(3), fopen(2): %s", strerror(errno));
+		
+		return NULL;
+	}
+	
+	fstat(fileno(fptr), file_stat);
+	
+	if (private)
+		pkey = PEM_read_PrivateKey(fptr, NULL, NULL, NULL);
+	else
+		pkey = PEM_read_PUBKEY(fptr, NULL, NULL, NULL);
+	
+	fclose(fptr);
+	
+	return pkey;
+}
+
+/*
+ * Returns the key in the PEM file at path, either a
+ * public key (.pubkey) or, if private is 1, a private
+ * key (id.pem). Returns NULL if there is none.
+ * It is the caller's responsibility to free the
+ * returned pointer with EVP_PKEY_free().
+ */
+EVP_PKEY *keyring_get(const char *path, int private)
+{
+	struct dp_key *key;
+	struct stat file_stat;
+	EVP_PKEY *pkey;
+	uint64_t hash;
+	uint64_t now;
+	
+	if (!path)
+		return NULL;
+	
+	hash = path_hash(path);
+	now = time_ms();
+	pkey = NULL;
+	
+	pthread_mutex_lock(&keyring_lock);
+	
+	if ((key = key_find(path, hash)) &&
+	    key->private == private &&
+	    now - key->time_checked < DP_KEYRING_CHECK_INT) {
+		if (key->pkey &&
+		    EVP_PKEY_up_ref(key->pkey) == 1)
+			pkey = key->pkey;
+		
+		pthread_mutex_unlock(&keyring_lock);
+		
+		return pkey;
+	}
+	
+	pthread_mutex_unlock(&keyring_lock);
+	
+	/* Parsing is left out of the lock; stat() alone is enough to tell whether it is needed. */
+	if (stat(path, &file_stat) != 0)
+		memset(&file_stat, 0, sizeof(file_stat));
+	
+	pthread_mutex_lock(&keyring_lock);
+	
+	if ((key = key_find(path, hash)) &&
+	    key->private == private &&
+	    key_identical(key, &file_stat) == 1) {
+		key->time_checked = now;
+		
+		if (key->pkey &&
+		    EVP_PKEY_up_ref(key->pkey) == 1)
+			pkey = key->pkey;
+		
+		pthread_mutex_unlock(&keyring_lock);
+		
+		return pkey;
+	}
+	
+	pthread_mutex_unlock(&keyring_lock);
+	pkey = key_read(path, private, &file_stat);
+	pthread_mutex_lock(&keyring_lock);
+	
+	if (!(key = key_find(path, hash))) {
+		key = (struct dp_key *)calloc(1, sizeof(*key));
+		key->path = (char *)calloc(strlen(path) + 1, sizeof(char));
+		strcpy(key->path, path);
+		key->next = keyring_keys[hash & (DP_KEYRING_BUCKETS - 1)];
+		keyring_keys[hash & (DP_KEYRING_BUCKETS - 1)] = key;
+	} else if (key->pkey) {
+		/* Anyone still using the old key holds their own reference to it. */
+		EVP_PKEY_free(key->pkey);
+	}
+	
+	key->pkey = pkey;
+	key->private = private;
+	key->inode = file_stat.st_ino;
+	key->size = file_stat.st_size;
+	key->ctime = file_stat.st_ctime;
+	key->mtime = file_stat.st_mtime;
+	key->time_checked = now;
+	
+	if (pkey &&
+	    EVP_PKEY_up_ref(pkey) != 1)
+		pkey = NULL;
+	
+	pthread_mutex_unlock(&keyring_lock);
+	
+	return pkey;
+}
+
+/*
+ * Forgets the key read from the file at path, so that
+ * the next lookup reads the file again.
+ */
+void keyring_invalidate(const char *path)
+{
+	struct dp_key **iter;
+	uint64_t hash;
+	
+	if (!path)
+		return;
+	
+	hash = path_hash(path);
+	pthread_mutex_lock(&keyring_lock);
+	
+	for (iter = &keyring_keys[hash & (DP_KEYRING_BUCKETS - 1)]; *iter; iter = &(*iter)->next) {
+		struct dp_key *key;
+		
+		if (strcmp((*iter)->path, path) != 0)
+			continue;
+		
+		key = *iter;
+		*iter = key->next;
+		
+		if (key->pkey)
+			EVP_PKEY_free(key->pkey);
+		
+		free(key->path);
+		free(key);
+		
+		break;
+	}
+	
+	pthread_mutex_unlock(&keyring_lock);
+}
@@ -0,0 +1,27 @@
+//
+//  keyring.h
+//  server
+//
+
+#ifndef KEYRING_H
+#define KEYRING_H
+
+
+#include <openssl/evp.h>
+
+
+#define DP_KEYRING_BUCKETS	1024	/* Key file hash buckets; must be a power of 2. */
+
+/*************
+ * CONSTANTS *
+ *************/
+static const int DP_KEYRING_CHECK_INT 	= 2 * 1000;	/* How long (in milliseconds) a cached key is used before its file is checked for changes. */
+
+/*************
+ * FUNCTIONS *
+ *************/
+EVP_PKEY *keyring_get(const char *, int);
+void keyring_invalidate(const char *);
+
+
+#endif /* KEYRING_H */
@@ -6,12 +6,23 @@
 //  Copyright © 2017 Ali Mahouk. All rights reserved.
 //
 
+#include "dedup.h"
 #include "disk.h"
+#include <errno.h>
+#include "eventlog.h"
 #include "net.h"
+#include "offload.h"
+#include "order.h"
 #include "protocol.h"
+#include "scan.h"
 #include <pthread.h>
 #include <signal.h>
+#include <string.h>
 #include <sys/time.h>
+#include "tls.h"
+#include "trace.h"
+#include "transfer.h"
+#include "watch.h"
 
 
 /********************
@@ -38,6 +49,15 @@ int main(int argc, const char *argv[])
 	pthread_t t_sched;
 	
 	path_dir_root = directories_bootstrap();
+	trace_bootstrap();
+	scan_bootstrap();
+	dedup_bootstrap();
+	eventlog_bootstrap();
+	offload_bootstrap();
+	order_bootstrap();
+	tls_bootstrap();
+	transfer_bootstrap();
+	watch_bootstrap(path_dir_root);
 	pthread_create(&t_sched, 0, schedule, 0);
 	
 	sockets_bootstrap();
@@ -63,14 +83,14 @@ void *schedule(void *args)
 	 * does not allow for passing arguments.
 	 */
 	if ( signal(SIGALRM, (void (*)(int))time_out) == SIG_ERR )
-		printf("Unable to catch SIGALRM");
+		trace_write(DP_TRACE_ERROR, "Unable to catch SIGALRM");
 	
 	it_val.it_value.tv_sec  = DP_DIR_SCAN_INT / 1000;
 	it_val.it_value.tv_usec = (DP_DIR_SCAN_INT * 1000) % 1000000;
 	it_val.it_interval      = it_val.it_value;
 	
 	if ( setitimer(ITIMER_REAL, &it_val, NULL) == -1 )
-		printf("Error calling setitimer()");
+		trace_write(DP_TRACE_ERROR, "Error calling setitimer(): %s", strerror(errno));
 	
 	/* Initiate the first call right away. */
 	time_out();
@@ -82,5 +102,8 @@ void time_out(void)
 {
 	pthread_t t_chkdir;
 	
-	pthread_create(&t_chkdir, 0, directory_tree_scan, (void *)path_dir_root);
+	/* Changes are picked up as they happen while the tree is watched. */
+	if (!watch_enabled() &&
+	    pthread_create(&t_chkdir, 0, directory_tree_scan, (void *)path_dir_root) == 0)
+		pthread_detach(t_chkdir);
 }
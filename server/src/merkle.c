@@ -0,0 +1,527 @@
+//
+//  merkle.c
+//  server
+//
+
+#include "merkle.h"
+
+#include "offload.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * BATCH SIGNATURES
+ * --
+ * Rather than signing every message, a sender hashes a
+ * batch of them into a Merkle tree and signs its root
+ * once. Each message then travels with that signature
+ * and the sibling hashes leading from it up to the root
+ * (its inclusion proof; see struct dp_proof).
+ *
+ * Leaves are SHA256(0x00 || UUID || timestamp ||
+ * sequence || message type || message body) and nodes
+ * are SHA256(0x01 || left || right). A node without a sibling moves up a
+ * level as it is. What gets signed is DP_MERKLE_DOMAIN
+ * || leaf count || root.
+ *
+ * A receiver rebuilds the root out of the parcel and its
+ * proof, which costs a few hashes. The signature is only
+ * checked for the first parcel of a batch; the rest find
+ * the root in a table of recently verified ones, or wait
+ * on the check already under way. Checks run on the
+ * crypto workers (see offload.c) so that the connection
+ * is never held up by them.
+ */
+
+/**************
+ * STRUCTURES *
+ **************/
+struct dp_merkle_waiter {
+	struct dp_merkle_waiter *next;
+	dp_merkle_verified done;
+	void *context;
+};
+
+/*
+ * Lets merkle_verify_wait() sleep until the check it
+ * asked for is done.
+ */
+struct dp_merkle_wait {
+	pthread_cond_t cond;
+	pthread_mutex_t lock;
+	int done;
+	int result;
+};
+
+/*
+ * A batch root as signed by one key: either verified,
+ * or with its signature being checked for the parcels
+ * waiting on it.
+ */
+struct dp_merkle_root {
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	unsigned char *signature;		/* Only kept while it is being checked */
+	struct dp_merkle_waiter *waiters;
+	EVP_PKEY *pkey;
+	size_t signature_len;
+	uint32_t count;
+	int state;
+};
+/**********************/
+
+/*************
+ * CONSTANTS *
+ *************/
+static const int DP_MERKLE_ROOT_EMPTY 		= 0;
+static const int DP_MERKLE_ROOT_CHECKING 	= 1;
+static const int DP_MERKLE_ROOT_VERIFIED 	= 2;
+
+/********************
+ * Global Variables
+ ********************/
+struct dp_merkle_root merkle_roots[DP_MERKLE_ROOTS];
+pthread_mutex_t merkle_lock = PTHREAD_MUTEX_INITIALIZER;
+size_t merkle_roots_next;	/* The slot to be reused next */
+/**********************/
+
+/**********************
+ * Private Prototypes
+ **********************/
+void node_hash(const unsigned char [], const unsigned char [], unsigned char []);
+void root_message_get(const unsigned char [], uint32_t, unsigned char []);
+int root_verify_work(void *);
+void root_verified(void *, int);
+void verify_waited(void *, int);
+/**********************/
+
+
+/*
+ * Builds the tree over the leaves and signs its root.
+ * Fills in proofs, which holds one entry per leaf; their
+ * signature points into signature.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int merkle_batch_sign(unsigned char (*leaves)[SHA256_DIGEST_LENGTH], uint32_t count, EVP_PKEY *pkey, struct dp_proof *proofs, struct data64 **signature)
+{
+	unsigned char message[DP_MERKLE_DOMAIN_LEN + sizeof(uint32_t) + SHA256_DIGEST_LENGTH];
+	unsigned char (*level)[SHA256_DIGEST_LENGTH];
+	EVP_MD_CTX *ctx;
+	const EVP_MD *md;
+	size_t signature_len;
+	uint32_t len;
+	int depth;
+	
+	if (!leaves ||
+	    count == 0 ||
+	    count > (1 << DP_PROTO_HOST_PROOF_MAX) ||
+	    !pkey ||
+	    !proofs ||
+	    !signature)
+		return 1;
+	
+	*signature = NULL;
+	depth = 0;
+	len = count;
+	level = (unsigned char (*)[SHA256_DIGEST_LENGTH])malloc(count * sizeof(*level));
+	memcpy(level, leaves, count * sizeof(*level));
+	
+	for (uint32_t i = 0; i < count; i++) {
+		proofs[i].count = count;
+		proofs[i].depth = 0;
+		proofs[i].index = i;
+	}
+	
+	while (len > 1) {
+		/* Every leaf takes its ancestor's sibling at this level. */
+		for (uint32_t i = 0; i < count; i++) {
+			uint32_t sibling;
+			
+			sibling = (i >> depth) ^ 1;
+			
+			if (sibling < len) {
+				memcpy(proofs[i].hashes[proofs[i].depth], level[sibling], SHA256_DIGEST_LENGTH);
+				proofs[i].depth++;
+			}
+		}
+		
+		for (uint32_t i = 0; i < len; i += 2) {
+			if (i + 1 < len)
+				node_hash(level[i], level[i + 1], level[i / 2]);
+			else
+				memcpy(level[i / 2], level[i], SHA256_DIGEST_LENGTH);
+		}
+		
+		len = (len + 1) / 2;
+		depth++;
+	}
+	
+	root_message_get(level[0], count, message);
+	free(level);
+	
+	/* Ed25519 keys hash the message themselves. */
+	md = EVP_PKEY_id(pkey) == EVP_PKEY_ED25519 ? NULL : EVP_sha256();
+	
+	if (!(ctx = EVP_MD_CTX_new()))
+		return -1;
+	
+	if (EVP_DigestSignInit(ctx, NULL, md, NULL, pkey) != 1 ||
+	    EVP_DigestSign(ctx, NULL, &signature_len, message, sizeof(message)) != 1 ||
+	    signature_len > UINT16_MAX) {
+		EVP_MD_CTX_free(ctx);
+		return -1;
+	}
+	
+	*signature = (struct data64 *)malloc(sizeof(**signature));
+	(*signature)->bytes = (unsigned char *)malloc(signature_len);
+	
+	if (EVP_DigestSign(ctx, (*signature)->bytes, &signature_len, message, sizeof(message)) != 1) {
+		EVP_MD_CTX_free(ctx);
+		free((*signature)->bytes);
+		free(*signature);
+		*signature = NULL;
+		
+		return -1;
+	}
+	
+	EVP_MD_CTX_free(ctx);
+	(*signature)->len = signature_len;
+	
+	for (uint32_t i = 0; i < count; i++) {
+		proofs[i].signature = (*signature)->bytes;
+		proofs[i].signature_len = signature_len;
+	}
+	
+	return 0;
+}
+
+/*
+ * The body is that of the message as it would go out
+ * unsigned, and head->type its type; tail, if any, is
+ * the part of the body that is kept apart.
+ * A sealed tail is hashed as it is sealed, so the leaf
+ * covers the bytes that go out.
+ */
+void merkle_leaf_get(const struct dp_parcel_head *head, const struct data64 *body, const struct dp_tail *tail, unsigned char leaf[])
+{
+	unsigned char fields[sizeof(DP_MERKLE_PREFIX_LEAF) + UUID_LEN + sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint16_t)];
+	EVP_MD_CTX *ctx;
+	uint64_t timestamp;
+	int pos;
+	
+	timestamp = (uint64_t)head->timestamp;
+	fields[0] = DP_MERKLE_PREFIX_LEAF;
+	pos = sizeof(DP_MERKLE_PREFIX_LEAF);
+	memcpy(&fields[pos], head->uuid, UUID_LEN);
+	pos += UUID_LEN;
+	
+	for (int i = 0; i < sizeof(uint64_t); i++) {
+		fields[pos + i] = (timestamp >> (56 - 8 * i)) & 0xff;
+		fields[pos + sizeof(uint64_t) + i] = (head->sequence >> (56 - 8 * i)) & 0xff;
+	}
+	
+	pos += sizeof(uint64_t) + sizeof(uint64_t);
+	fields[pos] = (head->type >> 8) & 0xff;
+	fields[pos + 1] = head->type & 0xff;
+	
+	ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+	EVP_DigestUpdate(ctx, fields, sizeof(fields));
+	
+	if (body)
+		EVP_DigestUpdate(ctx, body->bytes, body->len);
+	
+	if (tail)
+		tail_digest(tail, ctx);
+	
+	EVP_DigestFinal_ex(ctx, leaf, NULL);
+	EVP_MD_CTX_free(ctx);
+}
+
+/*
+ * Works out the root of the batch out of a leaf and its
+ * proof. Returns -1 if the proof does not fit the batch
+ * it claims to be part of.
+ */
+int merkle_root_get(const unsigned char leaf[], const struct dp_proof *proof, unsigned char root[])
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	uint32_t index;
+	uint32_t len;
+	int used;
+	
+	if (!leaf ||
+	    !proof ||
+	    !root)
+		return 1;
+	
+	if (proof->count == 0 ||
+	    proof->count > (1 << DP_PROTO_HOST_PROOF_MAX) ||
+	    proof->index >= proof->count ||
+	    proof->depth > DP_PROTO_HOST_PROOF_MAX)
+		return -1;
+	
+	memcpy(hash, leaf, SHA256_DIGEST_LENGTH);
+	index = proof->index;
+	len = proof->count;
+	used = 0;
+	
+	while (len > 1) {
+		if ((index ^ 1) < len) {
+			if (used >= proof->depth)
+				return -1;
+			
+			if (index & 1)
+				node_hash(proof->hashes[used], hash, hash);
+			else
+				node_hash(hash, proof->hashes[used], hash);
+			
+			used++;
+		}
+		
+		index >>= 1;
+		len = (len + 1) / 2;
+	}
+	
+	if (used != proof->depth)
+		return -1;
+	
+	memcpy(root, hash, SHA256_DIGEST_LENGTH);
+	
+	return 0;
+}
+
+/*
+ * Checks the signature over a batch root, which was
+ * worked out with merkle_root_get(). done is called with
+ * 0 if it is good, right away if the root was verified
+ * before and on a crypto worker otherwise.
+ */
+void merkle_verify(const unsigned char root[], const struct dp_proof *proof, EVP_PKEY *pkey, dp_merkle_verified done, void *context)
+{
+	struct dp_merkle_root *slot;
+	struct dp_merkle_waiter *waiter;
+	
+	if (!root ||
+	    !proof ||
+	    !pkey ||
+	    !done)
+		return;
+	
+	waiter = (struct dp_merkle_waiter *)malloc(sizeof(*waiter));
+	waiter->next = NULL;
+	waiter->done = done;
+	waiter->context = context;
+	slot = NULL;
+	
+	pthread_mutex_lock(&merkle_lock);
+	
+	/*
+	 * The table holds a reference to every key in it, so a
+	 * key that was replaced cannot share an address with
+	 * the one a root was verified with.
+	 */
+	for (size_t i = 0; i < DP_MERKLE_ROOTS; i++) {
+		struct dp_merkle_root *entry;
+		
+		entry = &merkle_roots[i];
+		
+		if (entry->state == DP_MERKLE_ROOT_EMPTY ||
+		    entry->pkey != pkey ||
+		    entry->count != proof->count ||
+		    memcmp(entry->hash, root, SHA256_DIGEST_LENGTH) != 0)
+			continue;
+		
+		if (entry->state == DP_MERKLE_ROOT_VERIFIED) {
+			pthread_mutex_unlock(&merkle_lock);
+			free(waiter);
+			done(context, 0);
+			
+			return;
+		}
+		
+		/* A different signature over the same root gets a check of its own. */
+		if (entry->signature_len == proof->signature_len &&
+		    memcmp(entry->signature, proof->signature, proof->signature_len) == 0) {
+			waiter->next = entry->waiters;
+			entry->waiters = waiter;
+			pthread_mutex_unlock(&merkle_lock);
+			
+			return;
+		}
+	}
+	
+	for (size_t i = 0; i < DP_MERKLE_ROOTS; i++) {
+		struct dp_merkle_root *entry;
+		
+		entry = &merkle_roots[(merkle_roots_next + i) % DP_MERKLE_ROOTS];
+		
+		if (entry->state != DP_MERKLE_ROOT_CHECKING) {
+			slot = entry;
+			merkle_roots_next = (merkle_roots_next + i + 1) % DP_MERKLE_ROOTS;
+			
+			break;
+		}
+	}
+	
+	if (!slot) {
+		/* Every slot has a check under way; this one goes unremembered. */
+		struct dp_merkle_root entry;
+		
+		pthread_mutex_unlock(&merkle_lock);
+		memcpy(entry.hash, root, SHA256_DIGEST_LENGTH);
+		entry.signature = (unsigned char *)proof->signature;
+		entry.signature_len = proof->signature_len;
+		entry.pkey = pkey;
+		entry.count = proof->count;
+		free(waiter);
+		done(context, root_verify_work(&entry));
+		
+		return;
+	}
+	
+	if (slot->pkey)
+		EVP_PKEY_free(slot->pkey);
+	
+	EVP_PKEY_up_ref(pkey);
+	memcpy(slot->hash, root, SHA256_DIGEST_LENGTH);
+	slot->pkey = pkey;
+	slot->count = proof->count;
+	slot->signature = (unsigned char *)malloc(proof->signature_len ? proof->signature_len : 1);
+	slot->signature_len = proof->signature_len;
+	memcpy(slot->signature, proof->signature, proof->signature_len);
+	slot->waiters = waiter;
+	slot->state = DP_MERKLE_ROOT_CHECKING;
+	pthread_mutex_unlock(&merkle_lock);
+	
+	if (offload_submit(root_verify_work, slot, root_verified, slot) != 0)
+		root_verified(slot, root_verify_work(slot));
+}
+
+/*
+ * Same as merkle_verify() but returns the outcome,
+ * blocking until the check is done; for messages that
+ * cannot be read any further before they are trusted.
+ */
+int merkle_verify_wait(const unsigned char root[], const struct dp_proof *proof, EVP_PKEY *pkey)
+{
+	struct dp_merkle_wait wait;
+	
+	if (!root ||
+	    !proof ||
+	    !pkey)
+		return 1;
+	
+	pthread_cond_init(&wait.cond, NULL);
+	pthread_mutex_init(&wait.lock, NULL);
+	wait.done = 0;
+	wait.result = -1;
+	merkle_verify(root, proof, pkey, verify_waited, &wait);
+	
+	pthread_mutex_lock(&wait.lock);
+	
+	while (!wait.done)
+		pthread_cond_wait(&wait.cond, &wait.lock);
+	
+	pthread_mutex_unlock(&wait.lock);
+	pthread_cond_destroy(&wait.cond);
+	pthread_mutex_destroy(&wait.lock);
+	
+	return wait.result;
+}
+
+void node_hash(const unsigned char left[], const unsigned char right[], unsigned char out[])
+{
+	unsigned char node[sizeof(DP_MERKLE_PREFIX_NODE) + SHA256_DIGEST_LENGTH * 2];
+	
+	node[0] = DP_MERKLE_PREFIX_NODE;
+	memcpy(&node[1], left, SHA256_DIGEST_LENGTH);
+	memcpy(&node[1 + SHA256_DIGEST_LENGTH], right, SHA256_DIGEST_LENGTH);
+	EVP_Digest(node, sizeof(node), out, NULL, EVP_sha256(), NULL);
+}
+
+void root_message_get(const unsigned char root[], uint32_t count, unsigned char out[])
+{
+	memcpy(out, DP_MERKLE_DOMAIN, DP_MERKLE_DOMAIN_LEN);
+	out[DP_MERKLE_DOMAIN_LEN] = (count >> 24) & 0xff;
+	out[DP_MERKLE_DOMAIN_LEN + 1] = (count >> 16) & 0xff;
+	out[DP_MERKLE_DOMAIN_LEN + 2] = (count >> 8) & 0xff;
+	out[DP_MERKLE_DOMAIN_LEN + 3] = count & 0xff;
+	memcpy(&out[DP_MERKLE_DOMAIN_LEN + sizeof(uint32_t)], root, SHA256_DIGEST_LENGTH);
+}
+
+/*
+ * Runs on a crypto worker. The slot is left alone by
+ * everyone else while it is being checked.
+ */
+int root_verify_work(void *args)
+{
+	unsigned char message[DP_MERKLE_DOMAIN_LEN + sizeof(uint32_t) + SHA256_DIGEST_LENGTH];
+	struct dp_merkle_root *root;
+	EVP_MD_CTX *ctx;
+	const EVP_MD *md;
+	int result;
+	
+	root = (struct dp_merkle_root *)args;
+	root_message_get(root->hash, root->count, message);
+	md = EVP_PKEY_id(root->pkey) == EVP_PKEY_ED25519 ? NULL : EVP_sha256();
+	
+	if (!(ctx = EVP_MD_CTX_new()))
+		return -1;
+	
+	if (EVP_DigestVerifyInit(ctx, NULL, md, NULL, root->pkey) == 1 &&
+	    EVP_DigestVerify(ctx, root->signature, root->signature_len, message, sizeof(message)) == 1)
+		result = 0;
+	else
+		result = -1;
+	
+	EVP_MD_CTX_free(ctx);
+	
+	return result;
+}
+
+/*
+ * Lets every parcel waiting on the root know how the
+ * check went. A root that failed it is forgotten.
+ */
+void root_verified(void *context, int result)
+{
+	struct dp_merkle_root *root;
+	struct dp_merkle_waiter *waiters;
+	
+	root = (struct dp_merkle_root *)context;
+	
+	pthread_mutex_lock(&merkle_lock);
+	waiters = root->waiters;
+	root->waiters = NULL;
+	free(root->signature);
+	root->signature = NULL;
+	root->signature_len = 0;
+	root->state = result == 0 ? DP_MERKLE_ROOT_VERIFIED : DP_MERKLE_ROOT_EMPTY;
+	pthread_mutex_unlock(&merkle_lock);
+	
+	while (waiters) {
+		struct dp_merkle_waiter *tmp;
+		
+		tmp = waiters;
+		waiters = waiters->next;
+		tmp->done(tmp->context, result);
+		free(tmp);
+	}
+}
+
+void verify_waited(void *context, int result)
+{
+	struct dp_merkle_wait *wait;
+	
+	wait = (struct dp_merkle_wait *)context;
+	
+	pthread_mutex_lock(&wait->lock);
+	wait->result = result;
+	wait->done = 1;
+	pthread_cond_signal(&wait->cond);
+	pthread_mutex_unlock(&wait->lock);
+}
@@ -0,0 +1,44 @@
+//
+//  merkle.h
+//  server
+//
+
+#ifndef MERKLE_H
+#define MERKLE_H
+
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include "protocol.h"
+
+
+#define DP_MERKLE_DOMAIN	"DPMERKLE"	/* Prefixes the root when it is signed */
+#define DP_MERKLE_DOMAIN_LEN	8
+#define DP_MERKLE_ROOTS		256		/* Batch roots whose signature is remembered */
+
+/*************
+ * CONSTANTS *
+ *************/
+static const unsigned char DP_MERKLE_PREFIX_LEAF 	= 0x00;
+static const unsigned char DP_MERKLE_PREFIX_NODE 	= 0x01;
+
+/**************
+ * STRUCTURES *
+ **************/
+/*
+ * Called once a batch signature is checked, with 0 if
+ * it is good.
+ */
+typedef void (*dp_merkle_verified)(void *, int);
+
+/*************
+ * FUNCTIONS *
+ *************/
+int merkle_batch_sign(unsigned char (*)[SHA256_DIGEST_LENGTH], uint32_t, EVP_PKEY *, struct dp_proof *, struct data64 **);
+void merkle_leaf_get(const struct dp_parcel_head *, const struct data64 *, const struct dp_tail *, unsigned char []);
+int merkle_root_get(const unsigned char [], const struct dp_proof *, unsigned char []);
+void merkle_verify(const unsigned char [], const struct dp_proof *, EVP_PKEY *, dp_merkle_verified, void *);
+int merkle_verify_wait(const unsigned char [], const struct dp_proof *, EVP_PKEY *);
+
+
+#endif /* MERKLE_H */
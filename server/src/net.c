@@ -9,41 +9,456 @@
 #include "net.h"
 
 #include <arpa/inet.h>
+#include "dedup.h"
+#include "delta.h"
+#include "disk.h"
 #include <errno.h>
+#include "merkle.h"
 #include <netdb.h>
+#include "order.h"
+#include <poll.h>
 #include "protocol.h"
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include "sync.h"
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <time.h>
+#include "tls.h"
+#include "trace.h"
+#include "transfer.h"
 #include <unistd.h>
 
 
+/**************
+ * STRUCTURES *
+ **************/
+/*
+ * Parcels on a host connection are delivered by the
+ * order workers, so their acknowledgements trickle in
+ * from other threads and are collected here until the
+ * connection flushes them.
+ */
+struct dp_conn {
+	struct dp_ack acks[DP_PROTO_HOST_ACK_MAX];
+	pthread_cond_t cond;
+	pthread_mutex_t lock;
+	uint64_t time_first_ack;
+	int outstanding;	/* Parcels handed over for delivery but not yet acknowledged */
+	int sockfd;
+	uint16_t ack_count;
+};
+
+struct dp_conn_args {
+	struct sockaddr_storage addr;
+	int sockfd;
+};
+
+/*
+ * Which connection to acknowledge a delivered parcel
+ * on, and with which message UUID.
+ */
+struct dp_receipt {
+	struct dp_conn *conn;
+	struct dp_parcel *parcel;	/* Held while its signature is checked */
+	uuid_t uuid;
+};
+
+/*
+ * One connection's share of a ranged send: payload
+ * bytes [start, end).
+ */
+struct dp_stream {
+	const unsigned char *checksum;
+	const char *host;
+	const struct dp_parcel *parcel;
+	const struct dp_tail *tail;	/* The whole payload as it goes out */
+	EVP_PKEY *pkey;			/* Signs the ranges, if given */
+	pthread_t thread;
+	uint64_t end;
+	uint64_t start;
+	uint16_t code;		/* DP_REQACCEPTED once the receiver has the whole share */
+	int started;
+};
+/**********************/
+
 /**********************
  * Private Prototypes 
  **********************/
+void ack_push(struct dp_conn *, const uuid_t, uint16_t);
+void acks_flush(struct dp_conn *);
+int acks_read(int, struct data16 **, size_t, uint16_t *);
+int acks_send(int, const struct dp_ack *, uint16_t);
+int basis_read(struct dp_conn *, const struct data16 *, const struct dp_proof *, uint64_t);
+int batch_send(const char *, struct data16 **, struct data64 **, const struct dp_tail *, size_t, uint16_t *);
+int batch_write(int, struct data16 **, struct data64 **, const struct dp_tail *, size_t, uint16_t *);
 void client_read(int);
+void *connection_handle(void *);
 void connection_log(const struct sockaddr_storage conn);
-void grim_reaper(void);
+ssize_t data_read(int, unsigned char *, size_t);
+int data_skip(int, uint64_t);
+int data_write(int, const unsigned char *, size_t);
+int delta_read(struct dp_conn *, const struct data16 *);
+int header_read(int, struct data16 **);
+int host_connect(const char *);
 void *in_addr_get(const struct sockaddr *);
-void parcel_read(int, const struct data16 *);
+int parcel_read(struct dp_conn *, const struct data16 *);
+int parcel_stream_read(struct dp_conn *, const struct data16 *);
+void parcel_delivered(void *, const struct dp_parcel *, struct dp_reqstatus);
+void parcel_submit(struct dp_conn *, struct dp_parcel *, const uuid_t);
+void parcel_verified(void *, int);
+int proof_check(const struct data16 *, uint16_t, const struct data64 *, const struct dp_proof *, EVP_PKEY *);
+int proof_read(int, uint64_t, struct data64 *, struct dp_proof *);
+int range_read(struct dp_conn *, const struct data16 *, const struct dp_proof *, uint64_t);
+int range_status_query(const char *, const struct dp_parcel *, uint16_t *);
+int ranges_send(int, const struct dp_parcel *, const struct dp_tail *, const unsigned char [], const struct dp_span *, uint32_t, EVP_PKEY *, uint16_t *);
+int resume_query(int, const uuid_t, uint16_t *, struct dp_span **, uint32_t *);
+int resume_read(struct dp_conn *, const struct data16 *);
+void retry_wait(int);
 void server_read(int);
-void sigchld_handle(int);
+int signature_required(const struct dp_parcel *);
+int signed_read(struct dp_conn *, const struct data16 *);
+void socket_close(int);
 int socket_is_local(const struct sockaddr *);
 int socket_setup(const char *);
+int socket_wait(int, int);
+void *stream_send(void *);
+int tail_write(int, const struct dp_tail *);
+int tree_read(struct dp_conn *, const struct data16 *, const struct dp_proof *, uint64_t);
 /**********************/
 
 
+/*
+ * Queues an acknowledgement on the connection.
+ */
+void ack_push(struct dp_conn *conn, const uuid_t uuid, uint16_t code)
+{
+	pthread_mutex_lock(&conn->lock);
+	
+	if (conn->ack_count == 0)
+		conn->time_first_ack = time_ms();
+	
+	uuid_copy(conn->acks[conn->ack_count].uuid, uuid);
+	conn->acks[conn->ack_count].code = code;
+	conn->ack_count++;
+	pthread_cond_broadcast(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/*
+ * Sends whatever acknowledgements are queued.
+ */
+void acks_flush(struct dp_conn *conn)
+{
+	struct dp_ack acks[DP_PROTO_HOST_ACK_MAX];
+	uint16_t ack_count;
+	
+	pthread_mutex_lock(&conn->lock);
+	ack_count = conn->ack_count;
+	memcpy(acks, conn->acks, ack_count * sizeof(*acks));
+	conn->ack_count = 0;
+	pthread_cond_broadcast(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+	
+	if (ack_count > 0)
+		acks_send(conn->sockfd, acks, ack_count);
+}
+
+/*
+ * Reads one acknowledgement message and marks the
+ * acknowledged parcels among the ones sent so far.
+ * Returns the number of newly acknowledged parcels,
+ * or -1 if the connection failed.
+ */
+int acks_read(int sockfd, struct data16 **heads, size_t sent, uint16_t *codes)
+{
+	struct data16 *head_data;
+	struct data64 ack_data;
+	struct dp_ack *acks;
+	uint16_t ack_count;
+	int acked;
+	
+	if (header_read(sockfd, &head_data) != 0)
+		return -1;
+	
+	acked = 0;
+	ack_data.len = parcel_size_get(head_data);
+	ack_data.bytes = (unsigned char *)malloc(ack_data.len);
+	
+	if (!ack_data.bytes ||
+	    data_read(sockfd, ack_data.bytes, ack_data.len) != ack_data.len) {
+		acked = -1;
+	} else if (parcel_type_get(head_data) == DP_PROTO_HOST_MSG_ACK &&
+		   ack_deserialise(&ack_data, &acks, &ack_count) == 0) {
+		for (int i = 0; i < ack_count; i++) {
+			for (size_t j = 0; j < sent; j++) {
+				uuid_t uuid;
+				
+				if (codes[j] != 0)
+					continue;
+				
+				parcel_uuid_get(heads[j], uuid);
+				
+				if (uuid_compare(uuid, acks[i].uuid) == 0) {
+					codes[j] = acks[i].code;
+					acked++;
+					break;
+				}
+			}
+		}
+		
+		free(acks);
+	}
+	
+	if (ack_data.bytes)
+		free(ack_data.bytes);
+	
+	free(head_data->bytes);
+	free(head_data);
+	
+	return acked;
+}
+
+int acks_send(int sockfd, const struct dp_ack *acks, uint16_t count)
+{
+	struct data16 *head_data;
+	struct data64 *ack_data;
+	int status;
+	
+	if (ack_serialise(acks, count, &head_data, &ack_data) != 0)
+		return 1;
+	
+	status = 0;
+	
+	if (data_write(sockfd, head_data->bytes, head_data->len) != 0 ||
+	    data_write(sockfd, ack_data->bytes, ack_data->len) != 0) {
+		trace_write(DP_TRACE_WARN, "acks_send(3), send(4): %s", strerror(errno));
+		status = -1;
+	}
+	
+	free(head_data->bytes);
+	free(head_data);
+	free(ack_data->bytes);
+	free(ack_data);
+	
+	return status;
+}
+
+/*
+ * Answers a sender that is about to send a newer version
+ * of a file with the signatures of the copy here, if
+ * there is one. Only a question signed by the sender's
+ * server is answered (see proof_check()); body_size is
+ * what follows the proof, if there is one.
+ * Returns -1 if the connection failed.
+ */
+int basis_read(struct dp_conn *conn, const struct data16 *head_data, const struct dp_proof *proof, uint64_t body_size)
+{
+	struct data16 *reply_head;
+	struct data64 basis_data;
+	struct data64 *reply_data;
+	struct dp_parcel *parcel;
+	struct dp_signature *signatures;
+	struct dp_reqstatus status;
+	EVP_PKEY *pkey;
+	uint64_t basis_size;
+	uint32_t block_len;
+	uint32_t count;
+	uuid_t uuid;
+	int result;
+	
+	basis_data.len = body_size;
+	parcel_uuid_get(head_data, uuid);
+	
+	if (basis_data.len > DP_PROTO_HOST_ENVELOPE_MAX) {
+		ack_push(conn, uuid, DP_REQERR_BADREQ.code);
+		return data_skip(conn->sockfd, basis_data.len);
+	}
+	
+	basis_data.bytes = (unsigned char *)malloc(basis_data.len ? basis_data.len : 1);
+	
+	if (data_read(conn->sockfd, basis_data.bytes, basis_data.len) != basis_data.len) {
+		free(basis_data.bytes);
+		return -1;
+	}
+	
+	status = basis_parse(head_data, &basis_data, &parcel);
+	
+	if (status.code == DP_REQOK.code) {
+		pkey = parcel_signer_key_get(parcel);
+		
+		if (proof_check(head_data, DP_PROTO_HOST_MSG_BASIS, &basis_data, proof, pkey) != 0) {
+			parcel_free(&parcel);
+			status = DP_REQERR_FORBIDDEN;
+		}
+		
+		if (pkey)
+			EVP_PKEY_free(pkey);
+	}
+	
+	free(basis_data.bytes);
+	
+	if (status.code != DP_REQOK.code) {
+		ack_push(conn, uuid, status.code);
+		return 0;
+	}
+	
+	/* Without a copy to work from, the sender is told so with no signatures. */
+	if (delta_signatures_get(parcel, &basis_size, &block_len, &signatures, &count) != 0) {
+		basis_size = 0;
+		block_len = 0;
+		count = 0;
+	}
+	
+	parcel_free(&parcel);
+	result = signatures_serialise(basis_size, block_len, signatures, count, &reply_head, &reply_data);
+	
+	if (signatures)
+		free(signatures);
+	
+	if (result != 0)
+		return -1;
+	
+	if (data_write(conn->sockfd, reply_head->bytes, reply_head->len) != 0 ||
+	    data_write(conn->sockfd, reply_data->bytes, reply_data->len) != 0) {
+		trace_write(DP_TRACE_WARN, "basis_read(2), send(4): %s", strerror(errno));
+		result = -1;
+	}
+	
+	free(reply_head->bytes);
+	free(reply_head);
+	free(reply_data->bytes);
+	free(reply_data);
+	
+	return result;
+}
+
+/*
+ * Sends the messages to the host over a single connection;
+ * see batch_write().
+ */
+int batch_send(const char *host, struct data16 **heads, struct data64 **bodies, const struct dp_tail *tails, size_t count, uint16_t *codes)
+{
+	int sockfd;
+	int status;
+	
+	if (!heads ||
+	    !bodies ||
+	    !codes)
+		return 1;
+	
+	memset(codes, 0, count * sizeof(*codes));
+	
+	if ((sockfd = host_connect(host)) == -1)
+		return 2;
+	
+	status = batch_write(sockfd, heads, bodies, tails, count, codes);
+	socket_close(sockfd);
+	
+	return status;
+}
+
+/*
+ * Sends the messages over the socket, keeping up to
+ * DP_PROTO_HOST_SEND_WINDOW of them in flight.
+ * If tails is given, each message's body is followed by
+ * the matching tail; see tail_write().
+ * The status code each message was acknowledged with is
+ * placed in codes, or 0 if it was never acknowledged.
+ */
+int batch_write(int sockfd, struct data16 **heads, struct data64 **bodies, const struct dp_tail *tails, size_t count, uint16_t *codes)
+{
+	size_t acked;
+	size_t in_flight;
+	size_t sent;
+	
+	memset(codes, 0, count * sizeof(*codes));
+	acked = 0;
+	in_flight = 0;
+	sent = 0;
+	
+	while (acked < count) {
+		int result;
+		
+		/* Fill the window. */
+		while (sent < count &&
+		       in_flight < DP_PROTO_HOST_SEND_WINDOW) {
+			if (data_write(sockfd, heads[sent]->bytes, heads[sent]->len) != 0 ||
+			    data_write(sockfd, bodies[sent]->bytes, bodies[sent]->len) != 0 ||
+			    (tails &&
+			     tail_write(sockfd, &tails[sent]) != 0)) {
+				trace_write(DP_TRACE_WARN, "batch_write(6), send(4): %s", strerror(errno));
+				return -1;
+			}
+			
+			sent++;
+			in_flight++;
+			
+			/*
+			 * Pick up any acknowledgements that already came in
+			 * so the window keeps sliding.
+			 */
+			if (socket_wait(sockfd, 0) > 0) {
+				if ((result = acks_read(sockfd, heads, sent, codes)) == -1)
+					break;
+				
+				acked += result;
+				in_flight -= result;
+			}
+		}
+		
+		/* Either the window is full or everything is out; wait for acknowledgements. */
+		if (socket_wait(sockfd, DP_PROTO_HOST_ACK_TIMEOUT * 1000) <= 0) {
+			trace_write(DP_TRACE_WARN, "batch_write: timed out waiting for acknowledgements");
+			break;
+		}
+		
+		if ((result = acks_read(sockfd, heads, sent, codes)) == -1)
+			break;
+		
+		acked += result;
+		in_flight -= result;
+	}
+	
+	if (acked != count)
+		return -1;
+	
+	return 0;
+}
+
 void client_read(int sockfd)
 {
 	char buffer[DP_PROTO_SERV_MAXREAD] = { 0 };
 	struct token *request;
 	ssize_t bytes_read;
+	size_t delim_len;
+	
+	bytes_read = 0;
+	delim_len = strlen(DP_PROTO_SERV_DELIM);
 	
-	if ((bytes_read = read(sockfd, buffer, DP_PROTO_SERV_MAXREAD)) == -1)
-		perror("read_client(1), read(3)");
+	/*
+	 * The request may arrive in pieces; it is read
+	 * until the double delimeter that ends it.
+	 */
+	while (bytes_read < DP_PROTO_SERV_MAXREAD) {
+		ssize_t len;
+		
+		if ((len = read(sockfd, buffer + bytes_read, DP_PROTO_SERV_MAXREAD - bytes_read)) <= 0) {
+			if (len == -1)
+				trace_write(DP_TRACE_WARN, "read_client(1), read(3): %s", strerror(errno));
+			
+			break;
+		}
+		
+		bytes_read += len;
+		
+		if (bytes_read >= delim_len * 2 &&
+		    memcmp(buffer + bytes_read - delim_len, DP_PROTO_SERV_DELIM, delim_len) == 0 &&
+		    memcmp(buffer + bytes_read - delim_len * 2, DP_PROTO_SERV_DELIM, delim_len) == 0)
+			break;
+	}
 	
 	/***********
 	 * PARSING
@@ -53,215 +468,1810 @@ void client_read(int sockfd)
 		client_request_parse(request);
 		request_free(&request);
 	} else {
-		printf("read_client: error parsing client request!\n");
+		trace_write(DP_TRACE_WARN, "read_client: error parsing client request!");
+		
+		if (valid_check(buffer) == 0)
+			trace_write(DP_TRACE_WARN, "Invalid request header.");
+	}
+}
+
+void *connection_handle(void *args)
+{
+	struct dp_conn_args *conn_args;
+	
+	conn_args = (struct dp_conn_args *)args;
+	
+	/*
+	 * Check if this is a connection from a local
+	 * service or a remote server.
+	 */
+	if (socket_is_local((struct sockaddr *)&conn_args->addr) == 0) {
+		client_read(conn_args->sockfd);
+	} else {
+		connection_log(conn_args->addr);
+		
+		if (tls_accept(conn_args->sockfd) != -1)
+			server_read(conn_args->sockfd);
+	}
+	
+	socket_close(conn_args->sockfd);
+	free(conn_args);
+	
+	return 0;
+}
+
+/*
+ * This function is too simple.
+ */
+void connection_log(const struct sockaddr_storage conn)
+{
+	char client_addr_str[INET6_ADDRSTRLEN];
+	
+	inet_ntop(conn.ss_family, in_addr_get((struct sockaddr *)&conn), client_addr_str, sizeof(client_addr_str));
+	trace_write(DP_TRACE_INFO, "LOG: connection from %s", client_addr_str);
+}
+
+/*
+ * Sends the parcels to the host over a single connection,
+ * keeping up to DP_PROTO_HOST_SEND_WINDOW of them in flight.
+ * If tails is given, each parcel's body is followed by
+ * the matching tail.
+ * The status code each parcel was acknowledged with is
+ * placed in codes, or 0 if it was never acknowledged.
+ */
+int data64_batch_send(const char *host, struct data16 **heads, struct data64 **bodies, const struct dp_tail *tails, size_t count, uint16_t *codes)
+{
+	return batch_send(host, heads, bodies, tails, count, codes);
+}
+
+/*
+ * Sends the parcel as a delta against the recipient's
+ * copy of the file. Returns 1 without sending anything
+ * if there is no copy or the delta would not save much,
+ * and also if the copy changed in the meantime; the
+ * parcel should then be sent in full. Otherwise, code
+ * is set to the status the parcel was acknowledged
+ * with, or 0 if it never was. The question for the copy
+ * and the delta are signed with pkey; the recipient
+ * does not answer unsigned questions, so none is asked
+ * without it.
+ */
+int data64_delta_send(const char *host, const struct dp_parcel *parcel, EVP_PKEY *pkey, uint16_t *code)
+{
+	unsigned char checksum[SHA256_DIGEST_LENGTH];
+	struct data16 *head_data;
+	struct data64 *body_data;
+	struct data64 *instructions;
+	struct data64 signatures_data;
+	struct dp_signature *signatures;
+	uint64_t basis_size;
+	uint64_t max;
+	uint32_t block_len;
+	uint32_t count;
+	int sockfd;
+	int status;
+	
+	if (!parcel ||
+	    !parcel->payload ||
+	    !code)
+		return -1;
+	
+	*code = 0;
+	
+	if (!pkey)
+		return 1;
+	
+	if (basis_serialise(parcel, &head_data, &body_data) != 0)
+		return -1;
+	
+	if (parcels_sign(&head_data, &body_data, NULL, 1, pkey) != 0) {
+		free(head_data->bytes);
+		free(head_data);
+		free(body_data->bytes);
+		free(body_data);
+		
+		return 1;
+	}
+	
+	if ((sockfd = host_connect(host)) == -1) {
+		free(head_data->bytes);
+		free(head_data);
+		free(body_data->bytes);
+		free(body_data);
+		
+		return -1;
+	}
+	
+	status = 0;
+	
+	if (data_write(sockfd, head_data->bytes, head_data->len) != 0 ||
+	    data_write(sockfd, body_data->bytes, body_data->len) != 0) {
+		trace_write(DP_TRACE_WARN, "data64_delta_send(3), send(4): %s", strerror(errno));
+		status = -1;
+	}
+	
+	free(head_data->bytes);
+	free(head_data);
+	free(body_data->bytes);
+	free(body_data);
+	
+	if (status != 0 ||
+	    socket_wait(sockfd, DP_PROTO_HOST_ACK_TIMEOUT * 1000) <= 0 ||
+	    header_read(sockfd, &head_data) != 0) {
+		socket_close(sockfd);
+		return -1;
+	}
+	
+	signatures_data.len = parcel_size_get(head_data);
+	
+	/* A host that does not know of delta transfers acknowledges the question with an error. */
+	if (parcel_type_get(head_data) != DP_PROTO_HOST_MSG_SIGNATURES ||
+	    signatures_data.len > DP_PROTO_HOST_SIGNATURES_HEAD_LEN + (uint64_t)DP_PROTO_HOST_SIGNATURES_MAX * DP_PROTO_HOST_SIGNATURE_LEN) {
+		free(head_data->bytes);
+		free(head_data);
+		socket_close(sockfd);
+		
+		return 1;
+	}
+	
+	free(head_data->bytes);
+	free(head_data);
+	signatures_data.bytes = (unsigned char *)malloc(signatures_data.len);
+	
+	if (data_read(sockfd, signatures_data.bytes, signatures_data.len) != signatures_data.len ||
+	    signatures_deserialise(&signatures_data, &basis_size, &block_len, &signatures, &count) != 0) {
+		free(signatures_data.bytes);
+		socket_close(sockfd);
+		
+		return -1;
+	}
+	
+	free(signatures_data.bytes);
+	
+	/*
+	 * Only worth it if it saves a quarter of the payload,
+	 * and the receiver reads it in one go.
+	 */
+	max = parcel->payload->len - parcel->payload->len / 4;
+	
+	if (max > DP_PROTO_HOST_RANGE_MIN)
+		max = DP_PROTO_HOST_RANGE_MIN;
+	
+	if (count == 0 ||
+	    delta_make(parcel->payload, block_len, signatures, count, max, &instructions) != 0) {
+		free(signatures);
+		socket_close(sockfd);
+		
+		return 1;
+	}
+	
+	free(signatures);
+	sha(parcel->payload->bytes, parcel->payload->len, checksum);
+	delta_serialise(parcel, checksum, basis_size, block_len, instructions, &head_data, &body_data);
+	free(instructions->bytes);
+	free(instructions);
+	
+	trace_write(DP_TRACE_INFO, "%s: sending %lu byte(s) of delta instead of %lu", parcel->raw_filename, body_data->len, parcel->payload->len);
+	
+	if (parcels_sign(&head_data, &body_data, NULL, 1, pkey) != 0)
+		trace_write(DP_TRACE_WARN, "%s: unable to sign the delta", parcel->raw_filename);
+	
+	status = batch_write(sockfd, &head_data, &body_data, NULL, 1, code);
+	socket_close(sockfd);
+	
+	free(head_data->bytes);
+	free(head_data);
+	free(body_data->bytes);
+	free(body_data);
+	
+	if (*code == DP_REQERR_CONFLICT.code) {
+		*code = 0;
+		return 1;
+	}
+	
+	return status;
+}
+
+/*
+ * Sends a large parcel as byte ranges spread over the
+ * given number of connections. The range bytes go out
+ * straight from the payload, sealed on the way if tail
+ * says so; the tail covers the whole payload as it goes
+ * out. A connection that breaks
+ * is re-established and picks up from the bytes the
+ * receiver is still missing. The ranges are signed with
+ * pkey, if given. code is set to the status the parcel
+ * was acknowledged with, or 0 if it never was.
+ */
+int data64_range_send(const char *host, const struct dp_parcel *parcel, const struct dp_tail *tail, EVP_PKEY *pkey, int streams, uint16_t *code)
+{
+	unsigned char checksum[SHA256_DIGEST_LENGTH];
+	struct dp_stream *stream_args;
+	uint64_t count;
+	uint64_t per_stream;
+	int result;
+	int status;
+	
+	if (!parcel ||
+	    !tail ||
+	    !code ||
+	    streams < 1)
+		return 1;
+	
+	*code = 0;
+	
+	/* The receiver checks the reassembled payload against this. */
+	if (sha_tail(tail, checksum) != 0)
+		return -1;
+	
+	count = (tail->len + DP_PROTO_HOST_RANGE_LEN - 1) / DP_PROTO_HOST_RANGE_LEN;
+	
+	if (count == 0)
+		count = 1;
+	
+	if (streams > count)
+		streams = (int)count;
+	
+	stream_args = (struct dp_stream *)calloc(streams, sizeof(*stream_args));
+	status = 0;
+	
+	/*
+	 * Consecutive ranges go over the same connection, so
+	 * each one writes a contiguous part of the file.
+	 */
+	per_stream = (count + streams - 1) / streams * DP_PROTO_HOST_RANGE_LEN;
+	
+	for (int i = 0; i < streams; i++) {
+		stream_args[i].checksum = checksum;
+		stream_args[i].host = host;
+		stream_args[i].parcel = parcel;
+		stream_args[i].tail = tail;
+		stream_args[i].pkey = pkey;
+		stream_args[i].start = i * per_stream < tail->len ? i * per_stream : tail->len;
+		stream_args[i].end = stream_args[i].start + per_stream < tail->len ? stream_args[i].start + per_stream : tail->len;
+		
+		if ((result = pthread_create(&stream_args[i].thread, NULL, stream_send, &stream_args[i])) == 0)
+			stream_args[i].started = 1;
+		else
+			trace_write(DP_TRACE_ERROR, "data64_range_send(4), pthread_create(4): %s", strerror(result));
+	}
+	
+	for (int i = 0; i < streams; i++) {
+		if (stream_args[i].started)
+			pthread_join(stream_args[i].thread, NULL);
+	}
+	
+	/*
+	 * Every share but the one that completed the parcel
+	 * ends with DP_REQACCEPTED; the odd one out carries
+	 * the parcel's status.
+	 */
+	for (int i = 0; i < streams; i++) {
+		if (stream_args[i].code == 0) {
+			*code = 0;
+			status = -1;
+			break;
+		}
+		
+		if (stream_args[i].code != DP_REQACCEPTED.code)
+			*code = stream_args[i].code;
+	}
+	
+	/*
+	 * If the acknowledgement of the range that completed
+	 * the parcel got lost, ask for the parcel's status.
+	 */
+	if (status == 0 &&
+	    *code == 0 &&
+	    range_status_query(host, parcel, code) != 0)
+		status = -1;
+	
+	free(stream_args);
+	
+	return status;
+}
+
+int data64_send(const char *host, const struct data16 *head, const struct data64 *body)
+{
+	uint16_t code;
+	
+	return data64_batch_send(host, (struct data16 **)&head, (struct data64 **)&body, NULL, 1, &code);
+}
+
+/*
+ * Asks the host for the entries of several directories
+ * over one connection, keeping up to
+ * DP_PROTO_HOST_SEND_WINDOW questions in flight; see
+ * sync.c. The answers are placed in replies, in the same
+ * order, as message bodies; those that never came are
+ * left NULL. Returns -1 if not every one came.
+ * It is the caller's responsibility to free the
+ * returned pointers.
+ */
+int data64_tree_query(const char *host, struct data16 **heads, struct data64 **bodies, size_t count, struct data64 **replies)
+{
+	struct data16 *head_data;
+	size_t received;
+	size_t sent;
+	uint64_t size;
+	int sockfd;
+	int status;
+	
+	if (!heads ||
+	    !bodies ||
+	    !replies)
+		return 1;
+	
+	memset(replies, 0, count * sizeof(*replies));
+	
+	if ((sockfd = host_connect(host)) == -1)
+		return -1;
+	
+	received = 0;
+	sent = 0;
+	status = 0;
+	
+	while (received < count) {
+		while (sent < count &&
+		       sent - received < (size_t)DP_PROTO_HOST_SEND_WINDOW) {
+			if (data_write(sockfd, heads[sent]->bytes, heads[sent]->len) != 0 ||
+			    data_write(sockfd, bodies[sent]->bytes, bodies[sent]->len) != 0) {
+				trace_write(DP_TRACE_WARN, "data64_tree_query(5), send(4): %s", strerror(errno));
+				status = -1;
+				break;
+			}
+			
+			sent++;
+		}
+		
+		if (status != 0 ||
+		    socket_wait(sockfd, DP_PROTO_HOST_ACK_TIMEOUT * 1000) <= 0 ||
+		    header_read(sockfd, &head_data) != 0) {
+			status = -1;
+			break;
+		}
+		
+		size = parcel_size_get(head_data);
+		
+		/* A host that does not know of syncing acknowledges the question with an error. */
+		if (parcel_type_get(head_data) != DP_PROTO_HOST_MSG_ENTRIES ||
+		    size > DP_PROTO_HOST_ENTRIES_HEAD_LEN + (uint64_t)DP_PROTO_HOST_ENTRIES_MAX * (DP_PROTO_HOST_ENTRY_LEN + NAME_MAX + 1)) {
+			free(head_data->bytes);
+			free(head_data);
+			status = -1;
+			break;
+		}
+		
+		free(head_data->bytes);
+		free(head_data);
+		replies[received] = (struct data64 *)malloc(sizeof(**replies));
+		replies[received]->bytes = (unsigned char *)malloc(size ? size : 1);
+		replies[received]->len = size;
+		
+		if (data_read(sockfd, replies[received]->bytes, size) != size) {
+			free(replies[received]->bytes);
+			free(replies[received]);
+			replies[received] = NULL;
+			status = -1;
+			break;
+		}
+		
+		received++;
+	}
+	
+	socket_close(sockfd);
+	
+	return status;
+}
+
+/*
+ * Keeps reading until len bytes are read or the
+ * connection is closed. Returns the number of
+ * bytes read or -1 on error.
+ */
+ssize_t data_read(int sockfd, unsigned char *buffer, size_t len)
+{
+	SSL *ssl;
+	size_t total;
+	
+	ssl = tls_get(sockfd);
+	total = 0;
+	
+	while (total < len) {
+		ssize_t bytes_read;
+		
+		if (ssl)
+			bytes_read = tls_read(ssl, buffer + total, len - total);
+		else
+			bytes_read = read(sockfd, buffer + total, len - total);
+		
+		if (bytes_read == -1) {
+			if (errno == EINTR)
+				continue;
+			
+			return -1;
+		} else if (bytes_read == 0) {
+			break;
+		}
+		
+		total += bytes_read;
+	}
+	
+	return total;
+}
+
+/*
+ * Reads and throws away len bytes.
+ */
+int data_skip(int sockfd, uint64_t len)
+{
+	unsigned char buffer[8192];
+	
+	while (len > 0) {
+		ssize_t bytes_read;
+		size_t chunk;
+		
+		chunk = len < sizeof(buffer) ? len : sizeof(buffer);
+		
+		if ((bytes_read = data_read(sockfd, buffer, chunk)) != chunk)
+			return -1;
+		
+		len -= bytes_read;
+	}
+	
+	return 0;
+}
+
+/*
+ * Keeps sending until all len bytes are out.
+ */
+int data_write(int sockfd, const unsigned char *buffer, size_t len)
+{
+	SSL *ssl;
+	size_t total;
+	
+	ssl = tls_get(sockfd);
+	total = 0;
+	
+	while (total < len) {
+		ssize_t bytes_sent;
+		
+		if (ssl)
+			bytes_sent = tls_write(ssl, buffer + total, len - total);
+		else
+			bytes_sent = send(sockfd, buffer + total, len - total, 0);
+		
+		if (bytes_sent == -1) {
+			if (errno == EINTR)
+				continue;
+			
+			return -1;
+		}
+		
+		total += bytes_sent;
+	}
+	
+	return 0;
+}
+
+/*
+ * Reads a delta message and rebuilds the parcel out of
+ * the copy of the file here before handing it over for
+ * delivery.
+ * Returns -1 if the connection failed.
+ */
+int delta_read(struct dp_conn *conn, const struct data16 *head_data)
+{
+	struct data64 delta_data;
+	struct dp_delta *delta;
+	struct dp_parcel *parcel;
+	struct dp_reqstatus status;
+	uuid_t uuid;
+	
+	delta_data.len = parcel_size_get(head_data);
+	parcel_uuid_get(head_data, uuid);
+	
+	if (delta_data.len > DP_PROTO_HOST_RANGE_MIN + DP_PROTO_HOST_DELTA_HEAD_LEN + DP_PROTO_HOST_ENVELOPE_MAX) {
+		ack_push(conn, uuid, DP_REQERR_BADREQ.code);
+		return data_skip(conn->sockfd, delta_data.len);
+	}
+	
+	/* The parcel was already delivered; this is a retry. */
+	if (dedup_check(uuid) == 1) {
+		ack_push(conn, uuid, DP_REQOK.code);
+		return data_skip(conn->sockfd, delta_data.len);
+	}
+	
+	delta_data.bytes = (unsigned char *)malloc(delta_data.len ? delta_data.len : 1);
+	
+	if (data_read(conn->sockfd, delta_data.bytes, delta_data.len) != delta_data.len) {
+		free(delta_data.bytes);
+		return -1;
+	}
+	
+	status = delta_parse(head_data, &delta_data, &delta);
+	
+	if (status.code == DP_REQOK.code) {
+		status = delta_patch(delta, &parcel);
+		delta_free(&delta);
+	}
+	
+	free(delta_data.bytes);
+	
+	if (status.code == DP_REQOK.code &&
+	    signature_required(parcel)) {
+		parcel_free(&parcel);
+		status = DP_REQERR_FORBIDDEN;
+	}
+	
+	if (status.code == DP_REQOK.code)
+		parcel_submit(conn, parcel, uuid);
+	else
+		ack_push(conn, uuid, status.code);
+	
+	return 0;
+}
+
+/*
+ * Reads a fixed-size header off the socket.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int header_read(int sockfd, struct data16 **out)
+{
+	*out = (struct data16 *)malloc(sizeof(**out));
+	(*out)->bytes = (unsigned char *)calloc(DP_PROTO_HOST_HEAD_LEN, sizeof(unsigned char));
+	(*out)->len = DP_PROTO_HOST_HEAD_LEN;
+	
+	if (data_read(sockfd, (*out)->bytes, DP_PROTO_HOST_HEAD_LEN) != DP_PROTO_HOST_HEAD_LEN ||
+	    memcmp((*out)->bytes, DP_PROTO_HOST_MAGIC_NUM, DP_PROTO_HOST_MAGIC_NUM_LEN) != 0 ||
+	    parcel_version_get(*out) != DP_PROTO_HOST_VER) {
+		free((*out)->bytes);
+		free(*out);
+		*out = NULL;
+		
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Returns a socket connected to the host or -1.
+ */
+int host_connect(const char *host)
+{
+	struct addrinfo *info;
+	struct addrinfo *p_info;
+	struct addrinfo hints;
+	char addr_str[INET6_ADDRSTRLEN];
+	char port_str[12];
+	int addr_result;
+	int port;
+	int sockfd;
+	
+	sockfd = -1;
+	
+	if ((port = config_port_get(host)) > 0)
+		snprintf(port_str, sizeof(port_str), "%d", port);
+	else
+		snprintf(port_str, sizeof(port_str), "%s", DP_PORT);
+	
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	
+	if ((addr_result = getaddrinfo(host, port_str, &hints, &info)) != 0) {
+		trace_write(DP_TRACE_ERROR, "getaddrinfo: %s", gai_strerror(addr_result));
+		return -1;
+	}
+	
+	// Loop through all the results and connect to the first we can.
+	for (p_info = info; p_info != NULL; p_info = p_info->ai_next) {
+		if ((sockfd = socket(p_info->ai_family, p_info->ai_socktype, p_info->ai_protocol)) == -1) {
+			trace_write(DP_TRACE_WARN, "host_connect(1), socket(3): %s", strerror(errno));
+			continue;
+		}
+		
+		inet_ntop(p_info->ai_family, in_addr_get((struct sockaddr *)p_info->ai_addr), addr_str, sizeof(addr_str));
+		trace_write(DP_TRACE_INFO, "Connecting to host %s", addr_str);
+		
+		if ( connect(sockfd, p_info->ai_addr, p_info->ai_addrlen) == -1) {
+			trace_write(DP_TRACE_WARN, "Unable to connect to host %s: %s", addr_str, strerror(errno));
+			close(sockfd);
+			continue;
+		}
+		
+		break;
+	}
+	
+	freeaddrinfo(info);
+	
+	if (!p_info) {
+		trace_write(DP_TRACE_ERROR, "host_connect: failed to connect");
+		return -1;
+	}
+	
+	if (config_tls_get(host) == 1 &&
+	    tls_connect(sockfd, host) != 0) {
+		close(sockfd);
+		trace_write(DP_TRACE_ERROR, "host_connect: TLS handshake failed");
+		
+		return -1;
+	}
+	
+	return sockfd;
+}
+
+void *in_addr_get(const struct sockaddr *sockaddr)
+{
+	if (sockaddr->sa_family == AF_INET)
+		return &(((struct sockaddr_in *)sockaddr)->sin_addr);
+	
+	return &(((struct sockaddr_in6 *)sockaddr)->sin6_addr);
+}
+
+/*
+ * This function can be used to spawn a thread,
+ * hence the pointer return.
+ *
+ * See also: stop_listening (1).
+ */
+void *listen_start(const int sockfd)
+{
+	struct sockaddr_storage client_addr;
+	pthread_attr_t thread_attr;
+	socklen_t sin_size;
+	
+	sin_size = sizeof(client_addr);
+	
+	/* Each connection gets its own thread, which nobody waits on. */
+	pthread_attr_init(&thread_attr);
+	pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+	
+	if (listen(sockfd, SOMAXCONN) == -1) {
+		trace_write(DP_TRACE_ERROR, "start_listening(1), listen(2): %s", strerror(errno));
+		exit(1);
+	}
+	
+	trace_write(DP_TRACE_INFO, "Server now listening.");
+	
+	while (1) {
+		struct dp_conn_args *conn_args;
+		pthread_t thread;
+		int new_fd;
+		int result;
+		
+		sin_size = sizeof(client_addr);
+		new_fd = accept(sockfd, (struct sockaddr *)&client_addr, &sin_size);
+		
+		if (new_fd == -1) {
+			trace_write(DP_TRACE_ERROR, "start_listening(1), accept(3): %s", strerror(errno));
+			continue;
+		}
+		
+		conn_args = (struct dp_conn_args *)malloc(sizeof(*conn_args));
+		conn_args->addr = client_addr;
+		conn_args->sockfd = new_fd;
+		
+		if ((result = pthread_create(&thread, &thread_attr, connection_handle, conn_args)) != 0) {
+			trace_write(DP_TRACE_ERROR, "start_listening(1), pthread_create(4): %s", strerror(result));
+			close(new_fd);
+			free(conn_args);
+		}
+	}
+	
+	pthread_attr_destroy(&thread_attr);
+	
+	return 0;
+}
+
+/*
+ * See also: start_listening (1).
+ */
+void listen_stop(const int sockfd)
+{
+	shutdown(sockfd, SHUT_RDWR);
+	close(sockfd);
+}
+
+/*
+ * Reads the message body that follows the header and
+ * hands it over for delivery; the acknowledgement is
+ * queued on the connection once it is delivered.
+ * Returns -1 if the connection failed.
+ */
+int parcel_read(struct dp_conn *conn, const struct data16 *head_data)
+{
+	struct data64 *parcel_data;
+	struct dp_parcel *parcel;
+	struct dp_reqstatus status;
+	uint64_t parcel_size;
+	uuid_t uuid;
+	
+	if (parcel_type_get(head_data) == DP_PROTO_HOST_MSG_RANGE)
+		return range_read(conn, head_data, NULL, parcel_size_get(head_data));
+	else if (parcel_type_get(head_data) == DP_PROTO_HOST_MSG_RESUME)
+		return resume_read(conn, head_data);
+	else if (parcel_type_get(head_data) == DP_PROTO_HOST_MSG_BASIS)
+		return basis_read(conn, head_data, NULL, parcel_size_get(head_data));
+	else if (parcel_type_get(head_data) == DP_PROTO_HOST_MSG_DELTA)
+		return delta_read(conn, head_data);
+	else if (parcel_type_get(head_data) == DP_PROTO_HOST_MSG_SIGNED)
+		return signed_read(conn, head_data);
+	else if (parcel_type_get(head_data) == DP_PROTO_HOST_MSG_TREE)
+		return tree_read(conn, head_data, NULL, parcel_size_get(head_data));
+	
+	parcel_size = parcel_size_get(head_data);
+	parcel_uuid_get(head_data, uuid);
+	
+	/*
+	 * A retried parcel that was already delivered gets
+	 * acknowledged again without being read into memory.
+	 */
+	if (parcel_type_get(head_data) == DP_PROTO_HOST_MSG_PARCEL &&
+	    dedup_check(uuid) == 1) {
+		ack_push(conn, uuid, DP_REQOK.code);
+		
+		return data_skip(conn->sockfd, parcel_size);
+	}
+	
+	if ((parcel_type_get(head_data) == DP_PROTO_HOST_MSG_PARCEL ||
+	     parcel_type_get(head_data) == DP_PROTO_HOST_MSG_SYNCED) &&
+	    parcel_size >= DP_PROTO_HOST_STREAM_MIN)
+		return parcel_stream_read(conn, head_data);
+	
+	parcel_data = (struct data64 *)malloc(sizeof(*parcel_data));
+	parcel_data->bytes = (unsigned char *)calloc(parcel_size, sizeof(unsigned char));
+	parcel_data->len = parcel_size;
+	
+	if (!parcel_data->bytes ||
+	    data_read(conn->sockfd, parcel_data->bytes, parcel_size) != parcel_size) {
+		trace_write(DP_TRACE_WARN, "parcel_read(3), read(3): %s", strerror(errno));
+		
+		if (parcel_data->bytes)
+			free(parcel_data->bytes);
+		
+		free(parcel_data);
+		
+		return -1;
+	}
+	
+	/***********
+	 * PARSING
+	 ***********/
+	if (parcel_type_get(head_data) == DP_PROTO_HOST_MSG_PARCEL ||
+	    parcel_type_get(head_data) == DP_PROTO_HOST_MSG_SYNCED) {
+		status = parcel_parse(head_data, parcel_data, &parcel);
+		
+		if (status.code == DP_REQOK.code &&
+		    signature_required(parcel)) {
+			parcel_free(&parcel);
+			status = DP_REQERR_FORBIDDEN;
+		}
+		
+		if (status.code == DP_REQOK.code) {
+			parcel_submit(conn, parcel, uuid);
+		} else {
+			ack_push(conn, uuid, status.code);
+		}
+	} else {
+		ack_push(conn, uuid, DP_REQERR_BADREQ.code);
+	}
+	
+	free(parcel_data->bytes);
+	free(parcel_data);
+	
+	return 0;
+}
+
+/*
+ * Called by an order worker once a parcel read off
+ * the connection is delivered.
+ */
+void parcel_delivered(void *context, const struct dp_parcel *parcel, struct dp_reqstatus status)
+{
+	struct dp_conn *conn;
+	struct dp_receipt *receipt;
+	
+	receipt = (struct dp_receipt *)context;
+	conn = receipt->conn;
+	ack_push(conn, receipt->uuid, status.code);
+	free(receipt);
+	
+	/* A received payload that did not make it into place is of no use. */
+	if (parcel->payload_file &&
+	    status.code != DP_REQOK.code)
+		unlink(parcel->payload_file);
+	
+	pthread_mutex_lock(&conn->lock);
+	conn->outstanding--;
+	pthread_cond_broadcast(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/*
+ * Reads a parcel too large to be held in memory, moving
+ * its payload from the socket straight into an unnamed
+ * file in the directory it is delivered to. Delivery
+ * then only gives the file its name, so the file never
+ * shows up half written.
+ * Returns -1 if the connection failed.
+ */
+int parcel_stream_read(struct dp_conn *conn, const struct data16 *head_data)
+{
+	unsigned char buffer[DP_TRANSFER_BUF_LEN];
+	struct data64 envelope_data;
+	struct dp_parcel *parcel;
+	struct path *path_dir;
+	struct dp_reqstatus status;
+	uint64_t end;
+	uint64_t parcel_size;
+	uint64_t pos;
+	uint64_t size;
+	uuid_t uuid;
+	int fd;
+	int result;
+	
+	parcel_size = parcel_size_get(head_data);
+	parcel_uuid_get(head_data, uuid);
+	
+	/* The envelope is somewhere in the first bytes, along with the start of the payload. */
+	envelope_data.bytes = buffer;
+	envelope_data.len = parcel_size < DP_TRANSFER_BUF_LEN ? parcel_size : DP_TRANSFER_BUF_LEN;
+	
+	if (data_read(conn->sockfd, envelope_data.bytes, envelope_data.len) != envelope_data.len) {
+		trace_write(DP_TRACE_WARN, "parcel_stream_read(2), read(3): %s", strerror(errno));
+		return -1;
+	}
+	
+	status = envelope_parse(head_data, &envelope_data, &parcel, &size, &end);
+	
+	if (status.code == DP_REQOK.code &&
+	    end + size > parcel_size) {
+		parcel_free(&parcel);
+		status = DP_REQERR_BADREQ;
+	}
+	
+	if (status.code == DP_REQOK.code &&
+	    signature_required(parcel)) {
+		parcel_free(&parcel);
+		status = DP_REQERR_FORBIDDEN;
+	}
+	
+	if (status.code != DP_REQOK.code) {
+		ack_push(conn, uuid, status.code);
+		return data_skip(conn->sockfd, parcel_size - envelope_data.len);
+	}
+	
+	fd = -1;
+	
+	if ((status = parcel_path_get(parcel, 1, &path_dir)).code == DP_REQOK.code) {
+		path_pop(&path_dir);
+		
+		if ((fd = tmpfile_open(path_dir, size, &parcel->payload_file)) == -1)
+			status = DP_REQERR_INTERNAL;
+		
+		path_free(&path_dir);
+	}
+	
+	if (status.code != DP_REQOK.code) {
+		ack_push(conn, uuid, status.code);
+		parcel_free(&parcel);
+		
+		return data_skip(conn->sockfd, parcel_size - envelope_data.len);
+	}
+	
+	/* Whatever of the payload came along with the envelope. */
+	pos = envelope_data.len - end < size ? envelope_data.len - end : size;
+	result = tmpfile_write(fd, 0, &buffer[end], pos);
+	
+	while (pos < size) {
+		size_t chunk;
+		
+		chunk = size - pos < DP_TRANSFER_BUF_LEN ? (size_t)(size - pos) : DP_TRANSFER_BUF_LEN;
+		
+		if (data_read(conn->sockfd, buffer, chunk) != chunk) {
+			trace_write(DP_TRACE_WARN, "parcel_stream_read(2), read(3): %s", strerror(errno));
+			close(fd);
+			
+			if (parcel->payload_file)
+				unlink(parcel->payload_file);
+			
+			parcel_free(&parcel);
+			
+			return -1;
+		}
+		
+		/* Once a write fails, the rest of the payload is only drained. */
+		if (result == 0)
+			result = tmpfile_write(fd, pos, buffer, chunk);
+		
+		pos += chunk;
+	}
+	
+	/* Nothing is meant to follow the payload. */
+	if (data_skip(conn->sockfd, parcel_size - (end + size > envelope_data.len ? end + size : envelope_data.len)) != 0) {
+		close(fd);
+		
+		if (parcel->payload_file)
+			unlink(parcel->payload_file);
+		
+		parcel_free(&parcel);
+		
+		return -1;
+	}
+	
+	if (result != 0) {
+		ack_push(conn, uuid, DP_REQERR_INTERNAL.code);
+		close(fd);
+		
+		if (parcel->payload_file)
+			unlink(parcel->payload_file);
+		
+		parcel_free(&parcel);
+		
+		return 0;
+	}
+	
+	/* A named file is moved into place rather than linked. */
+	if (parcel->payload_file)
+		close(fd);
+	else
+		parcel->payload_fd = fd;
+	
+	parcel_submit(conn, parcel, uuid);
+	
+	return 0;
+}
+
+/*
+ * Hands the parcel over for delivery; it will be
+ * acknowledged with the given message UUID. A copy
+ * that another connection already delivered (or is
+ * delivering, and then does) is dropped.
+ */
+void parcel_submit(struct dp_conn *conn, struct dp_parcel *parcel, const uuid_t uuid)
+{
+	struct dp_receipt *receipt;
+	
+	if (dedup_reserve(parcel->head.uuid) == 1) {
+		ack_push(conn, uuid, DP_REQOK.code);
+		
+		if (parcel->payload_file)
+			unlink(parcel->payload_file);
+		
+		parcel_free(&parcel);
+		
+		return;
+	}
+	
+	receipt = (struct dp_receipt *)malloc(sizeof(*receipt));
+	receipt->conn = conn;
+	receipt->parcel = NULL;
+	uuid_copy(receipt->uuid, uuid);
+	
+	pthread_mutex_lock(&conn->lock);
+	conn->outstanding++;
+	pthread_mutex_unlock(&conn->lock);
+	
+	order_submit(parcel, parcel_delivered, receipt);
+}
+
+/*
+ * Called once the signature over a parcel's batch is
+ * checked; the parcel has been counted as outstanding
+ * since it was read.
+ */
+void parcel_verified(void *context, int result)
+{
+	struct dp_conn *conn;
+	struct dp_receipt *receipt;
+	
+	receipt = (struct dp_receipt *)context;
+	conn = receipt->conn;
+	
+	if (result == 0) {
+		order_submit(receipt->parcel, parcel_delivered, receipt);
+		return;
+	}
+	
+	ack_push(conn, receipt->uuid, DP_REQERR_FORBIDDEN.code);
+	dedup_release(receipt->parcel->head.uuid, 0);
+	parcel_free(&receipt->parcel);
+	free(receipt);
+	
+	pthread_mutex_lock(&conn->lock);
+	conn->outstanding--;
+	pthread_cond_broadcast(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/*
+ * Returns 0 if the proof shows the message to be part
+ * of a batch signed with pkey; body is the message's as
+ * it was before it was signed. Unlike signed parcels,
+ * which are checked on a crypto worker, this blocks
+ * until the check is done; see merkle_verify_wait().
+ */
+int proof_check(const struct data16 *head_data, uint16_t type, const struct data64 *body, const struct dp_proof *proof, EVP_PKEY *pkey)
+{
+	unsigned char leaf[SHA256_DIGEST_LENGTH];
+	unsigned char root[SHA256_DIGEST_LENGTH];
+	struct dp_parcel_head head;
+	
+	if (!proof ||
+	    !pkey)
+		return -1;
+	
+	header_deserialise(head_data, &head);
+	head.type = type;
+	merkle_leaf_get(&head, body, NULL, leaf);
+	
+	if (merkle_root_get(leaf, proof, root) != 0)
+		return -1;
+	
+	return merkle_verify_wait(root, proof, pkey);
+}
+
+/*
+ * Reads the proof that a signed message starts with,
+ * which takes up at most len bytes, into proof_data;
+ * the proof's signature points into it.
+ * Returns 1 if the proof is malformed, with proof_data
+ * left empty but its length set to the bytes read, and
+ * -1 if the connection failed.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int proof_read(int sockfd, uint64_t len, struct data64 *proof_data, struct dp_proof *proof)
+{
+	unsigned char buffer[sizeof(uint16_t)];
+	uint64_t end;
+	uint64_t fixed;
+	uint16_t signature_len;
+	uint8_t depth;
+	
+	proof_data->bytes = NULL;
+	proof_data->len = 0;
+	
+	if (len < sizeof(buffer))
+		return 1;
+	
+	if (data_read(sockfd, buffer, sizeof(buffer)) != sizeof(buffer))
+		return -1;
+	
+	/* See proof_serialise(). */
+	signature_len = buffer[1] | ( (uint16_t)buffer[0] << 8 );
+	fixed = sizeof(uint16_t) + signature_len + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t);
+	proof_data->len = sizeof(buffer);
+	
+	if (fixed > len)
+		return 1;
+	
+	proof_data->bytes = (unsigned char *)malloc(fixed + DP_PROTO_HOST_PROOF_MAX * SHA256_DIGEST_LENGTH);
+	memcpy(proof_data->bytes, buffer, sizeof(buffer));
+	
+	if (data_read(sockfd, &proof_data->bytes[sizeof(buffer)], fixed - sizeof(buffer)) != fixed - sizeof(buffer)) {
+		free(proof_data->bytes);
+		proof_data->bytes = NULL;
+		
+		return -1;
+	}
+	
+	proof_data->len = fixed;
+	depth = proof_data->bytes[fixed - 1];
+	
+	if (depth > DP_PROTO_HOST_PROOF_MAX ||
+	    fixed + (uint64_t)depth * SHA256_DIGEST_LENGTH > len) {
+		free(proof_data->bytes);
+		proof_data->bytes = NULL;
+		
+		return 1;
+	}
+	
+	if (data_read(sockfd, &proof_data->bytes[fixed], depth * SHA256_DIGEST_LENGTH) != depth * SHA256_DIGEST_LENGTH) {
+		free(proof_data->bytes);
+		proof_data->bytes = NULL;
+		
+		return -1;
+	}
+	
+	proof_data->len = fixed + depth * SHA256_DIGEST_LENGTH;
+	
+	if (proof_deserialise(proof_data, proof, &end) != 0 ||
+	    end != proof_data->len) {
+		free(proof_data->bytes);
+		proof_data->bytes = NULL;
+		
+		return 1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Reads a range message, moving its range bytes from
+ * the socket straight into the transfer's staging file.
+ * The range that completes the parcel hands it over for
+ * delivery; the others are acknowledged right away with
+ * DP_REQACCEPTED. If the connection breaks halfway, the
+ * bytes that did arrive are kept.
+ * A range whose sender's key is on file has to come
+ * with proof, which is checked before any of its bytes
+ * are taken; body_size is what follows the proof, or
+ * the whole message if there is none.
+ * Returns -1 if the connection failed.
+ */
+int range_read(struct dp_conn *conn, const struct data16 *head_data, const struct dp_proof *proof, uint64_t body_size)
+{
+	unsigned char buffer[DP_TRANSFER_BUF_LEN];
+	struct data64 range_data;
+	struct dp_parcel *parcel;
+	struct dp_range *range;
+	struct dp_reqstatus status;
+	struct dp_transfer *transfer;
+	EVP_PKEY *pkey;
+	uint64_t len;
+	uint64_t offset;
+	uint64_t pos;
+	uint32_t envelope_size;
+	uuid_t uuid;
+	int result;
+	
+	parcel_uuid_get(head_data, uuid);
+	
+	if (body_size < DP_PROTO_HOST_RANGE_HEAD_LEN) {
+		ack_push(conn, uuid, DP_REQERR_BADREQ.code);
+		return data_skip(conn->sockfd, body_size);
+	}
+	
+	if (data_read(conn->sockfd, buffer, DP_PROTO_HOST_RANGE_HEAD_LEN) != DP_PROTO_HOST_RANGE_HEAD_LEN)
+		return -1;
+	
+	range_data.bytes = buffer;
+	range_data.len = DP_PROTO_HOST_RANGE_HEAD_LEN;
+	envelope_size = range_envelope_size_get(&range_data);
+	
+	if (envelope_size > DP_PROTO_HOST_ENVELOPE_MAX ||
+	    DP_PROTO_HOST_RANGE_HEAD_LEN + envelope_size > body_size) {
+		ack_push(conn, uuid, DP_REQERR_BADREQ.code);
+		return data_skip(conn->sockfd, body_size - DP_PROTO_HOST_RANGE_HEAD_LEN);
+	}
+	
+	range_data.len = DP_PROTO_HOST_RANGE_HEAD_LEN + envelope_size;
+	range_data.bytes = (unsigned char *)malloc(range_data.len);
+	memcpy(range_data.bytes, buffer, DP_PROTO_HOST_RANGE_HEAD_LEN);
+	
+	if (data_read(conn->sockfd, range_data.bytes + DP_PROTO_HOST_RANGE_HEAD_LEN, envelope_size) != envelope_size) {
+		free(range_data.bytes);
+		return -1;
+	}
+	
+	status = range_parse(head_data, &range_data, &range);
+	len = body_size - range_data.len;
+	
+	if (status.code == DP_REQOK.code &&
+	    (pkey = parcel_signer_key_get(range->parcel))) {
+		if (proof_check(head_data, DP_PROTO_HOST_MSG_RANGE, &range_data, proof, pkey) != 0) {
+			range_free(&range);
+			status = DP_REQERR_FORBIDDEN;
+		}
+		
+		EVP_PKEY_free(pkey);
+	}
+	
+	free(range_data.bytes);
+	
+	if (status.code != DP_REQOK.code) {
+		ack_push(conn, uuid, status.code);
+		return data_skip(conn->sockfd, len);
+	}
+	
+	/* The parcel was already delivered; this is a retry. */
+	if (dedup_check(range->parcel->head.uuid) == 1) {
+		ack_push(conn, uuid, DP_REQOK.code);
+		range_free(&range);
+		
+		return data_skip(conn->sockfd, len);
+	}
+	
+	offset = range->offset;
+	transfer = transfer_open(range);
+	range_free(&range);
+	
+	if (!transfer) {
+		ack_push(conn, uuid, DP_REQERR_BADREQ.code);
+		return data_skip(conn->sockfd, len);
+	}
+	
+	pos = 0;
+	result = 0;
+	
+	while (pos < len) {
+		size_t chunk;
+		
+		chunk = len - pos < DP_TRANSFER_BUF_LEN ? (size_t)(len - pos) : DP_TRANSFER_BUF_LEN;
+		
+		if (data_read(conn->sockfd, buffer, chunk) != chunk) {
+			/* Keep what made it so that the sender can resume after it. */
+			if (result == 0 &&
+			    transfer_commit(transfer, offset, pos, &parcel) == 1)
+				parcel_submit(conn, parcel, uuid);
+			
+			transfer_close(&transfer);
+			
+			return -1;
+		}
+		
+		/* Once a write fails, the rest of the range is only drained. */
+		if (result == 0)
+			result = transfer_write(transfer, offset + pos, buffer, chunk);
+		
+		pos += chunk;
+	}
+	
+	if (result == 1) {
+		ack_push(conn, uuid, DP_REQERR_BADREQ.code);
+	} else if (result == -1) {
+		ack_push(conn, uuid, DP_REQERR_INTERNAL.code);
+	} else {
+		result = transfer_commit(transfer, offset, len, &parcel);
+		
+		if (result == 1)
+			parcel_submit(conn, parcel, uuid);
+		else if (result == 0)
+			ack_push(conn, uuid, DP_REQACCEPTED.code);
+		else
+			ack_push(conn, uuid, DP_REQERR_BADREQ.code);
+	}
+	
+	transfer_close(&transfer);
+	
+	return 0;
+}
+
+/*
+ * Asks the host what became of a parcel whose ranges
+ * are all in, until it is no longer being checked.
+ * code is set to the status the parcel was delivered
+ * with.
+ */
+int range_status_query(const char *host, const struct dp_parcel *parcel, uint16_t *code)
+{
+	struct dp_span *spans;
+	uint32_t count;
+	
+	for (int attempt = 0; attempt <= DP_PROTO_HOST_RETRY_MAX; attempt++) {
+		int result;
+		int sockfd;
+		
+		retry_wait(attempt);
+		
+		if ((sockfd = host_connect(host)) == -1)
+			continue;
+		
+		result = resume_query(sockfd, parcel->head.uuid, code, &spans, &count);
+		socket_close(sockfd);
+		
+		if (result != 0)
+			continue;
+		
+		free(spans);
+		
+		if (*code == DP_REQOK.code)
+			return 0;
+	}
+	
+	*code = 0;
+	
+	return -1;
+}
+
+/*
+ * Sends the given spans of the payload over the socket
+ * as range messages, signed with pkey if it is given.
+ * The signature leaves out the range bytes, which the
+ * checksum in the messages covers. code is set to
+ * DP_REQACCEPTED if every range was stored without
+ * completing the parcel, otherwise to the first other
+ * status a range was acknowledged with. Returns -1 if
+ * not every range was acknowledged.
+ */
+int ranges_send(int sockfd, const struct dp_parcel *parcel, const struct dp_tail *tail, const unsigned char checksum[], const struct dp_span *spans, uint32_t span_count, EVP_PKEY *pkey, uint16_t *code)
+{
+	struct data16 **heads;
+	struct data64 **bodies;
+	struct dp_tail *tails;
+	uint16_t *codes;
+	size_t count;
+	size_t count_sign;
+	size_t i;
+	int status;
+	
+	count = 0;
+	
+	for (uint32_t j = 0; j < span_count; j++)
+		count += (spans[j].end - spans[j].start + DP_PROTO_HOST_RANGE_LEN - 1) / DP_PROTO_HOST_RANGE_LEN;
+	
+	codes = (uint16_t *)calloc(count ? count : 1, sizeof(*codes));
+	heads = (struct data16 **)calloc(count ? count : 1, sizeof(*heads));
+	bodies = (struct data64 **)calloc(count ? count : 1, sizeof(*bodies));
+	tails = (struct dp_tail *)calloc(count ? count : 1, sizeof(*tails));
+	i = 0;
+	
+	for (uint32_t j = 0; j < span_count; j++) {
+		for (uint64_t offset = spans[j].start; offset < spans[j].end; offset += DP_PROTO_HOST_RANGE_LEN) {
+			tails[i] = *tail;
+			tails[i].offset = offset;
+			tails[i].len = spans[j].end - offset < DP_PROTO_HOST_RANGE_LEN ? spans[j].end - offset : DP_PROTO_HOST_RANGE_LEN;
+			range_serialise(parcel, checksum, tail->len, offset, tails[i].len, &heads[i], &bodies[i]);
+			i++;
+		}
+	}
+	
+	count_sign = pkey ? config_sign_get() : 0;
+	
+	for (i = 0; count_sign > 0 && i < count; i += count_sign) {
+		if (parcels_sign(&heads[i], &bodies[i], NULL, count - i < count_sign ? count - i : count_sign, pkey) != 0)
+			trace_write(DP_TRACE_WARN, "%s: unable to sign the ranges", parcel->raw_filename);
+	}
+	
+	status = batch_write(sockfd, heads, bodies, tails, count, codes);
+	*code = DP_REQACCEPTED.code;
+	
+	for (i = 0; i < count; i++) {
+		if (codes[i] != 0 &&
+		    codes[i] != DP_REQACCEPTED.code) {
+			*code = codes[i];
+			break;
+		}
+	}
+	
+	for (i = 0; i < count; i++) {
+		if (heads[i]) {
+			free(heads[i]->bytes);
+			free(heads[i]);
+		}
+		
+		if (bodies[i]) {
+			free(bodies[i]->bytes);
+			free(bodies[i]);
+		}
+	}
+	
+	free(codes);
+	free(heads);
+	free(bodies);
+	free(tails);
+	
+	return status;
+}
+
+/*
+ * Asks the receiver which bytes of the parcel it
+ * already has. code is set to DP_REQOK if it was
+ * delivered, DP_REQACCEPTED if some of it is in (see
+ * spans) or DP_REQERR_NOTFOUND.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int resume_query(int sockfd, const uuid_t uuid, uint16_t *code, struct dp_span **spans, uint32_t *count)
+{
+	struct data16 *head_data;
+	struct data64 *resume_data;
+	struct data64 spans_data;
+	uint64_t size;
+	uuid_t uuid_reply;
+	int status;
+	
+	*spans = NULL;
+	
+	if (resume_serialise(uuid, &head_data, &resume_data) != 0)
+		return -1;
+	
+	status = 0;
+	
+	if (data_write(sockfd, head_data->bytes, head_data->len) != 0 ||
+	    data_write(sockfd, resume_data->bytes, resume_data->len) != 0) {
+		trace_write(DP_TRACE_WARN, "resume_query(5), send(4): %s", strerror(errno));
+		status = -1;
+	}
+	
+	free(head_data->bytes);
+	free(head_data);
+	free(resume_data->bytes);
+	free(resume_data);
+	
+	if (status != 0 ||
+	    socket_wait(sockfd, DP_PROTO_HOST_ACK_TIMEOUT * 1000) <= 0 ||
+	    header_read(sockfd, &head_data) != 0)
+		return -1;
+	
+	size = parcel_size_get(head_data);
+	
+	if (parcel_type_get(head_data) != DP_PROTO_HOST_MSG_SPANS ||
+	    size > UUID_LEN + sizeof(uint16_t) + sizeof(uint32_t) + (uint64_t)DP_PROTO_HOST_SPANS_MAX * DP_PROTO_HOST_SPAN_LEN) {
+		free(head_data->bytes);
+		free(head_data);
 		
-		if (valid_check(buffer) == 0)
-			printf("Invalid request header.\n");
+		return -1;
+	}
+	
+	free(head_data->bytes);
+	free(head_data);
+	
+	spans_data.len = size;
+	spans_data.bytes = (unsigned char *)malloc(size ? size : 1);
+	
+	if (data_read(sockfd, spans_data.bytes, size) != size ||
+	    spans_deserialise(&spans_data, uuid_reply, code, spans, count) != 0 ||
+	    uuid_compare(uuid, uuid_reply) != 0) {
+		status = -1;
+		
+		if (*spans) {
+			free(*spans);
+			*spans = NULL;
+		}
 	}
+	
+	free(spans_data.bytes);
+	
+	return status;
 }
 
 /*
- * This function is too simple.
+ * Answers a sender that lost its connection halfway
+ * through a ranged parcel with what made it here.
+ * Returns -1 if the connection failed.
  */
-void connection_log(const struct sockaddr_storage conn)
+int resume_read(struct dp_conn *conn, const struct data16 *head_data)
 {
-	char client_addr_str[INET6_ADDRSTRLEN];
+	struct data16 *reply_head;
+	struct data64 *reply_data;
+	struct data64 resume_data;
+	struct dp_span *spans;
+	uint64_t size;
+	uint32_t count;
+	uint16_t code;
+	uuid_t uuid;
+	uuid_t uuid_parcel;
+	int status;
 	
-	inet_ntop(conn.ss_family, in_addr_get((struct sockaddr *)&conn), client_addr_str, sizeof(client_addr_str));
-	printf("LOG: connection from %s\n", client_addr_str);
-}
-
-int data64_send(const char *host, const struct data16 *head, const struct data64 *body)
-{
-	struct addrinfo *info;
-	struct addrinfo *p_info;
-	struct addrinfo hints;
-	char addr_str[INET6_ADDRSTRLEN];
-	ssize_t len_bytes;
-	int addr_result;
-	int sockfd;
+	size = parcel_size_get(head_data);
+	parcel_uuid_get(head_data, uuid);
 	
-	sockfd = -1;
+	if (size != UUID_LEN) {
+		ack_push(conn, uuid, DP_REQERR_BADREQ.code);
+		return data_skip(conn->sockfd, size);
+	}
 	
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	resume_data.bytes = (unsigned char *)malloc(size);
+	resume_data.len = size;
 	
-	if ((addr_result = getaddrinfo(host, DP_PORT, &hints, &info)) != 0) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(addr_result));
-		return 1;
+	if (data_read(conn->sockfd, resume_data.bytes, size) != size) {
+		free(resume_data.bytes);
+		return -1;
 	}
 	
-	// Loop through all the results and connect to the first we can.
-	for (p_info = info; p_info != NULL; p_info = p_info->ai_next) {
-		if ((sockfd = socket(p_info->ai_family, p_info->ai_socktype, p_info->ai_protocol)) == -1) {
-			perror("send_data64(3), socket(3)");
-			continue;
-		}
-		
-		inet_ntop(p_info->ai_family, in_addr_get((struct sockaddr *)p_info->ai_addr), addr_str, sizeof(addr_str));
-		printf("Connecting to host %s\n", addr_str);
-		
-		if ( connect(sockfd, p_info->ai_addr, p_info->ai_addrlen) == -1) {
-			close(sockfd);
-			perror("send_data64(3), connect(3)");
-			continue;
-		}
-		
-		break;
-	}
+	resume_deserialise(&resume_data, uuid_parcel);
+	free(resume_data.bytes);
+	count = 0;
+	spans = NULL;
 	
-	if (!p_info) {
-		fprintf(stderr, "connect_server: failed to connect");
-		return 2;
-	}
+	if (dedup_check(uuid_parcel) == 1)
+		code = DP_REQOK.code;
+	else if (transfer_spans_get(uuid_parcel, &spans, &count) == 0)
+		code = DP_REQACCEPTED.code;
+	else
+		code = DP_REQERR_NOTFOUND.code;
 	
-	freeaddrinfo(info);
+	/* Leaving some spans out only means the sender sends a few bytes twice. */
+	if (count > DP_PROTO_HOST_SPANS_MAX)
+		count = DP_PROTO_HOST_SPANS_MAX;
 	
-	if ((len_bytes = send(sockfd, head->bytes, head->len, 0)) == -1 ||
-	    (len_bytes = send(sockfd, body->bytes, body->len, 0)) == -1) {
-		perror("send_data64(3), send(4)");
-		exit(1);
+	status = spans_serialise(uuid_parcel, code, spans, count, &reply_head, &reply_data);
+	
+	if (spans)
+		free(spans);
+	
+	if (status != 0)
+		return -1;
+	
+	if (data_write(conn->sockfd, reply_head->bytes, reply_head->len) != 0 ||
+	    data_write(conn->sockfd, reply_data->bytes, reply_data->len) != 0) {
+		trace_write(DP_TRACE_WARN, "resume_read(2), send(4): %s", strerror(errno));
+		status = -1;
 	}
 	
-	close(sockfd);
+	free(reply_head->bytes);
+	free(reply_head);
+	free(reply_data->bytes);
+	free(reply_data);
 	
-	return 0;
+	return status;
 }
 
-void grim_reaper(void)
+/*
+ * Sleeps before the given attempt at reaching a host,
+ * doubling the delay every time.
+ */
+void retry_wait(int attempt)
 {
-	struct sigaction sigact;
+	struct timespec delay;
+	int64_t ms;
 	
-	sigact.sa_handler = sigchld_handle;
-	sigemptyset(&sigact.sa_mask);
-	sigact.sa_flags = SA_RESTART;
+	if (attempt <= 0)
+		return;
 	
-	if (sigaction(SIGCHLD, &sigact, NULL) == -1)
-		perror("grim_reaper(0), sigaction(3)");
-}
-
-void *in_addr_get(const struct sockaddr *sockaddr)
-{
-	if (sockaddr->sa_family == AF_INET)
-		return &(((struct sockaddr_in *)sockaddr)->sin_addr);
+	ms = (int64_t)DP_PROTO_HOST_RETRY_DELAY << (attempt - 1);
+	delay.tv_sec = ms / 1000;
+	delay.tv_nsec = (ms % 1000) * 1000000;
 	
-	return &(((struct sockaddr_in6 *)sockaddr)->sin6_addr);
+	while (nanosleep(&delay, &delay) == -1 &&
+	       errno == EINTR);
 }
 
 /*
- * This function can be used to spawn a thread,
- * hence the pointer return.
- *
- * See also: stop_listening (1).
+ * A host may send several parcels over the same
+ * connection. Acknowledgements are held for up to
+ * DP_PROTO_HOST_ACK_WINDOW ms, or until the host goes
+ * quiet, and then sent back together in one message.
  */
-void *listen_start(const int sockfd)
+void server_read(int sockfd)
 {
-	struct sockaddr_storage client_addr;
-	socklen_t sin_size;
-	
-	sin_size = sizeof(client_addr);
-	
-	if (listen(sockfd, SOMAXCONN) == -1) {
-		perror("start_listening(1), listen(2)");
-		exit(1);
-	}
+	struct dp_conn conn;
 	
-	printf("Server now listening.\n");
+	memset(&conn, 0, sizeof(conn));
+	conn.sockfd = sockfd;
+	pthread_mutex_init(&conn.lock, NULL);
+	pthread_cond_init(&conn.cond, NULL);
 	
 	while (1) {
-		int new_fd;
+		struct data16 *head_data;
+		int64_t wait;
+		int ready;
 		
-		new_fd = accept(sockfd, (struct sockaddr *)&client_addr, &sin_size);
+		pthread_mutex_lock(&conn.lock);
 		
-		if (new_fd == -1) {
-			perror("start_listening(1), accept(3)");
+		/*
+		 * Every parcel in flight ends up as an acknowledgement,
+		 * so stop reading while there would be no room for them:
+		 * flush the ones queued, or if there are none yet, wait
+		 * for some.
+		 */
+		while (conn.ack_count == 0 &&
+		       conn.outstanding >= DP_PROTO_HOST_ACK_MAX)
+			pthread_cond_wait(&conn.cond, &conn.lock);
+		
+		if (conn.ack_count > 0) {
+			wait = DP_PROTO_HOST_ACK_WINDOW - (int64_t)(time_ms() - conn.time_first_ack);
+			
+			if (wait < 0 ||
+			    conn.ack_count + conn.outstanding >= DP_PROTO_HOST_ACK_MAX)
+				wait = 0;
+		} else if (conn.outstanding > 0) {
+			wait = DP_PROTO_HOST_ACK_WINDOW; /* Check back on deliveries in progress. */
+		} else {
+			wait = -1;
+		}
+		
+		pthread_mutex_unlock(&conn.lock);
+		
+		if (wait == 0)
+			ready = 0;
+		else
+			ready = socket_wait(sockfd, (int)wait);
+		
+		if (ready == 0) {
+			acks_flush(&conn);
 			continue;
+		} else if (ready < 0) {
+			break;
 		}
 		
-		if (!fork()) {
-			/* This is the child process. */
-			
-			/* The child doesn't need the listener. */
-			close(sockfd);
-			
-			/*
-			 * Check if this is a connection from a local
-			 * service or a remote server.
-			 */
-			if (socket_is_local((struct sockaddr *)&client_addr) == 0) {
-				client_read(new_fd);
-			} else {
-				connection_log(client_addr);
-				server_read(new_fd);
-			}
-			
-			close(new_fd);
-			exit(0);
+		/* Wait for a fixed-size header. */
+		if (header_read(sockfd, &head_data) != 0)
+			break;
+		
+		/* Header recvd; extract parcel size and read. */
+		if (parcel_read(&conn, head_data) != 0) {
+			free(head_data->bytes);
+			free(head_data);
+			break;
 		}
 		
-		/* The parent doesn't need the file descriptor. */
-		close(new_fd);
+		free(head_data->bytes);
+		free(head_data);
 	}
 	
-	return 0;
+	/* Wait for the deliveries still in progress and flush before hanging up. */
+	pthread_mutex_lock(&conn.lock);
+	
+	while (conn.outstanding > 0)
+		pthread_cond_wait(&conn.cond, &conn.lock);
+	
+	pthread_mutex_unlock(&conn.lock);
+	acks_flush(&conn);
+	
+	pthread_cond_destroy(&conn.cond);
+	pthread_mutex_destroy(&conn.lock);
 }
 
 /*
- * See also: start_listening (1).
+ * Returns 1 if the recipient keeps a key for the
+ * parcel's sending server, in which case the parcel
+ * is only taken signed; see parcel_signer_key_get().
  */
-void listen_stop(const int sockfd)
+int signature_required(const struct dp_parcel *parcel)
 {
-	shutdown(sockfd, SHUT_RDWR);
-	close(sockfd);
+	EVP_PKEY *pkey;
+	
+	if (!(pkey = parcel_signer_key_get(parcel)))
+		return 0;
+	
+	EVP_PKEY_free(pkey);
+	
+	return 1;
 }
 
-void parcel_read(int sockfd, const struct data16 *head_data)
+/*
+ * Reads a signed message, which is delivered once the
+ * signature over its batch checks out; that only takes
+ * a crypto worker for the first message of the batch
+ * (see merkle.c). A parcel from a server that the
+ * recipient has no key for is delivered as if it were
+ * not signed. Questions and range messages are left to
+ * the functions that read them unsigned.
+ * Returns -1 if the connection failed.
+ */
+int signed_read(struct dp_conn *conn, const struct data16 *head_data)
 {
-	struct data64 *parcel_data;
-	ssize_t bytes_read;
-	uint64_t parcel_size;
+	unsigned char leaf[SHA256_DIGEST_LENGTH];
+	unsigned char root[SHA256_DIGEST_LENGTH];
+	struct data64 body_data;
+	struct data64 proof_data;
+	struct dp_delta *delta;
+	struct dp_parcel *parcel;
+	struct dp_parcel_head head;
+	struct dp_proof proof;
+	struct dp_receipt *receipt;
+	struct dp_reqstatus status;
+	EVP_PKEY *pkey;
+	uint64_t size;
+	uuid_t uuid;
+	int result;
 	
-	parcel_size = parcel_size_get(head_data);
-	parcel_data = (struct data64 *)malloc(sizeof(*parcel_data));
-	parcel_data->bytes = (unsigned char *)calloc(parcel_size, sizeof(unsigned char));
+	size = parcel_size_get(head_data);
+	parcel_uuid_get(head_data, uuid);
 	
-	if ((bytes_read = read(sockfd, parcel_data->bytes, parcel_size)) == -1)
-		perror("read_parcel(2), read(3)");
+	if ((result = proof_read(conn->sockfd, size, &proof_data, &proof)) != 0) {
+		if (result == -1)
+			return -1;
+		
+		ack_push(conn, uuid, DP_REQERR_BADREQ.code);
+		
+		return data_skip(conn->sockfd, size - proof_data.len);
+	}
 	
-	parcel_data->len = bytes_read;
+	body_data.len = size - proof_data.len;
 	
-	/***********
-	 * PARSING
-	 ***********/
-	parcel_parse(head_data, parcel_data);
-}
-
-void server_read(int sockfd)
-{
-	struct data16 *head_data;
-	ssize_t bytes_read;
+	/* These read what follows the proof themselves. */
+	if (proof.type == DP_PROTO_HOST_MSG_BASIS ||
+	    proof.type == DP_PROTO_HOST_MSG_RANGE ||
+	    proof.type == DP_PROTO_HOST_MSG_TREE) {
+		if (proof.type == DP_PROTO_HOST_MSG_BASIS)
+			result = basis_read(conn, head_data, &proof, body_data.len);
+		else if (proof.type == DP_PROTO_HOST_MSG_RANGE)
+			result = range_read(conn, head_data, &proof, body_data.len);
+		else
+			result = tree_read(conn, head_data, &proof, body_data.len);
+		
+		free(proof_data.bytes);
+		
+		return result;
+	}
+	
+	if ((proof.type != DP_PROTO_HOST_MSG_PARCEL &&
+	     proof.type != DP_PROTO_HOST_MSG_SYNCED &&
+	     proof.type != DP_PROTO_HOST_MSG_DELTA) ||
+	    (proof.type == DP_PROTO_HOST_MSG_DELTA &&
+	     body_data.len > DP_PROTO_HOST_RANGE_MIN + DP_PROTO_HOST_DELTA_HEAD_LEN + DP_PROTO_HOST_ENVELOPE_MAX)) {
+		ack_push(conn, uuid, DP_REQERR_BADREQ.code);
+		free(proof_data.bytes);
+		
+		return data_skip(conn->sockfd, body_data.len);
+	}
+	
+	if (dedup_check(uuid) == 1) {
+		ack_push(conn, uuid, DP_REQOK.code);
+		free(proof_data.bytes);
+		
+		return data_skip(conn->sockfd, body_data.len);
+	}
+	
+	body_data.bytes = (unsigned char *)malloc(body_data.len ? body_data.len : 1);
+	
+	if (!body_data.bytes ||
+	    data_read(conn->sockfd, body_data.bytes, body_data.len) != body_data.len) {
+		trace_write(DP_TRACE_WARN, "signed_read(2), read(3): %s", strerror(errno));
+		
+		if (body_data.bytes)
+			free(body_data.bytes);
+		
+		free(proof_data.bytes);
+		
+		return -1;
+	}
+	
+	/* The leaf is that of the message before it was signed. */
+	header_deserialise(head_data, &head);
+	head.type = proof.type;
+	merkle_leaf_get(&head, &body_data, NULL, leaf);
+	
+	if (merkle_root_get(leaf, &proof, root) != 0) {
+		ack_push(conn, uuid, DP_REQERR_FORBIDDEN.code);
+		free(body_data.bytes);
+		free(proof_data.bytes);
+		
+		return 0;
+	}
+	
+	if (proof.type == DP_PROTO_HOST_MSG_DELTA) {
+		status = delta_parse(head_data, &body_data, &delta);
+		
+		if (status.code == DP_REQOK.code) {
+			status = delta_patch(delta, &parcel);
+			delta_free(&delta);
+		}
+	} else {
+		status = parcel_parse(head_data, &body_data, &parcel);
+	}
+	
+	free(body_data.bytes);
+	
+	if (status.code != DP_REQOK.code) {
+		ack_push(conn, uuid, status.code);
+		free(proof_data.bytes);
+		
+		return 0;
+	}
 	
-	head_data = (struct data16 *)malloc(sizeof(*head_data));
-	head_data->bytes = (unsigned char *)calloc(DP_PROTO_HOST_HEAD_LEN, sizeof(unsigned char));
+	parcel->head.type = proof.type;
+	
+	if (!(pkey = parcel_signer_key_get(parcel))) {
+		parcel_submit(conn, parcel, uuid);
+	} else if (dedup_reserve(parcel->head.uuid) == 1) {
+		ack_push(conn, uuid, DP_REQOK.code);
+		parcel_free(&parcel);
+		EVP_PKEY_free(pkey);
+	} else {
+		receipt = (struct dp_receipt *)malloc(sizeof(*receipt));
+		receipt->conn = conn;
+		receipt->parcel = parcel;
+		uuid_copy(receipt->uuid, uuid);
+		
+		pthread_mutex_lock(&conn->lock);
+		conn->outstanding++;
+		pthread_mutex_unlock(&conn->lock);
+		
+		merkle_verify(root, &proof, pkey, parcel_verified, receipt);
+		EVP_PKEY_free(pkey);
+	}
 	
-	/* Wait for a fixed-size header. */
-	if ((bytes_read = read(sockfd, head_data->bytes, DP_PROTO_HOST_HEAD_LEN)) == -1)
-		perror("read_server(1), read(3)");
+	free(proof_data.bytes);
 	
-	/* Header recvd; extract parcel size and read. */
-	head_data->len = bytes_read;
-	parcel_read(sockfd, head_data);
+	return 0;
 }
 
-void sigchld_handle(int s)
+/*
+ * Closes a host connection, ending its TLS session
+ * first if it has one.
+ */
+void socket_close(int sockfd)
 {
-	/* waitpid() might overwrite errno, so we save and restore it. */
-	int saved_errno = errno;
-	
-	while (waitpid(-1, NULL, WNOHANG) > 0);
-	
-	errno = saved_errno;
+	tls_close(sockfd);
+	close(sockfd);
 }
 
 /*
@@ -289,6 +2299,35 @@ int socket_is_local(const struct sockaddr *sockaddr)
 	}
 }
 
+/*
+ * Waits up to timeout ms for the socket to become
+ * readable. Returns 1 if it did, 0 on timeout or
+ * -1 on error.
+ */
+int socket_wait(int sockfd, int timeout)
+{
+	struct pollfd pfd;
+	SSL *ssl;
+	int result;
+	
+	/* TLS may have read ahead of what was asked for. */
+	if ((ssl = tls_get(sockfd)) &&
+	    SSL_pending(ssl) > 0)
+		return 1;
+	
+	pfd.fd = sockfd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	
+	while ((result = poll(&pfd, 1, timeout)) == -1 &&
+	       errno == EINTR);
+	
+	if (result > 0)
+		return 1;
+	
+	return result;
+}
+
 /*
  * Opens a new TCP socket and binds it to the given port.
  * Returns the socket file descriptor.
@@ -315,26 +2354,23 @@ int socket_setup(const char *port)
 	hints.ai_next = NULL;
 	
 	if ((addr_result = getaddrinfo(NULL, port, &hints, &info)) != 0) {
-		fprintf(stderr, "getaddrinfo, %s", gai_strerror(addr_result));
-		perror("");
+		trace_write(DP_TRACE_ERROR, "getaddrinfo, %s", gai_strerror(addr_result));
 		exit(1);
 	}
 	
 	/* Loop through all the results and bind to the first we can. */
 	for (p_info = info; p_info != NULL; p_info = p_info->ai_next) {
 		if ((sockfd = socket(p_info->ai_family, p_info->ai_socktype, p_info->ai_protocol)) == -1) {
-			perror("setup_socket(1), socket(3)");
+			trace_write(DP_TRACE_ERROR, "setup_socket(1), socket(3): %s", strerror(errno));
 			continue;
 		}
 		
 		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &flag_enable, sizeof(int)) == -1) {
-			fprintf(stderr, "setup_sock, TCP setsockopt, port %s", port);
-			perror("");
+			trace_write(DP_TRACE_ERROR, "setup_sock, TCP setsockopt, port %s: %s", port, strerror(errno));
 		}
 		
 		if (bind(sockfd, p_info->ai_addr, p_info->ai_addrlen) == -1) {
-			fprintf(stderr, "bind, error binding to TCP port %s", port);
-			perror("");
+			trace_write(DP_TRACE_ERROR, "bind, error binding to TCP port %s: %s", port, strerror(errno));
 			close(sockfd);
 			continue;
 		}
@@ -343,12 +2379,10 @@ int socket_setup(const char *port)
 	}
 	
 	if (!p_info) {
-		printf("setup_socket(1): TCP socket failed to bind");
+		trace_write(DP_TRACE_ERROR, "setup_socket(1): TCP socket failed to bind");
 		exit(1);
 	}
 	
-	/* Reap all dead processes. */
-	grim_reaper();
 	freeaddrinfo(info);
 	
 	return sockfd;
@@ -359,8 +2393,244 @@ int socket_setup(const char *port)
  */
 void sockets_bootstrap(void)
 {
+	char port_str[12];
+	int port;
 	int sockfd;
 	
-	sockfd = socket_setup(DP_PORT);
+	/* A host hanging up mid-send should fail the send, not kill us. */
+	signal(SIGPIPE, SIG_IGN);
+	
+	if ((port = config_port_get(DP_DIR_DEFAULT)) > 0)
+		snprintf(port_str, sizeof(port_str), "%d", port);
+	else
+		snprintf(port_str, sizeof(port_str), "%s", DP_PORT);
+	
+	sockfd = socket_setup(port_str);
 	listen_start(sockfd);
 }
+
+/*
+ * Sends one share of a ranged parcel. Should the
+ * connection break, it is re-established (backing off
+ * between attempts) and only the bytes the receiver is
+ * still missing are sent again.
+ */
+void *stream_send(void *args)
+{
+	struct dp_span *missing;
+	struct dp_stream *stream;
+	uint32_t missing_count;
+	
+	stream = (struct dp_stream *)args;
+	stream->code = 0;
+	
+	if (stream->start >= stream->end) {
+		stream->code = DP_REQACCEPTED.code;
+		return 0;
+	}
+	
+	missing = (struct dp_span *)malloc(sizeof(*missing));
+	missing->start = stream->start;
+	missing->end = stream->end;
+	missing_count = 1;
+	
+	for (int attempt = 0; attempt <= DP_PROTO_HOST_RETRY_MAX; attempt++) {
+		struct dp_span *spans;
+		uint32_t count;
+		uint16_t code;
+		int result;
+		int sockfd;
+		
+		retry_wait(attempt);
+		
+		if ((sockfd = host_connect(stream->host)) == -1)
+			continue;
+		
+		if (attempt > 0) {
+			if (resume_query(sockfd, stream->parcel->head.uuid, &code, &spans, &count) != 0) {
+				socket_close(sockfd);
+				continue;
+			}
+			
+			if (code == DP_REQOK.code) {
+				stream->code = code;
+				free(spans);
+				socket_close(sockfd);
+				break;
+			}
+			
+			/* The receiver knowing nothing of the parcel means starting over. */
+			if (code != DP_REQACCEPTED.code)
+				count = 0;
+			
+			/* Work out the gaps in this share. */
+			free(missing);
+			missing = (struct dp_span *)malloc((count + 1) * sizeof(*missing));
+			missing_count = 0;
+			missing[0].start = stream->start;
+			
+			for (uint32_t i = 0; i < count; i++) {
+				if (spans[i].end <= missing[missing_count].start ||
+				    spans[i].start >= stream->end)
+					continue;
+				
+				if (spans[i].start > missing[missing_count].start) {
+					missing[missing_count].end = spans[i].start;
+					missing_count++;
+				}
+				
+				missing[missing_count].start = spans[i].end;
+			}
+			
+			if (missing[missing_count].start < stream->end) {
+				missing[missing_count].end = stream->end;
+				missing_count++;
+			}
+			
+			free(spans);
+			
+			if (missing_count == 0) {
+				stream->code = DP_REQACCEPTED.code;
+				socket_close(sockfd);
+				break;
+			}
+		}
+		
+		result = ranges_send(sockfd, stream->parcel, stream->tail, stream->checksum, missing, missing_count, stream->pkey, &code);
+		socket_close(sockfd);
+		
+		/* Only a broken connection is worth another try. */
+		if (result == 0 ||
+		    code != DP_REQACCEPTED.code) {
+			stream->code = code;
+			break;
+		}
+	}
+	
+	free(missing);
+	
+	return 0;
+}
+
+/*
+ * Writes the tail out after its message. Plain bytes go
+ * straight from the payload; a sealed payload goes one
+ * record at a time through a buffer; see tail_read().
+ */
+int tail_write(int sockfd, const struct dp_tail *tail)
+{
+	unsigned char *buffer;
+	uint64_t pos;
+	
+	if (!tail->seal)
+		return data_write(sockfd, &tail->payload->bytes[tail->offset], tail->len);
+	
+	buffer = (unsigned char *)malloc(DP_SEAL_RECORD_LEN + DP_SEAL_TAG_LEN);
+	pos = 0;
+	
+	while (pos < tail->len) {
+		size_t chunk;
+		
+		chunk = tail_chunk_get(tail, pos);
+		
+		if (tail_read(tail, pos, buffer, chunk) != 0 ||
+		    data_write(sockfd, buffer, chunk) != 0) {
+			free(buffer);
+			return -1;
+		}
+		
+		pos += chunk;
+	}
+	
+	free(buffer);
+	
+	return 0;
+}
+
+/*
+ * Answers a host syncing its copy of a directory with
+ * the entries of the one here; see sync.c. Every question
+ * gets an answer, if only a status code, so the asker
+ * can match them up. Only a question signed by the
+ * sender's server is answered (see proof_check());
+ * body_size is what follows the proof, if there is one.
+ * Returns -1 if the connection failed.
+ */
+int tree_read(struct dp_conn *conn, const struct data16 *head_data, const struct dp_proof *proof, uint64_t body_size)
+{
+	unsigned char tree[SHA256_DIGEST_LENGTH];
+	struct arena *arena;
+	struct data16 *reply_head;
+	struct data64 *reply_data;
+	struct data64 tree_data;
+	struct dp_parcel *parcel;
+	struct dp_reqstatus status;
+	struct dp_sync_entry *entries;
+	EVP_PKEY *pkey;
+	uint32_t count;
+	int result;
+	
+	tree_data.len = body_size;
+	arena = NULL;
+	count = 0;
+	entries = NULL;
+	memset(tree, 0, sizeof(tree));
+	
+	if (tree_data.len > DP_PROTO_HOST_ENVELOPE_MAX) {
+		if (data_skip(conn->sockfd, tree_data.len) != 0)
+			return -1;
+		
+		status = DP_REQERR_BADREQ;
+	} else {
+		tree_data.bytes = (unsigned char *)malloc(tree_data.len ? tree_data.len : 1);
+		
+		if (data_read(conn->sockfd, tree_data.bytes, tree_data.len) != tree_data.len) {
+			free(tree_data.bytes);
+			return -1;
+		}
+		
+		status = tree_parse(head_data, &tree_data, &parcel);
+		
+		if (status.code == DP_REQOK.code) {
+			pkey = parcel_signer_key_get(parcel);
+			
+			if (proof_check(head_data, DP_PROTO_HOST_MSG_TREE, &tree_data, proof, pkey) != 0)
+				status = DP_REQERR_FORBIDDEN;
+			else if ((arena = arena_make(0)))
+				status = sync_entries_get(parcel, arena, tree, &entries, &count);
+			else
+				status = DP_REQERR_INTERNAL;
+			
+			if (pkey)
+				EVP_PKEY_free(pkey);
+			
+			parcel_free(&parcel);
+		}
+		
+		free(tree_data.bytes);
+	}
+	
+	if (status.code != DP_REQOK.code)
+		count = 0;
+	
+	result = entries_serialise(status.code, tree, entries, count, &reply_head, &reply_data);
+	
+	if (arena)
+		arena_free(&arena);
+	
+	if (result != 0)
+		return -1;
+	
+	if (data_write(conn->sockfd, reply_head->bytes, reply_head->len) != 0 ||
+	    data_write(conn->sockfd, reply_data->bytes, reply_data->len) != 0) {
+		trace_write(DP_TRACE_WARN, "tree_read(2), send(4): %s", strerror(errno));
+		result = -1;
+	}
+	
+	free(reply_head->bytes);
+	free(reply_head);
+	free(reply_data->bytes);
+	free(reply_data);
+	
+	return result;
+}
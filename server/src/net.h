@@ -10,9 +10,13 @@
 #define NET_H
 
 
+#include <stddef.h>
+#include "crypto.h"
 #include "types.h"
 
 
+struct dp_parcel;
+
 /*************
  * CONSTANTS *
  *************/
@@ -21,7 +25,11 @@ static const char *DP_PORT = "1992";
 /*************
  * FUNCTIONS *
  *************/
+int data64_batch_send(const char *, struct data16 **, struct data64 **, const struct dp_tail *, size_t, uint16_t *);
+int data64_delta_send(const char *, const struct dp_parcel *, EVP_PKEY *, uint16_t *);
+int data64_range_send(const char *, const struct dp_parcel *, const struct dp_tail *, EVP_PKEY *, int, uint16_t *);
 int data64_send(const char *, const struct data16 *, const struct data64 *);
+int data64_tree_query(const char *, struct data16 **, struct data64 **, size_t, struct data64 **);
 void *listen_start(const int);
 void listen_stop(const int);
 void sockets_bootstrap(void);
@@ -0,0 +1,307 @@
+//
+//  offload.c
+//  server
+//
+
+#include "offload.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+#include <unistd.h>
+
+
+/*
+ * OFFLOADING
+ * --
+ * Public-key operations (wrapping keys, signing and
+ * verifying) are slow next to everything else a
+ * connection thread does. They are queued here instead
+ * and run by a pool of crypto workers, one per CPU.
+ * Whoever submits a job gets called back, on the worker,
+ * once it is done; a host connection checking
+ * signatures goes on reading meanwhile.
+ *
+ * A group is not like that: the thread that waits for
+ * one (e.g. a client request signing its batches or
+ * wrapping keys) is blocked until every job in it is
+ * done. It runs the jobs no worker has picked up yet
+ * itself rather than sit idle, so a group is spread
+ * over the workers and the waiting thread alike.
+ *
+ * The queue is bounded. When it is full, a submission is
+ * turned away and the caller decides what to do, e.g.
+ * do the work itself.
+ */
+
+/**************
+ * STRUCTURES *
+ **************/
+struct dp_offload_job {
+	struct dp_offload_job *next;
+	dp_offload_work work;
+	void *args;
+	dp_offloaded done;
+	void *context;
+};
+/**********************/
+
+/********************
+ * Global Variables
+ ********************/
+pthread_cond_t offload_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t offload_lock = PTHREAD_MUTEX_INITIALIZER;
+struct dp_offload_job *offload_queue;
+int offload_queue_len;
+struct dp_offload_job *offload_queue_tail;
+int offload_workers_count;
+/**********************/
+
+/**********************
+ * Private Prototypes
+ **********************/
+void group_done(void *, int);
+struct dp_offload_job *group_job_take(const struct dp_offload_group *);
+void *offload_run(void *);
+/**********************/
+
+
+/*
+ * Completion callback of jobs added to a group.
+ */
+void group_done(void *context, int result)
+{
+	struct dp_offload_group *group;
+	
+	group = (struct dp_offload_group *)context;
+	
+	pthread_mutex_lock(&group->lock);
+	
+	if (result != 0)
+		group->failed++;
+	
+	if (--group->pending == 0)
+		pthread_cond_broadcast(&group->cond);
+	
+	pthread_mutex_unlock(&group->lock);
+}
+
+/*
+ * Takes a job of the group off the queue, if one is
+ * still waiting there.
+ */
+struct dp_offload_job *group_job_take(const struct dp_offload_group *group)
+{
+	struct dp_offload_job *job;
+	struct dp_offload_job *prev;
+	
+	prev = NULL;
+	
+	pthread_mutex_lock(&offload_lock);
+	
+	for (job = offload_queue; job; job = job->next) {
+		if (job->done == group_done &&
+		    job->context == group)
+			break;
+		
+		prev = job;
+	}
+	
+	if (job) {
+		if (prev)
+			prev->next = job->next;
+		else
+			offload_queue = job->next;
+		
+		if (offload_queue_tail == job)
+			offload_queue_tail = prev;
+		
+		offload_queue_len--;
+	}
+	
+	pthread_mutex_unlock(&offload_lock);
+	
+	return job;
+}
+
+/*
+ * Starts one crypto worker per CPU.
+ */
+int offload_bootstrap(void)
+{
+	long cpus;
+	
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	if (cpus < 1)
+		cpus = 1;
+	else if (cpus > DP_OFFLOAD_WORKERS_MAX)
+		cpus = DP_OFFLOAD_WORKERS_MAX;
+	
+	for (int i = 0; i < cpus; i++) {
+		pthread_t thread;
+		int result;
+		
+		if ((result = pthread_create(&thread, NULL, offload_run, NULL)) != 0) {
+			trace_write(DP_TRACE_ERROR, "offload_bootstrap(0), pthread_create(4): %s", strerror(result));
+			return -1;
+		}
+		
+		pthread_detach(thread);
+		offload_workers_count++;
+	}
+	
+	return 0;
+}
+
+/*
+ * Queues the work as part of the group. If the queue is
+ * full, the work is done right away on the calling
+ * thread instead.
+ */
+void offload_group_add(struct dp_offload_group *group, dp_offload_work work, void *args)
+{
+	pthread_mutex_lock(&group->lock);
+	group->pending++;
+	pthread_mutex_unlock(&group->lock);
+	
+	if (offload_submit(work, args, group_done, group) != 0)
+		group_done(group, work(args));
+}
+
+void offload_group_init(struct dp_offload_group *group)
+{
+	pthread_cond_init(&group->cond, NULL);
+	pthread_mutex_init(&group->lock, NULL);
+	group->failed = 0;
+	group->pending = 0;
+}
+
+/*
+ * Blocks until every job of the group is done, running
+ * those still queued on the calling thread, and tears
+ * the group down. Returns the number of jobs that failed.
+ */
+int offload_group_wait(struct dp_offload_group *group)
+{
+	struct dp_offload_job *job;
+	int failed;
+	
+	while ((job = group_job_take(group))) {
+		group_done(group, job->work(job->args));
+		free(job);
+	}
+	
+	pthread_mutex_lock(&group->lock);
+	
+	while (group->pending > 0)
+		pthread_cond_wait(&group->cond, &group->lock);
+	
+	failed = group->failed;
+	
+	pthread_mutex_unlock(&group->lock);
+	pthread_cond_destroy(&group->cond);
+	pthread_mutex_destroy(&group->lock);
+	
+	return failed;
+}
+
+void *offload_run(void *args)
+{
+	while (1) {
+		struct dp_offload_job *batch;
+		struct dp_offload_job *last;
+		int count;
+		int share;
+		
+		pthread_mutex_lock(&offload_lock);
+		
+		while (!offload_queue)
+			pthread_cond_wait(&offload_cond, &offload_lock);
+		
+		/*
+		 * Take a run of jobs so the lock is not taken for every
+		 * one, but no more than this worker's share of the
+		 * queue, so the others are not left idle behind it.
+		 */
+		share = offload_queue_len / offload_workers_count;
+		
+		if (share > DP_OFFLOAD_BATCH_MAX)
+			share = DP_OFFLOAD_BATCH_MAX;
+		
+		batch = offload_queue;
+		last = batch;
+		
+		for (count = 1; count < share && last->next; count++)
+			last = last->next;
+		
+		offload_queue = last->next;
+		offload_queue_len -= count;
+		
+		if (!offload_queue)
+			offload_queue_tail = NULL;
+		
+		last->next = NULL;
+		
+		pthread_mutex_unlock(&offload_lock);
+		
+		while (batch) {
+			struct dp_offload_job *job;
+			int result;
+			
+			job = batch;
+			batch = batch->next;
+			result = job->work(job->args);
+			
+			if (job->done)
+				job->done(job->context, result);
+			
+			free(job);
+		}
+	}
+	
+	return 0;
+}
+
+/*
+ * Queues the work for a crypto worker. done (if given)
+ * is called from that worker when the work is over.
+ * Returns 1 if the work was not queued because the queue
+ * is full or there are no workers.
+ */
+int offload_submit(dp_offload_work work, void *args, dp_offloaded done, void *context)
+{
+	struct dp_offload_job *job;
+	
+	if (!work)
+		return 1;
+	
+	pthread_mutex_lock(&offload_lock);
+	
+	if (offload_workers_count == 0 ||
+	    offload_queue_len >= DP_OFFLOAD_QUEUE_MAX) {
+		pthread_mutex_unlock(&offload_lock);
+		return 1;
+	}
+	
+	job = (struct dp_offload_job *)malloc(sizeof(*job));
+	job->next = NULL;
+	job->work = work;
+	job->args = args;
+	job->done = done;
+	job->context = context;
+	
+	if (offload_queue_tail)
+		offload_queue_tail->next = job;
+	else
+		offload_queue = job;
+	
+	offload_queue_tail = job;
+	offload_queue_len++;
+	pthread_cond_signal(&offload_cond);
+	pthread_mutex_unlock(&offload_lock);
+	
+	return 0;
+}
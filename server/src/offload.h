@@ -0,0 +1,57 @@
+//
+//  offload.h
+//  server
+//
+
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+
+#include <pthread.h>
+
+
+/*************
+ * CONSTANTS *
+ *************/
+static const int DP_OFFLOAD_BATCH_MAX 		= 32;	/* Jobs a worker takes off the queue in one go, at most; it only takes its share of the queue. */
+static const int DP_OFFLOAD_QUEUE_MAX 		= 4096;	/* Jobs waiting before submissions are turned away. */
+static const int DP_OFFLOAD_WORKERS_MAX 	= 16;
+
+/**************
+ * STRUCTURES *
+ **************/
+/*
+ * The work itself, run on a crypto worker. Returns 0 on
+ * success.
+ */
+typedef int (*dp_offload_work)(void *);
+
+/*
+ * Called on the crypto worker once the work is done,
+ * with what it returned.
+ */
+typedef void (*dp_offloaded)(void *, int);
+
+/*
+ * Lets a thread hand over a number of jobs and wait for
+ * all of them, blocking until they are done; see
+ * offload_group_wait().
+ */
+struct dp_offload_group {
+	pthread_cond_t cond;
+	pthread_mutex_t lock;
+	int failed;	/* Jobs that did not return 0 */
+	int pending;
+};
+
+/*************
+ * FUNCTIONS *
+ *************/
+int offload_bootstrap(void);
+void offload_group_add(struct dp_offload_group *, dp_offload_work, void *);
+void offload_group_init(struct dp_offload_group *);
+int offload_group_wait(struct dp_offload_group *);
+int offload_submit(dp_offload_work, void *, dp_offloaded, void *);
+
+
+#endif /* OFFLOAD_H */
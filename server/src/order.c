@@ -0,0 +1,622 @@
+//
+//  order.c
+//  server
+//
+
+#include "order.h"
+
+#include "dedup.h"
+#include "disk.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+#include <unistd.h>
+
+
+/*
+ * ORDERING
+ * --
+ * Every parcel carries a sequence number that is
+ * local to its (sender, recipient) pair, i.e. its
+ * conversation. The upper 32 bits are the sending
+ * daemon's epoch and the lower 32 bits count up from
+ * 1 within that epoch, so a newer epoch simply
+ * restarts the count. The epoch is when the daemon
+ * started, but always later than the one before it
+ * (kept in dp.epoch), so two runs never share one.
+ *
+ * A number is taken only as the parcel goes out, and
+ * handed back if the parcel never got acknowledged and
+ * no later one went out, so a failed send leaves no gap
+ * for the recipient to wait on.
+ *
+ * On the receiving side, each conversation is pinned
+ * to one delivery worker by hashing its pair. Parcels
+ * of one conversation are thus delivered one after the
+ * other, in sequence, while other conversations are
+ * delivered in parallel on the other workers. A parcel
+ * that arrives ahead of its predecessor is held back
+ * until the gap fills, or until DP_ORDER_HOLD_MAX ms
+ * pass, after which the gap is skipped. The first
+ * parcel of a conversation not seen before is taken as
+ * its start, wherever its count is.
+ */
+
+/**************
+ * STRUCTURES *
+ **************/
+struct dp_delivery {
+	struct dp_delivery *next;
+	struct dp_parcel *parcel;
+	dp_delivered done;
+	void *context;
+	uint64_t time_held;
+};
+
+struct dp_convo {
+	char *key;
+	struct dp_convo *next;
+	struct dp_delivery *pending;	/* Held parcels, sorted by sequence */
+	uint64_t time_active;
+	uint32_t epoch;
+	uint32_t seq_next;
+	int pending_count;
+};
+
+struct dp_worker {
+	struct dp_convo *convos[DP_ORDER_BUCKETS];
+	struct dp_delivery *queue;
+	struct dp_delivery *queue_tail;
+	pthread_cond_t cond;
+	pthread_mutex_t lock;
+	pthread_t thread;
+	uint64_t time_swept;
+	int held;			/* Parcels held across all conversations */
+};
+
+/*
+ * Sending side: the next sequence number of each
+ * conversation.
+ */
+struct dp_counter {
+	char *key;
+	struct dp_counter *next;
+	uint32_t seq_next;
+};
+/**********************/
+
+/********************
+ * Global Variables
+ ********************/
+struct dp_counter *order_counters[DP_ORDER_BUCKETS];
+pthread_mutex_t order_counters_lock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t order_epoch;
+struct dp_worker *order_workers;
+int order_workers_count;
+/**********************/
+
+/**********************
+ * Private Prototypes
+ **********************/
+void convo_drain(struct dp_convo *, struct dp_worker *);
+struct dp_convo *convo_get(struct dp_worker *, const char *, uint64_t);
+void convo_hold(struct dp_convo *, struct dp_worker *, struct dp_delivery *);
+void convo_skip(struct dp_convo *, struct dp_worker *);
+void convos_expire(struct dp_worker *);
+void delivery_drop(struct dp_delivery *, struct dp_reqstatus);
+void delivery_finish(struct dp_delivery *);
+uint64_t key_hash(const char *);
+char *key_make(const struct dp_parcel *);
+struct dp_counter *order_counter_get(const struct dp_parcel *, int);
+uint32_t order_epoch_make(void);
+void order_process(struct dp_worker *, struct dp_delivery *);
+void *worker_run(void *);
+/**********************/
+
+
+/*
+ * Delivers held parcels for as long as they follow
+ * on from one another.
+ */
+void convo_drain(struct dp_convo *convo, struct dp_worker *worker)
+{
+	while (convo->pending &&
+	       (uint32_t)convo->pending->parcel->head.sequence <= convo->seq_next) {
+		struct dp_delivery *delivery;
+		
+		delivery = convo->pending;
+		convo->pending = delivery->next;
+		convo->pending_count--;
+		worker->held--;
+		
+		if ((uint32_t)delivery->parcel->head.sequence == convo->seq_next)
+			convo->seq_next++;
+		
+		delivery_finish(delivery);
+	}
+}
+
+struct dp_convo *convo_get(struct dp_worker *worker, const char *key, uint64_t hash)
+{
+	struct dp_convo *convo;
+	uint32_t i_bucket;
+	
+	i_bucket = (uint32_t)(hash >> 32) & (DP_ORDER_BUCKETS - 1);
+	
+	for (convo = worker->convos[i_bucket]; convo; convo = convo->next) {
+		if (strcmp(convo->key, key) == 0)
+			return convo;
+	}
+	
+	convo = (struct dp_convo *)calloc(1, sizeof(*convo));
+	convo->key = (char *)calloc(strlen(key) + 1, sizeof(char));
+	convo->next = worker->convos[i_bucket];
+	strcpy(convo->key, key);
+	worker->convos[i_bucket] = convo;
+	
+	return convo;
+}
+
+/*
+ * Inserts the delivery into the conversation's held
+ * parcels, keeping them sorted by sequence. A parcel
+ * whose place is already taken is turned away.
+ */
+void convo_hold(struct dp_convo *convo, struct dp_worker *worker, struct dp_delivery *delivery)
+{
+	struct dp_delivery **link;
+	uint32_t seq;
+	
+	seq = (uint32_t)delivery->parcel->head.sequence;
+	link = &convo->pending;
+	
+	while (*link &&
+	       (uint32_t)(*link)->parcel->head.sequence < seq)
+		link = &(*link)->next;
+	
+	if (*link &&
+	    (uint32_t)(*link)->parcel->head.sequence == seq) {
+		delivery_drop(delivery, DP_REQERR_CONFLICT);
+		return;
+	}
+	
+	delivery->next = *link;
+	delivery->time_held = time_ms();
+	*link = delivery;
+	convo->pending_count++;
+	worker->held++;
+	
+	if (convo->pending_count > DP_ORDER_PENDING_MAX)
+		convo_skip(convo, worker);
+}
+
+/*
+ * Gives up on the missing predecessor(s) and moves on
+ * to the earliest held parcel.
+ */
+void convo_skip(struct dp_convo *convo, struct dp_worker *worker)
+{
+	if (convo->pending) {
+		if ((uint32_t)convo->pending->parcel->head.sequence > convo->seq_next)
+			convo->seq_next = (uint32_t)convo->pending->parcel->head.sequence;
+		
+		convo_drain(convo, worker);
+	}
+}
+
+/*
+ * Skips gaps that have been waited on for too long and
+ * forgets conversations that have gone idle.
+ */
+void convos_expire(struct dp_worker *worker)
+{
+	uint64_t now;
+	int sweep;
+	
+	now = time_ms();
+	sweep = now - worker->time_swept >= DP_ORDER_IDLE_MAX;
+	
+	if (worker->held == 0 &&
+	    !sweep)
+		return;
+	
+	for (int i = 0; i < DP_ORDER_BUCKETS; i++) {
+		struct dp_convo **link;
+		
+		link = &worker->convos[i];
+		
+		while (*link) {
+			struct dp_convo *convo;
+			
+			convo = *link;
+			
+			while (convo->pending &&
+			       now - convo->pending->time_held >= DP_ORDER_HOLD_MAX)
+				convo_skip(convo, worker);
+			
+			if (sweep &&
+			    !convo->pending &&
+			    now - convo->time_active >= DP_ORDER_IDLE_MAX) {
+				*link = convo->next;
+				free(convo->key);
+				free(convo);
+			} else {
+				link = &convo->next;
+			}
+		}
+	}
+	
+	if (sweep)
+		worker->time_swept = now;
+}
+
+/*
+ * Gives up on delivering the parcel.
+ */
+void delivery_drop(struct dp_delivery *delivery, struct dp_reqstatus status)
+{
+	dedup_release(delivery->parcel->head.uuid, 0);
+	
+	if (delivery->done)
+		delivery->done(delivery->context, delivery->parcel, status);
+	
+	parcel_free(&delivery->parcel);
+	free(delivery);
+}
+
+void delivery_finish(struct dp_delivery *delivery)
+{
+	struct dp_reqstatus status;
+	
+	status = parcel_deliver(delivery->parcel);
+	dedup_release(delivery->parcel->head.uuid, status.code == DP_REQOK.code);
+	
+	if (delivery->done)
+		delivery->done(delivery->context, delivery->parcel, status);
+	
+	parcel_free(&delivery->parcel);
+	free(delivery);
+}
+
+/*
+ * FNV-1a.
+ */
+uint64_t key_hash(const char *key)
+{
+	uint64_t hash;
+	
+	hash = 0xcbf29ce484222325ULL;
+	
+	for (; *key; key++) {
+		hash ^= (unsigned char)*key;
+		hash *= 0x100000001b3ULL;
+	}
+	
+	return hash;
+}
+
+/*
+ * Makes a key of the form sender_user@sender_host>recipient_user@recipient_host.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+char *key_make(const struct dp_parcel *parcel)
+{
+	const char *parts[4];
+	char *key;
+	size_t len;
+	
+	parts[0] = parcel->sender_addr->user->identifier;
+	parts[1] = parcel->sender_addr->host->identifier;
+	parts[2] = parcel->recipient_addr->user->identifier;
+	parts[3] = parcel->recipient_addr->host->identifier;
+	len = 4; /* '@', '>', '@' and \0 */
+	
+	for (int i = 0; i < 4; i++) {
+		if (!parts[i])
+			parts[i] = "";
+		
+		len += strlen(parts[i]);
+	}
+	
+	key = (char *)calloc(len, sizeof(char));
+	snprintf(key, len, "%s@%s>%s@%s", parts[0], parts[1], parts[2], parts[3]);
+	
+	return key;
+}
+
+/*
+ * Returns the sending counter of the parcel's
+ * conversation, making it if asked to. The caller
+ * holds order_counters_lock.
+ */
+struct dp_counter *order_counter_get(const struct dp_parcel *parcel, int make)
+{
+	struct dp_counter *counter;
+	char *key;
+	uint32_t i_bucket;
+	
+	key = key_make(parcel);
+	i_bucket = (uint32_t)(key_hash(key) >> 32) & (DP_ORDER_BUCKETS - 1);
+	
+	for (counter = order_counters[i_bucket]; counter; counter = counter->next) {
+		if (strcmp(counter->key, key) == 0)
+			break;
+	}
+	
+	if (!counter &&
+	    make) {
+		counter = (struct dp_counter *)malloc(sizeof(*counter));
+		counter->key = key;
+		counter->next = order_counters[i_bucket];
+		counter->seq_next = 1;
+		order_counters[i_bucket] = counter;
+		key = NULL;
+	}
+	
+	if (key)
+		free(key);
+	
+	return counter;
+}
+
+/*
+ * Starts one delivery worker per CPU.
+ */
+int order_bootstrap(void)
+{
+	long cpus;
+	
+	order_epoch = order_epoch_make();
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	if (cpus < 1)
+		cpus = 1;
+	else if (cpus > DP_ORDER_WORKERS_MAX)
+		cpus = DP_ORDER_WORKERS_MAX;
+	
+	order_workers_count = (int)cpus;
+	order_workers = (struct dp_worker *)calloc(order_workers_count, sizeof(*order_workers));
+	
+	for (int i = 0; i < order_workers_count; i++) {
+		struct dp_worker *worker;
+		int result;
+		
+		worker = &order_workers[i];
+		worker->time_swept = time_ms();
+		pthread_mutex_init(&worker->lock, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+		
+		if ((result = pthread_create(&worker->thread, NULL, worker_run, worker)) != 0) {
+			trace_write(DP_TRACE_ERROR, "order_bootstrap(0), pthread_create(4): %s", strerror(result));
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+/*
+ * Returns this run's epoch: the current time, or one
+ * past the previous run's epoch if that is later (the
+ * daemon restarted within the same second, or the clock
+ * went back). It is saved for the next run.
+ */
+uint32_t order_epoch_make(void)
+{
+	struct path *path_file_epoch;
+	char *text;
+	char buffer[16];
+	uint32_t epoch;
+	
+	path_file_epoch = home_dir_get();
+	path_append(&path_file_epoch, DP_DIR_CONF);
+	path_append(&path_file_epoch, DP_FILE_EPOCH);
+	epoch = (uint32_t)timestamp();
+	
+	if (readt(path_file_epoch, &text) > 0 &&
+	    text) {
+		uint32_t epoch_last;
+		
+		epoch_last = (uint32_t)strtoul(text, NULL, 10);
+		
+		if (epoch_last >= epoch)
+			epoch = epoch_last + 1;
+	}
+	
+	if (text)
+		free(text);
+	
+	snprintf(buffer, sizeof(buffer), "%u\n", epoch);
+	
+	if (writet(path_file_epoch, buffer) != strlen(buffer))
+		trace_write(DP_TRACE_WARN, "order_epoch_make(0), fwrite(4): %s", strerror(errno));
+	
+	path_free(&path_file_epoch);
+	
+	return epoch;
+}
+
+/*
+ * Delivers the parcel now or holds it back, depending
+ * on where it falls in its conversation.
+ */
+void order_process(struct dp_worker *worker, struct dp_delivery *delivery)
+{
+	struct dp_convo *convo;
+	char *key;
+	uint32_t epoch;
+	uint32_t seq;
+	
+	epoch = (uint32_t)(delivery->parcel->head.sequence >> 32);
+	seq = (uint32_t)delivery->parcel->head.sequence;
+	
+	/* Unordered parcel. */
+	if (seq == 0) {
+		delivery_finish(delivery);
+		return;
+	}
+	
+	key = key_make(delivery->parcel);
+	convo = convo_get(worker, key, key_hash(key));
+	convo->time_active = time_ms();
+	free(key);
+	
+	if (convo->epoch == 0) {
+		/*
+		 * First parcel seen from this conversation. If we are
+		 * joining its epoch midway (we restarted, not the
+		 * sender), what came before was delivered by the last
+		 * run, so the count goes on from this parcel.
+		 */
+		convo->epoch = epoch;
+		convo->seq_next = seq;
+	} else if (epoch > convo->epoch) {
+		/* The sender restarted; whatever was held from before can go now. */
+		while (convo->pending)
+			convo_skip(convo, worker);
+		
+		convo->epoch = epoch;
+		convo->seq_next = 1;
+	} else if (epoch < convo->epoch) {
+		/* Straggler from before a restart. */
+		delivery_finish(delivery);
+		return;
+	}
+	
+	if (seq == convo->seq_next) {
+		convo->seq_next++;
+		delivery_finish(delivery);
+		convo_drain(convo, worker);
+	} else if (seq > convo->seq_next) {
+		convo_hold(convo, worker, delivery);
+	} else {
+		/* Its place was already given up on. */
+		delivery_finish(delivery);
+	}
+}
+
+/*
+ * Hands the parcel's sequence number back if it is the
+ * last one its conversation gave out. Meant for parcels
+ * that never got acknowledged; going from the last one
+ * back, every one whose number is handed back leaves
+ * no gap behind.
+ */
+void order_sequence_return(const struct dp_parcel *parcel)
+{
+	struct dp_counter *counter;
+	
+	if ((uint32_t)(parcel->head.sequence >> 32) != order_epoch ||
+	    (uint32_t)parcel->head.sequence == 0)
+		return;
+	
+	pthread_mutex_lock(&order_counters_lock);
+	
+	if ((counter = order_counter_get(parcel, 0)) &&
+	    counter->seq_next == (uint32_t)parcel->head.sequence + 1)
+		counter->seq_next--;
+	
+	pthread_mutex_unlock(&order_counters_lock);
+}
+
+/*
+ * Returns the next sequence number for the parcel's
+ * conversation. It is taken right before the parcel is
+ * sent; see order_sequence_return(1).
+ */
+uint64_t order_sequence_next(const struct dp_parcel *parcel)
+{
+	uint32_t seq;
+	
+	pthread_mutex_lock(&order_counters_lock);
+	seq = order_counter_get(parcel, 1)->seq_next++;
+	pthread_mutex_unlock(&order_counters_lock);
+	
+	return ((uint64_t)order_epoch << 32) | seq;
+}
+
+/*
+ * Hands the parcel over to the worker that owns its
+ * conversation. done is called from that worker once
+ * the parcel is delivered. Without workers, the parcel
+ * is delivered right away.
+ */
+void order_submit(struct dp_parcel *parcel, dp_delivered done, void *context)
+{
+	struct dp_delivery *delivery;
+	struct dp_worker *worker;
+	char *key;
+	
+	delivery = (struct dp_delivery *)calloc(1, sizeof(*delivery));
+	delivery->parcel = parcel;
+	delivery->done = done;
+	delivery->context = context;
+	
+	if (order_workers_count == 0) {
+		delivery_finish(delivery);
+		return;
+	}
+	
+	key = key_make(parcel);
+	worker = &order_workers[key_hash(key) % order_workers_count];
+	free(key);
+	
+	pthread_mutex_lock(&worker->lock);
+	
+	if (worker->queue_tail)
+		worker->queue_tail->next = delivery;
+	else
+		worker->queue = delivery;
+	
+	worker->queue_tail = delivery;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+void *worker_run(void *args)
+{
+	struct dp_worker *worker;
+	
+	worker = (struct dp_worker *)args;
+	
+	while (1) {
+		struct dp_delivery *batch;
+		
+		pthread_mutex_lock(&worker->lock);
+		
+		while (!worker->queue) {
+			struct timespec deadline;
+			
+			/* Wake up now and then to let held parcels and idle conversations expire. */
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += worker->held > 0 ? 1 : DP_ORDER_IDLE_MAX / 1000;
+			
+			if (pthread_cond_timedwait(&worker->cond, &worker->lock, &deadline) != 0)
+				break;
+		}
+		
+		/* Take the whole queue in one go. */
+		batch = worker->queue;
+		worker->queue = NULL;
+		worker->queue_tail = NULL;
+		
+		pthread_mutex_unlock(&worker->lock);
+		
+		while (batch) {
+			struct dp_delivery *delivery;
+			
+			delivery = batch;
+			batch = batch->next;
+			delivery->next = NULL;
+			order_process(worker, delivery);
+		}
+		
+		convos_expire(worker);
+	}
+	
+	return 0;
+}
@@ -0,0 +1,41 @@
+//
+//  order.h
+//  server
+//
+
+#ifndef ORDER_H
+#define ORDER_H
+
+
+#include "protocol.h"
+
+
+#define DP_ORDER_BUCKETS	1024	/* Conversation hash buckets per worker; must be a power of 2. */
+
+/*************
+ * CONSTANTS *
+ *************/
+static const int DP_ORDER_HOLD_MAX 		= 5 * 1000;		/* How long (in milliseconds) a parcel waits for a missing predecessor. */
+static const int DP_ORDER_IDLE_MAX 		= 10 * 60 * 1000;	/* How long (in milliseconds) before an idle conversation is forgotten. */
+static const int DP_ORDER_PENDING_MAX 		= DP_PROTO_HOST_ACK_MAX / 2;	/* The maximum number of parcels held back per conversation; fewer than a connection lets be in flight, so it never stops reading with all of them held. */
+static const int DP_ORDER_WORKERS_MAX 		= 16;
+
+/**************
+ * STRUCTURES *
+ **************/
+/*
+ * Called once a parcel is delivered (or fails to be).
+ * The parcel is freed right after.
+ */
+typedef void (*dp_delivered)(void *, const struct dp_parcel *, struct dp_reqstatus);
+
+/*************
+ * FUNCTIONS *
+ *************/
+int order_bootstrap(void);
+uint64_t order_sequence_next(const struct dp_parcel *);
+void order_sequence_return(const struct dp_parcel *);
+void order_submit(struct dp_parcel *, dp_delivered, void *);
+
+
+#endif /* ORDER_H */
@@ -9,26 +9,207 @@
 #include "protocol.h"
 
 #include "disk.h"
+#include "eventlog.h"
+#include "index.h"
+#include "keyring.h"
+#include "merkle.h"
 #include "net.h"
+#include "offload.h"
+#include "order.h"
+#include "scan.h"
 #include <stdio.h>
 #include <string.h>
+#include "sync.h"
+#include "trace.h"
+#include <unistd.h>
 
 
+/**************
+ * STRUCTURES *
+ **************/
+/*
+ * One piece of sealing work for the crypto workers;
+ * see seals_make().
+ */
+struct dp_seal_job {
+	const struct dp_seal *seal;
+	EVP_PKEY *pkey;
+	struct data64 **head_out;
+};
+
+/*
+ * Hashes one parcel of a batch to be signed; see
+ * parcels_sign().
+ */
+struct dp_leaf_job {
+	const struct data16 *head;
+	const struct data64 *body;
+	const struct dp_tail *tail;
+	unsigned char *leaf;
+};
+/**********************/
+
+/********************
+ * Global Variables
+ ********************/
+extern struct path *path_dir_root; /* See main.c */
+/**********************/
+
 /**********************
  * Private Prototypes
  **********************/
+void addr_free(struct dp_addr **);
+int component_valid(const char *);
 int delimiter_check(const char *, size_t);
-void directory_process(const struct filelist *, int);
-void directory_scan(struct path *, int);
-int header_deserialise(const struct data16 *, struct dp_parcel_head *);
+int filename_get(const char *, char **);
 int header_serialise(const struct dp_parcel_head, uint64_t, struct data16 **);
+int leaf_work(void *);
 int parcel_deserialise(const struct data64 *, struct dp_parcel *);
 void parcel_filename_set(struct dp_parcel *, const char *);
-void parcel_recipient_addr_set(struct dp_parcel *, const char *);
+void parcel_sent_log(const struct dp_parcel *);
 int parcel_serialise(const struct dp_parcel *, struct data64 **);
+int parcel_single_send(const struct dp_parcel *, const struct dp_tail *, EVP_PKEY *, uint16_t *);
+int parcel_tail_serialise(const struct dp_parcel *, const struct data64 *, uint64_t, struct data64 **);
+int recipient_host_compare(const void *, const void *);
+int recipients_get(const char *, const char *, const char *, char ***, size_t *);
+int seal_head_work(void *);
+void seals_make(struct data64 **, size_t, EVP_PKEY **, size_t, struct dp_seal **, struct data64 **);
 /**********************/
 
 
+/*
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int ack_deserialise(const struct data64 *ack_data, struct dp_ack **out, uint16_t *count)
+{
+	int pos;
+	
+	if (!ack_data ||
+	    !out ||
+	    !count)
+		return 1;
+	
+	*out = NULL;
+	*count = 0;
+	pos = 0;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Acknowledgement count (2 bytes)
+	 * 2) UUID (16 bytes)
+	 * 3) Status code (2 bytes)
+	 * ...2) and 3) repeat for every acknowledgement.
+	 */
+	if (ack_data->len < sizeof(uint16_t))
+		return -1;
+	
+	/* 1) Acknowledgement count (2 bytes) */
+	*count = ack_data->bytes[pos + 1] |
+		( (uint16_t)ack_data->bytes[pos] << 8 );
+	pos += sizeof(uint16_t);
+	
+	if (ack_data->len < pos + (uint64_t)*count * DP_PROTO_HOST_ACK_ENTRY_LEN) {
+		*count = 0;
+		return -1;
+	}
+	
+	*out = (struct dp_ack *)calloc(*count, sizeof(**out));
+	
+	for (int i = 0; i < *count; i++) {
+		/* 2) UUID (16 bytes) */
+		memcpy((*out)[i].uuid, &ack_data->bytes[pos], UUID_LEN * sizeof(unsigned char));
+		pos += UUID_LEN * sizeof(unsigned char);
+		
+		/* 3) Status code (2 bytes) */
+		(*out)[i].code = ack_data->bytes[pos + 1] |
+			( (uint16_t)ack_data->bytes[pos] << 8 );
+		pos += sizeof(uint16_t);
+	}
+	
+	return 0;
+}
+
+/*
+ * Serialises a batch of acknowledgements into a
+ * complete message, i.e. a header and a body.
+ * It is the caller's responsibility to free the
+ * returned pointers.
+ */
+int ack_serialise(const struct dp_ack *acks, uint16_t count, struct data16 **head_out, struct data64 **body_out)
+{
+	struct dp_parcel_head head;
+	int pos;
+	
+	if (!acks ||
+	    !head_out ||
+	    !body_out)
+		return 1;
+	
+	pos = 0;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Acknowledgement count (2 bytes)
+	 * 2) UUID (16 bytes)
+	 * 3) Status code (2 bytes)
+	 * ...2) and 3) repeat for every acknowledgement.
+	 */
+	*body_out = (struct data64 *)malloc(sizeof(**body_out));
+	(*body_out)->len = sizeof(uint16_t) + count * DP_PROTO_HOST_ACK_ENTRY_LEN;
+	(*body_out)->bytes = (unsigned char *)calloc((*body_out)->len, sizeof(unsigned char));
+	
+	/* 1) Acknowledgement count (2 bytes) */
+	(*body_out)->bytes[pos]   = (count >> 8) & 0xff;
+	(*body_out)->bytes[++pos] = count & 0xff;
+	
+	for (int i = 0; i < count; i++) {
+		/* 2) UUID (16 bytes) */
+		memcpy(&(*body_out)->bytes[++pos], acks[i].uuid, UUID_LEN * sizeof(unsigned char));
+		pos += UUID_LEN * sizeof(unsigned char);
+		
+		/* 3) Status code (2 bytes) */
+		(*body_out)->bytes[pos]   = (acks[i].code >> 8) & 0xff;
+		(*body_out)->bytes[++pos] = acks[i].code & 0xff;
+	}
+	
+	memset(&head, 0, sizeof(head));
+	head.timestamp = timestamp();
+	head.type = DP_PROTO_HOST_MSG_ACK;
+	uuid_generate(head.uuid);
+	
+	return header_serialise(head, (*body_out)->len, head_out);
+}
+
+void addr_free(struct dp_addr **addr)
+{
+	if (addr &&
+	    *addr) {
+		if ((*addr)->host) {
+			if ((*addr)->host->identifier)
+				free((*addr)->host->identifier);
+			
+			if ((*addr)->host->pkey)
+				EVP_PKEY_free((*addr)->host->pkey);
+			
+			free((*addr)->host);
+		}
+		
+		if ((*addr)->user) {
+			if ((*addr)->user->identifier)
+				free((*addr)->user->identifier);
+			
+			if ((*addr)->user->pkey)
+				EVP_PKEY_free((*addr)->user->pkey);
+			
+			free((*addr)->user);
+		}
+		
+		free(*addr);
+		*addr = NULL;
+	}
+}
+
 /*
  * It is the caller's responsibility to free the
  * returned pointer.
@@ -115,59 +296,430 @@ int arg_val_get(const char *token, char **arg_val)
 	
 	if (val_start > 0) {
 		/* Extract the value. */
+		len_arg = len_token - val_start - 1;
 		*arg_val = (char *)calloc(len_arg + 1, sizeof(**arg_val));
-		strncpy(*arg_val, token + val_start + 1, len_token - val_start - 1);
+		strncpy(*arg_val, token + val_start + 1, len_arg);
 	}
 	
 	return 0;
 }
 
 /*
+ * Returns DP_REQOK along with the parcel a basis
+ * message is about; it has no payload.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+struct dp_reqstatus basis_parse(const struct data16 *head_data, const struct data64 *basis_data, struct dp_parcel **out)
+{
+	struct dp_parcel *parcel;
+	uint64_t end;
+	uint64_t size;
+	
+	if (!head_data ||
+	    !basis_data ||
+	    !out)
+		return DP_REQERR_INT_BADARG;
+	
+	*out = NULL;
+	parcel = parcel_make();
+	header_deserialise(head_data, &(parcel->head));
+	
+	/*
+	 * STRUCTURE
+	 * 1) Envelope; see envelope_serialise()
+	 */
+	if (envelope_deserialise(basis_data, parcel, &size, &end) != 0 ||
+	    end != basis_data->len) {
+		parcel_free(&parcel);
+		return DP_REQERR_BADREQ;
+	}
+	
+	*out = parcel;
+	
+	return DP_REQOK;
+}
+
+/*
+ * Asks the recipient's host for the block signatures
+ * of its copy of the parcel's file, if it has one.
+ * It is the caller's responsibility to free the
+ * returned pointers.
+ */
+int basis_serialise(const struct dp_parcel *parcel, struct data16 **head_out, struct data64 **body_out)
+{
+	struct dp_parcel_head head;
+	int status;
+	
+	if (!parcel ||
+	    !parcel->payload ||
+	    !head_out ||
+	    !body_out)
+		return 1;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Envelope; see envelope_serialise()
+	 */
+	if ((status = envelope_serialise(parcel, parcel->payload->len, 0, body_out)) != 0)
+		return status;
+	
+	head = parcel->head;
+	head.type = DP_PROTO_HOST_MSG_BASIS;
+	uuid_generate(head.uuid);
+	
+	return header_serialise(head, (*body_out)->len, head_out);
+}
+
+/*
+ * Every file in the request becomes a parcel to each
+ * recipient: the one given, or the members of the list
+ * it names (see recipients_get()). Parcels to the same
+ * host are sent over one connection.
+ * Recipients whose public key the sender has get the
+ * file sealed. However many of them there are, the file
+ * is encrypted only once; just the key is wrapped for
+ * each (see seals_make()), and the records made for the
+ * first are read back for the rest (see tail_read()).
+ * A request naming a contact to sync instead syncs the
+ * sender's directory for each recipient with their host;
+ * see sync.c.
  * Note: this function will free the passed request token list.
  */
 struct dp_reqstatus client_request_parse(struct token *request)
 {
-	struct data16 *head_data;
-	struct data64 *parcel_data;
-	struct dp_parcel *parcel;
+	char **recipients;
+	char *recipient;
+	const char **filenames;
+	const char *sender_host;
+	const char *sender_user;
+	const char *sync;
+	struct data16 **head_data;
+	struct data64 **parcel_data;
+	struct data64 **payloads;
+	struct data64 **seal_heads;
+	struct dp_parcel **parcels;
+	struct dp_reqstatus status;
+	struct dp_seal **seals;
+	struct dp_tail *tails;
 	struct token *iter_req;
+	EVP_PKEY **pkeys;
+	EVP_PKEY *pkey_host;
+	uint16_t *codes;
+	size_t count_batch;
+	size_t count_files;
+	size_t count_parcels;
+	size_t count_recipients;
+	size_t count_sign;	/* Parcels per batch signature */
+	size_t count_single;	/* Parcels sent on their own rather than in a batch */
+	int sealing;
 	
 	if (!request)
 		return DP_REQERR_INT_BADARG;
 	
+	count_files = 0;
+	count_parcels = 0;
+	count_single = 0;
 	iter_req = request;
-	parcel = parcel_make();
+	recipient = NULL;
+	sender_host = "bar.com";
+	sender_user = "foo";
+	sync = NULL;
 	
 	/* Loop over all tokens. */
 	while (iter_req) {
 		if (iter_req->name) {
 			if (strcmp(iter_req->name, DP_PROTO_SERV_ARG_FILE) == 0)
-				parcel_filename_set(parcel, iter_req->val);
+				count_files++;
 			else if (strcmp(iter_req->name, DP_PROTO_SERV_ARG_RECIP) == 0)
-				parcel_recipient_addr_set(parcel, iter_req->val);
+				recipient = iter_req->val;
+			else if (strcmp(iter_req->name, DP_PROTO_SERV_ARG_SYNC) == 0)
+				sync = iter_req->val;
 		}
 		
 		iter_req = iter_req->next;
 	}
 	
-	file_get(path_make(parcel->raw_filename), &(parcel->payload));
-	service_get(parcel->raw_filename, &(parcel->service));
-	parcel->head.type = DP_PROTO_HOST_MSG_PARCEL;
-	parcel->sender_addr->host->identifier = "bar.com";
-	parcel->sender_addr->user->identifier = "foo";
+	if (sync) {
+		if (recipients_get(sender_host, sender_user, sync, &recipients, &count_recipients) != 0) {
+			trace_write(DP_TRACE_WARN, "%s: the list has no members", sync);
+			return DP_REQERR_NOTFOUND;
+		}
+		
+		status = DP_REQOK;
+		
+		for (size_t i = 0; i < count_recipients; i++) {
+			if (sync_contact(sender_host, sender_user, recipients[i]).code != DP_REQOK.code)
+				status = DP_REQERR_INTERNAL;
+			
+			free(recipients[i]);
+		}
+		
+		free(recipients);
+		
+		return status;
+	}
 	
-	printf("RAW FILENAME: %s\n", parcel->raw_filename);
-	printf("FILE IS %lu byte(s)\n", parcel->payload->len);
-	printf("SERVICE: %s\n", parcel->service);
-	printf("TO: %s AT %s\n", parcel->recipient_addr->user->identifier, parcel->recipient_addr->host->identifier);
+	if (count_files == 0 ||
+	    !recipient)
+		return DP_REQERR_BADREQ;
 	
-	parcel_serialise(parcel, &parcel_data);
-	header_serialise(parcel->head, parcel_data->len, &head_data);
+	if (recipients_get(sender_host, sender_user, recipient, &recipients, &count_recipients) != 0) {
+		trace_write(DP_TRACE_WARN, "%s: the list has no members", recipient);
+		return DP_REQERR_NOTFOUND;
+	}
 	
-	data64_send(parcel->recipient_addr->host->identifier, head_data, parcel_data);
-	parcel_free(&parcel);
+	filenames = (const char **)calloc(count_files, sizeof(*filenames));
+	payloads = (struct data64 **)calloc(count_files, sizeof(*payloads));
+	seals = (struct dp_seal **)calloc(count_files, sizeof(*seals));
+	count_files = 0;
 	
-	return DP_REQOK;
+	/* Every file is read once, whatever the number of recipients. */
+	for (iter_req = request; iter_req; iter_req = iter_req->next) {
+		struct path *path_file;
+		
+		if (!iter_req->name ||
+		    strcmp(iter_req->name, DP_PROTO_SERV_ARG_FILE) != 0)
+			continue;
+		
+		filenames[count_files] = iter_req->val;
+		path_file = path_make(iter_req->val);
+		
+		if (file_get(path_file, &payloads[count_files]) != 0) {
+			trace_write(DP_TRACE_WARN, "Unable to read %s", iter_req->val);
+			payloads[count_files] = NULL;
+		}
+		
+		if (path_file)
+			path_free(&path_file);
+		
+		count_files++;
+	}
+	
+	codes = (uint16_t *)calloc(count_files * count_recipients, sizeof(*codes));
+	head_data = (struct data16 **)calloc(count_files * count_recipients, sizeof(*head_data));
+	parcel_data = (struct data64 **)calloc(count_files * count_recipients, sizeof(*parcel_data));
+	parcels = (struct dp_parcel **)calloc(count_files * count_recipients, sizeof(*parcels));
+	tails = (struct dp_tail *)calloc(count_files * count_recipients, sizeof(*tails));
+	status = DP_REQOK;
+	
+	pkeys = (EVP_PKEY **)calloc(count_recipients, sizeof(*pkeys));
+	seal_heads = (struct data64 **)calloc(count_files * count_recipients, sizeof(*seal_heads));
+	sealing = 0;
+	
+	for (size_t i = 0; i < count_recipients; i++) {
+		struct path *path_key;
+		
+		if ((path_key = contact_dir_get(sender_host, sender_user, recipients[i]))) {
+			path_append(&path_key, DP_FILE_PUBKEY);
+			
+			if ((pkeys[i] = keyring_get(path_cstr(path_key), 0)))
+				sealing = 1;
+			
+			path_free(&path_key);
+		}
+	}
+	
+	if (sealing)
+		seals_make(payloads, count_files, pkeys, count_recipients, seals, seal_heads);
+	
+	pkey_host = signing_key_get();
+	count_sign = pkey_host ? config_sign_get() : 0;
+	
+	for (size_t i = 0; i < count_recipients; i++) {
+		for (size_t j = 0; j < count_files; j++) {
+			struct data64 *seal_head;
+			struct dp_parcel *parcel;
+			struct dp_tail tail;
+			uint64_t size;
+			uint16_t code;
+			
+			if (!payloads[j])
+				continue;
+			
+			seal_head = seal_heads[i * count_files + j];
+			
+			if (pkeys[i] &&
+			    !seal_head) {
+				trace_write(DP_TRACE_WARN, "%s: unable to seal for %s", filenames[j], recipients[i]);
+				status = DP_REQERR_INTERNAL;
+				
+				continue;
+			}
+			
+			/* A sealed payload is only sealed as it goes out; see tail_read(). */
+			tail.payload = payloads[j];
+			tail.seal_head = seal_head;
+			tail.seal = seal_head ? seals[j] : NULL;
+			tail.len = (seal_head ? seal_head->len + seal_len(payloads[j]->len) : payloads[j]->len);
+			tail.offset = 0;
+			size = tail.len;
+			
+			parcel = parcel_make();
+			parcel_filename_set(parcel, filenames[j]);
+			parcel_recipient_addr_set(parcel, recipients[i]);
+			service_get(parcel->raw_filename, &(parcel->service));
+			parcel->head.type = DP_PROTO_HOST_MSG_PARCEL;
+			parcel->sender_addr->host->identifier = (char *)calloc(strlen(sender_host) + 1, sizeof(char));
+			parcel->sender_addr->user->identifier = (char *)calloc(strlen(sender_user) + 1, sizeof(char));
+			strcpy(parcel->sender_addr->host->identifier, sender_host);
+			strcpy(parcel->sender_addr->user->identifier, sender_user);
+			
+			if (pkeys[i] &&
+			    EVP_PKEY_up_ref(pkeys[i]) == 1)
+				parcel->recipient_addr->user->pkey = pkeys[i];
+			
+			trace_write(DP_TRACE_INFO, "RAW FILENAME: %s", parcel->raw_filename);
+			trace_write(DP_TRACE_INFO, "FILE IS %lu byte(s)%s", size, seal_head ? " (sealed)" : "");
+			trace_write(DP_TRACE_INFO, "SERVICE: %s", parcel->service);
+			trace_write(DP_TRACE_INFO, "TO: %s AT %s", parcel->recipient_addr->user->identifier, parcel->recipient_addr->host->identifier);
+			
+			if (size >= DP_PROTO_HOST_DELTA_MIN) {
+				int result;
+				
+				parcel->payload = payloads[j];
+				parcel->head.sequence = order_sequence_next(parcel);
+				result = parcel_single_send(parcel, &tail, pkey_host, &code);
+				
+				if (result == 1 ||
+				    code == 0)
+					order_sequence_return(parcel);
+				
+				parcel->payload = NULL;
+				
+				if (result == 0) {
+					if (code == 0) {
+						trace_write(DP_TRACE_WARN, "%s: no acknowledgement", parcel->raw_filename);
+						status = DP_REQERR_INTERNAL;
+					} else {
+						trace_write(DP_TRACE_INFO, "%s: %u", parcel->raw_filename, code);
+						
+						if (code != DP_REQOK.code)
+							status = DP_REQERR_INTERNAL;
+						else
+							parcel_sent_log(parcel);
+					}
+					
+					count_single++;
+					parcel_free(&parcel);
+					
+					continue;
+				}
+			}
+			
+			/* The payload goes out as a tail; the seal head, if any, goes in the body. */
+			tail.seal_head = NULL;
+			tail.len = size - (seal_head ? seal_head->len : 0);
+			parcel_tail_serialise(parcel, seal_head, tail.len, &parcel_data[count_parcels]);
+			tails[count_parcels] = tail;
+			parcels[count_parcels] = parcel;
+			count_parcels++;
+		}
+	}
+	
+	/* Recipients are sorted by host, so parcels to the same host are next to each other. */
+	for (size_t i = 0; i < count_parcels; i += count_batch) {
+		const char *host;
+		
+		host = parcels[i]->recipient_addr->host->identifier;
+		
+		for (count_batch = 1; i + count_batch < count_parcels; count_batch++) {
+			const char *host_next;
+			
+			host_next = parcels[i + count_batch]->recipient_addr->host->identifier;
+			
+			if (host_next != host &&
+			    (!host ||
+			     !host_next ||
+			     strcmp(host, host_next) != 0))
+				break;
+		}
+		
+		for (size_t j = i; j < i + count_batch; j++) {
+			parcels[j]->head.sequence = order_sequence_next(parcels[j]);
+			header_serialise(parcels[j]->head, parcel_data[j]->len + tails[j].len, &head_data[j]);
+		}
+		
+		if (count_sign > 0) {
+			for (size_t j = 0; j < count_batch; j += count_sign) {
+				size_t count_signed;
+				
+				count_signed = count_batch - j < count_sign ? count_batch - j : count_sign;
+				
+				if (parcels_sign(&head_data[i + j], &parcel_data[i + j], &tails[i + j], count_signed, pkey_host) != 0)
+					trace_write(DP_TRACE_WARN, "Unable to sign parcels to %s", host ? host : DP_DIR_DEFAULT);
+			}
+		}
+		
+		data64_batch_send(host, &head_data[i], &parcel_data[i], &tails[i], count_batch, &codes[i]);
+		
+		for (size_t j = i + count_batch; j > i && codes[j - 1] == 0; j--)
+			order_sequence_return(parcels[j - 1]);
+	}
+	
+	if (pkey_host)
+		EVP_PKEY_free(pkey_host);
+	
+	if (count_parcels == 0 &&
+	    count_single == 0)
+		status = DP_REQERR_BADREQ;
+	
+	for (size_t i = 0; i < count_parcels; i++) {
+		if (codes[i] == 0) {
+			trace_write(DP_TRACE_WARN, "%s: no acknowledgement", parcels[i]->raw_filename);
+			status = DP_REQERR_INTERNAL;
+		} else {
+			trace_write(DP_TRACE_INFO, "%s: %u", parcels[i]->raw_filename, codes[i]);
+			
+			if (codes[i] != DP_REQOK.code)
+				status = DP_REQERR_INTERNAL;
+			else
+				parcel_sent_log(parcels[i]);
+		}
+		
+		free(head_data[i]->bytes);
+		free(head_data[i]);
+		free(parcel_data[i]->bytes);
+		free(parcel_data[i]);
+		parcel_free(&parcels[i]);
+	}
+	
+	for (size_t i = 0; i < count_files; i++) {
+		if (file_release(&payloads[i]) == -1) {
+			trace_write(DP_TRACE_WARN, "%s was cut short while it was sent", filenames[i]);
+			status = DP_REQERR_INTERNAL;
+		}
+		
+		seal_free(&seals[i]);
+	}
+	
+	for (size_t i = 0; i < count_recipients; i++) {
+		for (size_t j = 0; j < count_files; j++) {
+			if (seal_heads[i * count_files + j]) {
+				free(seal_heads[i * count_files + j]->bytes);
+				free(seal_heads[i * count_files + j]);
+			}
+		}
+		
+		if (pkeys[i])
+			EVP_PKEY_free(pkeys[i]);
+		
+		free(recipients[i]);
+	}
+	
+	free(codes);
+	free(filenames);
+	free(head_data);
+	free(parcel_data);
+	free(parcels);
+	free(payloads);
+	free(pkeys);
+	free(recipients);
+	free(seal_heads);
+	free(seals);
+	free(tails);
+	
+	return status;
 }
 
 /*
@@ -267,6 +819,10 @@ int client_request_tokenise(const char *reqstr, uint16_t len, struct token **req
 			
 			/* Check if this is the end of the request. */
 			if (eor == 1) {
+				/* A request without a single argument is invalid. */
+				if (!last_line)
+					return -1;
+				
 				/* 8<-- Snip off the list. -- */
 				last_line->next = NULL;
 				return 0;
@@ -282,6 +838,73 @@ int client_request_tokenise(const char *reqstr, uint16_t len, struct token **req
 	return 1;
 }
 
+/*
+ * Checks that an address part can safely be used
+ * as a single path component.
+ */
+int component_valid(const char *component)
+{
+	if (!component ||
+	    strlen(component) == 0)
+		return 0;
+	
+	if (strcmp(component, ".") == 0 ||
+	    strcmp(component, "..") == 0 ||
+	    strchr(component, '/'))
+		return 0;
+	
+	return 1;
+}
+
+/*
+ * Returns the directory the sender keeps for one of
+ * their contacts, i.e. <sender host>/<sender user>/<host>/<user>,
+ * or <sender host>/<sender user>/<user> for an address
+ * without a host, such as a mailing list.
+ * Returns NULL if the address cannot name a directory.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+struct path *contact_dir_get(const char *sender_host, const char *sender_user, const char *addr)
+{
+	char *host;
+	char *user;
+	struct path *path_dir;
+	
+	host = NULL;
+	user = NULL;
+	path_dir = NULL;
+	host_get(addr, &host);
+	user_get(addr, &user);
+	
+	if (component_valid(user) == 1 &&
+	    (!host ||
+	     component_valid(host) == 1)) {
+		path_dir = path_copy(path_dir_root);
+		path_append(&path_dir, sender_host);
+		
+		if (directory_exists(path_dir) != 1) {
+			path_pop(&path_dir);
+			path_append(&path_dir, DP_DIR_DEFAULT);
+		}
+		
+		path_append(&path_dir, sender_user);
+		
+		if (host)
+			path_append(&path_dir, host);
+		
+		path_append(&path_dir, user);
+	}
+	
+	if (host)
+		free(host);
+	
+	if (user)
+		free(user);
+	
+	return path_dir;
+}
+
 int delimiter_check(const char *str, size_t index)
 {
 	size_t len;
@@ -321,236 +944,444 @@ int delimiter_check(const char *str, size_t index)
 	return delimited;
 }
 
-void directory_process(const struct filelist *files, int depth)
+void delta_free(struct dp_delta **delta)
 {
-	/* Skip the root directory. */
-	if (depth == 0)
-		return;
-	
-	if (depth == 1) {
-		/* Sender's domain. */
-		
-	} else if (depth == 2) {
-		/* Sender's username. */
-		
-	} else if (depth == 3) {
-		/* Recipient's domain. */
-		
-	} else if (depth == 4) {
-		/* Recipient's username. */
-		
-	} else {
-		/* Nested directories for organisation purposes. */
-		
+	if (delta &&
+	    *delta) {
+		parcel_free(&(*delta)->parcel);
+		free(*delta);
+		*delta = NULL;
 	}
 }
 
-void directory_scan(struct path *path, int depth)
+/*
+ * Parses a delta message. The instructions are left
+ * where they are in delta_data, which has to outlive
+ * the returned delta.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+struct dp_reqstatus delta_parse(const struct data16 *head_data, const struct data64 *delta_data, struct dp_delta **out)
 {
-	struct filelist *files;
-	struct filelist *iter;
+	struct data64 envelope;
+	struct dp_delta *delta;
+	uint64_t end;
+	uint64_t pos;
+	uint32_t envelope_size;
+	
+	if (!head_data ||
+	    !delta_data ||
+	    !out)
+		return DP_REQERR_INT_BADARG;
+	
+	*out = NULL;
+	
+	if (delta_data->len < DP_PROTO_HOST_DELTA_HEAD_LEN)
+		return DP_REQERR_BADREQ;
 	
-	printf("Scanning %s…\n", path->component);
-	filelist_get(path, &files);
+	delta = (struct dp_delta *)calloc(1, sizeof(*delta));
+	delta->parcel = parcel_make();
+	pos = 0;
+	header_deserialise(head_data, &(delta->parcel->head));
 	
 	/*
-	 * Analysis of directory at current depth, i.e.
-	 * what files ought to be present and creating
-	 * them if they're absent, checking the index,
-	 * etc.
+	 * STRUCTURE
+	 * 1) Payload checksum (32 bytes)
+	 * 2) Basis size (8 bytes)
+	 * 3) Block length (4 bytes)
+	 * 4) Envelope size (4 bytes)
+	 * 5) Envelope; see envelope_serialise()
+	 * 6) Instructions; see delta.c
 	 */
-	directory_process(files, depth);
 	
-	iter = files;
+	/* 1) Payload checksum (32 bytes) */
+	memcpy(delta->checksum, delta_data->bytes, SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+	pos += SHA256_DIGEST_LENGTH * sizeof(unsigned char);
 	
-	while (iter) {
-		/* The directory function requires an absolute path. */
-		path_append(&path, iter->path->component);
-		
-		if (is_directory(path) == 1)
-			directory_scan(path, depth + 1);
-		else
-			
-			path_pop(&path);
-		iter = iter->next;
-	}
+	/* 2) Basis size (8 bytes) */
+	delta->basis_size = delta_data->bytes[pos + 7] |
+		( (uint64_t)delta_data->bytes[pos + 6] << 8 ) |
+		( (uint64_t)delta_data->bytes[pos + 5] << 16 ) |
+		( (uint64_t)delta_data->bytes[pos + 4] << 24 ) |
+		( (uint64_t)delta_data->bytes[pos + 3] << 32 ) |
+		( (uint64_t)delta_data->bytes[pos + 2] << 40 ) |
+		( (uint64_t)delta_data->bytes[pos + 1] << 48 ) |
+		( (uint64_t)delta_data->bytes[pos] << 56 );
+	pos += sizeof(uint64_t);
 	
-	filelist_free(&files);
-}
-
-void *directory_tree_scan(void *root)
-{
-	struct path *path_dir_root;
+	/* 3) Block length (4 bytes) */
+	delta->block_len = delta_data->bytes[pos + 3] |
+		( (uint32_t)delta_data->bytes[pos + 2] << 8 ) |
+		( (uint32_t)delta_data->bytes[pos + 1] << 16 ) |
+		( (uint32_t)delta_data->bytes[pos] << 24 );
+	pos += sizeof(uint32_t);
+	
+	/* 4) Envelope size (4 bytes) */
+	envelope_size = delta_data->bytes[pos + 3] |
+		( (uint32_t)delta_data->bytes[pos + 2] << 8 ) |
+		( (uint32_t)delta_data->bytes[pos + 1] << 16 ) |
+		( (uint32_t)delta_data->bytes[pos] << 24 );
+	pos += sizeof(uint32_t);
 	
-	if (root) {
-		path_dir_root = (struct path *)root;
-		directory_scan(path_dir_root, 0);
+	/* 5) Envelope */
+	if (envelope_size > DP_PROTO_HOST_ENVELOPE_MAX ||
+	    envelope_size > delta_data->len - pos ||
+	    delta->block_len == 0) {
+		delta_free(&delta);
+		return DP_REQERR_BADREQ;
 	}
 	
-	return 0;
+	envelope.bytes = &delta_data->bytes[pos];
+	envelope.len = envelope_size;
+	
+	if (envelope_deserialise(&envelope, delta->parcel, &delta->size, &end) != 0 ||
+	    end != envelope.len) {
+		delta_free(&delta);
+		return DP_REQERR_BADREQ;
+	}
+	
+	pos += envelope_size;
+	
+	/* 6) Instructions */
+	delta->instructions.bytes = &delta_data->bytes[pos];
+	delta->instructions.len = delta_data->len - pos;
+	
+	service_get(delta->parcel->raw_filename, &(delta->parcel->service));
+	*out = delta;
+	
+	return DP_REQOK;
 }
 
-int header_deserialise(const struct data16 *head_data, struct dp_parcel_head *out)
+/*
+ * Makes a delta message out of the instructions for
+ * rebuilding the parcel's payload from a basis of the
+ * given size, cut into blocks of block_len bytes.
+ * checksum should be the sha() of the whole payload.
+ * The message carries the parcel's UUID.
+ * It is the caller's responsibility to free the
+ * returned pointers.
+ */
+int delta_serialise(const struct dp_parcel *parcel, const unsigned char checksum[], uint64_t basis_size, uint32_t block_len, const struct data64 *instructions, struct data16 **head_out, struct data64 **delta_out)
 {
+	struct data64 *envelope;
+	struct dp_parcel_head head;
 	int pos;
-	int status;
 	
-	pos = DP_PROTO_HOST_MAGIC_NUM_LEN + sizeof(DP_PROTO_SERV_VER);
-	status = 0;
+	if (!parcel ||
+	    !parcel->payload ||
+	    !instructions ||
+	    !head_out ||
+	    !delta_out)
+		return 1;
+	
+	if (envelope_serialise(parcel, parcel->payload->len, 0, &envelope) != 0)
+		return -1;
+	
+	pos = 0;
+	*delta_out = (struct data64 *)malloc(sizeof(**delta_out));
+	(*delta_out)->len = DP_PROTO_HOST_DELTA_HEAD_LEN + envelope->len + instructions->len;
+	(*delta_out)->bytes = (unsigned char *)calloc((*delta_out)->len, sizeof(unsigned char));
 	
 	/*
 	 * STRUCTURE
-	 * 1) Magic number
-	 * 2) Protocol version (4 bytes)
-	 * 3) Checksum (32 bytes)
-	 * 4) Timestamp (8 bytes)
-	 * 5) Type (2 bytes)
-	 * 6) UUID (16 bytes)
-	 * 7) Parcel size (8 bytes)
+	 * 1) Payload checksum (32 bytes)
+	 * 2) Basis size (8 bytes)
+	 * 3) Block length (4 bytes)
+	 * 4) Envelope size (4 bytes)
+	 * 5) Envelope; see envelope_serialise()
+	 * 6) Instructions; see delta.c
 	 */
 	
-	/* 3) Checksum (32 bytes) */
-	memcpy(out->checksum, &head_data->bytes[pos], SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+	/* 1) Payload checksum (32 bytes) */
+	memcpy((*delta_out)->bytes, checksum, SHA256_DIGEST_LENGTH * sizeof(unsigned char));
 	pos += SHA256_DIGEST_LENGTH * sizeof(unsigned char);
 	
-	/* 4) Timestamp (8 bytes) */
-	out->timestamp = head_data->bytes[pos + 7] |
-		( (uint64_t)head_data->bytes[pos + 6] << 8 ) |
-		( (uint64_t)head_data->bytes[pos + 5] << 16 ) |
-		( (uint64_t)head_data->bytes[pos + 4] << 24 ) |
-		( (uint64_t)head_data->bytes[pos + 3] << 32 ) |
-		( (uint64_t)head_data->bytes[pos + 2] << 40 ) |
-		( (uint64_t)head_data->bytes[pos + 1] << 48 ) |
-		( (uint64_t)head_data->bytes[pos] << 56 );
-	pos += sizeof(uint64_t);
+	/* 2) Basis size (8 bytes) */
+	(*delta_out)->bytes[pos]   = (basis_size >> 56) & 0xff;
+	(*delta_out)->bytes[++pos] = (basis_size >> 48) & 0xff;
+	(*delta_out)->bytes[++pos] = (basis_size >> 40) & 0xff;
+	(*delta_out)->bytes[++pos] = (basis_size >> 32) & 0xff;
+	(*delta_out)->bytes[++pos] = (basis_size >> 24) & 0xff;
+	(*delta_out)->bytes[++pos] = (basis_size >> 16) & 0xff;
+	(*delta_out)->bytes[++pos] = (basis_size >> 8) & 0xff;
+	(*delta_out)->bytes[++pos] = basis_size & 0xff;
+	
+	/* 3) Block length (4 bytes) */
+	(*delta_out)->bytes[++pos] = (block_len >> 24) & 0xff;
+	(*delta_out)->bytes[++pos] = (block_len >> 16) & 0xff;
+	(*delta_out)->bytes[++pos] = (block_len >> 8) & 0xff;
+	(*delta_out)->bytes[++pos] = block_len & 0xff;
+	
+	/* 4) Envelope size (4 bytes) */
+	(*delta_out)->bytes[++pos] = (envelope->len >> 24) & 0xff;
+	(*delta_out)->bytes[++pos] = (envelope->len >> 16) & 0xff;
+	(*delta_out)->bytes[++pos] = (envelope->len >> 8) & 0xff;
+	(*delta_out)->bytes[++pos] = envelope->len & 0xff;
+	
+	/* 5) Envelope */
+	memcpy(&(*delta_out)->bytes[++pos], envelope->bytes, envelope->len * sizeof(unsigned char));
+	pos += envelope->len;
+	
+	/* 6) Instructions */
+	memcpy(&(*delta_out)->bytes[pos], instructions->bytes, instructions->len * sizeof(unsigned char));
+	
+	/* Acknowledged and deduplicated like the parcel itself. */
+	head = parcel->head;
+	head.type = DP_PROTO_HOST_MSG_DELTA;
+	
+	free(envelope->bytes);
+	free(envelope);
+	
+	return header_serialise(head, (*delta_out)->len, head_out);
+}
+
+/*
+ * Files are reached relative to dirfd, the directory
+ * the list was read from.
+ */
+void directory_process(int dirfd, const struct filearray *files, int depth)
+{
+	struct dp_index *index;
+	int changed;
 	
-	/* 5) Type (2 bytes) */
-	out->type = head_data->bytes[pos + 1] |
-	( (uint16_t)head_data->bytes[pos] << 8 );
-	pos += sizeof(uint16_t);
+	/* Skip the root directory. */
+	if (depth == 0)
+		return;
 	
-	/* 6) UUID (16 bytes) */
-	memcpy(out->uuid, &head_data->bytes[pos], UUID_LEN * sizeof(unsigned char));
-	//pos += UUID_LEN * sizeof(unsigned char); /* Ucomment to continue parsing. */
+	if (depth == 1) {
+		/* Sender's domain. */
+		
+	} else if (depth == 2) {
+		/* Sender's username. */
+		
+	} else if (depth == 3) {
+		/* Recipient's domain. */
+		
+	} else if (depth == 4) {
+		/* Recipient's username. */
+		
+	} else {
+		/* Nested directories for organisation purposes. */
+		
+	}
 	
-	return status;
+	/* Recipients' directories and everything under them are indexed. */
+	if (depth >= DP_INDEX_DEPTH &&
+	    index_open(dirfd, &index) == 0) {
+		changed = index_sync(index, dirfd, files);
+		index_close(&index);
+		
+		/* Parents hold this directory's tree hash. */
+		if (changed > 0)
+			index_propagate(dirfd, depth);
+	}
 }
 
-int header_serialise(const struct dp_parcel_head head, uint64_t parcel_size, struct data16 **out)
+/*
+ * See scan.c.
+ */
+void *directory_tree_scan(void *root)
 {
-	int pos;
-	int status;
+	if (root)
+		scan_tree_try((const struct path *)root);
 	
-	status = 0;
+	return 0;
+}
+
+/*
+ * The names of the returned entries point into
+ * entries_data, which must outlive them.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int entries_deserialise(const struct data64 *entries_data, uint16_t *code, unsigned char tree[], struct dp_sync_entry **entries, uint32_t *count)
+{
+	uint64_t pos;
+	uint16_t name_len;
+	
+	if (!entries_data ||
+	    !code ||
+	    !tree ||
+	    !entries ||
+	    !count)
+		return 1;
+	
+	*entries = NULL;
+	pos = 0;
+	
+	if (entries_data->len < DP_PROTO_HOST_ENTRIES_HEAD_LEN)
+		return -1;
 	
 	/*
 	 * STRUCTURE
-	 * 1) Magic number
-	 * 2) Protocol version (4 bytes)
-	 * 3) Checksum (32 bytes)
-	 * 4) Timestamp (8 bytes)
-	 * 5) Type (2 bytes)
-	 * 6) UUID (16 bytes)
-	 * 7) Parcel size (8 bytes)
+	 * 1) Status code (2 bytes)
+	 * 2) Tree hash (32 bytes)
+	 * 3) Entry count (4 bytes)
+	 * 4) Type (1 byte): 1 for a subdirectory, 0 for a file
+	 * 5) Checksum (32 bytes)
+	 * 6) Name size (2 bytes)
+	 * 7) Name, null-terminated
+	 * ...4) to 7) repeat for every entry.
 	 */
-	*out = (struct data16 *)malloc(sizeof(**out));
-	(*out)->len = DP_PROTO_HOST_HEAD_LEN;
-	(*out)->bytes = (unsigned char *)calloc((*out)->len, sizeof(unsigned char));
-	
-	/* 1) Magic number */
-	memcpy((*out)->bytes, DP_PROTO_HOST_MAGIC_NUM, DP_PROTO_HOST_MAGIC_NUM_LEN * sizeof(unsigned char));
-	pos = DP_PROTO_HOST_MAGIC_NUM_LEN * sizeof(unsigned char);
 	
-	/* 2) Protocol version (4 bytes) */
-	(*out)->bytes[pos]   = (DP_PROTO_HOST_VER >> 24) & 0xff;
-	(*out)->bytes[++pos] = (DP_PROTO_HOST_VER >> 16) & 0xff;
-	(*out)->bytes[++pos] = (DP_PROTO_HOST_VER >> 8) & 0xff;
-	(*out)->bytes[++pos] = DP_PROTO_HOST_VER & 0xff;
+	/* 1) Status code (2 bytes) */
+	*code = entries_data->bytes[pos + 1] |
+		( (uint16_t)entries_data->bytes[pos] << 8 );
+	pos += sizeof(uint16_t);
 	
-	/* 3) Checksum (32 bytes) */
-	memcpy(&(*out)->bytes[++pos], head.checksum, SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+	/* 2) Tree hash (32 bytes) */
+	memcpy(tree, &entries_data->bytes[pos], SHA256_DIGEST_LENGTH * sizeof(unsigned char));
 	pos += SHA256_DIGEST_LENGTH * sizeof(unsigned char);
 	
-	/* 4) Timestamp (8 bytes) */
-	(*out)->bytes[pos] = (head.timestamp >> 56) & 0xff;
-	(*out)->bytes[++pos] = (head.timestamp >> 48) & 0xff;
-	(*out)->bytes[++pos] = (head.timestamp >> 40) & 0xff;
-	(*out)->bytes[++pos] = (head.timestamp >> 32) & 0xff;
-	(*out)->bytes[++pos] = (head.timestamp >> 24) & 0xff;
-	(*out)->bytes[++pos] = (head.timestamp >> 16) & 0xff;
-	(*out)->bytes[++pos] = (head.timestamp >> 8) & 0xff;
-	(*out)->bytes[++pos] = head.timestamp & 0xff;
+	/* 3) Entry count (4 bytes) */
+	*count = entries_data->bytes[pos + 3] |
+		( (uint32_t)entries_data->bytes[pos + 2] << 8 ) |
+		( (uint32_t)entries_data->bytes[pos + 1] << 16 ) |
+		( (uint32_t)entries_data->bytes[pos] << 24 );
+	pos += sizeof(uint32_t);
 	
-	/* 5) Type (2 bytes) */
-	(*out)->bytes[++pos] = (head.type >> 8) & 0xff;
-	(*out)->bytes[++pos] = head.type & 0xff;
+	if (*count > DP_PROTO_HOST_ENTRIES_MAX ||
+	    entries_data->len < pos + (uint64_t)*count * DP_PROTO_HOST_ENTRY_LEN)
+		return -1;
 	
-	/* 6) UUID (16 bytes) */
-	memcpy(&(*out)->bytes[++pos], head.uuid, UUID_LEN * sizeof(unsigned char));
-	pos += UUID_LEN * sizeof(unsigned char);
+	*entries = (struct dp_sync_entry *)calloc(*count ? *count : 1, sizeof(**entries));
 	
-	/* 7) Parcel size (8 bytes) */
-	(*out)->bytes[pos] = (parcel_size >> 56) & 0xff;
-	(*out)->bytes[++pos] = (parcel_size >> 48) & 0xff;
-	(*out)->bytes[++pos] = (parcel_size >> 40) & 0xff;
-	(*out)->bytes[++pos] = (parcel_size >> 32) & 0xff;
-	(*out)->bytes[++pos] = (parcel_size >> 24) & 0xff;
-	(*out)->bytes[++pos] = (parcel_size >> 16) & 0xff;
-	(*out)->bytes[++pos] = (parcel_size >> 8) & 0xff;
-	(*out)->bytes[++pos] = parcel_size & 0xff;
+	for (uint32_t i = 0; i < *count; i++) {
+		if (pos + DP_PROTO_HOST_ENTRY_LEN > entries_data->len)
+			break;
+		
+		/* 4) Type (1 byte) */
+		(*entries)[i].dir = entries_data->bytes[pos] == 1;
+		pos += sizeof(uint8_t);
+		
+		/* 5) Checksum (32 bytes) */
+		memcpy((*entries)[i].checksum, &entries_data->bytes[pos], SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+		pos += SHA256_DIGEST_LENGTH * sizeof(unsigned char);
+		
+		/* 6) Name size (2 bytes) */
+		name_len = entries_data->bytes[pos + 1] |
+			( (uint16_t)entries_data->bytes[pos] << 8 );
+		pos += sizeof(uint16_t);
+		
+		/* 7) Name, null-terminated */
+		if (name_len < 2 ||
+		    pos + name_len > entries_data->len ||
+		    memchr(&entries_data->bytes[pos], '\0', name_len) != &entries_data->bytes[pos + name_len - 1])
+			break;
+		
+		(*entries)[i].name = (const char *)&entries_data->bytes[pos];
+		pos += name_len;
+	}
 	
-	return status;
+	if (pos != entries_data->len ||
+	    (*count > 0 &&
+	     !(*entries)[*count - 1].name)) {
+		free(*entries);
+		*entries = NULL;
+		
+		return -1;
+	}
+	
+	return 0;
 }
 
 /*
- * In the case of local domain addresses, this function
- * might return a null host.
+ * Answers a DP_PROTO_HOST_MSG_TREE with the tree hash and
+ * the entries of the directory asked for, or with just a
+ * status code if it cannot be read.
+ * It is the caller's responsibility to free the
+ * returned pointers.
  */
-int host_get(const char *addr_str, char **host)
+int entries_serialise(uint16_t code, const unsigned char tree[], const struct dp_sync_entry *entries, uint32_t count, struct data16 **head_out, struct data64 **body_out)
 {
-	size_t addr_len;
-	size_t i_host;
-	int has_host;
-	
-	if (!addr_str ||
-	    !host)
+	struct dp_parcel_head head;
+	uint64_t len;
+	uint64_t pos;
+	uint16_t name_len;
+	
+	if (!tree ||
+	    !head_out ||
+	    !body_out ||
+	    (count > 0 &&
+	     !entries))
 		return 1;
 	
-	addr_len = strlen(addr_str);
-	has_host = 0;
-	i_host = 0;
+	len = DP_PROTO_HOST_ENTRIES_HEAD_LEN;
+	
+	for (uint32_t i = 0; i < count; i++)
+		len += DP_PROTO_HOST_ENTRY_LEN + strlen(entries[i].name) + 1;
 	
 	/*
-	 * Whatever comes after the first @ symbol
-	 * is the host.
+	 * STRUCTURE
+	 * 1) Status code (2 bytes)
+	 * 2) Tree hash (32 bytes)
+	 * 3) Entry count (4 bytes)
+	 * 4) Type (1 byte): 1 for a subdirectory, 0 for a file
+	 * 5) Checksum (32 bytes)
+	 * 6) Name size (2 bytes)
+	 * 7) Name, null-terminated
+	 * ...4) to 7) repeat for every entry.
 	 */
-	for (int i = 0; i < addr_len; i++) {
-		if (addr_str[i] == '@') {
-			has_host = 1;
-			i_host = i;
-			break;
-		}
-	}
+	*body_out = (struct data64 *)malloc(sizeof(**body_out));
+	(*body_out)->len = len;
+	(*body_out)->bytes = (unsigned char *)calloc(len, sizeof(unsigned char));
+	pos = 0;
 	
-	if (has_host == 0) {
-		/* No host specified; the whole address is the user. */
-		*host = NULL;
-	} else {
-		*host = (char *)calloc(addr_len - i_host, sizeof(**host));
-		strncpy(*host, addr_str + i_host + 1, addr_len - i_host - 1);
+	/* 1) Status code (2 bytes) */
+	(*body_out)->bytes[pos]   = (code >> 8) & 0xff;
+	(*body_out)->bytes[++pos] = code & 0xff;
+	
+	/* 2) Tree hash (32 bytes) */
+	memcpy(&(*body_out)->bytes[++pos], tree, SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+	pos += SHA256_DIGEST_LENGTH * sizeof(unsigned char);
+	
+	/* 3) Entry count (4 bytes) */
+	(*body_out)->bytes[pos]   = (count >> 24) & 0xff;
+	(*body_out)->bytes[++pos] = (count >> 16) & 0xff;
+	(*body_out)->bytes[++pos] = (count >> 8) & 0xff;
+	(*body_out)->bytes[++pos] = count & 0xff;
+	
+	for (uint32_t i = 0; i < count; i++) {
+		name_len = strlen(entries[i].name) + 1;
+		
+		/* 4) Type (1 byte) */
+		(*body_out)->bytes[++pos] = entries[i].dir ? 1 : 0;
+		
+		/* 5) Checksum (32 bytes) */
+		memcpy(&(*body_out)->bytes[++pos], entries[i].checksum, SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+		pos += SHA256_DIGEST_LENGTH * sizeof(unsigned char);
+		
+		/* 6) Name size (2 bytes) */
+		(*body_out)->bytes[pos]   = (name_len >> 8) & 0xff;
+		(*body_out)->bytes[++pos] = name_len & 0xff;
+		
+		/* 7) Name, null-terminated */
+		memcpy(&(*body_out)->bytes[++pos], entries[i].name, name_len * sizeof(char));
+		pos += name_len - 1;
 	}
 	
-	return 0;
+	memset(&head, 0, sizeof(head));
+	head.timestamp = timestamp();
+	head.type = DP_PROTO_HOST_MSG_ENTRIES;
+	uuid_generate(head.uuid);
+	
+	return header_serialise(head, (*body_out)->len, head_out);
 }
 
-int parcel_deserialise(const struct data64 *parcel_data, struct dp_parcel *out)
+/*
+ * Reads everything up to and including the payload
+ * size, which is placed in size. end is set to the
+ * position right after it, i.e. where the payload
+ * starts.
+ */
+int envelope_deserialise(const struct data64 *parcel_data, struct dp_parcel *out, uint64_t *size, uint64_t *end)
 {
 	uint32_t size_raw_filename;
 	uint32_t size_recipient_host;
 	uint32_t size_recipient_user;
 	uint32_t size_sender_host;
 	uint32_t size_sender_user;
-	int pos;
+	uint64_t pos;
 	int status;
 	
 	pos = 0;
@@ -569,13 +1400,15 @@ int parcel_deserialise(const struct data64 *parcel_data, struct dp_parcel *out)
 	 * 9) Sender user size (4 bytes)
 	 * 10) Sender user
 	 * 11) Payload size (8 bytes)
-	 * 12) Payload
 	 *
 	 * NOTE: null terminators are not copied to save space.
 	 * They should be accounted for upon deserialisation.
 	 */
 	
 	/* 1) Raw filename size (4 bytes) */
+	if (pos + sizeof(uint32_t) > parcel_data->len)
+		return -1;
+	
 	size_raw_filename = parcel_data->bytes[pos + 3] |
 		( (uint32_t)parcel_data->bytes[pos + 2] << 8 ) |
 		( (uint32_t)parcel_data->bytes[pos + 1] << 16 ) |
@@ -583,11 +1416,17 @@ int parcel_deserialise(const struct data64 *parcel_data, struct dp_parcel *out)
 	pos += sizeof(uint32_t);
 	
 	/* 2) Raw filename */
+	if (pos + size_raw_filename > parcel_data->len)
+		return -1;
+	
 	out->raw_filename = (char *)calloc(size_raw_filename + 1, sizeof(char));
 	memcpy(out->raw_filename, &parcel_data->bytes[pos], size_raw_filename * sizeof(char));
 	pos += size_raw_filename * sizeof(char);
 	
 	/* 3) Recipient host size (4 bytes) */
+	if (pos + sizeof(uint32_t) > parcel_data->len)
+		return -1;
+	
 	size_recipient_host = parcel_data->bytes[pos + 3] |
 		( (uint32_t)parcel_data->bytes[pos + 2] << 8 ) |
 		( (uint32_t)parcel_data->bytes[pos + 1] << 16 ) |
@@ -595,11 +1434,17 @@ int parcel_deserialise(const struct data64 *parcel_data, struct dp_parcel *out)
 	pos += sizeof(uint32_t);
 	
 	/* 4) Recipient host */
+	if (pos + size_recipient_host > parcel_data->len)
+		return -1;
+	
 	out->recipient_addr->host->identifier = (char *)calloc(size_recipient_host + 1, sizeof(char));
 	memcpy(out->recipient_addr->host->identifier, &parcel_data->bytes[pos], size_recipient_host * sizeof(char));
 	pos += size_recipient_host * sizeof(char);
 	
 	/* 5) Recipient user size (4 bytes) */
+	if (pos + sizeof(uint32_t) > parcel_data->len)
+		return -1;
+	
 	size_recipient_user = parcel_data->bytes[pos + 3] |
 		( (uint32_t)parcel_data->bytes[pos + 2] << 8 ) |
 		( (uint32_t)parcel_data->bytes[pos + 1] << 16 ) |
@@ -607,11 +1452,17 @@ int parcel_deserialise(const struct data64 *parcel_data, struct dp_parcel *out)
 	pos += sizeof(uint32_t);
 	
 	/* 6) Recipient user */
+	if (pos + size_recipient_user > parcel_data->len)
+		return -1;
+	
 	out->recipient_addr->user->identifier = (char *)calloc(size_recipient_user + 1, sizeof(char));
 	memcpy(out->recipient_addr->user->identifier, &parcel_data->bytes[pos], size_recipient_user * sizeof(char));
 	pos += size_recipient_user * sizeof(char);
 	
 	/* 7) Sender host size (4 bytes) */
+	if (pos + sizeof(uint32_t) > parcel_data->len)
+		return -1;
+	
 	size_sender_host = parcel_data->bytes[pos + 3] |
 		( (uint32_t)parcel_data->bytes[pos + 2] << 8 ) |
 		( (uint32_t)parcel_data->bytes[pos + 1] << 16 ) |
@@ -619,11 +1470,17 @@ int parcel_deserialise(const struct data64 *parcel_data, struct dp_parcel *out)
 	pos += sizeof(uint32_t);
 	
 	/* 8) Sender host */
+	if (pos + size_sender_host > parcel_data->len)
+		return -1;
+	
 	out->sender_addr->host->identifier = (char *)calloc(size_sender_host + 1, sizeof(char));
 	memcpy(out->sender_addr->host->identifier, &parcel_data->bytes[pos], size_sender_host * sizeof(char));
 	pos += size_sender_host * sizeof(char);
 	
 	/* 9) Sender user size (4 bytes) */
+	if (pos + sizeof(uint32_t) > parcel_data->len)
+		return -1;
+	
 	size_sender_user = parcel_data->bytes[pos + 3] |
 		( (uint32_t)parcel_data->bytes[pos + 2] << 8 ) |
 		( (uint32_t)parcel_data->bytes[pos + 1] << 16 ) |
@@ -631,14 +1488,18 @@ int parcel_deserialise(const struct data64 *parcel_data, struct dp_parcel *out)
 	pos += sizeof(uint32_t);
 	
 	/* 10) Sender user */
+	if (pos + size_sender_user > parcel_data->len)
+		return -1;
+	
 	out->sender_addr->user->identifier = (char *)calloc(size_sender_user + 1, sizeof(char));
 	memcpy(out->sender_addr->user->identifier, &parcel_data->bytes[pos], size_sender_user * sizeof(char));
 	pos += size_sender_user * sizeof(char);
 	
-	out->payload = (struct data64 *)malloc(sizeof(struct data64));
-	
 	/* 11) Payload size (8 bytes) */
-	out->payload->len = parcel_data->bytes[pos + 7] |
+	if (pos + sizeof(uint64_t) > parcel_data->len)
+		return -1;
+	
+	*size = parcel_data->bytes[pos + 7] |
 		( (uint64_t)parcel_data->bytes[pos + 6] << 8 ) |
 		( (uint64_t)parcel_data->bytes[pos + 5] << 16 ) |
 		( (uint64_t)parcel_data->bytes[pos + 4] << 24 ) |
@@ -646,95 +1507,59 @@ int parcel_deserialise(const struct data64 *parcel_data, struct dp_parcel *out)
 		( (uint64_t)parcel_data->bytes[pos + 2] << 40 ) |
 		( (uint64_t)parcel_data->bytes[pos + 1] << 48 ) |
 		( (uint64_t)parcel_data->bytes[pos] << 56 );
-	pos += sizeof(uint64_t);
-	
-	/* 12) Payload */
-	out->payload->bytes = (unsigned char *)calloc(out->payload->len, sizeof(unsigned char));
-	memcpy(out->payload->bytes, &parcel_data->bytes[pos], out->payload->len * sizeof(unsigned char));
-	//pos += size_sender_user * sizeof(unsigned char); /* Ucomment to continue parsing. */
+	*end = pos + sizeof(uint64_t);
 	
 	return status;
 }
 
-void parcel_filename_set(struct dp_parcel *parcel, const char *name)
-{
-	if (parcel) {
-		if (parcel->raw_filename)
-			free(parcel->raw_filename);
-		
-		if (name) {
-			parcel->raw_filename = (char *)calloc(strlen(name) + 1, sizeof(*name));
-			strcpy(parcel->raw_filename, name);
-		} else {
-			parcel->raw_filename = NULL;
-		}
-	}
-	
-}
-
 /*
- * !STUB!
- */
-void parcel_free(struct dp_parcel **parcel)
-{
-	
-}
-
-/*
- * Initialises an empty parcel struct.
+ * Returns DP_REQOK along with the parcel whose envelope
+ * is at the start of envelope_data, for when the payload
+ * is received apart from it. size is set to the payload's
+ * size and end to where it starts.
  * It is the caller's responsibility to free the
  * returned pointer.
  */
-struct dp_parcel *parcel_make(void)
+struct dp_reqstatus envelope_parse(const struct data16 *head_data, const struct data64 *envelope_data, struct dp_parcel **out, uint64_t *size, uint64_t *end)
 {
 	struct dp_parcel *parcel;
 	
-	parcel = (struct dp_parcel *)malloc(sizeof(*parcel));
-	parcel->head.timestamp = timestamp();
-	parcel->head.type = DP_PROTO_HOST_MSG_UNDEF;
-	parcel->raw_filename = NULL;
-	parcel->recipient_addr = (struct dp_addr *)malloc(sizeof(*(parcel->recipient_addr)));
-	parcel->recipient_addr->host = (struct dp_node *)malloc(sizeof(*(parcel->recipient_addr->host)));
-	parcel->recipient_addr->host->identifier = NULL;
-	parcel->recipient_addr->user = (struct dp_node *)malloc(sizeof(*(parcel->recipient_addr->user)));
-	parcel->recipient_addr->user->identifier = NULL;
-	parcel->sender_addr = (struct dp_addr *)malloc(sizeof(*(parcel->sender_addr)));
-	parcel->sender_addr->host = (struct dp_node *)malloc(sizeof(*(parcel->sender_addr->host)));
-	parcel->sender_addr->host->identifier = NULL;
-	parcel->sender_addr->user = (struct dp_node *)malloc(sizeof(*(parcel->sender_addr->user)));
-	parcel->sender_addr->user->identifier = NULL;
-	parcel->service = NULL;
-	
-	uuid_generate(parcel->head.uuid);
-	
-	return parcel;
-}
-
-void parcel_parse(const struct data16 *head_data, const struct data64 *parcel_data)
-{
-	struct dp_parcel *parcel;
+	if (!head_data ||
+	    !envelope_data ||
+	    !out ||
+	    !size ||
+	    !end)
+		return DP_REQERR_INT_BADARG;
 	
+	*out = NULL;
 	parcel = parcel_make();
 	header_deserialise(head_data, &(parcel->head));
-	parcel_deserialise(parcel_data, parcel);
-	service_get(parcel->raw_filename, &(parcel->service));
 	
-	printf("RAW FILENAME: %s\n", parcel->raw_filename);
-	printf("FILE IS %lu byte(s)\n", parcel->payload->len);
-	printf("SERVICE: %s\n", parcel->service);
-	printf("TO: %s AT %s\n", parcel->recipient_addr->user->identifier, parcel->recipient_addr->host->identifier);
-	printf("PAYLOAD: %s\n", parcel->payload->bytes);
-}
-
-void parcel_recipient_addr_set(struct dp_parcel *parcel, const char *addr_str)
-{
-	if (parcel) {
-		host_get(addr_str, &(parcel->recipient_addr->host->identifier));
-		user_get(addr_str, &(parcel->recipient_addr->user->identifier));
+	if (envelope_deserialise(envelope_data, parcel, size, end) != 0) {
+		parcel_free(&parcel);
+		return DP_REQERR_BADREQ;
 	}
+	
+	service_get(parcel->raw_filename, &(parcel->service));
+	
+	trace_write(DP_TRACE_INFO, "RAW FILENAME: %s", parcel->raw_filename);
+	trace_write(DP_TRACE_INFO, "FILE IS %lu byte(s)", *size);
+	trace_write(DP_TRACE_INFO, "SERVICE: %s", parcel->service);
+	trace_write(DP_TRACE_INFO, "TO: %s AT %s", parcel->recipient_addr->user->identifier, parcel->recipient_addr->host->identifier);
+	
+	*out = parcel;
+	
+	return DP_REQOK;
 }
 
-int parcel_serialise(const struct dp_parcel *parcel, struct data64 **out)
+/*
+ * Serialises everything up to and including the payload
+ * size, leaving extra zeroed bytes at the end for the
+ * caller to fill.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int envelope_serialise(const struct dp_parcel *parcel, uint64_t size, uint64_t extra, struct data64 **out)
 {
 	uint32_t size_raw_filename;
 	uint32_t size_recipient_host;
@@ -765,7 +1590,6 @@ int parcel_serialise(const struct dp_parcel *parcel, struct data64 **out)
 	 * 9) Sender user size (4 bytes)
 	 * 10) Sender user
 	 * 11) Payload size (8 bytes)
-	 * 12) Payload
 	 *
 	 * NOTE: null terminators are not copied to save space.
 	 * They should be accounted for upon deserialisation.
@@ -776,7 +1600,7 @@ int parcel_serialise(const struct dp_parcel *parcel, struct data64 **out)
 	sizeof(uint32_t) + size_recipient_user +
 	sizeof(uint32_t) + size_sender_host +
 	sizeof(uint32_t) + size_sender_user +
-	sizeof(uint64_t) + parcel->payload->len;
+	sizeof(uint64_t) + extra;
 	(*out)->bytes = (unsigned char *)calloc((*out)->len, sizeof(unsigned char));
 	
 	/* 1) Raw filename size (4 bytes) */
@@ -829,28 +1653,75 @@ int parcel_serialise(const struct dp_parcel *parcel, struct data64 **out)
 	memcpy(&(*out)->bytes[++pos], parcel->sender_addr->user->identifier, size_sender_user * sizeof(char));
 	pos += size_sender_user * sizeof(char);
 	
-	/* 7) Payload size (8 bytes) */
-	(*out)->bytes[pos] = (parcel->payload->len >> 56) & 0xff;
-	(*out)->bytes[++pos] = (parcel->payload->len >> 48) & 0xff;
-	(*out)->bytes[++pos] = (parcel->payload->len >> 40) & 0xff;
-	(*out)->bytes[++pos] = (parcel->payload->len >> 32) & 0xff;
-	(*out)->bytes[++pos] = (parcel->payload->len >> 24) & 0xff;
-	(*out)->bytes[++pos] = (parcel->payload->len >> 16) & 0xff;
-	(*out)->bytes[++pos] = (parcel->payload->len >> 8) & 0xff;
-	(*out)->bytes[++pos] = parcel->payload->len & 0xff;
-	
-	/* 7) Payload */
-	memcpy(&(*out)->bytes[++pos], parcel->payload->bytes, parcel->payload->len * sizeof(unsigned char));
+	/* 11) Payload size (8 bytes) */
+	(*out)->bytes[pos] = (size >> 56) & 0xff;
+	(*out)->bytes[++pos] = (size >> 48) & 0xff;
+	(*out)->bytes[++pos] = (size >> 40) & 0xff;
+	(*out)->bytes[++pos] = (size >> 32) & 0xff;
+	(*out)->bytes[++pos] = (size >> 24) & 0xff;
+	(*out)->bytes[++pos] = (size >> 16) & 0xff;
+	(*out)->bytes[++pos] = (size >> 8) & 0xff;
+	(*out)->bytes[++pos] = size & 0xff;
 	
 	return status;
 }
 
-uint64_t parcel_size_get(const struct data16 *head_data)
+/*
+ * Extracts the last component of a file path.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int filename_get(const char *filepath, char **filename)
 {
-	uint64_t size;
-	int pos = head_data->len - 8;
+	const char *start;
 	
-	size = head_data->bytes[pos + 7] |
+	if (!filepath ||
+	    !filename)
+		return 1;
+	
+	*filename = NULL;
+	start = strrchr(filepath, '/');
+	
+	if (start)
+		start++;
+	else
+		start = filepath;
+	
+	if (component_valid(start) != 1)
+		return -1;
+	
+	*filename = (char *)calloc(strlen(start) + 1, sizeof(**filename));
+	strcpy(*filename, start);
+	
+	return 0;
+}
+
+int header_deserialise(const struct data16 *head_data, struct dp_parcel_head *out)
+{
+	int pos;
+	int status;
+	
+	pos = DP_PROTO_HOST_MAGIC_NUM_LEN + sizeof(DP_PROTO_SERV_VER);
+	status = 0;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Magic number
+	 * 2) Protocol version (4 bytes)
+	 * 3) Checksum (32 bytes)
+	 * 4) Timestamp (8 bytes)
+	 * 5) Type (2 bytes)
+	 * 6) UUID (16 bytes)
+	 * 7) Sequence (8 bytes)
+	 * 8) Parcel size (8 bytes)
+	 */
+	
+	/* 3) Checksum (32 bytes) */
+	memcpy(out->checksum, &head_data->bytes[pos], SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+	pos += SHA256_DIGEST_LENGTH * sizeof(unsigned char);
+	
+	/* 4) Timestamp (8 bytes) */
+	out->timestamp = head_data->bytes[pos + 7] |
 		( (uint64_t)head_data->bytes[pos + 6] << 8 ) |
 		( (uint64_t)head_data->bytes[pos + 5] << 16 ) |
 		( (uint64_t)head_data->bytes[pos + 4] << 24 ) |
@@ -858,74 +1729,1829 @@ uint64_t parcel_size_get(const struct data16 *head_data)
 		( (uint64_t)head_data->bytes[pos + 2] << 40 ) |
 		( (uint64_t)head_data->bytes[pos + 1] << 48 ) |
 		( (uint64_t)head_data->bytes[pos] << 56 );
+	pos += sizeof(uint64_t);
 	
-	return size;
+	/* 5) Type (2 bytes) */
+	out->type = head_data->bytes[pos + 1] |
+	( (uint16_t)head_data->bytes[pos] << 8 );
+	pos += sizeof(uint16_t);
+	
+	/* 6) UUID (16 bytes) */
+	memcpy(out->uuid, &head_data->bytes[pos], UUID_LEN * sizeof(unsigned char));
+	pos += UUID_LEN * sizeof(unsigned char);
+	
+	/* 7) Sequence (8 bytes) */
+	out->sequence = head_data->bytes[pos + 7] |
+		( (uint64_t)head_data->bytes[pos + 6] << 8 ) |
+		( (uint64_t)head_data->bytes[pos + 5] << 16 ) |
+		( (uint64_t)head_data->bytes[pos + 4] << 24 ) |
+		( (uint64_t)head_data->bytes[pos + 3] << 32 ) |
+		( (uint64_t)head_data->bytes[pos + 2] << 40 ) |
+		( (uint64_t)head_data->bytes[pos + 1] << 48 ) |
+		( (uint64_t)head_data->bytes[pos] << 56 );
+	//pos += sizeof(uint64_t); /* Ucomment to continue parsing. */
+	
+	return status;
 }
 
-/*
- * !INCOMPLETE!
- */
-void request_free(struct token **request)
+int header_serialise(const struct dp_parcel_head head, uint64_t parcel_size, struct data16 **out)
 {
-	while (request) {
-		struct token *tmp;
-		
-		tmp = *request;
-		*request = (*request)->next;
-		free(tmp);
-	}
+	int pos;
+	int status;
+	
+	status = 0;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Magic number
+	 * 2) Protocol version (4 bytes)
+	 * 3) Checksum (32 bytes)
+	 * 4) Timestamp (8 bytes)
+	 * 5) Type (2 bytes)
+	 * 6) UUID (16 bytes)
+	 * 7) Sequence (8 bytes)
+	 * 8) Parcel size (8 bytes)
+	 */
+	*out = (struct data16 *)malloc(sizeof(**out));
+	(*out)->len = DP_PROTO_HOST_HEAD_LEN;
+	(*out)->bytes = (unsigned char *)calloc((*out)->len, sizeof(unsigned char));
+	
+	/* 1) Magic number */
+	memcpy((*out)->bytes, DP_PROTO_HOST_MAGIC_NUM, DP_PROTO_HOST_MAGIC_NUM_LEN * sizeof(unsigned char));
+	pos = DP_PROTO_HOST_MAGIC_NUM_LEN * sizeof(unsigned char);
+	
+	/* 2) Protocol version (4 bytes) */
+	(*out)->bytes[pos]   = (DP_PROTO_HOST_VER >> 24) & 0xff;
+	(*out)->bytes[++pos] = (DP_PROTO_HOST_VER >> 16) & 0xff;
+	(*out)->bytes[++pos] = (DP_PROTO_HOST_VER >> 8) & 0xff;
+	(*out)->bytes[++pos] = DP_PROTO_HOST_VER & 0xff;
+	
+	/* 3) Checksum (32 bytes) */
+	memcpy(&(*out)->bytes[++pos], head.checksum, SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+	pos += SHA256_DIGEST_LENGTH * sizeof(unsigned char);
+	
+	/* 4) Timestamp (8 bytes) */
+	(*out)->bytes[pos] = (head.timestamp >> 56) & 0xff;
+	(*out)->bytes[++pos] = (head.timestamp >> 48) & 0xff;
+	(*out)->bytes[++pos] = (head.timestamp >> 40) & 0xff;
+	(*out)->bytes[++pos] = (head.timestamp >> 32) & 0xff;
+	(*out)->bytes[++pos] = (head.timestamp >> 24) & 0xff;
+	(*out)->bytes[++pos] = (head.timestamp >> 16) & 0xff;
+	(*out)->bytes[++pos] = (head.timestamp >> 8) & 0xff;
+	(*out)->bytes[++pos] = head.timestamp & 0xff;
 	
-	request = NULL;
+	/* 5) Type (2 bytes) */
+	(*out)->bytes[++pos] = (head.type >> 8) & 0xff;
+	(*out)->bytes[++pos] = head.type & 0xff;
+	
+	/* 6) UUID (16 bytes) */
+	memcpy(&(*out)->bytes[++pos], head.uuid, UUID_LEN * sizeof(unsigned char));
+	pos += UUID_LEN * sizeof(unsigned char);
+	
+	/* 7) Sequence (8 bytes) */
+	(*out)->bytes[pos] = (head.sequence >> 56) & 0xff;
+	(*out)->bytes[++pos] = (head.sequence >> 48) & 0xff;
+	(*out)->bytes[++pos] = (head.sequence >> 40) & 0xff;
+	(*out)->bytes[++pos] = (head.sequence >> 32) & 0xff;
+	(*out)->bytes[++pos] = (head.sequence >> 24) & 0xff;
+	(*out)->bytes[++pos] = (head.sequence >> 16) & 0xff;
+	(*out)->bytes[++pos] = (head.sequence >> 8) & 0xff;
+	(*out)->bytes[++pos] = head.sequence & 0xff;
+	
+	/* 8) Parcel size (8 bytes) */
+	(*out)->bytes[++pos] = (parcel_size >> 56) & 0xff;
+	(*out)->bytes[++pos] = (parcel_size >> 48) & 0xff;
+	(*out)->bytes[++pos] = (parcel_size >> 40) & 0xff;
+	(*out)->bytes[++pos] = (parcel_size >> 32) & 0xff;
+	(*out)->bytes[++pos] = (parcel_size >> 24) & 0xff;
+	(*out)->bytes[++pos] = (parcel_size >> 16) & 0xff;
+	(*out)->bytes[++pos] = (parcel_size >> 8) & 0xff;
+	(*out)->bytes[++pos] = parcel_size & 0xff;
+	
+	return status;
 }
 
 /*
- * The service is indicated by the file extension.
- * It is the caller's responsibility to free the
- * returned pointer.
+ * In the case of local domain addresses, this function
+ * might return a null host.
  */
-int service_get(const char *filename, char **service)
+int host_get(const char *addr_str, char **host)
 {
-	size_t filename_len;
-	int valid;
+	size_t addr_len;
+	size_t i_host;
+	int has_host;
 	
-	if (!filename ||
-	    !service)
+	if (!addr_str ||
+	    !host)
 		return 1;
 	
-	filename_len = strlen(filename);
-	valid = 0;
-	
-	/*
-	 * Smallest valid filename: a.x
-	 */
-	if (filename_len < 3)
-		return -1;
+	addr_len = strlen(addr_str);
+	has_host = 0;
+	i_host = 0;
 	
 	/*
-	 * We want to extract whatever comes after
-	 * the final dot in the filename. We start
-	 * from the second position because there
-	 * needs to be at least 1 character after
-	 * the dot.
+	 * Whatever comes after the first @ symbol
+	 * is the host.
 	 */
-	for (size_t i = filename_len - 2; i > 0; i--) {
-		if (filename[i] == '.') {
-			*service = (char *)calloc(filename_len - i, sizeof(**service));
-			strncpy(*service, filename + i + 1, filename_len - i - 1);
-			
-			valid = 1;
+	for (int i = 0; i < addr_len; i++) {
+		if (addr_str[i] == '@') {
+			has_host = 1;
+			i_host = i;
 			break;
 		}
 	}
 	
-	if (valid != 1) {
-		free(*service);
-		return -1;
+	if (has_host == 0) {
+		/* No host specified; the whole address is the user. */
+		*host = NULL;
+	} else {
+		*host = (char *)calloc(addr_len - i_host, sizeof(**host));
+		strncpy(*host, addr_str + i_host + 1, addr_len - i_host - 1);
 	}
 	
 	return 0;
 }
 
+int leaf_work(void *args)
+{
+	struct dp_leaf_job *job;
+	struct dp_parcel_head head;
+	
+	job = (struct dp_leaf_job *)args;
+	header_deserialise(job->head, &head);
+	merkle_leaf_get(&head, job->body, job->tail, job->leaf);
+	
+	return 0;
+}
+
+/*
+ * Writes the parcel's payload into the recipient's
+ * directory, under the sender's address; see
+ * parcel_path_get().
+ */
+struct dp_reqstatus parcel_deliver(const struct dp_parcel *parcel)
+{
+	struct path *path_dir;
+	struct path *path_parcel;
+	struct dp_reqstatus status;
+	
+	if (!parcel ||
+	    (!parcel->payload &&
+	     !parcel->payload_file &&
+	     parcel->payload_fd == -1))
+		return DP_REQERR_INT_BADARG;
+	
+	status = parcel_path_get(parcel, 1, &path_parcel);
+	
+	if (status.code != DP_REQOK.code)
+		return status;
+	
+	if (parcel->payload_fd != -1) {
+		/* The payload was streamed into an unnamed file; see parcel_stream_read() in net.c. */
+		if (tmpfile_link(parcel->payload_fd, path_parcel) != 0)
+			status = DP_REQERR_INTERNAL;
+	} else if (parcel->payload_file) {
+		/* The payload was received straight to disk; see transfer.c. */
+		path_dir = path_copy(path_parcel);
+		path_pop(&path_dir);
+		
+		if (file_move(parcel->payload_file, path_cstr(path_parcel)) != 0 ||
+		    directory_sync(path_dir) != 0)
+			status = DP_REQERR_INTERNAL;
+		
+		path_free(&path_dir);
+	} else if (writeb(path_parcel, parcel->payload->bytes, parcel->payload->len) != parcel->payload->len) {
+		status = DP_REQERR_INTERNAL;
+	}
+	
+	if (status.code == DP_REQOK.code &&
+	    parcel_dir_get(parcel, 0, &path_dir).code == DP_REQOK.code) {
+		if (parcel->head.type == DP_PROTO_HOST_MSG_SYNCED)
+			eventlog_append(path_dir, DP_EVENTLOG_SYNCED, parcel->sender_addr->user->identifier, parcel->sender_addr->host->identifier, parcel->raw_filename);
+		else
+			eventlog_append(path_dir, DP_EVENTLOG_RECEIVED, parcel->sender_addr->user->identifier, parcel->sender_addr->host->identifier, path_name_get(path_parcel));
+		
+		path_free(&path_dir);
+	}
+	
+	path_free(&path_parcel);
+	
+	return status;
+}
+
+int parcel_deserialise(const struct data64 *parcel_data, struct dp_parcel *out)
+{
+	uint64_t pos;
+	uint64_t size;
+	int status;
+	
+	/*
+	 * STRUCTURE
+	 * 1) to 11) Envelope; see envelope_deserialise()
+	 * 12) Payload
+	 */
+	if ((status = envelope_deserialise(parcel_data, out, &size, &pos)) != 0)
+		return status;
+	
+	if (pos + size > parcel_data->len)
+		return -1;
+	
+	/* 12) Payload */
+	out->payload = (struct data64 *)malloc(sizeof(struct data64));
+	out->payload->len = size;
+	out->payload->bytes = (unsigned char *)calloc(out->payload->len, sizeof(unsigned char));
+	memcpy(out->payload->bytes, &parcel_data->bytes[pos], out->payload->len * sizeof(unsigned char));
+	
+	return status;
+}
+
+void parcel_filename_set(struct dp_parcel *parcel, const char *name)
+{
+	if (parcel) {
+		if (parcel->raw_filename)
+			free(parcel->raw_filename);
+		
+		if (name) {
+			parcel->raw_filename = (char *)calloc(strlen(name) + 1, sizeof(*name));
+			strcpy(parcel->raw_filename, name);
+		} else {
+			parcel->raw_filename = NULL;
+		}
+	}
+	
+}
+
+void parcel_free(struct dp_parcel **parcel)
+{
+	if (parcel &&
+	    *parcel) {
+		if ((*parcel)->payload) {
+			if ((*parcel)->payload->bytes)
+				free((*parcel)->payload->bytes);
+			
+			free((*parcel)->payload);
+		}
+		
+		if ((*parcel)->payload_fd != -1)
+			close((*parcel)->payload_fd);
+		
+		if ((*parcel)->payload_file)
+			free((*parcel)->payload_file);
+		
+		if ((*parcel)->raw_filename)
+			free((*parcel)->raw_filename);
+		
+		if ((*parcel)->sender_name)
+			free((*parcel)->sender_name);
+		
+		if ((*parcel)->service)
+			free((*parcel)->service);
+		
+		addr_free(&(*parcel)->recipient_addr);
+		addr_free(&(*parcel)->sender_addr);
+		free(*parcel);
+		*parcel = NULL;
+	}
+}
+
+/*
+ * Initialises an empty parcel struct.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+struct dp_parcel *parcel_make(void)
+{
+	struct dp_parcel *parcel;
+	
+	parcel = (struct dp_parcel *)malloc(sizeof(*parcel));
+	parcel->head.sequence = 0;
+	parcel->head.timestamp = timestamp();
+	parcel->head.type = DP_PROTO_HOST_MSG_UNDEF;
+	parcel->payload = NULL;
+	parcel->payload_fd = -1;
+	parcel->payload_file = NULL;
+	parcel->raw_filename = NULL;
+	parcel->recipient_addr = (struct dp_addr *)malloc(sizeof(*(parcel->recipient_addr)));
+	parcel->recipient_addr->host = (struct dp_node *)malloc(sizeof(*(parcel->recipient_addr->host)));
+	parcel->recipient_addr->host->identifier = NULL;
+	parcel->recipient_addr->host->pkey = NULL;
+	parcel->recipient_addr->user = (struct dp_node *)malloc(sizeof(*(parcel->recipient_addr->user)));
+	parcel->recipient_addr->user->identifier = NULL;
+	parcel->recipient_addr->user->pkey = NULL;
+	parcel->sender_addr = (struct dp_addr *)malloc(sizeof(*(parcel->sender_addr)));
+	parcel->sender_addr->host = (struct dp_node *)malloc(sizeof(*(parcel->sender_addr->host)));
+	parcel->sender_addr->host->identifier = NULL;
+	parcel->sender_addr->host->pkey = NULL;
+	parcel->sender_addr->user = (struct dp_node *)malloc(sizeof(*(parcel->sender_addr->user)));
+	parcel->sender_addr->user->identifier = NULL;
+	parcel->sender_addr->user->pkey = NULL;
+	parcel->sender_name = NULL;
+	parcel->service = NULL;
+	
+	uuid_generate(parcel->head.uuid);
+	
+	return parcel;
+}
+
+/*
+ * Returns DP_REQOK along with the parsed parcel, which
+ * is then ready for delivery. Otherwise, the status is
+ * what to acknowledge the parcel with.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+struct dp_reqstatus parcel_parse(const struct data16 *head_data, const struct data64 *parcel_data, struct dp_parcel **out)
+{
+	struct dp_parcel *parcel;
+	
+	if (!head_data ||
+	    !parcel_data ||
+	    !out)
+		return DP_REQERR_INT_BADARG;
+	
+	*out = NULL;
+	parcel = parcel_make();
+	header_deserialise(head_data, &(parcel->head));
+	
+	if (parcel_deserialise(parcel_data, parcel) != 0 ||
+	    !parcel->payload) {
+		parcel_free(&parcel);
+		return DP_REQERR_BADREQ;
+	}
+	
+	service_get(parcel->raw_filename, &(parcel->service));
+	
+	trace_write(DP_TRACE_INFO, "RAW FILENAME: %s", parcel->raw_filename);
+	trace_write(DP_TRACE_INFO, "FILE IS %lu byte(s)", parcel->payload->len);
+	trace_write(DP_TRACE_INFO, "SERVICE: %s", parcel->service);
+	trace_write(DP_TRACE_INFO, "TO: %s AT %s", parcel->recipient_addr->user->identifier, parcel->recipient_addr->host->identifier);
+	
+	*out = parcel;
+	
+	return DP_REQOK;
+}
+
+/*
+ * Works out the directory the parcel's file goes in: the
+ * recipient's directory, under the sender's address, i.e.
+ * <root>/<recipient host>/<recipient user>/<sender host>/<sender user>.
+ * Hosts without a directory of their own map to the
+ * default domain. The sender's directories are made
+ * along the way if make is set.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+struct dp_reqstatus parcel_dir_get(const struct dp_parcel *parcel, int make, struct path **out)
+{
+	struct path *path_dir;
+	struct dp_reqstatus status;
+	
+	if (!parcel ||
+	    !out)
+		return DP_REQERR_INT_BADARG;
+	
+	*out = NULL;
+	
+	if (component_valid(parcel->recipient_addr->user->identifier) != 1 ||
+	    component_valid(parcel->sender_addr->host->identifier) != 1 ||
+	    component_valid(parcel->sender_addr->user->identifier) != 1)
+		return DP_REQERR_BADREQ;
+	
+	path_dir = path_copy(path_dir_root);
+	status = DP_REQOK;
+	
+	if (component_valid(parcel->recipient_addr->host->identifier) == 1) {
+		path_append(&path_dir, parcel->recipient_addr->host->identifier);
+		
+		if (directory_exists(path_dir) != 1) {
+			path_pop(&path_dir);
+			path_append(&path_dir, DP_DIR_DEFAULT);
+		}
+	} else {
+		path_append(&path_dir, DP_DIR_DEFAULT);
+	}
+	
+	path_append(&path_dir, parcel->recipient_addr->user->identifier);
+	
+	if (directory_exists(path_dir) != 1) {
+		status = DP_REQERR_NOTFOUND;
+	} else {
+		path_append(&path_dir, parcel->sender_addr->host->identifier);
+		
+		if (make)
+			directory_make(path_dir);
+		
+		path_append(&path_dir, parcel->sender_addr->user->identifier);
+		
+		if (make &&
+		    directory_make(path_dir) == -1)
+			status = DP_REQERR_INTERNAL;
+	}
+	
+	if (status.code == DP_REQOK.code)
+		*out = path_dir;
+	else
+		path_free(&path_dir);
+	
+	return status;
+}
+
+/*
+ * Works out where the parcel's file goes; see
+ * parcel_dir_get(). A synced parcel's filename is its
+ * path within that directory, and any directories on
+ * that path are made too if make is set.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+struct dp_reqstatus parcel_path_get(const struct dp_parcel *parcel, int make, struct path **out)
+{
+	char *filename;
+	struct path *path_parcel;
+	struct dp_reqstatus status;
+	
+	if (!parcel ||
+	    !out)
+		return DP_REQERR_INT_BADARG;
+	
+	*out = NULL;
+	
+	if (parcel->head.type == DP_PROTO_HOST_MSG_SYNCED) {
+		status = parcel_dir_get(parcel, make, &path_parcel);
+		
+		if (status.code == DP_REQOK.code &&
+		    (status = relpath_append(&path_parcel, parcel->raw_filename, make)).code != DP_REQOK.code)
+			path_free(&path_parcel);
+	} else {
+		if (filename_get(parcel->raw_filename, &filename) != 0)
+			return DP_REQERR_BADREQ;
+		
+		if ((status = parcel_dir_get(parcel, make, &path_parcel)).code == DP_REQOK.code)
+			path_append(&path_parcel, filename);
+		
+		free(filename);
+	}
+	
+	if (status.code == DP_REQOK.code)
+		*out = path_parcel;
+	
+	return status;
+}
+
+void parcel_recipient_addr_set(struct dp_parcel *parcel, const char *addr_str)
+{
+	if (parcel) {
+		host_get(addr_str, &(parcel->recipient_addr->host->identifier));
+		user_get(addr_str, &(parcel->recipient_addr->user->identifier));
+	}
+}
+
+/*
+ * Logs a parcel the recipient acknowledged in the
+ * sender's directory for them.
+ */
+void parcel_sent_log(const struct dp_parcel *parcel)
+{
+	char *addr;
+	char *filename;
+	struct path *path_dir;
+	const char *host;
+	const char *user;
+	
+	host = parcel->recipient_addr->host->identifier;
+	user = parcel->recipient_addr->user->identifier;
+	
+	if (!user ||
+	    filename_get(parcel->raw_filename, &filename) != 0)
+		return;
+	
+	addr = (char *)calloc(strlen(user) + (host ? strlen(host) + 1 : 0) + 1, sizeof(char));
+	strcpy(addr, user);
+	
+	if (host) {
+		strcat(addr, "@");
+		strcat(addr, host);
+	}
+	
+	if ((path_dir = contact_dir_get(parcel->sender_addr->host->identifier, parcel->sender_addr->user->identifier, addr))) {
+		/* Contacts without a directory of their own have nowhere to log to. */
+		if (directory_exists(path_dir) == 1)
+			eventlog_append(path_dir, DP_EVENTLOG_SENT, user, host, filename);
+		
+		path_free(&path_dir);
+	}
+	
+	free(addr);
+	free(filename);
+}
+
+int parcel_serialise(const struct dp_parcel *parcel, struct data64 **out)
+{
+	int status;
+	
+	/*
+	 * STRUCTURE
+	 * 1) to 11) Envelope; see envelope_serialise()
+	 * 12) Payload
+	 */
+	if ((status = envelope_serialise(parcel, parcel->payload->len, parcel->payload->len, out)) != 0)
+		return status;
+	
+	/* 12) Payload */
+	memcpy(&(*out)->bytes[(*out)->len - parcel->payload->len], parcel->payload->bytes, parcel->payload->len * sizeof(unsigned char));
+	
+	return status;
+}
+
+/*
+ * Returns the key the recipient keeps for the sender's
+ * server, i.e. <root>/<recipient host>/<recipient user>/<sender host>/.pubkey,
+ * or NULL if there is none.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+EVP_PKEY *parcel_signer_key_get(const struct dp_parcel *parcel)
+{
+	struct path *path_key;
+	EVP_PKEY *pkey;
+	
+	if (!parcel ||
+	    parcel_dir_get(parcel, 0, &path_key).code != DP_REQOK.code)
+		return NULL;
+	
+	/* Up from the sender's user directory. */
+	path_pop(&path_key);
+	path_append(&path_key, DP_FILE_PUBKEY);
+	pkey = keyring_get(path_cstr(path_key), 0);
+	path_free(&path_key);
+	
+	return pkey;
+}
+
+/*
+ * Sends a parcel too large for a batch on its own: as
+ * a delta if the recipient has a copy of the file, or
+ * spread over several connections if it is large enough.
+ * tail is the whole payload as it goes out. A sealed
+ * payload never matches a copy, so no delta is tried
+ * for it. Whatever goes out is signed with pkey, if
+ * given.
+ * Returns 1 if the parcel should go in a batch after all;
+ * otherwise code is set as for data64_range_send().
+ */
+int parcel_single_send(const struct dp_parcel *parcel, const struct dp_tail *tail, EVP_PKEY *pkey, uint16_t *code)
+{
+	const char *host;
+	
+	*code = 0;
+	host = parcel->recipient_addr->host->identifier;
+	
+	if (!tail->seal &&
+	    data64_delta_send(host, parcel, pkey, code) != 1)
+		return 0;
+	
+	if (tail->len >= DP_PROTO_HOST_RANGE_MIN) {
+		data64_range_send(host, parcel, tail, pkey, config_streams_get(host), code);
+		return 0;
+	}
+	
+	return 1;
+}
+
+uint64_t parcel_size_get(const struct data16 *head_data)
+{
+	uint64_t size;
+	int pos = head_data->len - 8;
+	
+	size = head_data->bytes[pos + 7] |
+		( (uint64_t)head_data->bytes[pos + 6] << 8 ) |
+		( (uint64_t)head_data->bytes[pos + 5] << 16 ) |
+		( (uint64_t)head_data->bytes[pos + 4] << 24 ) |
+		( (uint64_t)head_data->bytes[pos + 3] << 32 ) |
+		( (uint64_t)head_data->bytes[pos + 2] << 40 ) |
+		( (uint64_t)head_data->bytes[pos + 1] << 48 ) |
+		( (uint64_t)head_data->bytes[pos] << 56 );
+	
+	return size;
+}
+
+/*
+ * Same as parcel_serialise() but stops short of the
+ * payload, which is sent after the message as a tail
+ * (see batch_write()); size is the payload's. If a
+ * prefix is given, it goes first in the payload and is
+ * serialised here.
+ */
+int parcel_tail_serialise(const struct dp_parcel *parcel, const struct data64 *prefix, uint64_t size, struct data64 **out)
+{
+	uint64_t prefix_len;
+	int status;
+	
+	prefix_len = prefix ? prefix->len : 0;
+	
+	/*
+	 * STRUCTURE
+	 * 1) to 11) Envelope; see envelope_serialise()
+	 * 12) Payload prefix, if any
+	 */
+	if ((status = envelope_serialise(parcel, prefix_len + size, prefix_len, out)) != 0)
+		return status;
+	
+	/* 12) Payload prefix */
+	if (prefix)
+		memcpy(&(*out)->bytes[(*out)->len - prefix_len], prefix->bytes, prefix_len * sizeof(unsigned char));
+	
+	return status;
+}
+
+uint16_t parcel_type_get(const struct data16 *head_data)
+{
+	int pos = DP_PROTO_HOST_MAGIC_NUM_LEN + sizeof(DP_PROTO_HOST_VER) + SHA256_DIGEST_LENGTH + sizeof(uint64_t);
+	
+	return head_data->bytes[pos + 1] |
+		( (uint16_t)head_data->bytes[pos] << 8 );
+}
+
+void parcel_uuid_get(const struct data16 *head_data, uuid_t uuid)
+{
+	int pos = DP_PROTO_HOST_MAGIC_NUM_LEN + sizeof(DP_PROTO_HOST_VER) + SHA256_DIGEST_LENGTH + sizeof(uint64_t) + sizeof(uint16_t);
+	
+	memcpy(uuid, &head_data->bytes[pos], UUID_LEN * sizeof(unsigned char));
+}
+
+uint32_t parcel_version_get(const struct data16 *head_data)
+{
+	int pos = DP_PROTO_HOST_MAGIC_NUM_LEN;
+	
+	return head_data->bytes[pos + 3] |
+		( (uint32_t)head_data->bytes[pos + 2] << 8 ) |
+		( (uint32_t)head_data->bytes[pos + 1] << 16 ) |
+		( (uint32_t)head_data->bytes[pos] << 24 );
+}
+
+/*
+ * Signs messages that are about to go out as one batch
+ * and turns them into DP_PROTO_HOST_MSG_SIGNED messages,
+ * each carrying its inclusion proof ahead of the body.
+ * A message's tail, if tails is given, is signed along
+ * with it; range bytes are not, since the checksum in
+ * their message covers them.
+ * The messages are hashed on the crypto workers and on
+ * this thread, which blocks until they all are; see
+ * offload_group_wait(). Returns -1, leaving them as they
+ * were, if they could not be signed.
+ */
+int parcels_sign(struct data16 **heads, struct data64 **bodies, const struct dp_tail *tails, size_t count, EVP_PKEY *pkey)
+{
+	unsigned char (*leaves)[SHA256_DIGEST_LENGTH];
+	struct data64 *signature;
+	struct dp_leaf_job *jobs;
+	struct dp_offload_group group;
+	struct dp_proof *proofs;
+	
+	if (!heads ||
+	    !bodies ||
+	    count == 0 ||
+	    !pkey)
+		return 1;
+	
+	jobs = (struct dp_leaf_job *)calloc(count, sizeof(*jobs));
+	leaves = (unsigned char (*)[SHA256_DIGEST_LENGTH])calloc(count, sizeof(*leaves));
+	proofs = (struct dp_proof *)calloc(count, sizeof(*proofs));
+	offload_group_init(&group);
+	
+	for (size_t i = 0; i < count; i++) {
+		jobs[i].head = heads[i];
+		jobs[i].body = bodies[i];
+		jobs[i].tail = tails ? &tails[i] : NULL;
+		jobs[i].leaf = leaves[i];
+		offload_group_add(&group, leaf_work, &jobs[i]);
+	}
+	
+	offload_group_wait(&group);
+	free(jobs);
+	
+	if (merkle_batch_sign(leaves, (uint32_t)count, pkey, proofs, &signature) != 0) {
+		free(leaves);
+		free(proofs);
+		
+		return -1;
+	}
+	
+	for (size_t i = 0; i < count; i++) {
+		struct data64 *body;
+		struct data64 *proof_data;
+		struct dp_parcel_head head;
+		uint64_t size;
+		
+		header_deserialise(heads[i], &head);
+		proofs[i].type = head.type;
+		proof_serialise(&proofs[i], &proof_data);
+		
+		body = (struct data64 *)malloc(sizeof(*body));
+		body->len = proof_data->len + bodies[i]->len;
+		body->bytes = (unsigned char *)malloc(body->len);
+		memcpy(body->bytes, proof_data->bytes, proof_data->len);
+		memcpy(&body->bytes[proof_data->len], bodies[i]->bytes, bodies[i]->len);
+		free(bodies[i]->bytes);
+		free(bodies[i]);
+		bodies[i] = body;
+		
+		size = parcel_size_get(heads[i]) + proof_data->len;
+		head.type = DP_PROTO_HOST_MSG_SIGNED;
+		free(heads[i]->bytes);
+		free(heads[i]);
+		header_serialise(head, size, &heads[i]);
+		free(proof_data->bytes);
+		free(proof_data);
+	}
+	
+	free(leaves);
+	free(proofs);
+	free(signature->bytes);
+	free(signature);
+	
+	return 0;
+}
+
+/*
+ * The proof's signature points into proof_data. end is
+ * set to where the message that follows the proof starts.
+ */
+int proof_deserialise(const struct data64 *proof_data, struct dp_proof *proof, uint64_t *end)
+{
+	uint64_t pos;
+	
+	if (!proof_data ||
+	    !proof ||
+	    !end)
+		return 1;
+	
+	pos = 0;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Signature size (2 bytes)
+	 * 2) Signature
+	 * 3) Batch size (4 bytes)
+	 * 4) Message index (4 bytes)
+	 * 5) Message type (2 bytes)
+	 * 6) Hash count (1 byte)
+	 * 7) Hashes (32 bytes each)
+	 */
+	if (proof_data->len < sizeof(uint16_t))
+		return -1;
+	
+	/* 1) Signature size (2 bytes) */
+	proof->signature_len = proof_data->bytes[pos + 1] |
+		( (uint16_t)proof_data->bytes[pos] << 8 );
+	pos += sizeof(uint16_t);
+	
+	if (proof_data->len < pos + proof->signature_len + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t))
+		return -1;
+	
+	/* 2) Signature */
+	proof->signature = &proof_data->bytes[pos];
+	pos += proof->signature_len;
+	
+	/* 3) Batch size (4 bytes) */
+	proof->count = proof_data->bytes[pos + 3] |
+		( (uint32_t)proof_data->bytes[pos + 2] << 8 ) |
+		( (uint32_t)proof_data->bytes[pos + 1] << 16 ) |
+		( (uint32_t)proof_data->bytes[pos] << 24 );
+	pos += sizeof(uint32_t);
+	
+	/* 4) Message index (4 bytes) */
+	proof->index = proof_data->bytes[pos + 3] |
+		( (uint32_t)proof_data->bytes[pos + 2] << 8 ) |
+		( (uint32_t)proof_data->bytes[pos + 1] << 16 ) |
+		( (uint32_t)proof_data->bytes[pos] << 24 );
+	pos += sizeof(uint32_t);
+	
+	/* 5) Message type (2 bytes) */
+	proof->type = proof_data->bytes[pos + 1] |
+		( (uint16_t)proof_data->bytes[pos] << 8 );
+	pos += sizeof(uint16_t);
+	
+	/* 6) Hash count (1 byte) */
+	proof->depth = proof_data->bytes[pos];
+	pos += sizeof(uint8_t);
+	
+	if (proof->depth > DP_PROTO_HOST_PROOF_MAX ||
+	    proof_data->len < pos + (uint64_t)proof->depth * SHA256_DIGEST_LENGTH)
+		return -1;
+	
+	/* 7) Hashes (32 bytes each) */
+	memcpy(proof->hashes, &proof_data->bytes[pos], proof->depth * SHA256_DIGEST_LENGTH);
+	pos += proof->depth * SHA256_DIGEST_LENGTH;
+	*end = pos;
+	
+	return 0;
+}
+
+/*
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int proof_serialise(const struct dp_proof *proof, struct data64 **out)
+{
+	uint64_t pos;
+	
+	if (!proof ||
+	    !out)
+		return 1;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Signature size (2 bytes)
+	 * 2) Signature
+	 * 3) Batch size (4 bytes)
+	 * 4) Message index (4 bytes)
+	 * 5) Message type (2 bytes)
+	 * 6) Hash count (1 byte)
+	 * 7) Hashes (32 bytes each)
+	 */
+	*out = (struct data64 *)malloc(sizeof(**out));
+	(*out)->len = sizeof(uint16_t) +
+		proof->signature_len +
+		sizeof(uint32_t) +
+		sizeof(uint32_t) +
+		sizeof(uint16_t) +
+		sizeof(uint8_t) +
+		proof->depth * SHA256_DIGEST_LENGTH;
+	(*out)->bytes = (unsigned char *)malloc((*out)->len);
+	pos = 0;
+	
+	/* 1) Signature size (2 bytes) */
+	(*out)->bytes[pos]   = (proof->signature_len >> 8) & 0xff;
+	(*out)->bytes[++pos] = proof->signature_len & 0xff;
+	
+	/* 2) Signature */
+	memcpy(&(*out)->bytes[++pos], proof->signature, proof->signature_len);
+	pos += proof->signature_len;
+	
+	/* 3) Batch size (4 bytes) */
+	(*out)->bytes[pos]   = (proof->count >> 24) & 0xff;
+	(*out)->bytes[++pos] = (proof->count >> 16) & 0xff;
+	(*out)->bytes[++pos] = (proof->count >> 8) & 0xff;
+	(*out)->bytes[++pos] = proof->count & 0xff;
+	
+	/* 4) Message index (4 bytes) */
+	(*out)->bytes[++pos] = (proof->index >> 24) & 0xff;
+	(*out)->bytes[++pos] = (proof->index >> 16) & 0xff;
+	(*out)->bytes[++pos] = (proof->index >> 8) & 0xff;
+	(*out)->bytes[++pos] = proof->index & 0xff;
+	
+	/* 5) Message type (2 bytes) */
+	(*out)->bytes[++pos] = (proof->type >> 8) & 0xff;
+	(*out)->bytes[++pos] = proof->type & 0xff;
+	
+	/* 6) Hash count (1 byte) */
+	(*out)->bytes[++pos] = proof->depth;
+	
+	/* 7) Hashes (32 bytes each) */
+	memcpy(&(*out)->bytes[++pos], proof->hashes, proof->depth * SHA256_DIGEST_LENGTH);
+	
+	return 0;
+}
+
+/*
+ * Reads the envelope size off the fixed part of a
+ * range message, which is DP_PROTO_HOST_RANGE_HEAD_LEN
+ * bytes long.
+ */
+uint32_t range_envelope_size_get(const struct data64 *range_data)
+{
+	int pos = DP_PROTO_HOST_RANGE_HEAD_LEN - sizeof(uint32_t);
+	
+	return range_data->bytes[pos + 3] |
+		( (uint32_t)range_data->bytes[pos + 2] << 8 ) |
+		( (uint32_t)range_data->bytes[pos + 1] << 16 ) |
+		( (uint32_t)range_data->bytes[pos] << 24 );
+}
+
+void range_free(struct dp_range **range)
+{
+	if (range &&
+	    *range) {
+		parcel_free(&(*range)->parcel);
+		free(*range);
+		*range = NULL;
+	}
+}
+
+/*
+ * Parses everything in a range message that precedes
+ * the range bytes themselves, i.e. the fixed part and
+ * the envelope.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+struct dp_reqstatus range_parse(const struct data16 *head_data, const struct data64 *range_data, struct dp_range **out)
+{
+	struct data64 envelope;
+	struct dp_range *range;
+	uint64_t end;
+	int pos;
+	
+	if (!head_data ||
+	    !range_data ||
+	    !out)
+		return DP_REQERR_INT_BADARG;
+	
+	*out = NULL;
+	
+	if (range_data->len < DP_PROTO_HOST_RANGE_HEAD_LEN ||
+	    range_data->len != DP_PROTO_HOST_RANGE_HEAD_LEN + range_envelope_size_get(range_data))
+		return DP_REQERR_BADREQ;
+	
+	range = (struct dp_range *)malloc(sizeof(*range));
+	range->parcel = parcel_make();
+	pos = 0;
+	header_deserialise(head_data, &(range->parcel->head));
+	
+	/*
+	 * STRUCTURE
+	 * 1) Parcel UUID (16 bytes)
+	 * 2) Payload checksum (32 bytes)
+	 * 3) Range offset (8 bytes)
+	 * 4) Envelope size (4 bytes)
+	 * 5) Envelope; see envelope_serialise()
+	 * 6) Range bytes
+	 */
+	
+	/* 1) Parcel UUID (16 bytes) */
+	memcpy(range->parcel->head.uuid, &range_data->bytes[pos], UUID_LEN * sizeof(unsigned char));
+	pos += UUID_LEN * sizeof(unsigned char);
+	
+	/* 2) Payload checksum (32 bytes) */
+	memcpy(range->checksum, &range_data->bytes[pos], SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+	pos += SHA256_DIGEST_LENGTH * sizeof(unsigned char);
+	
+	/* 3) Range offset (8 bytes) */
+	range->offset = range_data->bytes[pos + 7] |
+		( (uint64_t)range_data->bytes[pos + 6] << 8 ) |
+		( (uint64_t)range_data->bytes[pos + 5] << 16 ) |
+		( (uint64_t)range_data->bytes[pos + 4] << 24 ) |
+		( (uint64_t)range_data->bytes[pos + 3] << 32 ) |
+		( (uint64_t)range_data->bytes[pos + 2] << 40 ) |
+		( (uint64_t)range_data->bytes[pos + 1] << 48 ) |
+		( (uint64_t)range_data->bytes[pos] << 56 );
+	pos += sizeof(uint64_t);
+	
+	/* 4) Envelope size (4 bytes); already checked against the message length above. */
+	pos += sizeof(uint32_t);
+	
+	/* 5) Envelope */
+	envelope.bytes = &range_data->bytes[pos];
+	envelope.len = range_data->len - pos;
+	
+	if (envelope_deserialise(&envelope, range->parcel, &range->size, &end) != 0 ||
+	    end != envelope.len) {
+		range_free(&range);
+		return DP_REQERR_BADREQ;
+	}
+	
+	service_get(range->parcel->raw_filename, &(range->parcel->service));
+	*out = range;
+	
+	return DP_REQOK;
+}
+
+/*
+ * Makes the header and everything up to the range
+ * bytes of a range message carrying len bytes of the
+ * parcel's payload, size bytes as it goes out, starting
+ * at offset. The range bytes themselves are left for
+ * the caller to send straight out of the payload.
+ * checksum should be the sha() of the whole payload.
+ * It is the caller's responsibility to free the
+ * returned pointers.
+ */
+int range_serialise(const struct dp_parcel *parcel, const unsigned char checksum[], uint64_t size, uint64_t offset, uint64_t len, struct data16 **head_out, struct data64 **range_out)
+{
+	struct data64 *envelope;
+	struct dp_parcel_head head;
+	int pos;
+	
+	if (!parcel ||
+	    !head_out ||
+	    !range_out)
+		return 1;
+	
+	if (envelope_serialise(parcel, size, 0, &envelope) != 0)
+		return -1;
+	
+	pos = 0;
+	*range_out = (struct data64 *)malloc(sizeof(**range_out));
+	(*range_out)->len = DP_PROTO_HOST_RANGE_HEAD_LEN + envelope->len;
+	(*range_out)->bytes = (unsigned char *)calloc((*range_out)->len, sizeof(unsigned char));
+	
+	/*
+	 * STRUCTURE
+	 * 1) Parcel UUID (16 bytes)
+	 * 2) Payload checksum (32 bytes)
+	 * 3) Range offset (8 bytes)
+	 * 4) Envelope size (4 bytes)
+	 * 5) Envelope; see envelope_serialise()
+	 * 6) Range bytes
+	 */
+	
+	/* 1) Parcel UUID (16 bytes) */
+	memcpy((*range_out)->bytes, parcel->head.uuid, UUID_LEN * sizeof(unsigned char));
+	pos += UUID_LEN * sizeof(unsigned char);
+	
+	/* 2) Payload checksum (32 bytes) */
+	memcpy(&(*range_out)->bytes[pos], checksum, SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+	pos += SHA256_DIGEST_LENGTH * sizeof(unsigned char);
+	
+	/* 3) Range offset (8 bytes) */
+	(*range_out)->bytes[pos] = (offset >> 56) & 0xff;
+	(*range_out)->bytes[++pos] = (offset >> 48) & 0xff;
+	(*range_out)->bytes[++pos] = (offset >> 40) & 0xff;
+	(*range_out)->bytes[++pos] = (offset >> 32) & 0xff;
+	(*range_out)->bytes[++pos] = (offset >> 24) & 0xff;
+	(*range_out)->bytes[++pos] = (offset >> 16) & 0xff;
+	(*range_out)->bytes[++pos] = (offset >> 8) & 0xff;
+	(*range_out)->bytes[++pos] = offset & 0xff;
+	
+	/* 4) Envelope size (4 bytes) */
+	(*range_out)->bytes[++pos] = (envelope->len >> 24) & 0xff;
+	(*range_out)->bytes[++pos] = (envelope->len >> 16) & 0xff;
+	(*range_out)->bytes[++pos] = (envelope->len >> 8) & 0xff;
+	(*range_out)->bytes[++pos] = envelope->len & 0xff;
+	
+	/* 5) Envelope */
+	memcpy(&(*range_out)->bytes[++pos], envelope->bytes, envelope->len * sizeof(unsigned char));
+	
+	/* Every range message is acknowledged on its own, so it gets its own UUID. */
+	head = parcel->head;
+	head.type = DP_PROTO_HOST_MSG_RANGE;
+	uuid_generate(head.uuid);
+	
+	free(envelope->bytes);
+	free(envelope);
+	
+	return header_serialise(head, (*range_out)->len + len, head_out);
+}
+
+/*
+ * Orders addresses by host (qsort() comparator).
+ */
+int recipient_host_compare(const void *a, const void *b)
+{
+	const char *host_a;
+	const char *host_b;
+	
+	host_a = strchr(*(char * const *)a, '@');
+	host_b = strchr(*(char * const *)b, '@');
+	
+	return strcmp(host_a ? host_a : "", host_b ? host_b : "");
+}
+
+/*
+ * Expands the recipient into the addresses to send to:
+ * the members of the list if the sender keeps a dp.list
+ * for it, one address per line, or else the recipient
+ * alone. The addresses are sorted by host.
+ * Returns -1 if the list has no members.
+ * It is the caller's responsibility to free the
+ * returned pointers.
+ */
+int recipients_get(const char *sender_host, const char *sender_user, const char *recipient, char ***out, size_t *count)
+{
+	char *list;
+	struct path *path_list;
+	size_t len_line;
+	size_t len_list;
+	
+	if (!recipient ||
+	    !out ||
+	    !count)
+		return 1;
+	
+	*out = NULL;
+	*count = 0;
+	list = NULL;
+	
+	if ((path_list = contact_dir_get(sender_host, sender_user, recipient))) {
+		path_append(&path_list, DP_FILE_LIST);
+		
+		if (file_exists(path_list) == 1)
+			readt(path_list, &list);
+		
+		path_free(&path_list);
+	}
+	
+	if (!list) {
+		*out = (char **)malloc(sizeof(**out));
+		(*out)[0] = (char *)calloc(strlen(recipient) + 1, sizeof(char));
+		strcpy((*out)[0], recipient);
+		*count = 1;
+		
+		return 0;
+	}
+	
+	len_line = 0;
+	len_list = strlen(list);
+	
+	/* Blank lines and comment lines are skipped. */
+	for (size_t i = 0; i <= len_list; i++) {
+		const char *line;
+		
+		if (i < len_list &&
+		    list[i] != '\n' &&
+		    list[i] != '\r') {
+			len_line++;
+			continue;
+		}
+		
+		line = list + i - len_line;
+		
+		if (len_line > 0 &&
+		    line[0] != DP_CONF_COMMENT) {
+			*out = (char **)realloc(*out, (*count + 1) * sizeof(**out));
+			(*out)[*count] = (char *)calloc(len_line + 1, sizeof(char));
+			strncpy((*out)[*count], line, len_line);
+			(*count)++;
+		}
+		
+		len_line = 0;
+	}
+	
+	free(list);
+	
+	if (*count == 0)
+		return -1;
+	
+	qsort(*out, *count, sizeof(**out), recipient_host_compare);
+	
+	return 0;
+}
+
+/*
+ * Appends the components of relpath, a path within a
+ * synced directory, to path. None of them may be hidden,
+ * so the directory's .index and the like are out of
+ * reach. The directories on the way are made if make is
+ * set.
+ */
+struct dp_reqstatus relpath_append(struct path **path, const char *relpath, int make)
+{
+	char *component;
+	char *copy;
+	char *next;
+	char *save;
+	struct dp_reqstatus status;
+	
+	if (!path ||
+	    !*path ||
+	    !relpath)
+		return DP_REQERR_INT_BADARG;
+	
+	if (!(copy = strdup(relpath)))
+		return DP_REQERR_INTERNAL;
+	
+	status = DP_REQOK;
+	component = strtok_r(copy, "/", &save);
+	
+	if (!component)
+		status = DP_REQERR_BADREQ;
+	
+	while (component &&
+	       status.code == DP_REQOK.code) {
+		next = strtok_r(NULL, "/", &save);
+		
+		if (component_valid(component) != 1 ||
+		    component[0] == '.') {
+			status = DP_REQERR_BADREQ;
+			break;
+		}
+		
+		path_append(path, component);
+		
+		if (make &&
+		    next &&
+		    directory_make(*path) == -1)
+			status = DP_REQERR_INTERNAL;
+		
+		component = next;
+	}
+	
+	free(copy);
+	
+	return status;
+}
+
+void request_free(struct token **request)
+{
+	if (!request)
+		return;
+	
+	while (*request) {
+		struct token *tmp;
+		
+		tmp = *request;
+		*request = (*request)->next;
+		
+		if (tmp->name)
+			free(tmp->name);
+		
+		if (tmp->val)
+			free(tmp->val);
+		
+		free(tmp);
+	}
+}
+
+int resume_deserialise(const struct data64 *resume_data, uuid_t uuid)
+{
+	if (!resume_data ||
+	    resume_data->len != UUID_LEN)
+		return 1;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Parcel UUID (16 bytes)
+	 */
+	memcpy(uuid, resume_data->bytes, UUID_LEN * sizeof(unsigned char));
+	
+	return 0;
+}
+
+/*
+ * Asks the receiver how much of the parcel it holds.
+ * It is the caller's responsibility to free the
+ * returned pointers.
+ */
+int resume_serialise(const uuid_t uuid, struct data16 **head_out, struct data64 **body_out)
+{
+	struct dp_parcel_head head;
+	
+	if (!head_out ||
+	    !body_out)
+		return 1;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Parcel UUID (16 bytes)
+	 */
+	*body_out = (struct data64 *)malloc(sizeof(**body_out));
+	(*body_out)->len = UUID_LEN;
+	(*body_out)->bytes = (unsigned char *)calloc((*body_out)->len, sizeof(unsigned char));
+	memcpy((*body_out)->bytes, uuid, UUID_LEN * sizeof(unsigned char));
+	
+	memset(&head, 0, sizeof(head));
+	head.timestamp = timestamp();
+	head.type = DP_PROTO_HOST_MSG_RESUME;
+	uuid_generate(head.uuid);
+	
+	return header_serialise(head, (*body_out)->len, head_out);
+}
+
+/*
+ * Wraps a seal's key for one recipient; run on a crypto
+ * worker.
+ */
+int seal_head_work(void *args)
+{
+	struct dp_seal_job *job;
+	
+	job = (struct dp_seal_job *)args;
+	
+	return seal_head_make(job->seal, job->pkey, job->head_out);
+}
+
+/*
+ * Draws a seal for every file and wraps each seal's key
+ * for every recipient with a public key, spread over the
+ * crypto workers; this thread blocks until every key is
+ * wrapped. The records themselves are made while the
+ * parcels go out. seal_heads is indexed by recipient,
+ * then by file; entries that could not be sealed are
+ * left NULL.
+ */
+void seals_make(struct data64 **payloads, size_t count_files, EVP_PKEY **pkeys, size_t count_recipients, struct dp_seal **seals, struct data64 **seal_heads)
+{
+	struct dp_offload_group group;
+	struct dp_seal_job *jobs;
+	
+	jobs = (struct dp_seal_job *)calloc(count_files * count_recipients, sizeof(*jobs));
+	offload_group_init(&group);
+	
+	for (size_t i = 0; i < count_files; i++) {
+		if (payloads[i])
+			seal_make(payloads[i]->len, &seals[i]);
+	}
+	
+	
+	for (size_t i = 0; i < count_recipients; i++) {
+		for (size_t j = 0; j < count_files; j++) {
+			struct dp_seal_job *job;
+			
+			if (!pkeys[i] ||
+			    !seals[j])
+				continue;
+			
+			job = &jobs[i * count_files + j];
+			job->seal = seals[j];
+			job->pkey = pkeys[i];
+			job->head_out = &seal_heads[i * count_files + j];
+			offload_group_add(&group, seal_head_work, job);
+		}
+	}
+	
+	offload_group_wait(&group);
+	free(jobs);
+}
+
+/*
+ * The service is indicated by the file extension.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int service_get(const char *filename, char **service)
+{
+	size_t filename_len;
+	int valid;
+	
+	if (!filename ||
+	    !service)
+		return 1;
+	
+	filename_len = strlen(filename);
+	valid = 0;
+	
+	/*
+	 * Smallest valid filename: a.x
+	 */
+	if (filename_len < 3)
+		return -1;
+	
+	/*
+	 * We want to extract whatever comes after
+	 * the final dot in the filename. We start
+	 * from the second position because there
+	 * needs to be at least 1 character after
+	 * the dot.
+	 */
+	for (size_t i = filename_len - 2; i > 0; i--) {
+		if (filename[i] == '.') {
+			*service = (char *)calloc(filename_len - i, sizeof(**service));
+			strncpy(*service, filename + i + 1, filename_len - i - 1);
+			
+			valid = 1;
+			break;
+		}
+	}
+	
+	if (valid != 1) {
+		free(*service);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int signatures_deserialise(const struct data64 *signatures_data, uint64_t *basis_size, uint32_t *block_len, struct dp_signature **signatures, uint32_t *count)
+{
+	uint64_t pos;
+	
+	if (!signatures_data ||
+	    !basis_size ||
+	    !block_len ||
+	    !signatures ||
+	    !count)
+		return 1;
+	
+	*signatures = NULL;
+	pos = 0;
+	
+	if (signatures_data->len < DP_PROTO_HOST_SIGNATURES_HEAD_LEN)
+		return -1;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Basis size (8 bytes)
+	 * 2) Block length (4 bytes)
+	 * 3) Signature count (4 bytes)
+	 * 4) Weak checksum (4 bytes)
+	 * 5) Strong checksum (16 bytes)
+	 * ...4) and 5) repeat for every block.
+	 */
+	
+	/* 1) Basis size (8 bytes) */
+	*basis_size = signatures_data->bytes[pos + 7] |
+		( (uint64_t)signatures_data->bytes[pos + 6] << 8 ) |
+		( (uint64_t)signatures_data->bytes[pos + 5] << 16 ) |
+		( (uint64_t)signatures_data->bytes[pos + 4] << 24 ) |
+		( (uint64_t)signatures_data->bytes[pos + 3] << 32 ) |
+		( (uint64_t)signatures_data->bytes[pos + 2] << 40 ) |
+		( (uint64_t)signatures_data->bytes[pos + 1] << 48 ) |
+		( (uint64_t)signatures_data->bytes[pos] << 56 );
+	pos += sizeof(uint64_t);
+	
+	/* 2) Block length (4 bytes) */
+	*block_len = signatures_data->bytes[pos + 3] |
+		( (uint32_t)signatures_data->bytes[pos + 2] << 8 ) |
+		( (uint32_t)signatures_data->bytes[pos + 1] << 16 ) |
+		( (uint32_t)signatures_data->bytes[pos] << 24 );
+	pos += sizeof(uint32_t);
+	
+	/* 3) Signature count (4 bytes) */
+	*count = signatures_data->bytes[pos + 3] |
+		( (uint32_t)signatures_data->bytes[pos + 2] << 8 ) |
+		( (uint32_t)signatures_data->bytes[pos + 1] << 16 ) |
+		( (uint32_t)signatures_data->bytes[pos] << 24 );
+	pos += sizeof(uint32_t);
+	
+	if (*count > DP_PROTO_HOST_SIGNATURES_MAX ||
+	    signatures_data->len != pos + (uint64_t)*count * DP_PROTO_HOST_SIGNATURE_LEN ||
+	    (*count > 0 &&
+	     *block_len == 0))
+		return -1;
+	
+	*signatures = (struct dp_signature *)calloc(*count ? *count : 1, sizeof(**signatures));
+	
+	for (uint32_t i = 0; i < *count; i++) {
+		/* 4) Weak checksum (4 bytes) */
+		(*signatures)[i].weak = signatures_data->bytes[pos + 3] |
+			( (uint32_t)signatures_data->bytes[pos + 2] << 8 ) |
+			( (uint32_t)signatures_data->bytes[pos + 1] << 16 ) |
+			( (uint32_t)signatures_data->bytes[pos] << 24 );
+		pos += sizeof(uint32_t);
+		
+		/* 5) Strong checksum (16 bytes) */
+		memcpy((*signatures)[i].strong, &signatures_data->bytes[pos], DP_PROTO_HOST_STRONG_LEN * sizeof(unsigned char));
+		pos += DP_PROTO_HOST_STRONG_LEN * sizeof(unsigned char);
+	}
+	
+	return 0;
+}
+
+/*
+ * Describes the recipient's copy of a file (the basis)
+ * block by block. A count of 0 means there is none.
+ * It is the caller's responsibility to free the
+ * returned pointers.
+ */
+int signatures_serialise(uint64_t basis_size, uint32_t block_len, const struct dp_signature *signatures, uint32_t count, struct data16 **head_out, struct data64 **body_out)
+{
+	struct dp_parcel_head head;
+	int pos;
+	
+	if (!head_out ||
+	    !body_out ||
+	    (count > 0 &&
+	     !signatures))
+		return 1;
+	
+	pos = 0;
+	*body_out = (struct data64 *)malloc(sizeof(**body_out));
+	(*body_out)->len = DP_PROTO_HOST_SIGNATURES_HEAD_LEN + (uint64_t)count * DP_PROTO_HOST_SIGNATURE_LEN;
+	(*body_out)->bytes = (unsigned char *)calloc((*body_out)->len, sizeof(unsigned char));
+	
+	/*
+	 * STRUCTURE
+	 * 1) Basis size (8 bytes)
+	 * 2) Block length (4 bytes)
+	 * 3) Signature count (4 bytes)
+	 * 4) Weak checksum (4 bytes)
+	 * 5) Strong checksum (16 bytes)
+	 * ...4) and 5) repeat for every block.
+	 */
+	
+	/* 1) Basis size (8 bytes) */
+	(*body_out)->bytes[pos]   = (basis_size >> 56) & 0xff;
+	(*body_out)->bytes[++pos] = (basis_size >> 48) & 0xff;
+	(*body_out)->bytes[++pos] = (basis_size >> 40) & 0xff;
+	(*body_out)->bytes[++pos] = (basis_size >> 32) & 0xff;
+	(*body_out)->bytes[++pos] = (basis_size >> 24) & 0xff;
+	(*body_out)->bytes[++pos] = (basis_size >> 16) & 0xff;
+	(*body_out)->bytes[++pos] = (basis_size >> 8) & 0xff;
+	(*body_out)->bytes[++pos] = basis_size & 0xff;
+	
+	/* 2) Block length (4 bytes) */
+	(*body_out)->bytes[++pos] = (block_len >> 24) & 0xff;
+	(*body_out)->bytes[++pos] = (block_len >> 16) & 0xff;
+	(*body_out)->bytes[++pos] = (block_len >> 8) & 0xff;
+	(*body_out)->bytes[++pos] = block_len & 0xff;
+	
+	/* 3) Signature count (4 bytes) */
+	(*body_out)->bytes[++pos] = (count >> 24) & 0xff;
+	(*body_out)->bytes[++pos] = (count >> 16) & 0xff;
+	(*body_out)->bytes[++pos] = (count >> 8) & 0xff;
+	(*body_out)->bytes[++pos] = count & 0xff;
+	
+	for (uint32_t i = 0; i < count; i++) {
+		/* 4) Weak checksum (4 bytes) */
+		(*body_out)->bytes[++pos] = (signatures[i].weak >> 24) & 0xff;
+		(*body_out)->bytes[++pos] = (signatures[i].weak >> 16) & 0xff;
+		(*body_out)->bytes[++pos] = (signatures[i].weak >> 8) & 0xff;
+		(*body_out)->bytes[++pos] = signatures[i].weak & 0xff;
+		
+		/* 5) Strong checksum (16 bytes) */
+		memcpy(&(*body_out)->bytes[++pos], signatures[i].strong, DP_PROTO_HOST_STRONG_LEN * sizeof(unsigned char));
+		pos += DP_PROTO_HOST_STRONG_LEN - 1;
+	}
+	
+	memset(&head, 0, sizeof(head));
+	head.timestamp = timestamp();
+	head.type = DP_PROTO_HOST_MSG_SIGNATURES;
+	uuid_generate(head.uuid);
+	
+	return header_serialise(head, (*body_out)->len, head_out);
+}
+
+/*
+ * Returns this server's private key (see DP_FILE_PRIVKEY)
+ * if messages to other hosts are to be signed (see
+ * DP_CKEY_SIGN), or NULL.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+EVP_PKEY *signing_key_get(void)
+{
+	struct path *path_key;
+	EVP_PKEY *pkey;
+	
+	if (config_sign_get() <= 0)
+		return NULL;
+	
+	path_key = path_copy(path_dir_root);
+	path_append(&path_key, DP_FILE_PRIVKEY);
+	
+	if (!(pkey = keyring_get(path_cstr(path_key), 1)))
+		trace_write(DP_TRACE_WARN, "Unable to sign parcels without %s", path_cstr(path_key));
+	
+	path_free(&path_key);
+	
+	return pkey;
+}
+
+/*
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int spans_deserialise(const struct data64 *spans_data, uuid_t uuid, uint16_t *code, struct dp_span **spans, uint32_t *count)
+{
+	int pos;
+	
+	if (!spans_data ||
+	    !code ||
+	    !spans ||
+	    !count)
+		return 1;
+	
+	*spans = NULL;
+	pos = 0;
+	
+	if (spans_data->len < UUID_LEN + sizeof(uint16_t) + sizeof(uint32_t))
+		return -1;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Parcel UUID (16 bytes)
+	 * 2) Status code (2 bytes)
+	 * 3) Span count (4 bytes)
+	 * 4) Start (8 bytes)
+	 * 5) End (8 bytes)
+	 * ...4) and 5) repeat for every span.
+	 */
+	
+	/* 1) Parcel UUID (16 bytes) */
+	memcpy(uuid, spans_data->bytes, UUID_LEN * sizeof(unsigned char));
+	pos += UUID_LEN * sizeof(unsigned char);
+	
+	/* 2) Status code (2 bytes) */
+	*code = spans_data->bytes[pos + 1] |
+		( (uint16_t)spans_data->bytes[pos] << 8 );
+	pos += sizeof(uint16_t);
+	
+	/* 3) Span count (4 bytes) */
+	*count = spans_data->bytes[pos + 3] |
+		( (uint32_t)spans_data->bytes[pos + 2] << 8 ) |
+		( (uint32_t)spans_data->bytes[pos + 1] << 16 ) |
+		( (uint32_t)spans_data->bytes[pos] << 24 );
+	pos += sizeof(uint32_t);
+	
+	if (*count > DP_PROTO_HOST_SPANS_MAX ||
+	    spans_data->len != pos + (uint64_t)*count * DP_PROTO_HOST_SPAN_LEN)
+		return -1;
+	
+	*spans = (struct dp_span *)calloc(*count ? *count : 1, sizeof(**spans));
+	
+	for (uint32_t i = 0; i < *count; i++) {
+		/* 4) Start (8 bytes) */
+		(*spans)[i].start = spans_data->bytes[pos + 7] |
+			( (uint64_t)spans_data->bytes[pos + 6] << 8 ) |
+			( (uint64_t)spans_data->bytes[pos + 5] << 16 ) |
+			( (uint64_t)spans_data->bytes[pos + 4] << 24 ) |
+			( (uint64_t)spans_data->bytes[pos + 3] << 32 ) |
+			( (uint64_t)spans_data->bytes[pos + 2] << 40 ) |
+			( (uint64_t)spans_data->bytes[pos + 1] << 48 ) |
+			( (uint64_t)spans_data->bytes[pos] << 56 );
+		pos += sizeof(uint64_t);
+		
+		/* 5) End (8 bytes) */
+		(*spans)[i].end = spans_data->bytes[pos + 7] |
+			( (uint64_t)spans_data->bytes[pos + 6] << 8 ) |
+			( (uint64_t)spans_data->bytes[pos + 5] << 16 ) |
+			( (uint64_t)spans_data->bytes[pos + 4] << 24 ) |
+			( (uint64_t)spans_data->bytes[pos + 3] << 32 ) |
+			( (uint64_t)spans_data->bytes[pos + 2] << 40 ) |
+			( (uint64_t)spans_data->bytes[pos + 1] << 48 ) |
+			( (uint64_t)spans_data->bytes[pos] << 56 );
+		pos += sizeof(uint64_t);
+	}
+	
+	return 0;
+}
+
+/*
+ * Tells the sender what became of a parcel: DP_REQOK if
+ * it was delivered, DP_REQACCEPTED along with the spans
+ * that are in if it is partly received, or
+ * DP_REQERR_NOTFOUND if nothing is known of it.
+ * It is the caller's responsibility to free the
+ * returned pointers.
+ */
+int spans_serialise(const uuid_t uuid, uint16_t code, const struct dp_span *spans, uint32_t count, struct data16 **head_out, struct data64 **body_out)
+{
+	struct dp_parcel_head head;
+	int pos;
+	
+	if (!head_out ||
+	    !body_out ||
+	    (count > 0 &&
+	     !spans))
+		return 1;
+	
+	pos = 0;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Parcel UUID (16 bytes)
+	 * 2) Status code (2 bytes)
+	 * 3) Span count (4 bytes)
+	 * 4) Start (8 bytes)
+	 * 5) End (8 bytes)
+	 * ...4) and 5) repeat for every span.
+	 */
+	*body_out = (struct data64 *)malloc(sizeof(**body_out));
+	(*body_out)->len = UUID_LEN + sizeof(uint16_t) + sizeof(uint32_t) + (uint64_t)count * DP_PROTO_HOST_SPAN_LEN;
+	(*body_out)->bytes = (unsigned char *)calloc((*body_out)->len, sizeof(unsigned char));
+	
+	/* 1) Parcel UUID (16 bytes) */
+	memcpy((*body_out)->bytes, uuid, UUID_LEN * sizeof(unsigned char));
+	pos += UUID_LEN * sizeof(unsigned char);
+	
+	/* 2) Status code (2 bytes) */
+	(*body_out)->bytes[pos]   = (code >> 8) & 0xff;
+	(*body_out)->bytes[++pos] = code & 0xff;
+	
+	/* 3) Span count (4 bytes) */
+	(*body_out)->bytes[++pos] = (count >> 24) & 0xff;
+	(*body_out)->bytes[++pos] = (count >> 16) & 0xff;
+	(*body_out)->bytes[++pos] = (count >> 8) & 0xff;
+	(*body_out)->bytes[++pos] = count & 0xff;
+	
+	for (uint32_t i = 0; i < count; i++) {
+		/* 4) Start (8 bytes) */
+		(*body_out)->bytes[++pos] = (spans[i].start >> 56) & 0xff;
+		(*body_out)->bytes[++pos] = (spans[i].start >> 48) & 0xff;
+		(*body_out)->bytes[++pos] = (spans[i].start >> 40) & 0xff;
+		(*body_out)->bytes[++pos] = (spans[i].start >> 32) & 0xff;
+		(*body_out)->bytes[++pos] = (spans[i].start >> 24) & 0xff;
+		(*body_out)->bytes[++pos] = (spans[i].start >> 16) & 0xff;
+		(*body_out)->bytes[++pos] = (spans[i].start >> 8) & 0xff;
+		(*body_out)->bytes[++pos] = spans[i].start & 0xff;
+		
+		/* 5) End (8 bytes) */
+		(*body_out)->bytes[++pos] = (spans[i].end >> 56) & 0xff;
+		(*body_out)->bytes[++pos] = (spans[i].end >> 48) & 0xff;
+		(*body_out)->bytes[++pos] = (spans[i].end >> 40) & 0xff;
+		(*body_out)->bytes[++pos] = (spans[i].end >> 32) & 0xff;
+		(*body_out)->bytes[++pos] = (spans[i].end >> 24) & 0xff;
+		(*body_out)->bytes[++pos] = (spans[i].end >> 16) & 0xff;
+		(*body_out)->bytes[++pos] = (spans[i].end >> 8) & 0xff;
+		(*body_out)->bytes[++pos] = spans[i].end & 0xff;
+	}
+	
+	memset(&head, 0, sizeof(head));
+	head.timestamp = timestamp();
+	head.type = DP_PROTO_HOST_MSG_SPANS;
+	uuid_generate(head.uuid);
+	
+	return header_serialise(head, (*body_out)->len, head_out);
+}
+
+/*
+ * Serialises a parcel that restores a file of the
+ * recipient's copy; see sync.c. Its payload, size bytes,
+ * is sent after it as a tail.
+ * It is the caller's responsibility to free the
+ * returned pointers.
+ */
+int synced_serialise(const struct dp_parcel *parcel, uint64_t size, struct data16 **head_out, struct data64 **body_out)
+{
+	struct dp_parcel_head head;
+	int status;
+	
+	if (!parcel ||
+	    !parcel->raw_filename ||
+	    !head_out ||
+	    !body_out)
+		return 1;
+	
+	/*
+	 * STRUCTURE
+	 * 1) to 11) Envelope; see envelope_serialise()
+	 * 12) Payload, sent separately
+	 */
+	if ((status = parcel_tail_serialise(parcel, NULL, size, body_out)) != 0)
+		return status;
+	
+	head = parcel->head;
+	head.type = DP_PROTO_HOST_MSG_SYNCED;
+	
+	return header_serialise(head, (*body_out)->len + size, head_out);
+}
+
+/*
+ * Returns DP_REQOK along with a parcel holding the
+ * addresses of the directory asked for; its filename is
+ * the path of the directory within the recipient's
+ * copy, empty for the copy itself.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+struct dp_reqstatus tree_parse(const struct data16 *head_data, const struct data64 *tree_data, struct dp_parcel **out)
+{
+	struct dp_parcel *parcel;
+	uint64_t end;
+	uint64_t size;
+	
+	if (!head_data ||
+	    !tree_data ||
+	    !out)
+		return DP_REQERR_INT_BADARG;
+	
+	*out = NULL;
+	parcel = parcel_make();
+	header_deserialise(head_data, &(parcel->head));
+	
+	/*
+	 * STRUCTURE
+	 * 1) Envelope; see envelope_serialise()
+	 */
+	if (envelope_deserialise(tree_data, parcel, &size, &end) != 0 ||
+	    end != tree_data->len) {
+		parcel_free(&parcel);
+		return DP_REQERR_BADREQ;
+	}
+	
+	*out = parcel;
+	
+	return DP_REQOK;
+}
+
+/*
+ * Asks the recipient's host for the entries of the
+ * directory of its copy named by the parcel's filename;
+ * see tree_parse().
+ * It is the caller's responsibility to free the
+ * returned pointers.
+ */
+int tree_serialise(const struct dp_parcel *parcel, struct data16 **head_out, struct data64 **body_out)
+{
+	struct dp_parcel_head head;
+	int status;
+	
+	if (!parcel ||
+	    !parcel->raw_filename ||
+	    !head_out ||
+	    !body_out)
+		return 1;
+	
+	/*
+	 * STRUCTURE
+	 * 1) Envelope; see envelope_serialise()
+	 */
+	if ((status = envelope_serialise(parcel, 0, 0, body_out)) != 0)
+		return status;
+	
+	head = parcel->head;
+	head.type = DP_PROTO_HOST_MSG_TREE;
+	uuid_generate(head.uuid);
+	
+	return header_serialise(head, (*body_out)->len, head_out);
+}
+
 /*
  * In the case of DDM, this function might return
  * a null user.
@@ -1019,7 +3645,7 @@ int valid_check(const char *reqstr)
 	ver_str = (char *)calloc(i_eol - head_len + 1, sizeof(ver_str));
 	strncpy(ver_str, reqstr + head_len, i_eol - head_len);
 	ver = atoi(ver_str);
-	printf("Protocol Version %d\n", ver);
+	trace_write(DP_TRACE_INFO, "Protocol Version %d", ver);
 	free(ver_str);
 	
 	return valid;
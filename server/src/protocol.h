@@ -18,6 +18,9 @@
 
 
 #define DP_PROTO_HOST_MAGIC_NUM_LEN  	9
+#define DP_PROTO_HOST_ACK_MAX		64	/* The maximum number of acknowledgements coalesced into one message. */
+#define DP_PROTO_HOST_STRONG_LEN	16	/* Bytes of a block's SHA-256 kept in its signature. */
+#define DP_PROTO_HOST_PROOF_MAX		16	/* Hashes in an inclusion proof, enough for a batch of 65536 parcels. */
 
 /*************
  * CONSTANTS *
@@ -26,20 +29,69 @@ static const char *DP_PROTO_SERV_HEAD 					= "!DP";
 static const char *DP_PROTO_SERV_DELIM 					= "\r\n";
 static const char *DP_PROTO_SERV_ARG_FILE 				= "f"; 	/* Specifies a file path */
 static const char *DP_PROTO_SERV_ARG_RECIP 				= "r"; 	/* Specifies a recipient */
+static const char *DP_PROTO_SERV_ARG_SYNC 				= "s"; 	/* Specifies a contact whose directory is synced with their host; see sync.c */
 static const uint32_t DP_PROTO_SERV_VER 				= 1;
 static const char DP_PROTO_HOST_MAGIC_NUM[DP_PROTO_HOST_MAGIC_NUM_LEN] 	= { 0x89, 0x50, 0x44, 0x48, 0x5a, 0x0d, 0x0a, 0x1a, 0x0a };
-static const uint32_t DP_PROTO_HOST_VER 				= 1;
+static const uint32_t DP_PROTO_HOST_VER 				= 2;
 static const int DP_PROTO_SERV_ARGMAX_NAME 				= 4; 	/* The maximum length of an argument name. */
 static const int DP_PROTO_SERV_ARGMAX_VAL 				= 256;	/* The maximum length of an argument value. */
 static const int DP_PROTO_SERV_MAXREAD 					= 8192; /* 8 KB */
 static const uint16_t DP_PROTO_HOST_MSG_UNDEF 				= 0;
 static const uint16_t DP_PROTO_HOST_MSG_PARCEL 				= 1;
+static const uint16_t DP_PROTO_HOST_MSG_ACK 				= 2;
+static const uint16_t DP_PROTO_HOST_MSG_RANGE 				= 3;
+static const uint16_t DP_PROTO_HOST_MSG_RESUME 				= 4;	/* Asks which bytes of a large parcel the receiver already has */
+static const uint16_t DP_PROTO_HOST_MSG_SPANS 				= 5;	/* The answer to DP_PROTO_HOST_MSG_RESUME */
+static const uint16_t DP_PROTO_HOST_MSG_BASIS 				= 6;	/* Asks for the block signatures of the recipient's copy of a file */
+static const uint16_t DP_PROTO_HOST_MSG_SIGNATURES 			= 7;	/* The answer to DP_PROTO_HOST_MSG_BASIS */
+static const uint16_t DP_PROTO_HOST_MSG_DELTA 				= 8;	/* A parcel expressed as changes to the recipient's copy */
+static const uint16_t DP_PROTO_HOST_MSG_SIGNED 				= 9;	/* A message carrying its batch's signature ahead of it; see merkle.c */
+static const uint16_t DP_PROTO_HOST_MSG_TREE 				= 10;	/* Asks for the entries of a directory of the recipient's copy; see sync.c */
+static const uint16_t DP_PROTO_HOST_MSG_ENTRIES 			= 11;	/* The answer to DP_PROTO_HOST_MSG_TREE */
+static const uint16_t DP_PROTO_HOST_MSG_SYNCED 				= 12;	/* A parcel named by its path within the recipient's copy */
+static const int DP_PROTO_HOST_ACK_WINDOW 				= 20;	/* How long (in milliseconds) a receiver holds acknowledgements before flushing them. */
+static const int DP_PROTO_HOST_ACK_TIMEOUT 				= 30;	/* How long (in seconds) a sender waits for an acknowledgement. */
+static const int DP_PROTO_HOST_SEND_WINDOW 				= 16;	/* The maximum number of unacknowledged parcels per connection. */
+static const uint64_t DP_PROTO_HOST_RANGE_MIN 				= 64 * 1024 * 1024;	/* Payloads this large are sent in byte ranges over several connections. */
+static const uint64_t DP_PROTO_HOST_RANGE_LEN 				= 4 * 1024 * 1024;	/* The maximum number of payload bytes per range message. */
+static const uint32_t DP_PROTO_HOST_ENVELOPE_MAX 			= 64 * 1024;
+static const uint64_t DP_PROTO_HOST_STREAM_MIN 				= 1024 * 1024;	/* Parcels this large are received straight into a file rather than into memory. */
+static const uint32_t DP_PROTO_HOST_ENTRIES_MAX 			= 1024 * 1024;
+static const uint16_t DP_PROTO_HOST_ENTRY_LEN 				= sizeof(uint8_t) + 		/* Type (1 byte) */
+										SHA256_DIGEST_LENGTH + 		/* Checksum (32 bytes) */
+										sizeof(uint16_t);		/* Name size (2 bytes); the name follows */
+static const uint16_t DP_PROTO_HOST_ENTRIES_HEAD_LEN 			= sizeof(uint16_t) + 		/* Status code (2 bytes) */
+										SHA256_DIGEST_LENGTH + 		/* Tree hash (32 bytes) */
+										sizeof(uint32_t);		/* Entry count (4 bytes) */
+static const uint64_t DP_PROTO_HOST_DELTA_MIN 				= 64 * 1024;	/* Smaller payloads are not worth the round trip for signatures. */
+static const uint32_t DP_PROTO_HOST_SIGNATURES_MAX 			= 1024 * 1024;
+static const uint16_t DP_PROTO_HOST_SIGNATURE_LEN 			= sizeof(uint32_t) + 		/* Weak checksum (4 bytes) */
+										DP_PROTO_HOST_STRONG_LEN;	/* Strong checksum (16 bytes) */
+static const uint16_t DP_PROTO_HOST_SIGNATURES_HEAD_LEN 		= sizeof(uint64_t) + 	/* Basis size (8 bytes) */
+										sizeof(uint32_t) + 	/* Block length (4 bytes) */
+										sizeof(uint32_t);	/* Signature count (4 bytes) */
+static const uint16_t DP_PROTO_HOST_DELTA_HEAD_LEN 			= SHA256_DIGEST_LENGTH + 	/* Payload checksum (32 bytes) */
+										sizeof(uint64_t) + 		/* Basis size (8 bytes) */
+										sizeof(uint32_t) + 		/* Block length (4 bytes) */
+										sizeof(uint32_t); 		/* Envelope size (4 bytes) */
+static const int DP_PROTO_HOST_RETRY_DELAY 				= 500;	/* How long (in ms) to wait before the first retry; doubled after each one. */
+static const int DP_PROTO_HOST_RETRY_MAX 				= 6;	/* How many times a broken range connection is re-established. */
+static const uint32_t DP_PROTO_HOST_SPANS_MAX 				= 65536;
+static const uint16_t DP_PROTO_HOST_SPAN_LEN 				= sizeof(uint64_t) + 	/* Start (8 bytes) */
+										sizeof(uint64_t);	/* End (8 bytes) */
+static const uint16_t DP_PROTO_HOST_RANGE_HEAD_LEN 			= UUID_LEN + 			/* Parcel UUID (16 bytes) */
+										SHA256_DIGEST_LENGTH + 		/* Payload checksum (32 bytes) */
+										sizeof(uint64_t) + 		/* Range offset (8 bytes) */
+										sizeof(uint32_t); 		/* Envelope size (4 bytes) */
+static const uint16_t DP_PROTO_HOST_ACK_ENTRY_LEN 			= UUID_LEN + 	/* UUID (16 bytes) */
+										sizeof(uint16_t);		/* Status code (2 bytes) */
 static const uint16_t DP_PROTO_HOST_HEAD_LEN 				= DP_PROTO_HOST_MAGIC_NUM_LEN + 	/* Magic number */
 										sizeof(DP_PROTO_HOST_VER) + 	/* Protocol version (4 bytes) */
 										SHA256_DIGEST_LENGTH + 		/* Checksum (32 bytes) */
 										sizeof(uint64_t) + 		/* Timestamp (8 bytes) */
 										sizeof(uint16_t) + 		/* Type (2 bytes) */
 										UUID_LEN +			/* UUID (16 bytes) */
+										sizeof(uint64_t) + 		/* Sequence (8 bytes) */
 										sizeof(uint64_t); 		/* Parcel size (8 bytes) */
 
 
@@ -54,6 +106,15 @@ static const uint16_t DP_PROTO_HOST_HEAD_LEN 				= DP_PROTO_HOST_MAGIC_NUM_LEN +
  * up.
  */
 
+/*
+ * Acknowledges the outcome of a parcel to its sender.
+ * The code is that of a dp_reqstatus.
+ */
+struct dp_ack {
+	uuid_t uuid;
+	uint16_t code;
+};
+
 /*
  * A representation of user@server.
  */
@@ -68,17 +129,19 @@ struct dp_addr {
  */
 struct dp_node {
 	char *identifier;
-	void *pkey; /* !TODO! Change to EVP_PKEY once crypto is in place! */
+	EVP_PKEY *pkey;
 };
 
 struct dp_parcel_head {
 	unsigned char checksum[SHA256_DIGEST_LENGTH * sizeof(unsigned char)];	/* Checksum includes the header along with the parcel */
 	uuid_t uuid;								/* Message's unique identifier */
 	time_t timestamp;							/* Message timestamp */
+	uint64_t sequence;							/* Position within the sender→recipient conversation; see order.c */
 	uint16_t type;
 };
 
 struct dp_parcel {
+	char *payload_file;		/* Set instead of payload when the bytes are already on disk */
 	char *raw_filename;
 	char *sender_name;
 	char *service;  		/* The service as denoted by the file extension */
@@ -86,6 +149,7 @@ struct dp_parcel {
 	struct dp_addr *recipient_addr;  /* user@host, user, or @host */
 	struct dp_addr *sender_addr;
 	struct dp_parcel_head head;
+	int payload_fd;			/* Set instead of payload when the bytes are in an unnamed file; see tmpfile_open() */
 };
 
 struct dp_reqstatus {
@@ -93,13 +157,85 @@ struct dp_reqstatus {
 	uint16_t code;
 };
 
+/*
+ * Shows that a message is part of a signed batch: the
+ * sibling hashes, bottom up, rebuild the batch's Merkle
+ * root from the message, and the signature covers that
+ * root.
+ */
+struct dp_proof {
+	unsigned char hashes[DP_PROTO_HOST_PROOF_MAX][SHA256_DIGEST_LENGTH];
+	const unsigned char *signature;	/* Points into the message it was parsed from */
+	uint32_t count;			/* Messages in the batch */
+	uint32_t index;			/* This message's position in the batch */
+	uint16_t signature_len;
+	uint16_t type;			/* Of the message signed, e.g. DP_PROTO_HOST_MSG_PARCEL */
+	uint8_t depth;			/* Hashes in use */
+};
+
+/*
+ * Identifies one block of a file: the weak checksum
+ * can be rolled along the bytes cheaply, the strong one
+ * confirms a match.
+ */
+struct dp_signature {
+	unsigned char strong[DP_PROTO_HOST_STRONG_LEN];
+	uint32_t weak;
+};
+
+/*
+ * A file or subdirectory of a synced directory, as its
+ * index has it; see sync.c.
+ */
+struct dp_sync_entry {
+	unsigned char checksum[SHA256_DIGEST_LENGTH];	/* The tree hash, for a subdirectory */
+	const char *name;	/* Points into the message or listing it was read from */
+	uint8_t dir;
+};
+
+/*
+ * Payload bytes [start, end) of a large parcel.
+ */
+struct dp_span {
+	uint64_t end;
+	uint64_t start;
+};
+
+/*
+ * A parcel sent as instructions for rebuilding it out
+ * of the recipient's copy (the basis); see delta.c.
+ */
+struct dp_delta {
+	unsigned char checksum[SHA256_DIGEST_LENGTH * sizeof(unsigned char)];	/* Of the rebuilt payload */
+	struct data64 instructions;	/* Points into the message it was parsed from */
+	struct dp_parcel *parcel;	/* Everything but the payload */
+	uint64_t basis_size;
+	uint64_t size;			/* Of the rebuilt payload */
+	uint32_t block_len;
+};
+
+/*
+ * One byte range of a large parcel's payload.
+ */
+struct dp_range {
+	unsigned char checksum[SHA256_DIGEST_LENGTH * sizeof(unsigned char)];	/* Of the whole payload */
+	struct dp_parcel *parcel;	/* Everything but the payload; head.uuid is the parcel's */
+	uint64_t offset;
+	uint64_t size;			/* Of the whole payload */
+};
+
 
 /**********
  * ERRORS *
  **********/
 /* External Errors */
 static const struct dp_reqstatus DP_REQOK 		= { .name = "OK", .code = 200 };
+static const struct dp_reqstatus DP_REQACCEPTED 	= { .name = "Accepted", .code = 202 };	/* Range stored; the parcel is not complete yet. */
 static const struct dp_reqstatus DP_REQERR_BADREQ 	= { .name = "Bad Request", .code = 400 };
+static const struct dp_reqstatus DP_REQERR_FORBIDDEN 	= { .name = "Forbidden", .code = 403 };	/* The message is unsigned though its sender's key is on file, or its signature does not check out. */
+static const struct dp_reqstatus DP_REQERR_NOTFOUND 	= { .name = "Not Found", .code = 404 };
+static const struct dp_reqstatus DP_REQERR_CONFLICT 	= { .name = "Conflict", .code = 409 };	/* The recipient's copy is not the one a delta was made against. */
+static const struct dp_reqstatus DP_REQERR_INTERNAL 	= { .name = "Internal Server Error", .code = 500 };
 
 /* Internal Program Errors */
 static const struct dp_reqstatus DP_REQERR_INT_BADARG = { .name = "Bad request passed to function", .code = 600 };
@@ -108,18 +244,59 @@ static const struct dp_reqstatus DP_REQERR_INT_BADARG = { .name = "Bad request p
 /*************
  * FUNCTIONS *
  *************/
+int ack_deserialise(const struct data64 *, struct dp_ack **, uint16_t *);
+int ack_serialise(const struct dp_ack *, uint16_t, struct data16 **, struct data64 **);
 int arg_name_get(const char *, char **);
 int arg_val_get(const char *, char **);
+struct dp_reqstatus basis_parse(const struct data16 *, const struct data64 *, struct dp_parcel **);
+int basis_serialise(const struct dp_parcel *, struct data16 **, struct data64 **);
 struct dp_reqstatus client_request_parse(struct token *);
 int client_request_tokenise(const char *, uint16_t, struct token **);
+struct path *contact_dir_get(const char *, const char *, const char *);
+void delta_free(struct dp_delta **);
+struct dp_reqstatus delta_parse(const struct data16 *, const struct data64 *, struct dp_delta **);
+int delta_serialise(const struct dp_parcel *, const unsigned char[], uint64_t, uint32_t, const struct data64 *, struct data16 **, struct data64 **);
+void directory_process(int, const struct filearray *, int);
 void *directory_tree_scan(void *);
+int entries_deserialise(const struct data64 *, uint16_t *, unsigned char [], struct dp_sync_entry **, uint32_t *);
+int entries_serialise(uint16_t, const unsigned char [], const struct dp_sync_entry *, uint32_t, struct data16 **, struct data64 **);
+int envelope_deserialise(const struct data64 *, struct dp_parcel *, uint64_t *, uint64_t *);
+struct dp_reqstatus envelope_parse(const struct data16 *, const struct data64 *, struct dp_parcel **, uint64_t *, uint64_t *);
+int envelope_serialise(const struct dp_parcel *, uint64_t, uint64_t, struct data64 **);
+int header_deserialise(const struct data16 *, struct dp_parcel_head *);
 int host_get(const char *, char **);
 void parcel_free(struct dp_parcel **);
+struct dp_reqstatus parcel_deliver(const struct dp_parcel *);
+struct dp_reqstatus parcel_dir_get(const struct dp_parcel *, int, struct path **);
 struct dp_parcel *parcel_make(void);
-void parcel_parse(const struct data16 *, const struct data64 *);
+struct dp_reqstatus parcel_parse(const struct data16 *, const struct data64 *, struct dp_parcel **);
+struct dp_reqstatus parcel_path_get(const struct dp_parcel *, int, struct path **);
+void parcel_recipient_addr_set(struct dp_parcel *, const char *);
 uint64_t parcel_size_get(const struct data16 *);
+EVP_PKEY *parcel_signer_key_get(const struct dp_parcel *);
+uint16_t parcel_type_get(const struct data16 *);
+void parcel_uuid_get(const struct data16 *, uuid_t);
+uint32_t parcel_version_get(const struct data16 *);
+uint32_t range_envelope_size_get(const struct data64 *);
+int parcels_sign(struct data16 **, struct data64 **, const struct dp_tail *, size_t, EVP_PKEY *);
+int proof_deserialise(const struct data64 *, struct dp_proof *, uint64_t *);
+int proof_serialise(const struct dp_proof *, struct data64 **);
+void range_free(struct dp_range **);
+struct dp_reqstatus range_parse(const struct data16 *, const struct data64 *, struct dp_range **);
+int range_serialise(const struct dp_parcel *, const unsigned char[], uint64_t, uint64_t, uint64_t, struct data16 **, struct data64 **);
+struct dp_reqstatus relpath_append(struct path **, const char *, int);
 void request_free(struct token **);
+int resume_deserialise(const struct data64 *, uuid_t);
+int resume_serialise(const uuid_t, struct data16 **, struct data64 **);
 int service_get(const char *, char **);
+int signatures_deserialise(const struct data64 *, uint64_t *, uint32_t *, struct dp_signature **, uint32_t *);
+int signatures_serialise(uint64_t, uint32_t, const struct dp_signature *, uint32_t, struct data16 **, struct data64 **);
+EVP_PKEY *signing_key_get(void);
+int spans_deserialise(const struct data64 *, uuid_t, uint16_t *, struct dp_span **, uint32_t *);
+int spans_serialise(const uuid_t, uint16_t, const struct dp_span *, uint32_t, struct data16 **, struct data64 **);
+int synced_serialise(const struct dp_parcel *, uint64_t, struct data16 **, struct data64 **);
+struct dp_reqstatus tree_parse(const struct data16 *, const struct data64 *, struct dp_parcel **);
+int tree_serialise(const struct dp_parcel *, struct data16 **, struct data64 **);
 int user_get(const char *, char **);
 int valid_check(const char *);
 
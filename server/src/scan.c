@@ -0,0 +1,888 @@
+//
+//  scan.c
+//  server
+//
+
+#include "scan.h"
+
+#include <dirent.h>
+#include "disk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include "index.h"
+#include "protocol.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+#include <unistd.h>
+#include "util.h"
+
+
+/*
+ * SCANNING
+ * --
+ * A full scan of the tree (at startup, after the watcher
+ * lost track of changes, or periodically when there is
+ * no watcher) lists every directory in it. Each directory
+ * is a task; a fixed number of workers, DP_SCAN_WORKERS_PER_CPU
+ * per CPU, run them, which also bounds how many listings
+ * are waiting on the disk at once.
+ *
+ * Every worker has its own deque. The subdirectories a
+ * worker finds go to the bottom of its deque and it takes
+ * its next task from there too, so it goes depth first
+ * and stays close to what it just read. A worker that
+ * runs dry steals from the top of another's deque, which
+ * is where the tasks nearest the root, i.e. the biggest
+ * subtrees, are. directory_process() is therefore called
+ * for directories at any depth at the same time.
+ *
+ * A task holds on to its parent directory's descriptor and
+ * opens itself relative to it. The descriptor is closed
+ * once all of the parent's subdirectories have been opened.
+ *
+ * SCAN STATE
+ * --
+ * What every directory looked like (inode, modification
+ * and change times, number of entries and the names of
+ * its subdirectories) at the end of the last full scan
+ * is kept in dp.scan in the config directory. A
+ * directory whose times have not moved since is not
+ * listed or processed again; only its subdirectories
+ * are opened and checked in turn, so a scan of an
+ * unchanged tree costs one open and one stat per
+ * directory. Note that a change deep down does not touch
+ * the times of the directories above it, which is why
+ * every directory is still checked.
+ *
+ * Directories changed less than DP_SCAN_SETTLE seconds
+ * before they were checked are not remembered, since
+ * more changes within the same second would not show.
+ * Nor are indexed directories (see DP_INDEX_DEPTH): a
+ * file rewritten in place leaves its directory's times
+ * alone, and files hashed while they were still
+ * changing are due another look. Those are processed on
+ * every scan, which costs little for the files that did
+ * not change; see index_sync().
+ */
+
+/**************
+ * STRUCTURES *
+ **************/
+struct dp_scan_dir {
+	int fd;
+	int refs;
+};
+
+struct dp_scan_task {
+	struct dp_scan_dir *parent;	/* NULL for the root */
+	char *name;
+	int depth;
+};
+
+struct dp_scan_deque {
+	pthread_mutex_t lock;
+	struct dp_scan_task **tasks;
+	size_t head;	/* Thieves take from here */
+	size_t tail;	/* The owner pushes and takes from here */
+	size_t len;
+};
+
+struct dp_scan_state {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t ctime;
+	int64_t mtime;
+	uint32_t entries;
+	uint32_t names_len;
+	char *names;	/* Subdirectory names, each NUL-terminated */
+};
+
+/*
+ * As written to dp.scan, after a DP_SCAN_MAGIC and a
+ * uint64_t count. Each record is followed by its names.
+ */
+struct dp_scan_record {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t ctime;
+	int64_t mtime;
+	uint32_t entries;
+	uint32_t names_len;
+};
+
+struct dp_scan_states {
+	unsigned char *file;	/* The names of loaded states point into it */
+	size_t *slots;		/* 1 + index into states; 0 when free */
+	size_t slots_len;	/* A power of 2 */
+	struct dp_scan_state *states;
+	size_t count;
+	size_t len;
+};
+
+struct dp_scan {
+	pthread_cond_t cond;
+	struct dp_scan_deque *deques;
+	pthread_mutex_t lock;
+	size_t pending;		/* Tasks made but not yet done */
+	struct dp_scan_states *recorded;	/* What this scan found, for the next one */
+	time_t start;
+	int idle;
+	int workers;
+};
+
+struct dp_scan_worker {
+	struct arena *arena;
+	int index;
+	struct dp_scan *scan;
+	pthread_t thread;
+};
+/**********************/
+
+/********************
+ * Global Variables
+ ********************/
+struct dp_scan_states *scan_states;
+char *scan_states_file;
+pthread_rwlock_t scan_states_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t scan_tree_lock = PTHREAD_MUTEX_INITIALIZER;	/* Held for as long as a scan runs */
+/**********************/
+
+/**********************
+ * Private Prototypes
+ **********************/
+void scan_dir_release(struct dp_scan *, struct dp_scan_dir *);
+struct dp_scan_task *scan_pop(struct dp_scan_deque *, int);
+int scan_push(struct dp_scan *, int, struct dp_scan_task *);
+void *scan_run(void *);
+struct dp_scan_state *scan_state_find(const struct dp_scan_states *, uint64_t, uint64_t);
+void scan_state_record(struct dp_scan *, const struct stat *, uint32_t, const char *, uint32_t);
+int scan_tree_run(const struct path *);
+void scan_states_free(struct dp_scan_states **);
+int scan_states_index(struct dp_scan_states *);
+int scan_states_write(const struct dp_scan_states *, const char *);
+struct dp_scan_task *scan_take(struct dp_scan_worker *);
+void scan_task_run(struct dp_scan_worker *, struct dp_scan_task *);
+/**********************/
+
+
+/*
+ * Loads what the last full scan found. Without it, the
+ * first scan lists everything.
+ */
+int scan_bootstrap(void)
+{
+	struct dp_scan_record record;
+	unsigned char *file;
+	struct path *path_file_scan;
+	struct dp_scan_state *state;
+	struct dp_scan_states *states;
+	uint64_t count;
+	size_t len;
+	size_t offset;
+	
+	file = NULL;
+	path_file_scan = home_dir_get();
+	path_append(&path_file_scan, DP_DIR_CONF);
+	path_append(&path_file_scan, DP_FILE_SCAN);
+	scan_states_file = path_str(path_file_scan);
+	len = file_exists(path_file_scan) == 1 ? readb(path_file_scan, &file) : 0;
+	path_free(&path_file_scan);
+	
+	if (len == 0 ||
+	    len == (size_t)-1 ||
+	    !file)
+		return 0;
+	
+	offset = sizeof(DP_SCAN_MAGIC) + sizeof(count);
+	states = (struct dp_scan_states *)calloc(1, sizeof(*states));
+	
+	if (!states ||
+	    len < offset ||
+	    memcmp(file, DP_SCAN_MAGIC, sizeof(DP_SCAN_MAGIC)) != 0) {
+		free(states);
+		free(file);
+		return 0;
+	}
+	
+	memcpy(&count, file + sizeof(DP_SCAN_MAGIC), sizeof(count));
+	
+	if (count > (len - offset) / sizeof(record) ||
+	    !(states->states = (struct dp_scan_state *)malloc((count ? count : 1) * sizeof(*states->states)))) {
+		free(states);
+		free(file);
+		return 0;
+	}
+	
+	states->file = file;
+	states->len = count;
+	
+	for (uint64_t i = 0; i < count; i++) {
+		if (len - offset < sizeof(record))
+			break;
+		
+		memcpy(&record, file + offset, sizeof(record));
+		offset += sizeof(record);
+		
+		/* The names must be all there and end with a terminator. */
+		if (len - offset < record.names_len ||
+		    (record.names_len > 0 &&
+		     file[offset + record.names_len - 1] != '\0'))
+			break;
+		
+		state = &states->states[states->count++];
+		state->ctime = record.ctime;
+		state->dev = record.dev;
+		state->entries = record.entries;
+		state->ino = record.ino;
+		state->mtime = record.mtime;
+		state->names = (char *)file + offset;
+		state->names_len = record.names_len;
+		offset += record.names_len;
+	}
+	
+	if (scan_states_index(states) != 0) {
+		scan_states_free(&states);
+		return -1;
+	}
+	
+	scan_states = states;
+	
+	return 0;
+}
+
+/*
+ * Drops a reference to the directory and closes it
+ * when it was the last one.
+ */
+void scan_dir_release(struct dp_scan *scan, struct dp_scan_dir *dir)
+{
+	int refs;
+	
+	if (!dir)
+		return;
+	
+	pthread_mutex_lock(&scan->lock);
+	refs = --dir->refs;
+	pthread_mutex_unlock(&scan->lock);
+	
+	if (refs == 0) {
+		close(dir->fd);
+		free(dir);
+	}
+}
+
+/*
+ * Takes a task off the bottom of the deque, or off the
+ * top if steal is set.
+ */
+struct dp_scan_task *scan_pop(struct dp_scan_deque *deque, int steal)
+{
+	struct dp_scan_task *task;
+	
+	task = NULL;
+	
+	pthread_mutex_lock(&deque->lock);
+	
+	if (deque->tail > deque->head) {
+		if (steal)
+			task = deque->tasks[deque->head++];
+		else
+			task = deque->tasks[--deque->tail];
+		
+		if (deque->head == deque->tail) {
+			deque->head = 0;
+			deque->tail = 0;
+		}
+	}
+	
+	pthread_mutex_unlock(&deque->lock);
+	
+	return task;
+}
+
+/*
+ * Pushes the task onto the bottom of the worker's deque
+ * and wakes up an idle worker to steal it.
+ */
+int scan_push(struct dp_scan *scan, int index, struct dp_scan_task *task)
+{
+	struct dp_scan_deque *deque;
+	struct dp_scan_task **tasks;
+	size_t len;
+	
+	deque = &scan->deques[index];
+	
+	pthread_mutex_lock(&deque->lock);
+	
+	if (deque->tail == deque->len) {
+		if (deque->head > 0) {
+			/* Reuse the room left by thieves. */
+			memmove(deque->tasks, deque->tasks + deque->head, (deque->tail - deque->head) * sizeof(*deque->tasks));
+			deque->tail -= deque->head;
+			deque->head = 0;
+		} else {
+			len = deque->len ? deque->len * 2 : DP_SCAN_DEQUE_INIT;
+			
+			if (!(tasks = (struct dp_scan_task **)realloc(deque->tasks, len * sizeof(*tasks)))) {
+				pthread_mutex_unlock(&deque->lock);
+				return -1;
+			}
+			
+			deque->len = len;
+			deque->tasks = tasks;
+		}
+	}
+	
+	deque->tasks[deque->tail++] = task;
+	
+	pthread_mutex_unlock(&deque->lock);
+	
+	pthread_mutex_lock(&scan->lock);
+	
+	if (scan->idle > 0)
+		pthread_cond_signal(&scan->cond);
+	
+	pthread_mutex_unlock(&scan->lock);
+	
+	return 0;
+}
+
+void *scan_run(void *args)
+{
+	struct dp_scan_task *task;
+	struct dp_scan_worker *worker;
+	
+	worker = (struct dp_scan_worker *)args;
+	
+	while ((task = scan_take(worker)))
+		scan_task_run(worker, task);
+	
+	return 0;
+}
+
+struct dp_scan_state *scan_state_find(const struct dp_scan_states *states, uint64_t dev, uint64_t ino)
+{
+	struct dp_scan_state *state;
+	size_t slot;
+	
+	if (!states ||
+	    !states->slots)
+		return NULL;
+	
+	slot = (size_t)(((ino ^ (dev << 32 | dev >> 32)) * 0x9E3779B97F4A7C15ULL) >> 32) & (states->slots_len - 1);
+	
+	while (states->slots[slot]) {
+		state = &states->states[states->slots[slot] - 1];
+		
+		if (state->ino == ino &&
+		    state->dev == dev)
+			return state;
+		
+		slot = (slot + 1) & (states->slots_len - 1);
+	}
+	
+	return NULL;
+}
+
+/*
+ * Returns 0 and the names of the subdirectories that the
+ * last full scan found in the directory described by info
+ * if it has not changed since, or -1 if it has (or was
+ * never seen). The names are NUL-terminated and placed
+ * one after the other in the arena; entries, if given,
+ * is set to how many entries the directory had.
+ */
+int scan_state_names_get(const struct stat *info, struct arena *arena, char **names, uint32_t *names_len, uint32_t *entries)
+{
+	struct dp_scan_state *state;
+	int status;
+	
+	if (!info ||
+	    !arena ||
+	    !names ||
+	    !names_len)
+		return 1;
+	
+	status = -1;
+	*names = NULL;
+	*names_len = 0;
+	
+	pthread_rwlock_rdlock(&scan_states_lock);
+	
+	if ((state = scan_state_find(scan_states, info->st_dev, info->st_ino)) &&
+	    state->ctime == info->st_ctime &&
+	    state->mtime == info->st_mtime &&
+	    (state->names_len == 0 ||
+	     (*names = (char *)arena_alloc(arena, state->names_len)))) {
+		memcpy(*names, state->names, state->names_len);
+		*names_len = state->names_len;
+		status = 0;
+		
+		if (entries)
+			*entries = state->entries;
+	}
+	
+	pthread_rwlock_unlock(&scan_states_lock);
+	
+	return status;
+}
+
+/*
+ * Remembers the directory as this scan found it, unless
+ * it changed too recently to be trusted.
+ */
+void scan_state_record(struct dp_scan *scan, const struct stat *info, uint32_t entries, const char *names, uint32_t names_len)
+{
+	struct dp_scan_states *recorded;
+	struct dp_scan_state *state;
+	struct dp_scan_state *grown;
+	size_t len;
+	
+	if (!scan->recorded ||
+	    info->st_ctime >= scan->start - DP_SCAN_SETTLE ||
+	    info->st_mtime >= scan->start - DP_SCAN_SETTLE)
+		return;
+	
+	recorded = scan->recorded;
+	
+	pthread_mutex_lock(&scan->lock);
+	
+	if (recorded->count == recorded->len) {
+		len = recorded->len ? recorded->len * 2 : DP_SCAN_STATES_INIT;
+		
+		if (!(grown = (struct dp_scan_state *)realloc(recorded->states, len * sizeof(*grown)))) {
+			pthread_mutex_unlock(&scan->lock);
+			return;
+		}
+		
+		recorded->len = len;
+		recorded->states = grown;
+	}
+	
+	state = &recorded->states[recorded->count];
+	state->names = NULL;
+	
+	if (names_len == 0 ||
+	    (state->names = (char *)malloc(names_len))) {
+		state->ctime = info->st_ctime;
+		state->dev = info->st_dev;
+		state->entries = entries;
+		state->ino = info->st_ino;
+		state->mtime = info->st_mtime;
+		state->names_len = names_len;
+		
+		if (names_len > 0)
+			memcpy(state->names, names, names_len);
+		
+		recorded->count++;
+	}
+	
+	pthread_mutex_unlock(&scan->lock);
+}
+
+void scan_states_free(struct dp_scan_states **states)
+{
+	if (!states ||
+	    !*states)
+		return;
+	
+	/* Loaded names belong to the file. */
+	if ((*states)->file)
+		free((*states)->file);
+	else
+		for (size_t i = 0; i < (*states)->count; i++)
+			free((*states)->states[i].names);
+	
+	free((*states)->slots);
+	free((*states)->states);
+	free(*states);
+	*states = NULL;
+}
+
+/*
+ * Builds the lookup table. A directory reached twice
+ * (through a link) is only kept once.
+ */
+int scan_states_index(struct dp_scan_states *states)
+{
+	struct dp_scan_state *state;
+	size_t slot;
+	
+	states->slots_len = 16;
+	
+	while (states->slots_len < states->count * 2)
+		states->slots_len *= 2;
+	
+	if (!(states->slots = (size_t *)calloc(states->slots_len, sizeof(*states->slots))))
+		return -1;
+	
+	for (size_t i = 0; i < states->count; i++) {
+		state = &states->states[i];
+		slot = (size_t)(((state->ino ^ (state->dev << 32 | state->dev >> 32)) * 0x9E3779B97F4A7C15ULL) >> 32) & (states->slots_len - 1);
+		
+		while (states->slots[slot] &&
+		       (states->states[states->slots[slot] - 1].ino != state->ino ||
+			states->states[states->slots[slot] - 1].dev != state->dev))
+			slot = (slot + 1) & (states->slots_len - 1);
+		
+		if (!states->slots[slot])
+			states->slots[slot] = i + 1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Writes the states to a temporary file first and moves
+ * it in place, so that dp.scan is never half written.
+ */
+int scan_states_write(const struct dp_scan_states *states, const char *path)
+{
+	struct dp_scan_record record;
+	FILE *fptr;
+	char *path_tmp;
+	uint64_t count;
+	size_t len;
+	int status;
+	
+	if (!states ||
+	    !path)
+		return 1;
+	
+	len = strlen(path) + 5;
+	
+	if (!(path_tmp = (char *)malloc(len)))
+		return -1;
+	
+	snprintf(path_tmp, len, "%s.tmp", path);
+	
+	if (!(fptr = fopen(path_tmp, "wb"))) {
+		trace_write(DP_TRACE_WARN, "scan_states_write(2), fopen(2): %s", strerror(errno));
+		free(path_tmp);
+		return -1;
+	}
+	
+	count = states->count;
+	status = fwrite(DP_SCAN_MAGIC, sizeof(DP_SCAN_MAGIC), 1, fptr) == 1 &&
+		 fwrite(&count, sizeof(count), 1, fptr) == 1 ? 0 : -1;
+	
+	for (size_t i = 0; i < states->count && status == 0; i++) {
+		record.ctime = states->states[i].ctime;
+		record.dev = states->states[i].dev;
+		record.entries = states->states[i].entries;
+		record.ino = states->states[i].ino;
+		record.mtime = states->states[i].mtime;
+		record.names_len = states->states[i].names_len;
+		
+		if (fwrite(&record, sizeof(record), 1, fptr) != 1 ||
+		    (record.names_len > 0 &&
+		     fwrite(states->states[i].names, record.names_len, 1, fptr) != 1))
+			status = -1;
+	}
+	
+	if (fflush(fptr) != 0 ||
+	    fsync(fileno(fptr)) != 0)
+		status = -1;
+	
+	fclose(fptr);
+	
+	if (status != 0) {
+		trace_write(DP_TRACE_WARN, "scan_states_write(2), fwrite(4): %s", strerror(errno));
+		unlink(path_tmp);
+	} else if (rename(path_tmp, path) != 0) {
+		trace_write(DP_TRACE_WARN, "scan_states_write(2), rename(2): %s", strerror(errno));
+		unlink(path_tmp);
+		status = -1;
+	}
+	
+	free(path_tmp);
+	
+	return status;
+}
+
+/*
+ * Returns the worker's next task, stealing one if its
+ * own deque is empty. Blocks until there is one, or
+ * returns NULL once the whole tree has been scanned.
+ */
+struct dp_scan_task *scan_take(struct dp_scan_worker *worker)
+{
+	struct dp_scan *scan;
+	struct dp_scan_task *task;
+	
+	scan = worker->scan;
+	
+	if ((task = scan_pop(&scan->deques[worker->index], 0)))
+		return task;
+	
+	pthread_mutex_lock(&scan->lock);
+	
+	for (;;) {
+		/*
+		 * Pushes take the scan lock after the task is in,
+		 * so nothing pushed from here on goes unnoticed.
+		 */
+		for (int i = 1; i <= scan->workers && !task; i++)
+			task = scan_pop(&scan->deques[(worker->index + i) % scan->workers], 1);
+		
+		if (task ||
+		    scan->pending == 0)
+			break;
+		
+		scan->idle++;
+		pthread_cond_wait(&scan->cond, &scan->lock);
+		scan->idle--;
+	}
+	
+	pthread_mutex_unlock(&scan->lock);
+	
+	return task;
+}
+
+/*
+ * Processes the directory, unless it is unchanged since
+ * the last full scan, and queues its subdirectories.
+ */
+void scan_task_run(struct dp_scan_worker *worker, struct dp_scan_task *task)
+{
+	struct arena_mark mark;
+	struct dp_scan_dir *dir;
+	struct filearray files;
+	struct stat info;
+	struct dp_scan *scan;
+	struct dp_scan_task *child;
+	char *names;
+	uint32_t entries;
+	uint32_t names_len;
+	int fd;
+	
+	scan = worker->scan;
+	fd = directory_open(task->parent ? task->parent->fd : AT_FDCWD, task->name);
+	scan_dir_release(scan, task->parent);
+	
+	if (fd != -1 &&
+	    (dir = (struct dp_scan_dir *)malloc(sizeof(*dir)))) {
+		dir->fd = fd;
+		dir->refs = 1;
+		mark = arena_mark_get(worker->arena);
+		
+		if (fstat(fd, &info) == -1) {
+			trace_write(DP_TRACE_WARN, "scan_task_run(2), fstat(2): %s", strerror(errno));
+			names_len = 0;
+		} else if (task->depth < DP_INDEX_DEPTH &&
+			   scan_state_names_get(&info, worker->arena, &names, &names_len, &entries) == 0) {
+			scan_state_record(scan, &info, entries, names, names_len);
+		} else {
+			trace_write(DP_TRACE_INFO, "Scanning %s…", task->name);
+			filearray_at_get(fd, worker->arena, &files);
+			directory_process(fd, &files, task->depth);
+			names_len = 0;
+			
+			for (size_t i = 0; i < files.count; i++) {
+				if (files.entries[i].type == DT_DIR)
+					names_len += strlen(files.entries[i].name) + 1;
+			}
+			
+			if (names_len > 0 &&
+			    (names = (char *)arena_alloc(worker->arena, names_len))) {
+				names_len = 0;
+				
+				for (size_t i = 0; i < files.count; i++) {
+					if (files.entries[i].type == DT_DIR) {
+						strcpy(names + names_len, files.entries[i].name);
+						names_len += strlen(files.entries[i].name) + 1;
+					}
+				}
+			} else {
+				names_len = 0;
+			}
+			
+			if (task->depth < DP_INDEX_DEPTH)
+				scan_state_record(scan, &info, (uint32_t)files.count, names, names_len);
+		}
+		
+		for (uint32_t i = 0; i < names_len; i += strlen(names + i) + 1) {
+			if (!(child = (struct dp_scan_task *)malloc(sizeof(*child))))
+				continue;
+			
+			child->depth = task->depth + 1;
+			child->name = strdup(names + i);
+			child->parent = dir;
+			
+			pthread_mutex_lock(&scan->lock);
+			dir->refs++;
+			scan->pending++;
+			pthread_mutex_unlock(&scan->lock);
+			
+			if (!child->name ||
+			    scan_push(scan, worker->index, child) != 0) {
+				pthread_mutex_lock(&scan->lock);
+				dir->refs--;
+				scan->pending--;
+				pthread_mutex_unlock(&scan->lock);
+				
+				free(child->name);
+				free(child);
+			}
+		}
+		
+		arena_rewind(worker->arena, mark);
+		scan_dir_release(scan, dir);
+	} else if (fd != -1) {
+		close(fd);
+	}
+	
+	free(task->name);
+	free(task);
+	
+	pthread_mutex_lock(&scan->lock);
+	
+	if (--scan->pending == 0)
+		pthread_cond_broadcast(&scan->cond);
+	
+	pthread_mutex_unlock(&scan->lock);
+}
+
+/*
+ * Scans the tree under root on a pool of workers and
+ * returns once every directory in it was processed.
+ * Scans run one at a time; this one waits its turn.
+ */
+int scan_tree(const struct path *root)
+{
+	int result;
+	
+	pthread_mutex_lock(&scan_tree_lock);
+	result = scan_tree_run(root);
+	pthread_mutex_unlock(&scan_tree_lock);
+	
+	return result;
+}
+
+int scan_tree_run(const struct path *root)
+{
+	struct dp_scan scan;
+	struct dp_scan_task *task;
+	struct dp_scan_worker *workers;
+	long cpus;
+	int result;
+	int started;
+	
+	if (!root)
+		return 1;
+	
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	if (cpus < 1)
+		cpus = 1;
+	
+	scan.idle = 0;
+	scan.pending = 1;
+	scan.recorded = (struct dp_scan_states *)calloc(1, sizeof(*scan.recorded));
+	scan.start = time(NULL);
+	scan.workers = cpus * DP_SCAN_WORKERS_PER_CPU > DP_SCAN_WORKERS_MAX ? DP_SCAN_WORKERS_MAX : (int)cpus * DP_SCAN_WORKERS_PER_CPU;
+	scan.deques = (struct dp_scan_deque *)calloc(scan.workers, sizeof(*scan.deques));
+	workers = (struct dp_scan_worker *)calloc(scan.workers, sizeof(*workers));
+	task = (struct dp_scan_task *)malloc(sizeof(*task));
+	
+	if (!scan.deques ||
+	    !workers ||
+	    !task ||
+	    !(task->name = strdup(path_cstr(root)))) {
+		free(scan.deques);
+		free(workers);
+		free(task);
+		scan_states_free(&scan.recorded);
+		
+		return -1;
+	}
+	
+	pthread_cond_init(&scan.cond, NULL);
+	pthread_mutex_init(&scan.lock, NULL);
+	
+	for (int i = 0; i < scan.workers; i++)
+		pthread_mutex_init(&scan.deques[i].lock, NULL);
+	
+	task->depth = 0;
+	task->parent = NULL;
+	scan_push(&scan, 0, task);
+	started = 0;
+	
+	for (int i = 0; i < scan.workers; i++) {
+		workers[i].arena = arena_make(0);
+		workers[i].index = i;
+		workers[i].scan = &scan;
+		
+		result = workers[i].arena ? pthread_create(&workers[i].thread, NULL, scan_run, &workers[i]) : ENOMEM;
+		
+		if (result != 0) {
+			trace_write(DP_TRACE_ERROR, "scan_tree_run(1), pthread_create(4): %s", strerror(result));
+			arena_free(&workers[i].arena);
+			break;
+		}
+		
+		started++;
+	}
+	
+	/* Without a single worker, scan on this thread. */
+	if (started == 0) {
+		workers[0].arena = arena_make(0);
+		scan_run(&workers[0]);
+		arena_free(&workers[0].arena);
+	}
+	
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		arena_free(&workers[i].arena);
+	}
+	
+	for (int i = 0; i < scan.workers; i++) {
+		free(scan.deques[i].tasks);
+		pthread_mutex_destroy(&scan.deques[i].lock);
+	}
+	
+	pthread_cond_destroy(&scan.cond);
+	pthread_mutex_destroy(&scan.lock);
+	free(scan.deques);
+	free(workers);
+	
+	/* What this scan found is what the next one starts from. */
+	if (scan.recorded &&
+	    scan_states_index(scan.recorded) == 0) {
+		scan_states_write(scan.recorded, scan_states_file);
+		
+		pthread_rwlock_wrlock(&scan_states_lock);
+		scan_states_free(&scan_states);
+		scan_states = scan.recorded;
+		pthread_rwlock_unlock(&scan_states_lock);
+	} else {
+		scan_states_free(&scan.recorded);
+	}
+	
+	return 0;
+}
+
+/*
+ * Like scan_tree(1), but returns 1 right away rather
+ * than waiting if a scan is already running, so that
+ * periodic scans of a tree that takes longer than the
+ * interval do not pile up.
+ */
+int scan_tree_try(const struct path *root)
+{
+	int result;
+	
+	if (pthread_mutex_trylock(&scan_tree_lock) != 0) {
+		trace_write(DP_TRACE_DEBUG, "Still scanning; skipping this one");
+		return 1;
+	}
+	
+	result = scan_tree_run(root);
+	pthread_mutex_unlock(&scan_tree_lock);
+	
+	return result;
+}
@@ -0,0 +1,34 @@
+//
+//  scan.h
+//  server
+//
+
+#ifndef SCAN_H
+#define SCAN_H
+
+
+#include <sys/stat.h>
+#include "types.h"
+
+
+#define DP_SCAN_MAGIC	"DPSCAN1"	/* Starts the scan-state file; includes the terminator */
+
+/*************
+ * CONSTANTS *
+ *************/
+static const size_t DP_SCAN_DEQUE_INIT 		= 64;
+static const int DP_SCAN_SETTLE 		= 2;	/* Directories changed less than this many seconds before a scan are not remembered as unchanged. */
+static const size_t DP_SCAN_STATES_INIT 	= 1024;
+static const int DP_SCAN_WORKERS_MAX 		= 32;
+static const int DP_SCAN_WORKERS_PER_CPU 	= 2;	/* Listing a directory mostly waits on the disk, so more workers than CPUs keep it busy. */
+
+/*************
+ * FUNCTIONS *
+ *************/
+int scan_bootstrap(void);
+int scan_state_names_get(const struct stat *, struct arena *, char **, uint32_t *, uint32_t *);
+int scan_tree(const struct path *);
+int scan_tree_try(const struct path *);
+
+
+#endif /* SCAN_H */
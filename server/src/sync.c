@@ -0,0 +1,650 @@
+//
+//  sync.c
+//  server
+//
+
+#include "sync.h"
+
+#include <dirent.h>
+#include "disk.h"
+#include "eventlog.h"
+#include <fcntl.h>
+#include "index.h"
+#include "net.h"
+#include "order.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+#include <unistd.h>
+#include "util.h"
+
+
+/*
+ * SYNCING
+ * --
+ * The directory a sender keeps for a contact,
+ * <sender host>/<sender user>/<host>/<user>, has its
+ * counterpart on the contact's host, where the files
+ * sent to them end up:
+ * <host>/<user>/<sender host>/<sender user>. Syncing
+ * brings the contact's copy up to date with the sender's
+ * after the two drifted apart, e.g. after an outage,
+ * without sending everything again.
+ *
+ * Both sides keep the tree hash of every directory in
+ * its .index (see index.c), so the sender asks for the
+ * entries of the top of the copy (DP_PROTO_HOST_MSG_TREE)
+ * and stops right there if the tree hashes match.
+ * Otherwise, it compares the entries: files that are
+ * missing or whose checksums differ are to be sent, and
+ * subdirectories whose tree hashes differ are asked for
+ * in turn. The subdirectories of one level are asked for
+ * together over one connection, so a sync takes one
+ * round trip per level of the tree, and only along the
+ * paths where something differs. Subdirectories the
+ * contact does not have at all are not asked for.
+ *
+ * The files are then sent as DP_PROTO_HOST_MSG_SYNCED
+ * parcels, which are named by their path within the
+ * copy. Nothing is ever removed from the copy.
+ *
+ * Since the answers give away what the contact has, the
+ * questions are signed like parcels (see merkle.c) and
+ * only answered if the contact keeps this server's key.
+ * Syncing therefore takes DP_CKEY_SIGN to be set.
+ *
+ * Hidden files and the daemon's own files (dp.*, auto.*)
+ * are not synced. Neither are contacts whose files are
+ * sealed, since their copy never matches the plain files
+ * here.
+ */
+
+/**************
+ * STRUCTURES *
+ **************/
+/*
+ * Paths within the copy, with whether the contact is
+ * already known not to have them.
+ */
+struct dp_sync_paths {
+	char **paths;
+	unsigned char *absent;
+	size_t count;
+	size_t count_max;
+};
+/**********************/
+
+/**********************
+ * Private Prototypes
+ **********************/
+int sync_dir_compare(int, const char *, const struct data64 *, struct arena *, struct dp_sync_paths *, struct dp_sync_paths *);
+int sync_entries_at_get(int, struct arena *, unsigned char [], struct dp_sync_entry **, uint32_t *);
+int sync_entry_compare(const void *, const void *);
+int sync_files_send(const char *, const struct dp_parcel *, const struct path *, const struct dp_sync_paths *, EVP_PKEY *);
+int sync_name_skip(const char *);
+void sync_paths_free(struct dp_sync_paths *);
+int sync_paths_push(struct dp_sync_paths *, const char *, const char *, int);
+/**********************/
+
+
+/*
+ * Syncs the sender's directory for the contact at addr
+ * with the contact's copy on their host.
+ */
+struct dp_reqstatus sync_contact(const char *sender_host, const char *sender_user, const char *addr)
+{
+	struct arena *arena;
+	char *host;
+	struct data16 **heads;
+	struct data64 **bodies;
+	struct data64 **replies;
+	struct path *path_dir;
+	struct dp_parcel *parcel;
+	struct dp_reqstatus status;
+	struct dp_sync_paths dirs;
+	struct dp_sync_paths dirs_next;
+	struct dp_sync_paths files;
+	EVP_PKEY *pkey;
+	size_t count_queries;
+	size_t count_sign;
+	size_t query;
+	int dirfd;
+	int failed;
+	
+	if (!sender_host ||
+	    !sender_user ||
+	    !addr)
+		return DP_REQERR_INT_BADARG;
+	
+	/* The contact's host only answers questions signed by this one. */
+	if ((count_sign = config_sign_get()) == 0) {
+		trace_write(DP_TRACE_WARN, "%s: not syncing, as questions are only signed with %s set in %s", addr, DP_CKEY_SIGN, DP_FILE_CONF);
+		return DP_REQERR_FORBIDDEN;
+	}
+	
+	host = NULL;
+	host_get(addr, &host);
+	
+	if (!host ||
+	    !(path_dir = contact_dir_get(sender_host, sender_user, addr))) {
+		trace_write(DP_TRACE_WARN, "%s: not a contact on another host", addr);
+		
+		if (host)
+			free(host);
+		
+		return DP_REQERR_BADREQ;
+	}
+	
+	path_append(&path_dir, DP_FILE_PUBKEY);
+	
+	if (file_exists(path_dir) == 1) {
+		trace_write(DP_TRACE_WARN, "%s: files to this contact are sealed and cannot be synced", addr);
+		path_free(&path_dir);
+		free(host);
+		
+		return DP_REQERR_BADREQ;
+	}
+	
+	path_pop(&path_dir);
+	
+	if ((dirfd = open(path_cstr(path_dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		trace_write(DP_TRACE_WARN, "%s: no directory to sync", addr);
+		path_free(&path_dir);
+		free(host);
+		
+		return DP_REQERR_NOTFOUND;
+	}
+	
+	if (!(pkey = signing_key_get())) {
+		trace_write(DP_TRACE_WARN, "%s: unable to sync without a signing key", addr);
+		close(dirfd);
+		path_free(&path_dir);
+		free(host);
+		
+		return DP_REQERR_INTERNAL;
+	}
+	
+	if (!(arena = arena_make(0))) {
+		EVP_PKEY_free(pkey);
+		close(dirfd);
+		path_free(&path_dir);
+		free(host);
+		
+		return DP_REQERR_INTERNAL;
+	}
+	
+	parcel = parcel_make();
+	parcel_recipient_addr_set(parcel, addr);
+	parcel->sender_addr->host->identifier = (char *)calloc(strlen(sender_host) + 1, sizeof(char));
+	parcel->sender_addr->user->identifier = (char *)calloc(strlen(sender_user) + 1, sizeof(char));
+	strcpy(parcel->sender_addr->host->identifier, sender_host);
+	strcpy(parcel->sender_addr->user->identifier, sender_user);
+	
+	memset(&dirs, 0, sizeof(dirs));
+	memset(&files, 0, sizeof(files));
+	failed = 0;
+	sync_paths_push(&dirs, NULL, "", 0);
+	
+	/* One level of the tree at a time. */
+	while (dirs.count > 0) {
+		count_queries = 0;
+		memset(&dirs_next, 0, sizeof(dirs_next));
+		
+		for (size_t i = 0; i < dirs.count; i++) {
+			if (!dirs.absent[i])
+				count_queries++;
+		}
+		
+		heads = (struct data16 **)calloc(count_queries ? count_queries : 1, sizeof(*heads));
+		bodies = (struct data64 **)calloc(count_queries ? count_queries : 1, sizeof(*bodies));
+		replies = (struct data64 **)calloc(count_queries ? count_queries : 1, sizeof(*replies));
+		query = 0;
+		
+		for (size_t i = 0; i < dirs.count; i++) {
+			if (dirs.absent[i])
+				continue;
+			
+			/* Only borrowed for the envelope. */
+			parcel->raw_filename = dirs.paths[i];
+			tree_serialise(parcel, &heads[query], &bodies[query]);
+			parcel->raw_filename = NULL;
+			query++;
+		}
+		
+		for (size_t i = 0; count_sign > 0 && i < count_queries; i += count_sign) {
+			if (parcels_sign(&heads[i], &bodies[i], NULL, count_queries - i < count_sign ? count_queries - i : count_sign, pkey) != 0)
+				trace_write(DP_TRACE_WARN, "%s: unable to sign the questions to %s", addr, host);
+		}
+		
+		if (count_queries > 0 &&
+		    data64_tree_query(host, heads, bodies, count_queries, replies) != 0) {
+			trace_write(DP_TRACE_WARN, "%s: %s did not answer every question", addr, host);
+			failed = 1;
+		}
+		
+		query = 0;
+		
+		for (size_t i = 0; i < dirs.count; i++) {
+			const struct data64 *reply;
+			
+			reply = NULL;
+			
+			if (!dirs.absent[i] &&
+			    !(reply = replies[query++]))
+				continue;
+			
+			if (sync_dir_compare(dirfd, dirs.paths[i], reply, arena, &dirs_next, &files) != 0) {
+				trace_write(DP_TRACE_WARN, "%s: unable to compare %s/", addr, dirs.paths[i]);
+				failed = 1;
+			}
+		}
+		
+		for (size_t i = 0; i < count_queries; i++) {
+			if (heads[i]) {
+				free(heads[i]->bytes);
+				free(heads[i]);
+			}
+			
+			if (bodies[i]) {
+				free(bodies[i]->bytes);
+				free(bodies[i]);
+			}
+			
+			if (replies[i]) {
+				free(replies[i]->bytes);
+				free(replies[i]);
+			}
+		}
+		
+		free(heads);
+		free(bodies);
+		free(replies);
+		sync_paths_free(&dirs);
+		dirs = dirs_next;
+	}
+	
+	trace_write(DP_TRACE_INFO, "%s: %lu file(s) to sync", addr, files.count);
+	
+	if (files.count > 0 &&
+	    sync_files_send(host, parcel, path_dir, &files, pkey) != 0)
+		failed = 1;
+	
+	status = failed ? DP_REQERR_INTERNAL : DP_REQOK;
+	
+	sync_paths_free(&files);
+	parcel_free(&parcel);
+	EVP_PKEY_free(pkey);
+	arena_free(&arena);
+	close(dirfd);
+	path_free(&path_dir);
+	free(host);
+	
+	return status;
+}
+
+/*
+ * Compares the directory at relpath within the copy open
+ * at rootfd with the contact's, as described by reply
+ * (NULL if they do not have it), adding what differs to
+ * dirs (to be asked for next) and files (to be sent).
+ */
+int sync_dir_compare(int rootfd, const char *relpath, const struct data64 *reply, struct arena *arena, struct dp_sync_paths *dirs, struct dp_sync_paths *files)
+{
+	unsigned char tree[SHA256_DIGEST_LENGTH];
+	unsigned char tree_remote[SHA256_DIGEST_LENGTH];
+	struct arena_mark mark;
+	struct dp_sync_entry *entries;
+	struct dp_sync_entry *entries_remote;
+	const struct dp_sync_entry *found;
+	uint32_t count;
+	uint32_t count_remote;
+	uint16_t code;
+	int dirfd;
+	int status;
+	
+	if ((dirfd = directory_open(rootfd, relpath[0] ? relpath : ".")) == -1)
+		return -1;
+	
+	count_remote = 0;
+	entries_remote = NULL;
+	mark = arena_mark_get(arena);
+	status = 0;
+	
+	if (sync_entries_at_get(dirfd, arena, tree, &entries, &count) != 0) {
+		close(dirfd);
+		return -1;
+	}
+	
+	if (reply) {
+		if (entries_deserialise(reply, &code, tree_remote, &entries_remote, &count_remote) != 0) {
+			status = -1;
+			count = 0;
+		} else if (code == DP_REQERR_FORBIDDEN.code) {
+			/* They would not take the files either. */
+			status = -1;
+			count = 0;
+		} else if (code != DP_REQOK.code) {
+			/* Nothing there to go by; everything is sent. */
+			count_remote = 0;
+		} else if (memcmp(tree, tree_remote, sizeof(tree)) == 0) {
+			count = 0;
+		}
+	}
+	
+	/* The order the contact listed them in is not taken on trust. */
+	if (count_remote > 0)
+		qsort(entries_remote, count_remote, sizeof(*entries_remote), sync_entry_compare);
+	
+	for (uint32_t i = 0; i < count; i++) {
+		found = count_remote > 0 ? (const struct dp_sync_entry *)bsearch(&entries[i], entries_remote, count_remote, sizeof(*entries_remote), sync_entry_compare) : NULL;
+		
+		if (found &&
+		    found->dir == entries[i].dir &&
+		    memcmp(found->checksum, entries[i].checksum, SHA256_DIGEST_LENGTH) == 0)
+			continue;
+		
+		if (entries[i].dir)
+			sync_paths_push(dirs, relpath, entries[i].name, !found || !found->dir);
+		else
+			sync_paths_push(files, relpath, entries[i].name, !found);
+	}
+	
+	if (entries_remote)
+		free(entries_remote);
+	
+	arena_rewind(arena, mark);
+	close(dirfd);
+	
+	return status;
+}
+
+/*
+ * Gets the tree hash and the entries of the directory
+ * open at dirfd from its index, sorted by name. The
+ * entries and their names are placed in arena.
+ * Returns -1 if the directory has no index yet.
+ */
+int sync_entries_at_get(int dirfd, struct arena *arena, unsigned char tree[], struct dp_sync_entry **entries, uint32_t *count)
+{
+	const struct dp_index_entry *entry;
+	struct filearray files;
+	struct dp_index *index;
+	unsigned char type;
+	
+	*count = 0;
+	*entries = NULL;
+	
+	if (filearray_at_get(dirfd, arena, &files) != 0 ||
+	    index_open(dirfd, &index) != 0)
+		return -1;
+	
+	if (index_tree_get(index, tree) != 0 ||
+	    !(*entries = (struct dp_sync_entry *)arena_alloc(arena, (files.count ? files.count : 1) * sizeof(**entries)))) {
+		index_close(&index);
+		return -1;
+	}
+	
+	/* The listing is sorted by name already. */
+	for (size_t i = 0; i < files.count; i++) {
+		type = files.entries[i].type;
+		
+		if ((type != DT_REG &&
+		     type != DT_DIR) ||
+		    sync_name_skip(files.entries[i].name) ||
+		    !(entry = index_find(index, files.entries[i].name)) ||
+		    ((entry->flags & DP_INDEX_DIR) != 0) != (type == DT_DIR))
+			continue;
+		
+		memcpy((*entries)[*count].checksum, entry->checksum, SHA256_DIGEST_LENGTH);
+		(*entries)[*count].dir = type == DT_DIR;
+		(*entries)[*count].name = files.entries[i].name;
+		(*count)++;
+	}
+	
+	index_close(&index);
+	
+	return 0;
+}
+
+/*
+ * Answers a host syncing with the tree hash and entries
+ * of the directory of its copy that the parcel names;
+ * see tree_parse(). The entries are placed in arena.
+ */
+struct dp_reqstatus sync_entries_get(const struct dp_parcel *parcel, struct arena *arena, unsigned char tree[], struct dp_sync_entry **entries, uint32_t *count)
+{
+	struct path *path_dir;
+	struct dp_reqstatus status;
+	int dirfd;
+	
+	if (!parcel ||
+	    !parcel->raw_filename ||
+	    !arena ||
+	    !tree ||
+	    !entries ||
+	    !count)
+		return DP_REQERR_INT_BADARG;
+	
+	*count = 0;
+	*entries = NULL;
+	
+	if ((status = parcel_dir_get(parcel, 0, &path_dir)).code != DP_REQOK.code)
+		return status;
+	
+	if (parcel->raw_filename[0] &&
+	    (status = relpath_append(&path_dir, parcel->raw_filename, 0)).code != DP_REQOK.code) {
+		path_free(&path_dir);
+		return status;
+	}
+	
+	dirfd = open(path_cstr(path_dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	path_free(&path_dir);
+	
+	if (dirfd == -1)
+		return DP_REQERR_NOTFOUND;
+	
+	if (sync_entries_at_get(dirfd, arena, tree, entries, count) != 0)
+		status = DP_REQERR_NOTFOUND;
+	
+	close(dirfd);
+	
+	return status;
+}
+
+int sync_entry_compare(const void *a, const void *b)
+{
+	return strcmp(((const struct dp_sync_entry *)a)->name, ((const struct dp_sync_entry *)b)->name);
+}
+
+/*
+ * Sends the files, in batches of up to DP_SYNC_BATCH_MAX
+ * files or DP_SYNC_BATCH_LEN bytes, each over one
+ * connection, signed with pkey. Returns -1 if any of
+ * them did not make it.
+ */
+int sync_files_send(const char *host, const struct dp_parcel *parcel_sync, const struct path *path_root, const struct dp_sync_paths *files, EVP_PKEY *pkey)
+{
+	struct data16 *heads[DP_SYNC_BATCH_MAX];
+	struct data64 *bodies[DP_SYNC_BATCH_MAX];
+	struct data64 *payloads[DP_SYNC_BATCH_MAX];
+	struct dp_tail tails[DP_SYNC_BATCH_MAX];
+	struct dp_parcel *parcels[DP_SYNC_BATCH_MAX];
+	uint16_t codes[DP_SYNC_BATCH_MAX];
+	size_t count;
+	size_t count_sign;
+	size_t len;
+	size_t next;
+	int status;
+	
+	next = 0;
+	status = 0;
+	count_sign = config_sign_get();
+	
+	while (next < files->count) {
+		count = 0;
+		len = 0;
+		
+		for (; next < files->count && count < DP_SYNC_BATCH_MAX && len < DP_SYNC_BATCH_LEN; next++) {
+			struct path *path_file;
+			struct dp_parcel *parcel;
+			
+			path_file = path_copy(path_root);
+			
+			if (relpath_append(&path_file, files->paths[next], 0).code != DP_REQOK.code ||
+			    file_get(path_file, &payloads[count]) != 0) {
+				trace_write(DP_TRACE_WARN, "Unable to read %s", files->paths[next]);
+				path_free(&path_file);
+				status = -1;
+				
+				continue;
+			}
+			
+			path_free(&path_file);
+			
+			parcel = parcel_make();
+			parcel->head.type = DP_PROTO_HOST_MSG_SYNCED;
+			parcel->raw_filename = (char *)calloc(strlen(files->paths[next]) + 1, sizeof(char));
+			strcpy(parcel->raw_filename, files->paths[next]);
+			service_get(parcel->raw_filename, &(parcel->service));
+			parcel->recipient_addr->host->identifier = (char *)calloc(strlen(parcel_sync->recipient_addr->host->identifier) + 1, sizeof(char));
+			parcel->recipient_addr->user->identifier = (char *)calloc(strlen(parcel_sync->recipient_addr->user->identifier) + 1, sizeof(char));
+			parcel->sender_addr->host->identifier = (char *)calloc(strlen(parcel_sync->sender_addr->host->identifier) + 1, sizeof(char));
+			parcel->sender_addr->user->identifier = (char *)calloc(strlen(parcel_sync->sender_addr->user->identifier) + 1, sizeof(char));
+			strcpy(parcel->recipient_addr->host->identifier, parcel_sync->recipient_addr->host->identifier);
+			strcpy(parcel->recipient_addr->user->identifier, parcel_sync->recipient_addr->user->identifier);
+			strcpy(parcel->sender_addr->host->identifier, parcel_sync->sender_addr->host->identifier);
+			strcpy(parcel->sender_addr->user->identifier, parcel_sync->sender_addr->user->identifier);
+			parcel->head.sequence = order_sequence_next(parcel);
+			
+			if (synced_serialise(parcel, payloads[count]->len, &heads[count], &bodies[count]) != 0) {
+				order_sequence_return(parcel);
+				file_release(&payloads[count]);
+				parcel_free(&parcel);
+				status = -1;
+				
+				continue;
+			}
+			
+			memset(&tails[count], 0, sizeof(tails[count]));
+			tails[count].payload = payloads[count];
+			tails[count].len = payloads[count]->len;
+			parcels[count] = parcel;
+			len += payloads[count]->len;
+			count++;
+		}
+		
+		if (count == 0)
+			continue;
+		
+		for (size_t i = 0; count_sign > 0 && i < count; i += count_sign) {
+			if (parcels_sign(&heads[i], &bodies[i], &tails[i], count - i < count_sign ? count - i : count_sign, pkey) != 0)
+				trace_write(DP_TRACE_WARN, "Unable to sign files synced to %s", host);
+		}
+		
+		data64_batch_send(host, heads, bodies, tails, count, codes);
+		
+		for (size_t i = count; i > 0 && codes[i - 1] == 0; i--)
+			order_sequence_return(parcels[i - 1]);
+		
+		for (size_t i = 0; i < count; i++) {
+			/* What was sent of a file cut short is not its copy. */
+			if (file_release(&payloads[i]) == -1) {
+				trace_write(DP_TRACE_WARN, "%s was cut short while it was sent", parcels[i]->raw_filename);
+				status = -1;
+			} else if (codes[i] == 0) {
+				trace_write(DP_TRACE_WARN, "%s: no acknowledgement", parcels[i]->raw_filename);
+				status = -1;
+			} else {
+				trace_write(DP_TRACE_INFO, "%s: %u", parcels[i]->raw_filename, codes[i]);
+				
+				if (codes[i] != DP_REQOK.code)
+					status = -1;
+				else
+					eventlog_append(path_root, DP_EVENTLOG_SYNCED, parcels[i]->recipient_addr->user->identifier, parcels[i]->recipient_addr->host->identifier, parcels[i]->raw_filename);
+			}
+			
+			free(heads[i]->bytes);
+			free(heads[i]);
+			free(bodies[i]->bytes);
+			free(bodies[i]);
+			parcel_free(&parcels[i]);
+		}
+	}
+	
+	return status;
+}
+
+/*
+ * Hidden files and the daemon's own are not synced.
+ */
+int sync_name_skip(const char *name)
+{
+	size_t len;
+	
+	len = strlen(DP_FILE_AUTORESPONSE);
+	
+	return name[0] == '.' ||
+	       strncmp(name, "dp.", 3) == 0 ||
+	       (strncmp(name, DP_FILE_AUTORESPONSE, len) == 0 &&
+		name[len] == '.');
+}
+
+void sync_paths_free(struct dp_sync_paths *list)
+{
+	for (size_t i = 0; i < list->count; i++)
+		free(list->paths[i]);
+	
+	if (list->paths)
+		free(list->paths);
+	
+	if (list->absent)
+		free(list->absent);
+	
+	memset(list, 0, sizeof(*list));
+}
+
+/*
+ * Adds dir/name, or name alone if dir is NULL or empty,
+ * to the list.
+ */
+int sync_paths_push(struct dp_sync_paths *list, const char *dir, const char *name, int absent)
+{
+	char *path;
+	size_t len;
+	
+	if (list->count == list->count_max) {
+		char **paths;
+		unsigned char *absents;
+		size_t count_max;
+		
+		count_max = list->count_max ? list->count_max * 2 : DP_SYNC_PATHS_INIT;
+		
+		if (!(paths = (char **)realloc(list->paths, count_max * sizeof(*paths))))
+			return -1;
+		
+		list->paths = paths;
+		
+		if (!(absents = (unsigned char *)realloc(list->absent, count_max * sizeof(*absents))))
+			return -1;
+		
+		list->absent = absents;
+		list->count_max = count_max;
+	}
+	
+	len = (dir && dir[0] ? strlen(dir) + 1 : 0) + strlen(name) + 1;
+	
+	if (!(path = (char *)malloc(len)))
+		return -1;
+	
+	if (dir &&
+	    dir[0])
+		snprintf(path, len, "%s/%s", dir, name);
+	else
+		snprintf(path, len, "%s", name);
+	
+	list->absent[list->count] = absent ? 1 : 0;
+	list->paths[list->count++] = path;
+	
+	return 0;
+}
@@ -0,0 +1,28 @@
+//
+//  sync.h
+//  server
+//
+
+#ifndef SYNC_H
+#define SYNC_H
+
+
+#include "protocol.h"
+#include "types.h"
+
+
+/*************
+ * CONSTANTS *
+ *************/
+static const size_t DP_SYNC_BATCH_LEN 		= 64 * 1024 * 1024;	/* Payload bytes held for one batch of files */
+static const size_t DP_SYNC_BATCH_MAX 		= 64;	/* Files sent over one connection */
+static const size_t DP_SYNC_PATHS_INIT 		= 64;
+
+/*************
+ * FUNCTIONS *
+ *************/
+struct dp_reqstatus sync_contact(const char *, const char *, const char *);
+struct dp_reqstatus sync_entries_get(const struct dp_parcel *, struct arena *, unsigned char [], struct dp_sync_entry **, uint32_t *);
+
+
+#endif /* SYNC_H */
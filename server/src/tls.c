@@ -0,0 +1,556 @@
+//
+//  tls.c
+//  server
+//
+
+#include "tls.h"
+
+#include "disk.h"
+#include <errno.h>
+#include "keyring.h"
+#include <limits.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "trace.h"
+#include "util.h"
+
+
+/*
+ * TLS
+ * --
+ * Host connections can be wrapped in TLS, per host as
+ * set with "TLS <host> on" in dp.conf. The listening side
+ * takes both: a connection that opens with a TLS
+ * handshake record is accepted as TLS, anything else is
+ * read as plain messages as before.
+ *
+ * The server's certificate is made at startup out of the
+ * machine's key (id.pem). The connecting side only goes
+ * on if the key in it is the one it keeps for the host,
+ * in <root>/<host>/.pubkey; without that key, or with a
+ * different one, the connection is dropped rather than
+ * carried on in the clear or with a stranger.
+ *
+ * Connections are short-lived (one per batch or per
+ * range stream), so each peer's last session (or TLS 1.3
+ * ticket) is kept and offered on the next connection to
+ * it; a resumed handshake skips the public-key work.
+ * Where the kernel supports it, record encryption is
+ * handed over to it (kTLS) once the handshake is done.
+ *
+ * The TLS state of a connection is looked up by its
+ * socket, so the rest of the network code carries on
+ * passing sockets around; see data_read() and
+ * data_write() in net.c.
+ */
+
+/**************
+ * STRUCTURES *
+ **************/
+struct dp_tls_link {
+	char *host;	/* The peer, for connections made to one */
+	SSL *ssl;
+};
+
+/*
+ * The session to offer the next time a connection to
+ * the host is made.
+ */
+struct dp_tls_session {
+	char *host;
+	struct dp_tls_session *next;
+	SSL_SESSION *session;
+};
+/**********************/
+
+/********************
+ * Global Variables
+ ********************/
+extern struct path *path_dir_root; /* See main.c */
+SSL_CTX *tls_ctx_client;
+SSL_CTX *tls_ctx_server;		/* NULL if there is no key to serve with */
+struct dp_tls_link **tls_links;		/* Indexed by socket */
+size_t tls_links_len;
+pthread_mutex_t tls_sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+struct dp_tls_session *tls_sessions;	/* Most recently used first */
+/**********************/
+
+/**********************
+ * Private Prototypes
+ **********************/
+X509 *certificate_make(EVP_PKEY *);
+int peer_check(SSL *, const char *);
+SSL_SESSION *session_get(const char *);
+int session_new(SSL *, SSL_SESSION *);
+void session_put(const char *, SSL_SESSION *);
+void tls_errors_trace(int, const char *);
+/**********************/
+
+
+/*
+ * Makes a self-signed certificate for the key.
+ */
+X509 *certificate_make(EVP_PKEY *pkey)
+{
+	X509 *cert;
+	X509_NAME *name;
+	const EVP_MD *md;
+	
+	if (!(cert = X509_new()))
+		return NULL;
+	
+	/* Ed25519 keys hash the certificate themselves. */
+	md = EVP_PKEY_id(pkey) == EVP_PKEY_ED25519 ? NULL : EVP_sha256();
+	name = X509_get_subject_name(cert);
+	
+	if (X509_set_version(cert, 2) != 1 ||
+	    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) != 1 ||
+	    !X509_gmtime_adj(X509_getm_notBefore(cert), 0) ||
+	    !X509_gmtime_adj(X509_getm_notAfter(cert), (long)DP_TLS_CERT_DAYS * 24 * 60 * 60) ||
+	    X509_set_pubkey(cert, pkey) != 1 ||
+	    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)DP_TLS_SESSION_CONTEXT, -1, -1, 0) != 1 ||
+	    X509_set_issuer_name(cert, name) != 1 ||
+	    X509_sign(cert, pkey, md) <= 0) {
+		X509_free(cert);
+		return NULL;
+	}
+	
+	return cert;
+}
+
+/*
+ * Returns 0 if the key in the certificate the peer
+ * presented is the one kept for the host; a resumed
+ * session carries the certificate from its first
+ * handshake.
+ */
+int peer_check(SSL *ssl, const char *host)
+{
+	struct path *path_key;
+	EVP_PKEY *pkey;
+	X509 *cert;
+	int same;
+	
+	path_key = path_copy(path_dir_root);
+	path_append(&path_key, host);
+	path_append(&path_key, DP_FILE_PUBKEY);
+	
+	if (!(pkey = keyring_get(path_cstr(path_key), 0))) {
+		trace_write(DP_TRACE_WARN, "%s: no key in %s to check the TLS certificate against", host, path_cstr(path_key));
+		path_free(&path_key);
+		
+		return -1;
+	}
+	
+	path_free(&path_key);
+	
+	if (!(cert = SSL_get_peer_certificate(ssl))) {
+		EVP_PKEY_free(pkey);
+		return -1;
+	}
+	
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	same = EVP_PKEY_eq(X509_get0_pubkey(cert), pkey);
+#else
+	same = EVP_PKEY_cmp(X509_get0_pubkey(cert), pkey);
+#endif
+	X509_free(cert);
+	EVP_PKEY_free(pkey);
+	
+	if (same != 1) {
+		trace_write(DP_TRACE_WARN, "%s: TLS certificate does not carry the key kept for the host", host);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+SSL_SESSION *session_get(const char *host)
+{
+	struct dp_tls_session *entry;
+	SSL_SESSION *session;
+	
+	session = NULL;
+	
+	pthread_mutex_lock(&tls_sessions_lock);
+	
+	for (entry = tls_sessions; entry; entry = entry->next) {
+		if (strcmp(entry->host, host) == 0) {
+			if (SSL_SESSION_up_ref(entry->session) == 1)
+				session = entry->session;
+			
+			break;
+		}
+	}
+	
+	pthread_mutex_unlock(&tls_sessions_lock);
+	
+	return session;
+}
+
+/*
+ * Called by OpenSSL whenever the server hands over a
+ * session (or ticket) that can be resumed. Returns 1 as
+ * the session is kept.
+ */
+int session_new(SSL *ssl, SSL_SESSION *session)
+{
+	struct dp_tls_link *link;
+	
+	link = (struct dp_tls_link *)SSL_get_app_data(ssl);
+	
+	if (!link ||
+	    !link->host ||
+	    SSL_SESSION_is_resumable(session) != 1)
+		return 0;
+	
+	session_put(link->host, session);
+	
+	return 1;
+}
+
+/*
+ * Takes over the session, replacing the one kept for
+ * the host.
+ */
+void session_put(const char *host, SSL_SESSION *session)
+{
+	struct dp_tls_session *entry;
+	struct dp_tls_session *prev;
+	int count;
+	
+	count = 0;
+	prev = NULL;
+	
+	pthread_mutex_lock(&tls_sessions_lock);
+	
+	for (entry = tls_sessions; entry; prev = entry, entry = entry->next) {
+		if (strcmp(entry->host, host) == 0)
+			break;
+	}
+	
+	if (entry) {
+		if (prev)
+			prev->next = entry->next;
+		else
+			tls_sessions = entry->next;
+		
+		SSL_SESSION_free(entry->session);
+	} else {
+		entry = (struct dp_tls_session *)malloc(sizeof(*entry));
+		entry->host = (char *)malloc(strlen(host) + 1);
+		strcpy(entry->host, host);
+	}
+	
+	entry->session = session;
+	entry->next = tls_sessions;
+	tls_sessions = entry;
+	
+	/* Forget the peers not connected to for the longest. */
+	for (prev = NULL, entry = tls_sessions; entry; prev = entry, entry = entry->next) {
+		if (++count > DP_TLS_SESSIONS_MAX) {
+			prev->next = NULL;
+			
+			while (entry) {
+				struct dp_tls_session *tmp;
+				
+				tmp = entry;
+				entry = entry->next;
+				SSL_SESSION_free(tmp->session);
+				free(tmp->host);
+				free(tmp);
+			}
+			
+			break;
+		}
+	}
+	
+	pthread_mutex_unlock(&tls_sessions_lock);
+}
+
+/*
+ * Takes a connection accepted on the listening socket
+ * into TLS if it opens with a handshake. Returns -1 if
+ * the handshake fails; a plain connection is left as it
+ * is.
+ */
+int tls_accept(int sockfd)
+{
+	struct dp_tls_link *link;
+	SSL *ssl;
+	ssize_t peeked;
+	unsigned char byte;
+	
+	if (sockfd < 0 ||
+	    sockfd >= tls_links_len)
+		return 1;
+	
+	while ((peeked = recv(sockfd, &byte, sizeof(byte), MSG_PEEK)) == -1 &&
+	       errno == EINTR);
+	
+	if (peeked != sizeof(byte) ||
+	    byte != DP_TLS_RECORD_HANDSHAKE ||
+	    !tls_ctx_server)
+		return 0;
+	
+	if (!(ssl = SSL_new(tls_ctx_server)))
+		return -1;
+	
+	if (SSL_set_fd(ssl, sockfd) != 1 ||
+	    SSL_accept(ssl) != 1) {
+		tls_errors_trace(DP_TRACE_WARN, "tls_accept(1), SSL_accept(1)");
+		SSL_free(ssl);
+		
+		return -1;
+	}
+	
+	link = (struct dp_tls_link *)malloc(sizeof(*link));
+	link->host = NULL;
+	link->ssl = ssl;
+	tls_links[sockfd] = link;
+	
+	return 0;
+}
+
+int tls_bootstrap(void)
+{
+	struct path *path_key;
+	struct rlimit limit;
+	EVP_PKEY *pkey;
+	X509 *cert;
+	
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+		trace_write(DP_TRACE_ERROR, "tls_bootstrap(0), getrlimit(2): %s", strerror(errno));
+		return -1;
+	}
+	
+	if (limit.rlim_cur == RLIM_INFINITY ||
+	    limit.rlim_cur > DP_TLS_SOCKETS_MAX)
+		tls_links_len = DP_TLS_SOCKETS_MAX;
+	else
+		tls_links_len = (size_t)limit.rlim_cur;
+	
+	tls_links = (struct dp_tls_link **)calloc(tls_links_len, sizeof(*tls_links));
+	
+	if (!(tls_ctx_client = SSL_CTX_new(TLS_client_method()))) {
+		tls_errors_trace(DP_TRACE_ERROR, "tls_bootstrap(0), SSL_CTX_new(1)");
+		return -1;
+	}
+	
+	/*
+	 * Sessions are only kept in tls_sessions, by peer, rather
+	 * than in OpenSSL's cache, which is keyed by session ID.
+	 */
+	SSL_CTX_set_min_proto_version(tls_ctx_client, TLS1_2_VERSION);
+	SSL_CTX_set_session_cache_mode(tls_ctx_client, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(tls_ctx_client, session_new);
+	
+	/* Certificates are self-signed; see peer_check() for what is checked instead. */
+	SSL_CTX_set_verify(tls_ctx_client, SSL_VERIFY_NONE, NULL);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	SSL_CTX_set_options(tls_ctx_client, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(tls_ctx_client, SSL_OP_ENABLE_KTLS);
+#endif
+	
+	path_key = path_copy(path_dir_root);
+	path_append(&path_key, DP_FILE_PRIVKEY);
+	pkey = keyring_get(path_cstr(path_key), 1);
+	
+	if (!pkey) {
+		trace_write(DP_TRACE_WARN, "TLS connections are not accepted without %s", path_cstr(path_key));
+		path_free(&path_key);
+		
+		return 0;
+	}
+	
+	path_free(&path_key);
+	cert = certificate_make(pkey);
+	
+	if (!cert ||
+	    !(tls_ctx_server = SSL_CTX_new(TLS_server_method())) ||
+	    SSL_CTX_use_certificate(tls_ctx_server, cert) != 1 ||
+	    SSL_CTX_use_PrivateKey(tls_ctx_server, pkey) != 1) {
+		tls_errors_trace(DP_TRACE_ERROR, "tls_bootstrap(0), server context");
+		
+		if (tls_ctx_server) {
+			SSL_CTX_free(tls_ctx_server);
+			tls_ctx_server = NULL;
+		}
+	} else {
+		SSL_CTX_set_min_proto_version(tls_ctx_server, TLS1_2_VERSION);
+		SSL_CTX_set_session_id_context(tls_ctx_server, (const unsigned char *)DP_TLS_SESSION_CONTEXT, strlen(DP_TLS_SESSION_CONTEXT));
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+		SSL_CTX_set_options(tls_ctx_server, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+		SSL_CTX_set_options(tls_ctx_server, SSL_OP_ENABLE_KTLS);
+#endif
+	}
+	
+	if (cert)
+		X509_free(cert);
+	
+	EVP_PKEY_free(pkey);
+	
+	return tls_ctx_server ? 0 : -1;
+}
+
+/*
+ * Ends the TLS session on the socket, if there is one;
+ * the socket itself is left open.
+ */
+void tls_close(int sockfd)
+{
+	struct dp_tls_link *link;
+	
+	if (sockfd < 0 ||
+	    sockfd >= tls_links_len ||
+	    !(link = tls_links[sockfd]))
+		return;
+	
+	tls_links[sockfd] = NULL;
+	SSL_shutdown(link->ssl);
+	SSL_free(link->ssl);
+	
+	if (link->host)
+		free(link->host);
+	
+	free(link);
+}
+
+/*
+ * Runs the TLS handshake on a socket connected to the
+ * host, resuming the last session with it if there is
+ * one. Returns -1 if the handshake fails or the host is
+ * not who it should be; see peer_check().
+ */
+int tls_connect(int sockfd, const char *host)
+{
+	struct dp_tls_link *link;
+	SSL_SESSION *session;
+	SSL *ssl;
+	int offloaded;
+	
+	if (sockfd < 0 ||
+	    sockfd >= tls_links_len ||
+	    !tls_ctx_client)
+		return 1;
+	
+	if (!host)
+		host = DP_DIR_DEFAULT;
+	
+	if (!(ssl = SSL_new(tls_ctx_client)))
+		return -1;
+	
+	link = (struct dp_tls_link *)malloc(sizeof(*link));
+	link->host = (char *)malloc(strlen(host) + 1);
+	link->ssl = ssl;
+	strcpy(link->host, host);
+	SSL_set_app_data(ssl, link);
+	
+	if ((session = session_get(host))) {
+		SSL_set_session(ssl, session);
+		SSL_SESSION_free(session);
+	}
+	
+	if (SSL_set_fd(ssl, sockfd) != 1 ||
+	    SSL_connect(ssl) != 1 ||
+	    peer_check(ssl, host) != 0) {
+		tls_errors_trace(DP_TRACE_WARN, "tls_connect(2), SSL_connect(1)");
+		SSL_free(ssl);
+		free(link->host);
+		free(link);
+		
+		return -1;
+	}
+	
+	tls_links[sockfd] = link;
+	offloaded = 0;
+#ifdef BIO_get_ktls_send
+	offloaded = BIO_get_ktls_send(SSL_get_wbio(ssl));
+#endif
+	trace_write(DP_TRACE_INFO, "TLS %s%s%s", SSL_get_version(ssl), SSL_session_reused(ssl) ? ", resumed" : "", offloaded ? ", kernel offload" : "");
+	
+	return 0;
+}
+
+/*
+ * Returns the TLS session on the socket, or NULL for a
+ * plain connection.
+ */
+SSL *tls_get(int sockfd)
+{
+	if (sockfd < 0 ||
+	    sockfd >= tls_links_len ||
+	    !tls_links[sockfd])
+		return NULL;
+	
+	return tls_links[sockfd]->ssl;
+}
+
+/*
+ * Writes the errors OpenSSL queued on this thread to the
+ * trace, which also clears them.
+ */
+void tls_errors_trace(int level, const char *where)
+{
+	char buffer[256];
+	unsigned long error;
+	
+	while ((error = ERR_get_error()) != 0) {
+		ERR_error_string_n(error, buffer, sizeof(buffer));
+		trace_write(level, "%s: %s", where, buffer);
+	}
+}
+
+/*
+ * Behaves like read(2): returns 0 once the peer has
+ * closed the connection, or -1 with errno set.
+ */
+ssize_t tls_read(SSL *ssl, unsigned char *buffer, size_t len)
+{
+	int bytes_read;
+	int error;
+	
+	if ((bytes_read = SSL_read(ssl, buffer, len > INT_MAX ? INT_MAX : (int)len)) > 0)
+		return bytes_read;
+	
+	error = SSL_get_error(ssl, bytes_read);
+	
+	if (error == SSL_ERROR_ZERO_RETURN)
+		return 0;
+	else if (error != SSL_ERROR_SYSCALL ||
+		 errno == 0)
+		errno = EIO;
+	
+	return -1;
+}
+
+/*
+ * Behaves like write(2).
+ */
+ssize_t tls_write(SSL *ssl, const unsigned char *buffer, size_t len)
+{
+	int bytes_sent;
+	
+	if ((bytes_sent = SSL_write(ssl, buffer, len > INT_MAX ? INT_MAX : (int)len)) > 0)
+		return bytes_sent;
+	
+	if (SSL_get_error(ssl, bytes_sent) != SSL_ERROR_SYSCALL ||
+	    errno == 0)
+		errno = EIO;
+	
+	return -1;
+}
@@ -0,0 +1,35 @@
+//
+//  tls.h
+//  server
+//
+
+#ifndef TLS_H
+#define TLS_H
+
+
+#include <openssl/ssl.h>
+#include <sys/types.h>
+
+
+/*************
+ * CONSTANTS *
+ *************/
+static const int DP_TLS_CERT_DAYS 		= 365;	/* Lifetime of the certificate made out of id.pem at startup */
+static const unsigned char DP_TLS_RECORD_HANDSHAKE 	= 0x16;	/* First byte of a TLS client hello */
+static const char *DP_TLS_SESSION_CONTEXT 	= "dispatchd";
+static const int DP_TLS_SESSIONS_MAX 		= 1024;	/* Peers whose session is kept for resumption */
+static const size_t DP_TLS_SOCKETS_MAX 		= 1048576;	/* Sockets above this one are never wrapped in TLS */
+
+/*************
+ * FUNCTIONS *
+ *************/
+int tls_accept(int);
+int tls_bootstrap(void);
+void tls_close(int);
+int tls_connect(int, const char *);
+SSL *tls_get(int);
+ssize_t tls_read(SSL *, unsigned char *, size_t);
+ssize_t tls_write(SSL *, const unsigned char *, size_t);
+
+
+#endif /* TLS_H */
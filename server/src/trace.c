@@ -0,0 +1,434 @@
+//
+//  trace.c
+//  server
+//
+
+#include "trace.h"
+
+#include "disk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "util.h"
+
+
+/*
+ * TRACING
+ * --
+ * What the daemon has to say goes to dp.log by way of
+ * trace_write(3), which is called from every connection
+ * and parcel, so it must neither take a lock nor wait
+ * on the disk.
+ *
+ * Each thread gets a ring of DP_TRACE_RING_LEN bytes the
+ * first time it writes a record; it is the only one
+ * that ever writes to it. A record is a fixed header
+ * (time, level and length) followed by the formatted
+ * message, padded to 8 bytes. The thread advances the
+ * ring's head and the drain thread its tail, so the two
+ * only ever exchange the one index each. When a ring is
+ * full, records are dropped and counted rather than
+ * waited for.
+ *
+ * Every DP_TRACE_DRAIN_INT ms, the drain thread takes
+ * the records out of every ring, puts them in time
+ * order and appends them to dp.log in one write(2).
+ * The ring of a thread that ended is freed once it has
+ * been drained.
+ */
+
+/**************
+ * STRUCTURES *
+ **************/
+struct dp_trace_record {
+	uint64_t time;		/* Nanoseconds since the UNIX epoch */
+	uint16_t len;		/* Message bytes following the header */
+	uint8_t level;
+	uint8_t reserved[5];
+};
+
+struct dp_trace_ring {
+	struct dp_trace_ring *next;
+	_Atomic uint64_t head;		/* Bytes ever written; advanced by the thread */
+	_Atomic uint64_t tail;		/* Bytes ever drained; advanced by the drain thread */
+	_Atomic uint64_t dropped;
+	_Atomic int orphaned;		/* The thread ended */
+	uint32_t thread;
+	unsigned char bytes[DP_TRACE_RING_LEN];
+};
+
+/*
+ * A record taken out of a ring by the drain thread.
+ */
+struct dp_trace_entry {
+	uint64_t time;
+	uint32_t thread;
+	uint16_t len;
+	uint8_t level;
+	char msg[DP_TRACE_MSG_MAX];
+};
+/**********************/
+
+/********************
+ * Global Variables
+ ********************/
+int trace_fd = -1;
+pthread_key_t trace_key;
+_Atomic(struct dp_trace_ring *) trace_rings;
+int trace_running;
+_Atomic uint32_t trace_threads;
+/**********************/
+
+/**********************
+ * Private Prototypes
+ **********************/
+void trace_drain(struct dp_trace_entry **, size_t *, char **, size_t *);
+int trace_entry_compare(const void *, const void *);
+void trace_orphan(void *);
+struct dp_trace_ring *trace_ring_get(void);
+void trace_ring_read(const struct dp_trace_ring *, uint64_t, void *, size_t);
+void trace_ring_write(struct dp_trace_ring *, uint64_t, const void *, size_t);
+void *trace_run(void *);
+/**********************/
+
+
+int trace_bootstrap(void)
+{
+	struct path *path_log;
+	pthread_t thread;
+	int result;
+	
+	path_log = errlog_file_get();
+	trace_fd = open(path_cstr(path_log), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	path_free(&path_log);
+	
+	/* Until trace_running is set, trace_write(2) goes to the standard output. */
+	if (trace_fd == -1) {
+		trace_write(DP_TRACE_ERROR, "trace_bootstrap(0), open(3): %s", strerror(errno));
+		return -1;
+	}
+	
+	if ((result = pthread_key_create(&trace_key, trace_orphan)) != 0 ||
+	    (result = pthread_create(&thread, NULL, trace_run, NULL)) != 0) {
+		trace_write(DP_TRACE_ERROR, "trace_bootstrap(0), pthread_create(4): %s", strerror(result));
+		close(trace_fd);
+		trace_fd = -1;
+		
+		return -1;
+	}
+	
+	pthread_detach(thread);
+	trace_running = 1;
+	
+	return 0;
+}
+
+/*
+ * Takes the records out of every ring, frees the rings
+ * of threads that ended, and appends the records to
+ * dp.log in time order. entries and out are kept by
+ * the drain thread from one round to the next.
+ */
+void trace_drain(struct dp_trace_entry **entries, size_t *entries_max, char **out, size_t *out_max)
+{
+	struct dp_trace_ring *prev;
+	struct dp_trace_ring *ring;
+	size_t count;
+	size_t len;
+	
+	count = 0;
+	prev = NULL;
+	ring = atomic_load_explicit(&trace_rings, memory_order_acquire);
+	
+	while (ring) {
+		struct dp_trace_ring *next;
+		uint64_t dropped;
+		uint64_t head;
+		uint64_t tail;
+		int orphaned;
+		
+		/* Read before the head, so that a ring seen as orphaned is seen in full. */
+		orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+		
+		while (tail < head ||
+		       dropped > 0) {
+			struct dp_trace_entry *entry;
+			struct dp_trace_record record;
+			
+			if (count == *entries_max) {
+				*entries_max = *entries_max ? *entries_max * 2 : 256;
+				*entries = (struct dp_trace_entry *)realloc(*entries, *entries_max * sizeof(**entries));
+			}
+			
+			entry = &(*entries)[count++];
+			
+			/* Dropped records go down as one of their own, ahead of whatever is left. */
+			if (dropped > 0) {
+				struct timespec now;
+				
+				clock_gettime(CLOCK_REALTIME, &now);
+				entry->time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+				entry->thread = ring->thread;
+				entry->level = DP_TRACE_WARN;
+				entry->len = snprintf(entry->msg, sizeof(entry->msg), "%llu record(s) dropped", (unsigned long long)dropped);
+				dropped = 0;
+				
+				continue;
+			}
+			
+			trace_ring_read(ring, tail, &record, sizeof(record));
+			entry->time = record.time;
+			entry->thread = ring->thread;
+			entry->level = record.level;
+			entry->len = record.len;
+			trace_ring_read(ring, tail + sizeof(record), entry->msg, record.len);
+			tail += (sizeof(record) + record.len + 7) & ~(uint64_t)7;
+		}
+		
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+		next = ring->next;
+		
+		if (orphaned) {
+			/*
+			 * Only this thread ever unlinks rings; new ones are
+			 * pushed at the front, so unlinking the front one has
+			 * to race with them.
+			 */
+			if (prev) {
+				prev->next = next;
+			} else {
+				struct dp_trace_ring *expected;
+				
+				expected = ring;
+				
+				if (!atomic_compare_exchange_strong(&trace_rings, &expected, next)) {
+					for (prev = expected; prev->next != ring; prev = prev->next);
+					
+					prev->next = next;
+				}
+			}
+			
+			free(ring);
+		} else {
+			prev = ring;
+		}
+		
+		ring = next;
+	}
+	
+	if (count == 0)
+		return;
+	
+	qsort(*entries, count, sizeof(**entries), trace_entry_compare);
+	len = 0;
+	
+	for (size_t i = 0; i < count; i++) {
+		static const char *levels[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+		struct dp_trace_entry *entry;
+		struct tm tm;
+		time_t secs;
+		
+		entry = &(*entries)[i];
+		
+		if (len + DP_TRACE_MSG_MAX + 64 > *out_max) {
+			*out_max = *out_max ? *out_max * 2 : 65536;
+			*out = (char *)realloc(*out, *out_max);
+		}
+		
+		secs = (time_t)(entry->time / 1000000000);
+		localtime_r(&secs, &tm);
+		len += strftime(&(*out)[len], *out_max - len, "%Y-%m-%d %H:%M:%S", &tm);
+		len += snprintf(&(*out)[len], *out_max - len, ".%03u %-5s [%u] %.*s\n",
+				(unsigned)(entry->time / 1000000 % 1000),
+				levels[entry->level <= 3 ? entry->level : 3],
+				entry->thread,
+				(int)entry->len,
+				entry->msg);
+	}
+	
+	for (size_t written = 0; written < len;) {
+		ssize_t result;
+		
+		if ((result = write(trace_fd, &(*out)[written], len - written)) == -1) {
+			/* The log itself is what failed; this is the one place left to say so. */
+			perror("trace_drain(4), write(3)");
+			break;
+		}
+		
+		written += result;
+	}
+}
+
+int trace_entry_compare(const void *a, const void *b)
+{
+	uint64_t time_a;
+	uint64_t time_b;
+	
+	time_a = ((const struct dp_trace_entry *)a)->time;
+	time_b = ((const struct dp_trace_entry *)b)->time;
+	
+	return (time_a > time_b) - (time_a < time_b);
+}
+
+/*
+ * Called as a thread ends; its ring is freed by the
+ * drain thread once emptied.
+ */
+void trace_orphan(void *ring)
+{
+	atomic_store_explicit(&((struct dp_trace_ring *)ring)->orphaned, 1, memory_order_release);
+}
+
+/*
+ * Returns the calling thread's ring, setting one up
+ * the first time.
+ */
+struct dp_trace_ring *trace_ring_get(void)
+{
+	struct dp_trace_ring *ring;
+	struct dp_trace_ring *head;
+	
+	if ((ring = (struct dp_trace_ring *)pthread_getspecific(trace_key)))
+		return ring;
+	
+	if (!(ring = (struct dp_trace_ring *)malloc(sizeof(*ring))))
+		return NULL;
+	
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->dropped, 0);
+	atomic_init(&ring->orphaned, 0);
+	ring->thread = atomic_fetch_add(&trace_threads, 1) + 1;
+	pthread_setspecific(trace_key, ring);
+	head = atomic_load_explicit(&trace_rings, memory_order_relaxed);
+	
+	do {
+		ring->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&trace_rings, &head, ring, memory_order_release, memory_order_relaxed));
+	
+	return ring;
+}
+
+/*
+ * Copies len bytes out of the ring from pos, wrapping
+ * around its end.
+ */
+void trace_ring_read(const struct dp_trace_ring *ring, uint64_t pos, void *out, size_t len)
+{
+	size_t first;
+	size_t offset;
+	
+	offset = pos & (DP_TRACE_RING_LEN - 1);
+	first = DP_TRACE_RING_LEN - offset < len ? DP_TRACE_RING_LEN - offset : len;
+	memcpy(out, &ring->bytes[offset], first);
+	memcpy((unsigned char *)out + first, ring->bytes, len - first);
+}
+
+/*
+ * Copies len bytes into the ring at pos, wrapping
+ * around its end.
+ */
+void trace_ring_write(struct dp_trace_ring *ring, uint64_t pos, const void *bytes, size_t len)
+{
+	size_t first;
+	size_t offset;
+	
+	offset = pos & (DP_TRACE_RING_LEN - 1);
+	first = DP_TRACE_RING_LEN - offset < len ? DP_TRACE_RING_LEN - offset : len;
+	memcpy(&ring->bytes[offset], bytes, first);
+	memcpy(ring->bytes, (const unsigned char *)bytes + first, len - first);
+}
+
+/*
+ * The drain thread.
+ */
+void *trace_run(void *args)
+{
+	struct dp_trace_entry *entries;
+	struct timespec interval;
+	char *out;
+	size_t entries_max;
+	size_t out_max;
+	
+	entries = NULL;
+	entries_max = 0;
+	out = NULL;
+	out_max = 0;
+	interval.tv_sec = DP_TRACE_DRAIN_INT / 1000;
+	interval.tv_nsec = (DP_TRACE_DRAIN_INT % 1000) * 1000000;
+	
+	while (1) {
+		nanosleep(&interval, NULL);
+		trace_drain(&entries, &entries_max, &out, &out_max);
+	}
+	
+	return 0;
+}
+
+/*
+ * Records a message at the given level. Before
+ * trace_bootstrap(0), it goes to the standard output
+ * instead.
+ */
+void trace_write(int level, const char *format, ...)
+{
+	char msg[DP_TRACE_MSG_MAX];
+	struct dp_trace_record record;
+	struct dp_trace_ring *ring;
+	struct timespec now;
+	va_list args;
+	uint64_t head;
+	uint64_t len;
+	int result;
+	
+	if (level < DP_TRACE_LEVEL_MIN)
+		return;
+	
+	va_start(args, format);
+	
+	if (!trace_running ||
+	    !(ring = trace_ring_get())) {
+		vprintf(format, args);
+		putchar('\n');
+		va_end(args);
+		
+		return;
+	}
+	
+	result = vsnprintf(msg, sizeof(msg), format, args);
+	va_end(args);
+	
+	if (result < 0)
+		return;
+	
+	clock_gettime(CLOCK_REALTIME, &now);
+	record.time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	record.len = (size_t)result < sizeof(msg) ? (uint16_t)result : (uint16_t)(sizeof(msg) - 1);
+	record.level = (uint8_t)level;
+	memset(record.reserved, 0, sizeof(record.reserved));
+	len = (sizeof(record) + record.len + 7) & ~(uint64_t)7;
+	
+	/* Only this thread moves the head. */
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	
+	if (head + len - atomic_load_explicit(&ring->tail, memory_order_acquire) > DP_TRACE_RING_LEN) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	
+	trace_ring_write(ring, head, &record, sizeof(record));
+	trace_ring_write(ring, head + sizeof(record), msg, record.len);
+	atomic_store_explicit(&ring->head, head + len, memory_order_release);
+}
@@ -0,0 +1,30 @@
+//
+//  trace.h
+//  server
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+
+#define DP_TRACE_MSG_MAX	512	/* Longer messages are cut short. */
+#define DP_TRACE_RING_LEN	65536	/* Record bytes buffered per thread; must be a power of 2. */
+
+/*************
+ * CONSTANTS *
+ *************/
+static const int DP_TRACE_DEBUG 		= 0;
+static const int DP_TRACE_INFO 			= 1;
+static const int DP_TRACE_WARN 			= 2;
+static const int DP_TRACE_ERROR 		= 3;
+static const int DP_TRACE_DRAIN_INT 		= 100;	/* How often (in milliseconds) the records are written out. */
+static const int DP_TRACE_LEVEL_MIN 		= 1;	/* Records below this level are dropped right away. */
+
+/*************
+ * FUNCTIONS *
+ *************/
+int trace_bootstrap(void);
+void trace_write(int, const char *, ...) __attribute__((format(printf, 2, 3)));
+
+
+#endif /* TRACE_H */
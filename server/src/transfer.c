@@ -0,0 +1,940 @@
+//
+//  transfer.c
+//  server
+//
+
+#include "transfer.h"
+
+#include "disk.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include <unistd.h>
+
+
+/*
+ * RANGED TRANSFERS
+ * --
+ * Large parcels arrive as byte ranges, possibly over
+ * several connections at once. The ranges are written
+ * straight into a preallocated staging file under
+ * ~/.dispatch/partial, named after the parcel's UUID.
+ * Once every byte is in, the file is checked against
+ * the payload checksum and handed over for delivery,
+ * which moves it into place.
+ *
+ * Next to each staging file sits a <uuid>.meta file
+ * holding the parcel's envelope and the spans received
+ * so far. It is rewritten (via a rename, so it is never
+ * half-written) every time a range is committed, once
+ * the range's bytes are flushed to disk. This
+ * way a restarted daemon picks up where it left off and
+ * a reconnecting sender can ask which bytes it still
+ * has to send. Whatever the meta file claims is checked
+ * by the payload checksum in the end anyway.
+ */
+
+/**************
+ * STRUCTURES *
+ **************/
+/*
+ * A run of payload bytes that is already on disk.
+ */
+struct dp_spanlist {
+	struct dp_spanlist *next;
+	uint64_t end;
+	uint64_t start;
+};
+
+struct dp_transfer {
+	unsigned char checksum[SHA256_DIGEST_LENGTH * sizeof(unsigned char)];
+	char *path;
+	char *path_meta;
+	struct data64 *envelope;	/* Kept serialised for the meta file */
+	struct dp_parcel *parcel;	/* Without its payload */
+	struct dp_spanlist *spans;	/* Sorted by start and never adjacent */
+	struct dp_transfer *next;
+	pthread_mutex_t lock;
+	time_t touched;			/* When a range was last committed */
+	uuid_t uuid;			/* The parcel's */
+	uint64_t received;
+	uint64_t size;
+	uint32_t span_count;
+	int complete;
+	int fd;
+	int refs;			/* Connections currently writing to it */
+};
+/**********************/
+
+/********************
+ * Global Variables
+ ********************/
+struct path *transfer_dir;
+struct dp_transfer *transfers;
+pthread_mutex_t transfers_lock = PTHREAD_MUTEX_INITIALIZER;
+/**********************/
+
+/**********************
+ * Private Prototypes
+ **********************/
+int meta_parse(const struct data64 *, struct dp_parcel *, unsigned char [], uint64_t *, struct dp_span **, uint32_t *);
+int spans_add(struct dp_transfer *, uint64_t, uint64_t);
+void spans_clear(struct dp_transfer *);
+struct dp_span *spans_get(const struct dp_transfer *);
+struct dp_transfer *transfer_find(const uuid_t);
+void transfer_free(struct dp_transfer **);
+int transfer_load(const char *, time_t);
+struct dp_transfer *transfer_make(const uuid_t, const unsigned char [], uint64_t);
+int transfer_save(struct dp_transfer *);
+void transfers_expire(void);
+/**********************/
+
+
+/*
+ * Reads back what transfer_save() wrote. The parcel's
+ * envelope and head are filled in.
+ * It is the caller's responsibility to free the
+ * returned spans.
+ */
+int meta_parse(const struct data64 *meta, struct dp_parcel *parcel, unsigned char checksum[], uint64_t *size, struct dp_span **spans, uint32_t *count)
+{
+	struct data64 envelope;
+	struct data64 spans_data;
+	uint64_t end;
+	uint64_t pos;
+	uint16_t code;
+	
+	*spans = NULL;
+	pos = 0;
+	
+	if (meta->len < DP_TRANSFER_META_MAGIC_LEN + SHA256_DIGEST_LENGTH + sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint32_t) ||
+	    memcmp(meta->bytes, DP_TRANSFER_META_MAGIC, DP_TRANSFER_META_MAGIC_LEN) != 0)
+		return -1;
+	
+	/* 1) Magic number (8 bytes) */
+	pos += DP_TRANSFER_META_MAGIC_LEN;
+	
+	/* 2) Payload checksum (32 bytes) */
+	memcpy(checksum, &meta->bytes[pos], SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+	pos += SHA256_DIGEST_LENGTH * sizeof(unsigned char);
+	
+	/* 3) Timestamp (8 bytes) */
+	parcel->head.timestamp = (time_t)(meta->bytes[pos + 7] |
+		( (uint64_t)meta->bytes[pos + 6] << 8 ) |
+		( (uint64_t)meta->bytes[pos + 5] << 16 ) |
+		( (uint64_t)meta->bytes[pos + 4] << 24 ) |
+		( (uint64_t)meta->bytes[pos + 3] << 32 ) |
+		( (uint64_t)meta->bytes[pos + 2] << 40 ) |
+		( (uint64_t)meta->bytes[pos + 1] << 48 ) |
+		( (uint64_t)meta->bytes[pos] << 56 ));
+	pos += sizeof(uint64_t);
+	
+	/* 4) Sequence number (8 bytes) */
+	parcel->head.sequence = meta->bytes[pos + 7] |
+		( (uint64_t)meta->bytes[pos + 6] << 8 ) |
+		( (uint64_t)meta->bytes[pos + 5] << 16 ) |
+		( (uint64_t)meta->bytes[pos + 4] << 24 ) |
+		( (uint64_t)meta->bytes[pos + 3] << 32 ) |
+		( (uint64_t)meta->bytes[pos + 2] << 40 ) |
+		( (uint64_t)meta->bytes[pos + 1] << 48 ) |
+		( (uint64_t)meta->bytes[pos] << 56 );
+	pos += sizeof(uint64_t);
+	
+	/* 5) Envelope size (4 bytes) */
+	envelope.len = meta->bytes[pos + 3] |
+		( (uint32_t)meta->bytes[pos + 2] << 8 ) |
+		( (uint32_t)meta->bytes[pos + 1] << 16 ) |
+		( (uint32_t)meta->bytes[pos] << 24 );
+	pos += sizeof(uint32_t);
+	
+	/* 6) Envelope */
+	if (envelope.len > meta->len - pos)
+		return -1;
+	
+	envelope.bytes = &meta->bytes[pos];
+	
+	if (envelope_deserialise(&envelope, parcel, size, &end) != 0 ||
+	    end != envelope.len)
+		return -1;
+	
+	pos += envelope.len;
+	
+	/* 7) Spans */
+	spans_data.bytes = &meta->bytes[pos];
+	spans_data.len = meta->len - pos;
+	
+	if (spans_deserialise(&spans_data, parcel->head.uuid, &code, spans, count) != 0)
+		return -1;
+	
+	parcel->head.type = DP_PROTO_HOST_MSG_RANGE;
+	service_get(parcel->raw_filename, &(parcel->service));
+	
+	return 0;
+}
+
+/*
+ * Records [start, end) as received, merging it with
+ * any spans it overlaps or touches so that retried
+ * ranges are not counted twice. Returns -1, with the
+ * spans left as they were, if out of memory.
+ */
+int spans_add(struct dp_transfer *transfer, uint64_t start, uint64_t end)
+{
+	struct dp_spanlist **link;
+	struct dp_spanlist *merged;
+	struct dp_spanlist *span;
+	
+	if (!(merged = (struct dp_spanlist *)malloc(sizeof(*merged)))) {
+		trace_write(DP_TRACE_ERROR, "spans_add(3), malloc(1): %s", strerror(errno));
+		return -1;
+	}
+	
+	link = &transfer->spans;
+	
+	/* Skip the spans that end before this one starts. */
+	while (*link &&
+	       (*link)->end < start)
+		link = &(*link)->next;
+	
+	/* Swallow every span this one overlaps or touches. */
+	while (*link &&
+	       (*link)->start <= end) {
+		span = *link;
+		
+		if (span->start < start)
+			start = span->start;
+		
+		if (span->end > end)
+			end = span->end;
+		
+		transfer->received -= span->end - span->start;
+		transfer->span_count--;
+		*link = span->next;
+		free(span);
+	}
+	
+	merged->start = start;
+	merged->end = end;
+	merged->next = *link;
+	*link = merged;
+	transfer->received += end - start;
+	transfer->span_count++;
+	
+	return 0;
+}
+
+/*
+ * Forgets every span received. The transfer must be
+ * locked, except while it is being freed.
+ */
+void spans_clear(struct dp_transfer *transfer)
+{
+	struct dp_spanlist *span;
+	
+	while (transfer->spans) {
+		span = transfer->spans;
+		transfer->spans = span->next;
+		free(span);
+	}
+	
+	transfer->received = 0;
+	transfer->span_count = 0;
+}
+
+/*
+ * Copies the spans into an array of span_count entries.
+ * The transfer must be locked.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+struct dp_span *spans_get(const struct dp_transfer *transfer)
+{
+	struct dp_span *spans;
+	struct dp_spanlist *span;
+	uint32_t i;
+	
+	spans = (struct dp_span *)calloc(transfer->span_count ? transfer->span_count : 1, sizeof(*spans));
+	i = 0;
+	
+	for (span = transfer->spans; span; span = span->next) {
+		spans[i].end = span->end;
+		spans[i].start = span->start;
+		i++;
+	}
+	
+	return spans;
+}
+
+/*
+ * Makes sure the staging directory exists and picks up
+ * the partial parcels a previous run left behind.
+ * Whatever cannot be resumed is cleared out.
+ */
+int transfer_bootstrap(void)
+{
+	char name[UUID_STR_LEN + 1];
+	struct dirent *entry;
+	DIR *dir;
+	struct stat info;
+	size_t len_ext;
+	size_t len_name;
+	uuid_t uuid;
+	
+	transfer_dir = home_dir_get();
+	path_append(&transfer_dir, DP_DIR_CONF);
+	path_append(&transfer_dir, DP_DIR_PARTIAL);
+	
+	if (directory_make(transfer_dir) == -1)
+		return -1;
+	
+	dir = opendir(path_cstr(transfer_dir));
+	
+	if (!dir) {
+		trace_write(DP_TRACE_ERROR, "transfer_bootstrap(0), opendir(1): %s", strerror(errno));
+		return -1;
+	}
+	
+	len_ext = strlen(DP_TRANSFER_META_EXT);
+	
+	/* First, load every meta file that is recent enough. */
+	while ((entry = readdir(dir)) != NULL) {
+		char *path_str_meta;
+		
+		len_name = strlen(entry->d_name);
+		
+		if (len_name != UUID_STR_LEN + len_ext ||
+		    strcmp(entry->d_name + UUID_STR_LEN, DP_TRANSFER_META_EXT) != 0)
+			continue;
+		
+		path_append(&transfer_dir, entry->d_name);
+		path_str_meta = path_str(transfer_dir);
+		path_pop(&transfer_dir);
+		
+		if (stat(path_str_meta, &info) == -1 ||
+		    timestamp() - info.st_mtime > DP_TRANSFER_KEEP ||
+		    transfer_load(entry->d_name, info.st_mtime) != 0)
+			unlink(path_str_meta);
+		
+		free(path_str_meta);
+	}
+	
+	/* Then remove everything that does not belong to a loaded transfer. */
+	rewinddir(dir);
+	
+	while ((entry = readdir(dir)) != NULL) {
+		struct dp_transfer *transfer;
+		
+		if (entry->d_name[0] == '.')
+			continue;
+		
+		len_name = strlen(entry->d_name);
+		transfer = NULL;
+		
+		if (len_name == UUID_STR_LEN ||
+		    (len_name == UUID_STR_LEN + len_ext &&
+		     strcmp(entry->d_name + UUID_STR_LEN, DP_TRANSFER_META_EXT) == 0)) {
+			memcpy(name, entry->d_name, UUID_STR_LEN * sizeof(char));
+			name[UUID_STR_LEN] = '\0';
+			
+			if (uuid_parse(name, uuid) == 0)
+				transfer = transfer_find(uuid);
+		}
+		
+		if (!transfer) {
+			path_append(&transfer_dir, entry->d_name);
+			file_remove(transfer_dir);
+			path_pop(&transfer_dir);
+		}
+	}
+	
+	closedir(dir);
+	
+	return 0;
+}
+
+/*
+ * Lets go of a transfer. A finished transfer is
+ * forgotten once the last connection lets go of it.
+ */
+void transfer_close(struct dp_transfer **transfer)
+{
+	struct dp_transfer **link;
+	
+	if (!transfer ||
+	    !*transfer)
+		return;
+	
+	pthread_mutex_lock(&transfers_lock);
+	
+	if (--(*transfer)->refs == 0 &&
+	    (*transfer)->complete) {
+		for (link = &transfers; *link; link = &(*link)->next) {
+			if (*link == *transfer) {
+				*link = (*transfer)->next;
+				break;
+			}
+		}
+		
+		transfer_free(transfer);
+	}
+	
+	pthread_mutex_unlock(&transfers_lock);
+	*transfer = NULL;
+}
+
+/*
+ * Marks len bytes at offset as written. Returns 0 while
+ * bytes are still missing. Once the last of them is in,
+ * the payload is checked: on a match, 1 is returned
+ * along with the parcel ready for delivery, otherwise
+ * every byte counts as missing again and -1 is
+ * returned.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int transfer_commit(struct dp_transfer *transfer, uint64_t offset, uint64_t len, struct dp_parcel **out)
+{
+	unsigned char checksum[SHA256_DIGEST_LENGTH];
+	int complete;
+	
+	*out = NULL;
+	
+	if (len == 0)
+		return 0;
+	
+	/* The meta file must never claim bytes that a crash could still take back. */
+	if (fdatasync(transfer->fd) != 0) {
+		trace_write(DP_TRACE_WARN, "transfer_commit(4), fdatasync(1): %s", strerror(errno));
+		return -1;
+	}
+	
+	pthread_mutex_lock(&transfer->lock);
+	
+	if (spans_add(transfer, offset, offset + len) != 0) {
+		pthread_mutex_unlock(&transfer->lock);
+		return -1;
+	}
+	
+	transfer->touched = timestamp();
+	
+	/* Only one connection gets to finish the transfer. */
+	complete = transfer->received == transfer->size &&
+		   !transfer->complete;
+	
+	if (complete)
+		transfer->complete = 1;
+	else if (!transfer->complete)
+		transfer_save(transfer);
+	
+	pthread_mutex_unlock(&transfer->lock);
+	
+	if (!complete)
+		return 0;
+	
+	unlink(transfer->path_meta);
+	
+	if (sha_file(transfer->fd, transfer->size, checksum) != 0 ||
+	    memcmp(checksum, transfer->checksum, SHA256_DIGEST_LENGTH) != 0) {
+		trace_write(DP_TRACE_WARN, "%s: payload checksum mismatch; all of it has to be sent again", transfer->parcel->raw_filename);
+		
+		/* Ranges sent from now on are taken as if none had come yet. */
+		pthread_mutex_lock(&transfer->lock);
+		spans_clear(transfer);
+		transfer->complete = 0;
+		transfer->touched = timestamp();
+		pthread_mutex_unlock(&transfer->lock);
+		
+		return -1;
+	}
+	
+	*out = transfer->parcel;
+	(*out)->payload_file = transfer->path;
+	transfer->parcel = NULL;
+	transfer->path = NULL;
+	
+	return 1;
+}
+
+/*
+ * transfers_lock must be held, except while
+ * bootstrapping.
+ */
+struct dp_transfer *transfer_find(const uuid_t uuid)
+{
+	struct dp_transfer *transfer;
+	
+	for (transfer = transfers; transfer; transfer = transfer->next) {
+		if (uuid_compare(transfer->uuid, uuid) == 0)
+			break;
+	}
+	
+	return transfer;
+}
+
+void transfer_free(struct dp_transfer **transfer)
+{
+	if (!transfer ||
+	    !*transfer)
+		return;
+	
+	spans_clear(*transfer);
+	
+	if ((*transfer)->fd != -1)
+		close((*transfer)->fd);
+	
+	if ((*transfer)->envelope) {
+		free((*transfer)->envelope->bytes);
+		free((*transfer)->envelope);
+	}
+	
+	if ((*transfer)->path)
+		free((*transfer)->path);
+	
+	if ((*transfer)->path_meta)
+		free((*transfer)->path_meta);
+	
+	parcel_free(&(*transfer)->parcel);
+	pthread_mutex_destroy(&(*transfer)->lock);
+	free(*transfer);
+	*transfer = NULL;
+}
+
+/*
+ * Restores the transfer described by the given meta
+ * file. Returns -1 if its staging file is gone or
+ * does not match. Only called while bootstrapping.
+ */
+int transfer_load(const char *name, time_t touched)
+{
+	unsigned char checksum[SHA256_DIGEST_LENGTH];
+	char name_expected[UUID_STR_LEN + 1];
+	struct data64 *meta;
+	struct dp_parcel *parcel;
+	struct dp_span *spans;
+	struct dp_transfer *transfer;
+	struct stat info;
+	uint64_t size;
+	uint32_t count;
+	int status;
+	
+	path_append(&transfer_dir, name);
+	file_get(transfer_dir, &meta);
+	path_pop(&transfer_dir);
+	
+	if (!meta)
+		return -1;
+	
+	count = 0;
+	parcel = parcel_make();
+	spans = NULL;
+	transfer = NULL;
+	status = meta_parse(meta, parcel, checksum, &size, &spans, &count);
+	
+	file_release(&meta);
+	
+	/* The file name has to agree with the contents. */
+	if (status == 0) {
+		uuid_unparse_lower(parcel->head.uuid, name_expected);
+		
+		if (strncmp(name, name_expected, UUID_STR_LEN) != 0 ||
+		    transfer_find(parcel->head.uuid))
+			status = -1;
+	}
+	
+	if (status == 0) {
+		transfer = transfer_make(parcel->head.uuid, checksum, size);
+		
+		if ((transfer->fd = open(transfer->path, O_RDWR)) == -1 ||
+		    fstat(transfer->fd, &info) == -1 ||
+		    (uint64_t)info.st_size != size)
+			status = -1;
+	}
+	
+	for (uint32_t i = 0; status == 0 && i < count; i++) {
+		if (spans[i].start >= spans[i].end ||
+		    spans[i].end > size ||
+		    spans_add(transfer, spans[i].start, spans[i].end) != 0)
+			status = -1;
+	}
+	
+	if (spans)
+		free(spans);
+	
+	if (status != 0) {
+		parcel_free(&parcel);
+		transfer_free(&transfer);
+		
+		return -1;
+	}
+	
+	envelope_serialise(parcel, size, 0, &transfer->envelope);
+	transfer->parcel = parcel;
+	transfer->touched = touched;
+	transfer->next = transfers;
+	transfers = transfer;
+	
+	return 0;
+}
+
+/*
+ * Sets up a transfer without opening its staging file.
+ */
+struct dp_transfer *transfer_make(const uuid_t uuid, const unsigned char checksum[], uint64_t size)
+{
+	struct dp_transfer *transfer;
+	
+	transfer = (struct dp_transfer *)calloc(1, sizeof(*transfer));
+	transfer->fd = -1;
+	transfer->size = size;
+	transfer->touched = timestamp();
+	memcpy(transfer->checksum, checksum, SHA256_DIGEST_LENGTH);
+	uuid_copy(transfer->uuid, uuid);
+	pthread_mutex_init(&transfer->lock, NULL);
+	
+	transfer->path = transfer_path_get(uuid, "");
+	transfer->path_meta = transfer_path_get(uuid, DP_TRANSFER_META_EXT);
+	
+	return transfer;
+}
+
+/*
+ * Returns the transfer the range belongs to, starting
+ * one (and its preallocated staging file) if it is the
+ * first range to arrive. The range's parcel is taken
+ * over in that case. Returns NULL if the range does
+ * not fit the transfer.
+ * Every transfer returned must be let go of with
+ * transfer_close().
+ */
+struct dp_transfer *transfer_open(struct dp_range *range)
+{
+	struct dp_transfer *transfer;
+	int result;
+	
+	if (!range ||
+	    !transfer_dir)
+		return NULL;
+	
+	pthread_mutex_lock(&transfers_lock);
+	transfers_expire();
+	
+	if ((transfer = transfer_find(range->parcel->head.uuid)) != NULL) {
+		if (transfer->complete ||
+		    transfer->size != range->size ||
+		    memcmp(transfer->checksum, range->checksum, SHA256_DIGEST_LENGTH) != 0) {
+			pthread_mutex_unlock(&transfers_lock);
+			return NULL;
+		}
+		
+		transfer->refs++;
+		pthread_mutex_unlock(&transfers_lock);
+		
+		return transfer;
+	}
+	
+	transfer = transfer_make(range->parcel->head.uuid, range->checksum, range->size);
+	transfer->refs = 1;
+	
+	if ((transfer->fd = open(transfer->path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1) {
+		trace_write(DP_TRACE_WARN, "transfer_open(1), open(3): %s", strerror(errno));
+		transfer_free(&transfer);
+		pthread_mutex_unlock(&transfers_lock);
+		
+		return NULL;
+	}
+	
+	/* Reserve the space up front so that ranges can land anywhere without fragmenting the file. */
+	if (space_check(transfer->fd, transfer->size) != 0) {
+		trace_write(DP_TRACE_WARN, "transfer_open(1), space_check(2): %s", strerror(errno));
+		unlink(transfer->path);
+		transfer_free(&transfer);
+		pthread_mutex_unlock(&transfers_lock);
+		
+		return NULL;
+	}
+	
+#ifdef __linux__
+	result = posix_fallocate(transfer->fd, 0, transfer->size);
+	
+	/* Not every file system supports it. */
+	if (result == EOPNOTSUPP ||
+	    result == EINVAL)
+		result = ftruncate(transfer->fd, transfer->size) == 0 ? 0 : errno;
+#else
+	result = ftruncate(transfer->fd, transfer->size) == 0 ? 0 : errno;
+#endif
+	
+	if (result != 0) {
+		errno = result;
+		trace_write(DP_TRACE_WARN, "transfer_open(1), posix_fallocate(3): %s", strerror(errno));
+		unlink(transfer->path);
+		transfer_free(&transfer);
+		pthread_mutex_unlock(&transfers_lock);
+		
+		return NULL;
+	}
+	
+	envelope_serialise(range->parcel, range->size, 0, &transfer->envelope);
+	transfer->parcel = range->parcel;
+	range->parcel = NULL;
+	transfer->next = transfers;
+	transfers = transfer;
+	pthread_mutex_unlock(&transfers_lock);
+	
+	return transfer;
+}
+
+/*
+ * Returns the path of the file in the staging directory
+ * named after the UUID, followed by the suffix. Whatever
+ * is in there without belonging to a transfer is cleared
+ * out on start-up, so it suits other scratch files too.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+char *transfer_path_get(const uuid_t uuid, const char *suffix)
+{
+	char name[UUID_STR_LEN + 1];
+	const char *path_str_dir;
+	char *path;
+	size_t len;
+	
+	if (!transfer_dir ||
+	    !suffix)
+		return NULL;
+	
+	uuid_unparse_lower(uuid, name);
+	path_str_dir = path_cstr(transfer_dir);
+	len = strlen(path_str_dir) + 1 + UUID_STR_LEN + strlen(suffix) + 1;
+	path = (char *)calloc(len, sizeof(char));
+	snprintf(path, len, "%s/%s%s", path_str_dir, name, suffix);
+	
+	return path;
+}
+
+/*
+ * Writes the meta file. The transfer must be locked.
+ *
+ * STRUCTURE
+ * 1) Magic number (8 bytes)
+ * 2) Payload checksum (32 bytes)
+ * 3) Timestamp (8 bytes)
+ * 4) Sequence number (8 bytes)
+ * 5) Envelope size (4 bytes)
+ * 6) Envelope; see envelope_serialise()
+ * 7) Spans; see spans_serialise()
+ */
+int transfer_save(struct dp_transfer *transfer)
+{
+	char *path_tmp;
+	unsigned char *meta;
+	struct data16 *head;
+	struct data64 *spans_data;
+	struct dp_span *spans;
+	size_t len;
+	size_t written;
+	uint64_t pos;
+	uint64_t sequence;
+	uint64_t time_sent;
+	int fd;
+	int status;
+	
+	spans = spans_get(transfer);
+	status = spans_serialise(transfer->uuid, DP_REQACCEPTED.code, spans, transfer->span_count, &head, &spans_data);
+	free(spans);
+	
+	if (status != 0)
+		return -1;
+	
+	free(head->bytes);
+	free(head);
+	
+	len = DP_TRANSFER_META_MAGIC_LEN + SHA256_DIGEST_LENGTH + sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint32_t) + transfer->envelope->len + spans_data->len;
+	meta = (unsigned char *)calloc(len, sizeof(unsigned char));
+	pos = 0;
+	sequence = transfer->parcel->head.sequence;
+	time_sent = (uint64_t)transfer->parcel->head.timestamp;
+	
+	/* 1) Magic number (8 bytes) */
+	memcpy(meta, DP_TRANSFER_META_MAGIC, DP_TRANSFER_META_MAGIC_LEN);
+	pos += DP_TRANSFER_META_MAGIC_LEN;
+	
+	/* 2) Payload checksum (32 bytes) */
+	memcpy(&meta[pos], transfer->checksum, SHA256_DIGEST_LENGTH * sizeof(unsigned char));
+	pos += SHA256_DIGEST_LENGTH * sizeof(unsigned char);
+	
+	/* 3) Timestamp (8 bytes) */
+	meta[pos]   = (time_sent >> 56) & 0xff;
+	meta[++pos] = (time_sent >> 48) & 0xff;
+	meta[++pos] = (time_sent >> 40) & 0xff;
+	meta[++pos] = (time_sent >> 32) & 0xff;
+	meta[++pos] = (time_sent >> 24) & 0xff;
+	meta[++pos] = (time_sent >> 16) & 0xff;
+	meta[++pos] = (time_sent >> 8) & 0xff;
+	meta[++pos] = time_sent & 0xff;
+	
+	/* 4) Sequence number (8 bytes) */
+	meta[++pos] = (sequence >> 56) & 0xff;
+	meta[++pos] = (sequence >> 48) & 0xff;
+	meta[++pos] = (sequence >> 40) & 0xff;
+	meta[++pos] = (sequence >> 32) & 0xff;
+	meta[++pos] = (sequence >> 24) & 0xff;
+	meta[++pos] = (sequence >> 16) & 0xff;
+	meta[++pos] = (sequence >> 8) & 0xff;
+	meta[++pos] = sequence & 0xff;
+	
+	/* 5) Envelope size (4 bytes) */
+	meta[++pos] = (transfer->envelope->len >> 24) & 0xff;
+	meta[++pos] = (transfer->envelope->len >> 16) & 0xff;
+	meta[++pos] = (transfer->envelope->len >> 8) & 0xff;
+	meta[++pos] = transfer->envelope->len & 0xff;
+	
+	/* 6) Envelope */
+	memcpy(&meta[++pos], transfer->envelope->bytes, transfer->envelope->len * sizeof(unsigned char));
+	pos += transfer->envelope->len;
+	
+	/* 7) Spans */
+	memcpy(&meta[pos], spans_data->bytes, spans_data->len * sizeof(unsigned char));
+	free(spans_data->bytes);
+	free(spans_data);
+	
+	/* Write it next to the old one and swap them so that a crash never leaves a torn meta file. */
+	path_tmp = (char *)calloc(strlen(transfer->path_meta) + 2, sizeof(char));
+	sprintf(path_tmp, "%s~", transfer->path_meta);
+	status = -1;
+	written = 0;
+	
+	/* Both the meta file and its name have to reach the disk before the ranges are acknowledged. */
+	if ((fd = open(path_tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) == -1) {
+		trace_write(DP_TRACE_WARN, "transfer_save(1), open(3): %s", strerror(errno));
+	} else {
+		while (written < len) {
+			ssize_t result;
+			
+			if ((result = write(fd, meta + written, len - written)) == -1) {
+				if (errno == EINTR)
+					continue;
+				
+				trace_write(DP_TRACE_WARN, "transfer_save(1), write(3): %s", strerror(errno));
+				break;
+			}
+			
+			written += result;
+		}
+		
+		if (written == len &&
+		    fdatasync(fd) != 0) {
+			trace_write(DP_TRACE_WARN, "transfer_save(1), fdatasync(1): %s", strerror(errno));
+			written = 0;
+		}
+		
+		close(fd);
+		
+		if (written != len ||
+		    rename(path_tmp, transfer->path_meta) != 0)
+			unlink(path_tmp);
+		else if (directory_sync(transfer_dir) == 0)
+			status = 0;
+	}
+	
+	free(meta);
+	free(path_tmp);
+	
+	return status;
+}
+
+/*
+ * Looks up the spans received so far of a parcel.
+ * Returns 0 along with the spans if a transfer is
+ * under way, otherwise 1.
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+int transfer_spans_get(const uuid_t uuid, struct dp_span **spans, uint32_t *count)
+{
+	struct dp_transfer *transfer;
+	
+	if (!spans ||
+	    !count)
+		return 1;
+	
+	*spans = NULL;
+	*count = 0;
+	pthread_mutex_lock(&transfers_lock);
+	
+	if ((transfer = transfer_find(uuid)) != NULL) {
+		pthread_mutex_lock(&transfer->lock);
+		*spans = spans_get(transfer);
+		*count = transfer->span_count;
+		pthread_mutex_unlock(&transfer->lock);
+	}
+	
+	pthread_mutex_unlock(&transfers_lock);
+	
+	return transfer ? 0 : 1;
+}
+
+/*
+ * Writes range bytes at offset. Returns 0 on success,
+ * 1 if they do not fit in the payload or -1 on failure.
+ */
+int transfer_write(struct dp_transfer *transfer, uint64_t offset, const unsigned char *bytes, size_t len)
+{
+	size_t written;
+	
+	if (offset > transfer->size ||
+	    len > transfer->size - offset)
+		return 1;
+	
+	written = 0;
+	
+	while (written < len) {
+		ssize_t result;
+		
+		if ((result = pwrite(transfer->fd, bytes + written, len - written, offset + written)) == -1) {
+			if (errno == EINTR)
+				continue;
+			
+			trace_write(DP_TRACE_WARN, "transfer_write(4), pwrite(4): %s", strerror(errno));
+			return -1;
+		}
+		
+		written += result;
+	}
+	
+	return 0;
+}
+
+/*
+ * Drops the transfers nobody has touched for longer
+ * than DP_TRANSFER_KEEP. transfers_lock must be held.
+ */
+void transfers_expire(void)
+{
+	struct dp_transfer **link;
+	struct dp_transfer *transfer;
+	time_t now;
+	
+	link = &transfers;
+	now = timestamp();
+	
+	while (*link) {
+		transfer = *link;
+		
+		if (transfer->refs == 0 &&
+		    !transfer->complete &&
+		    now - transfer->touched > DP_TRANSFER_KEEP) {
+			*link = transfer->next;
+			unlink(transfer->path);
+			unlink(transfer->path_meta);
+			transfer_free(&transfer);
+		} else {
+			link = &transfer->next;
+		}
+	}
+}
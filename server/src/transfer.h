@@ -0,0 +1,36 @@
+//
+//  transfer.h
+//  server
+//
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+
+#include "protocol.h"
+
+
+#define DP_TRANSFER_BUF_LEN		65536	/* Range bytes are moved from the socket to the file in chunks of this size. */
+#define DP_TRANSFER_KEEP		604800	/* Seconds an abandoned partial parcel is kept around for (one week). */
+#define DP_TRANSFER_META_EXT		".meta"
+#define DP_TRANSFER_META_MAGIC		"DPPART01"
+#define DP_TRANSFER_META_MAGIC_LEN	8
+
+/**************
+ * STRUCTURES *
+ **************/
+struct dp_transfer;
+
+/*************
+ * FUNCTIONS *
+ *************/
+int transfer_bootstrap(void);
+void transfer_close(struct dp_transfer **);
+int transfer_commit(struct dp_transfer *, uint64_t, uint64_t, struct dp_parcel **);
+struct dp_transfer *transfer_open(struct dp_range *);
+char *transfer_path_get(const uuid_t, const char *);
+int transfer_spans_get(const uuid_t, struct dp_span **, uint32_t *);
+int transfer_write(struct dp_transfer *, uint64_t, const unsigned char *, size_t);
+
+
+#endif /* TRANSFER_H */
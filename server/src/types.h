@@ -10,6 +10,7 @@
 #define TYPES_H
 
 
+#include <stddef.h>
 #include <stdint.h>
 
 
@@ -28,15 +29,59 @@ struct data16 {
 	uint16_t len;
 };
 
+/*
+ * Memory handed out by an arena lives until the arena
+ * is rewound past it or freed; nothing in it is freed
+ * on its own.
+ */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t len;
+	size_t used;
+	unsigned char bytes[];
+};
+
+struct arena {
+	struct arena_chunk *current;
+	struct arena_chunk *head;
+	size_t len_chunk;
+};
+
+struct arena_mark {
+	struct arena_chunk *chunk;
+	size_t used;
+};
+
+/*
+ * A path is one '/'-separated string along with the
+ * offset at which each component starts, so it can be
+ * handed to a system call as is. A component may itself
+ * contain slashes (e.g. the root directory read from the
+ * config file) and is popped as a whole.
+ */
 struct path {
-	char *component;
-	struct path *next;
-	struct path *previous;
+	char *buf;		/* Always NUL-terminated */
+	struct arena *arena;	/* Owns the path when set */
+	size_t *offsets;
+	size_t count;
+	size_t count_max;
+	size_t len;
+	size_t len_max;
+};
+
+struct fileentry {
+	char *name;
+	uint64_t inode;
+	unsigned char type;	/* DT_* from <dirent.h>; links are resolved to what they point at */
 };
 
-struct filelist {
-	struct path *path;
-	struct filelist *next;
+/*
+ * A directory listing with its entries sorted by name.
+ */
+struct filearray {
+	struct fileentry *entries;
+	size_t count;
+	size_t count_max;
 };
 
 struct token {
@@ -8,45 +8,196 @@
 
 #include "util.h"
 
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "trace.h"
 
 
-char *path_str(const struct path *path)
+/*
+ * Returns memory for size bytes from the arena. Chunks
+ * that were rewound past are reused before a new one is
+ * made.
+ */
+void *arena_alloc(struct arena *arena, size_t size)
 {
-	char *str;
-	struct path *iter;
+	struct arena_chunk *chunk;
+	struct arena_chunk *last;
+	void *ptr;
+	size_t len;
 	
-	if (!path)
+	if (!arena)
 		return NULL;
 	
-	iter = (struct path *)path;
-	str = NULL;
+	size = (size + DP_ARENA_ALIGN - 1) & ~(DP_ARENA_ALIGN - 1);
+	chunk = arena->current;
+	last = NULL;
 	
-	if (!iter->next &&
-	    iter->previous) {
-		/* Last path component; rewind to the beginning. */
-		while (iter->previous)
-			iter = iter->previous;
+	while (chunk &&
+	       chunk->used + size > chunk->len) {
+		last = chunk;
+		chunk = chunk->next;
+		
+		if (chunk)
+			chunk->used = 0;
 	}
 	
-	while (iter) {
-		if (str) {
-			/* +2 for the '/' and \0. */
-			str = (char *)realloc(str, strlen(str) + strlen(iter->component) + 2);
-			strcat(str, "/");
-			strcat(str, iter->component);
-		} else {
-			str = (char *)calloc(strlen(iter->component) + 1, sizeof(char));
-			strcpy(str, iter->component);
+	if (!chunk) {
+		len = size > arena->len_chunk ? size : arena->len_chunk;
+		
+		if (!(chunk = (struct arena_chunk *)malloc(sizeof(*chunk) + len))) {
+			trace_write(DP_TRACE_ERROR, "arena_alloc(2), malloc(1): %s", strerror(errno));
+			return NULL;
 		}
 		
-		iter = iter->next;
+		chunk->len = len;
+		chunk->next = NULL;
+		chunk->used = 0;
+		
+		if (last)
+			last->next = chunk;
+		else
+			arena->head = chunk;
+	}
+	
+	arena->current = chunk;
+	ptr = chunk->bytes + chunk->used;
+	chunk->used += size;
+	
+	return ptr;
+}
+
+void arena_free(struct arena **arena)
+{
+	struct arena_chunk *chunk;
+	struct arena_chunk *next;
+	
+	if (!arena ||
+	    !*arena)
+		return;
+	
+	chunk = (*arena)->head;
+	
+	while (chunk) {
+		next = chunk->next;
+		free(chunk);
+		chunk = next;
 	}
 	
+	free(*arena);
+	*arena = NULL;
+}
+
+/*
+ * No memory is taken until the first allocation. Pass 0
+ * for the default chunk size. It is the caller's
+ * responsibility to free the returned pointer by calling
+ * arena_free(1).
+ */
+struct arena *arena_make(size_t len_chunk)
+{
+	struct arena *arena;
+	
+	if (!(arena = (struct arena *)malloc(sizeof(*arena))))
+		return NULL;
+	
+	arena->current = NULL;
+	arena->head = NULL;
+	arena->len_chunk = len_chunk ? len_chunk : DP_ARENA_CHUNK_LEN;
+	
+	return arena;
+}
+
+/*
+ * Everything allocated after the returned mark can be
+ * given back at once with arena_rewind(2).
+ */
+struct arena_mark arena_mark_get(const struct arena *arena)
+{
+	struct arena_mark mark;
+	
+	mark.chunk = arena->current;
+	mark.used = arena->current ? arena->current->used : 0;
+	
+	return mark;
+}
+
+void arena_rewind(struct arena *arena, struct arena_mark mark)
+{
+	if (!arena)
+		return;
+	
+	if (mark.chunk) {
+		arena->current = mark.chunk;
+		arena->current->used = mark.used;
+	} else {
+		arena->current = arena->head;
+		
+		if (arena->current)
+			arena->current->used = 0;
+	}
+}
+
+/*
+ * Returns the path as a C string without copying it. The
+ * string belongs to the path and changes along with it.
+ */
+const char *path_cstr(const struct path *path)
+{
+	if (!path)
+		return NULL;
+	
+	return path->buf;
+}
+
+/*
+ * FNV-1a.
+ */
+uint64_t path_hash(const char *path)
+{
+	uint64_t hash;
+	
+	hash = 0xcbf29ce484222325ULL;
+	
+	for (; *path; path++) {
+		hash ^= (unsigned char)*path;
+		hash *= 0x100000001b3ULL;
+	}
+	
+	return hash;
+}
+
+/*
+ * It is the caller's responsibility to free the
+ * returned pointer.
+ */
+char *path_str(const struct path *path)
+{
+	char *str;
+	
+	if (!path)
+		return NULL;
+	
+	if ((str = (char *)malloc(path->len + 1)))
+		memcpy(str, path->buf, path->len + 1);
+	
 	return str;
 }
 
+/*
+ * Returns a monotonic clock reading in milliseconds.
+ * Only useful for measuring intervals.
+ */
+uint64_t time_ms(void)
+{
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 time_t timestamp(void)
 {
 	time_t curr_time;
@@ -18,13 +18,23 @@
 /*************
  * CONSTANTS *
  *************/
+static const size_t DP_ARENA_ALIGN = 16;
+static const size_t DP_ARENA_CHUNK_LEN = 65536;
 static const int UUID_LEN = 16;
 static const int UUID_STR_LEN = 36;
 
 /*************
  * FUNCTIONS *
  *************/
+void *arena_alloc(struct arena *, size_t);
+void arena_free(struct arena **);
+struct arena *arena_make(size_t);
+struct arena_mark arena_mark_get(const struct arena *);
+void arena_rewind(struct arena *, struct arena_mark);
+const char *path_cstr(const struct path *);
+uint64_t path_hash(const char *);
 char *path_str(const struct path *);
+uint64_t time_ms(void);
 time_t timestamp(void);
 char *uuid_str(void);
 
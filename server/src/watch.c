@@ -0,0 +1,434 @@
+//
+//  watch.c
+//  server
+//
+
+#include "watch.h"
+
+#include <dirent.h>
+#include "disk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include "keyring.h"
+#include <poll.h>
+#include "protocol.h"
+#include <pthread.h>
+#include "scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "trace.h"
+#include <unistd.h>
+#include "util.h"
+
+
+/*
+ * WATCHING
+ * --
+ * Rather than walking the whole root directory every
+ * DP_DIR_SCAN_INT ms, every directory under it is
+ * watched for changes with inotify(7). The watcher
+ * thread gathers the directories that changed and,
+ * once things settle for DP_WATCH_SETTLE_INT ms, runs
+ * directory_process() on each of them and nothing else.
+ * Under constant change things never settle, so a batch
+ * is also acted on once it is DP_WATCH_LATENCY_MAX ms
+ * old or holds DP_WATCH_BATCH_MAX changes.
+ * New directories are watched (and processed) as they
+ * appear. A change to a key file also drops the key
+ * from the keyring right away.
+ *
+ * If the kernel cannot watch the whole tree (e.g. the
+ * watch limit is reached) or this is not Linux, the
+ * watcher gives up and the periodic scans take over
+ * again; see watch_enabled().
+ */
+
+/**************
+ * STRUCTURES *
+ **************/
+struct dp_watch {
+	struct path *path;	/* NULL once the directory is gone */
+	unsigned int walk;	/* Last walk that reached the directory */
+	int depth;
+	int dirty;
+};
+/**********************/
+
+/********************
+ * Global Variables
+ ********************/
+struct arena *watch_arena;
+int *watch_dirty;
+int watch_dirty_count;
+int watch_dirty_max;
+int watch_fd = -1;
+pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+int watch_on;
+struct path *watch_root;
+unsigned int watch_walk;
+struct dp_watch *watches;
+int watches_len;
+/**********************/
+
+/**********************
+ * Private Prototypes
+ **********************/
+int watch_add(struct path *, int);
+void watch_dirty_mark(int);
+void watch_flush(void);
+void watch_off(void);
+void watch_rewalk(void);
+void *watch_run(void *);
+#ifdef __linux__
+void watch_event(const struct inotify_event *);
+#endif
+/**********************/
+
+
+/*
+ * Watches the directory at path and everything under it,
+ * and marks all of it for processing. Returns -1 if the
+ * kernel would not watch one of the directories.
+ */
+int watch_add(struct path *path, int depth)
+{
+#ifdef __linux__
+	struct arena_mark mark;
+	struct filearray files;
+	struct dp_watch *grown;
+	struct stat info;
+	char *names;
+	uint32_t names_len;
+	int dirfd;
+	int status;
+	int wd;
+	
+	if ((wd = inotify_add_watch(watch_fd, path_cstr(path), IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)) == -1) {
+		/* It may have gone away in the meantime. */
+		if (errno == ENOENT ||
+		    errno == ENOTDIR)
+			return 0;
+		
+		trace_write(DP_TRACE_WARN, "watch_add(2), inotify_add_watch(3): %s", strerror(errno));
+		return -1;
+	}
+	
+	if (wd >= watches_len) {
+		if (!(grown = (struct dp_watch *)realloc(watches, (wd + 1) * 2 * sizeof(*watches)))) {
+			inotify_rm_watch(watch_fd, wd);
+			return -1;
+		}
+		
+		memset(grown + watches_len, 0, ((wd + 1) * 2 - watches_len) * sizeof(*grown));
+		watches = grown;
+		watches_len = (wd + 1) * 2;
+	}
+	
+	/* A link back up the tree. */
+	if (watches[wd].walk == watch_walk &&
+	    watches[wd].path)
+		return 0;
+	
+	/* Directories keep their watch when they are moved. */
+	if (watches[wd].path &&
+	    strcmp(path_cstr(watches[wd].path), path_cstr(path)) != 0)
+		path_free(&watches[wd].path);
+	
+	if (!watches[wd].path)
+		watches[wd].path = path_copy(path);
+	
+	watches[wd].depth = depth;
+	watches[wd].walk = watch_walk;
+	watch_dirty_mark(wd);
+	
+	if ((dirfd = directory_open(AT_FDCWD, path_cstr(path))) == -1)
+		return 0;
+	
+	mark = arena_mark_get(watch_arena);
+	status = 0;
+	
+	/* A directory unchanged since the last full scan need not be listed. */
+	if (fstat(dirfd, &info) == 0 &&
+	    scan_state_names_get(&info, watch_arena, &names, &names_len, NULL) == 0) {
+		for (uint32_t i = 0; i < names_len && status == 0; i += strlen(names + i) + 1) {
+			path_append(&path, names + i);
+			status = watch_add(path, depth + 1);
+			path_pop(&path);
+		}
+	} else {
+		filearray_at_get(dirfd, watch_arena, &files);
+		
+		for (size_t i = 0; i < files.count && status == 0; i++) {
+			if (files.entries[i].type == DT_DIR) {
+				path_append(&path, files.entries[i].name);
+				status = watch_add(path, depth + 1);
+				path_pop(&path);
+			}
+		}
+	}
+	
+	close(dirfd);
+	arena_rewind(watch_arena, mark);
+	
+	return status;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Starts watching the tree under root. Returns 0 if the
+ * watcher took over from the periodic scans.
+ */
+int watch_bootstrap(const struct path *root)
+{
+#ifdef __linux__
+	pthread_t thread;
+	int result;
+	
+	if (!root)
+		return 1;
+	
+	if ((watch_fd = inotify_init1(IN_CLOEXEC)) == -1) {
+		trace_write(DP_TRACE_ERROR, "watch_bootstrap(1), inotify_init1(1): %s", strerror(errno));
+		return -1;
+	}
+	
+	watch_arena = arena_make(0);
+	watch_root = path_copy(root);
+	watch_on = 1;
+	
+	if ((result = pthread_create(&thread, NULL, watch_run, NULL)) != 0) {
+		trace_write(DP_TRACE_ERROR, "watch_bootstrap(1), pthread_create(4): %s", strerror(result));
+		watch_off();
+		return -1;
+	}
+	
+	pthread_detach(thread);
+	
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+void watch_dirty_mark(int wd)
+{
+	int *grown;
+	
+	if (watches[wd].dirty)
+		return;
+	
+	if (watch_dirty_count == watch_dirty_max) {
+		if (!(grown = (int *)realloc(watch_dirty, (watch_dirty_max ? watch_dirty_max * 2 : 64) * sizeof(*grown))))
+			return;
+		
+		watch_dirty = grown;
+		watch_dirty_max = watch_dirty_max ? watch_dirty_max * 2 : 64;
+	}
+	
+	watches[wd].dirty = 1;
+	watch_dirty[watch_dirty_count++] = wd;
+}
+
+/*
+ * Only 1 while the watcher is keeping up with the whole
+ * tree, i.e. the periodic scans are not needed.
+ */
+int watch_enabled(void)
+{
+	int enabled;
+	
+	pthread_mutex_lock(&watch_lock);
+	enabled = watch_on;
+	pthread_mutex_unlock(&watch_lock);
+	
+	return enabled;
+}
+
+#ifdef __linux__
+void watch_event(const struct inotify_event *event)
+{
+	struct path *path;
+	
+	/* Events were dropped; go over everything again. */
+	if (event->mask & IN_Q_OVERFLOW) {
+		watch_rewalk();
+		return;
+	}
+	
+	if (event->wd < 0 ||
+	    event->wd >= watches_len ||
+	    !watches[event->wd].path)
+		return;
+	
+	/* The directory is gone. */
+	if (event->mask & IN_IGNORED) {
+		path_free(&watches[event->wd].path);
+		return;
+	}
+	
+	if (event->len > 0) {
+		/* The index is written while the directory is processed. */
+		if (strncmp(event->name, DP_FILE_INDEX, strlen(DP_FILE_INDEX)) == 0)
+			return;
+		
+		/* So is an event log, with every parcel. */
+		if (strcmp(event->name, DP_FILE_LOG) == 0)
+			return;
+		
+		if ((event->mask & IN_ISDIR) &&
+		    (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+			path = path_copy(watches[event->wd].path);
+			path_append(&path, event->name);
+			watch_walk++;
+			
+			if (watch_add(path, watches[event->wd].depth + 1) != 0)
+				watch_off();
+			
+			path_free(&path);
+		} else if (strcmp(event->name, DP_FILE_PUBKEY) == 0 ||
+			   strcmp(event->name, DP_FILE_PRIVKEY) == 0) {
+			path = path_copy(watches[event->wd].path);
+			path_append(&path, event->name);
+			keyring_invalidate(path_cstr(path));
+			path_free(&path);
+		}
+	}
+	
+	watch_dirty_mark(event->wd);
+}
+#endif
+
+/*
+ * Processes every directory that changed since the last
+ * flush.
+ */
+void watch_flush(void)
+{
+	struct arena_mark mark;
+	struct filearray files;
+	int dirfd;
+	int wd;
+	
+	/* In the order they changed, so parents come first. */
+	for (int i = 0; i < watch_dirty_count; i++) {
+		wd = watch_dirty[i];
+		watches[wd].dirty = 0;
+		
+		if (!watches[wd].path ||
+		    (dirfd = directory_open(AT_FDCWD, path_cstr(watches[wd].path))) == -1)
+			continue;
+		
+		trace_write(DP_TRACE_INFO, "Scanning %s…", path_name_get(watches[wd].path));
+		mark = arena_mark_get(watch_arena);
+		filearray_at_get(dirfd, watch_arena, &files);
+		directory_process(dirfd, &files, watches[wd].depth);
+		arena_rewind(watch_arena, mark);
+		close(dirfd);
+	}
+	
+	watch_dirty_count = 0;
+}
+
+/*
+ * Hands the tree back to the periodic scans.
+ */
+void watch_off(void)
+{
+	trace_write(DP_TRACE_WARN, "Unable to watch %s for changes; scanning it every %d ms instead", path_cstr(watch_root), DP_DIR_SCAN_INT);
+	
+	pthread_mutex_lock(&watch_lock);
+	watch_on = 0;
+	pthread_mutex_unlock(&watch_lock);
+}
+
+/*
+ * Watches the whole tree again and has every directory in
+ * it processed by a full, parallel scan rather than one
+ * by one by the watcher.
+ */
+void watch_rewalk(void)
+{
+	watch_walk++;
+	
+	if (watch_add(watch_root, 0) != 0) {
+		watch_off();
+		return;
+	}
+	
+	for (int i = 0; i < watch_dirty_count; i++)
+		watches[watch_dirty[i]].dirty = 0;
+	
+	watch_dirty_count = 0;
+	scan_tree(watch_root);
+}
+
+void *watch_run(void *args)
+{
+#ifdef __linux__
+	unsigned char *buffer;
+	struct inotify_event *event;
+	struct pollfd pfd;
+	uint64_t time_first;
+	ssize_t len;
+	int count;
+	
+	/* inotify_event has an int in front; keep it aligned. */
+	buffer = (unsigned char *)aligned_alloc(sizeof(int), DP_WATCH_BUF_LEN);
+	pfd.fd = watch_fd;
+	pfd.events = POLLIN;
+	
+	if (!buffer)
+		watch_off();
+	else
+		watch_rewalk();
+	
+	while (watch_enabled()) {
+		watch_flush();
+		
+		/* Block for the first change, then gather the rest of the batch. */
+		if ((len = read(watch_fd, buffer, DP_WATCH_BUF_LEN)) == -1) {
+			if (errno == EINTR)
+				continue;
+			
+			trace_write(DP_TRACE_WARN, "watch_run(1), read(3): %s", strerror(errno));
+			watch_off();
+			break;
+		}
+		
+		time_first = time_ms();
+		count = 0;
+		
+		do {
+			for (ssize_t i = 0; i < len; i += sizeof(*event) + event->len) {
+				event = (struct inotify_event *)(buffer + i);
+				watch_event(event);
+				count++;
+			}
+			
+			len = 0;
+			
+			/* Whatever is left waits in the queue for the next batch. */
+			if (count >= DP_WATCH_BATCH_MAX ||
+			    time_ms() - time_first >= DP_WATCH_LATENCY_MAX)
+				break;
+			
+			if (poll(&pfd, 1, DP_WATCH_SETTLE_INT) > 0)
+				len = read(watch_fd, buffer, DP_WATCH_BUF_LEN);
+		} while (len > 0 &&
+			 watch_enabled());
+	}
+	
+	if (buffer)
+		free(buffer);
+	
+	close(watch_fd);
+#endif
+	
+	return 0;
+}
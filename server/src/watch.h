@@ -0,0 +1,29 @@
+//
+//  watch.h
+//  server
+//
+
+#ifndef WATCH_H
+#define WATCH_H
+
+
+#include "types.h"
+
+
+#define DP_WATCH_BUF_LEN	65536	/* Change notifications read per system call */
+
+/*************
+ * CONSTANTS *
+ *************/
+static const int DP_WATCH_BATCH_MAX 	= 4096;	/* Changes gathered into a batch before it is acted on regardless. */
+static const int DP_WATCH_LATENCY_MAX 	= 250;	/* How long (in milliseconds) a batch may keep gathering changes before it is acted on regardless. */
+static const int DP_WATCH_SETTLE_INT 	= 10;	/* How long (in milliseconds) to wait for more changes before acting on a batch. */
+
+/*************
+ * FUNCTIONS *
+ *************/
+int watch_bootstrap(const struct path *);
+int watch_enabled(void);
+
+
+#endif /* WATCH_H */
@@ -0,0 +1,94 @@
+#!/bin/bash
+#
+#  sync_test.sh
+#  server
+#
+#  Runs two daemons on this machine and syncs a contact's
+#  directory from one to the other; see sync.c.
+#
+#  A, on port 1992, keeps the directory of foo (sending
+#  as bar.com) for alice@<address>. B, on port 1993, is
+#  alice's host. B is given A's key, the files are synced
+#  and both copies are compared. The key is then taken
+#  away and a sync is expected to get nothing through.
+#
+#  Connections from the loopback address are taken to be
+#  clients, so A reaches B through this machine's first
+#  other address unless one is given.
+#
+#  usage: sync_test.sh <path to dispatchd> [address]
+#
+
+DISPATCHD=${1:-dispatchd}
+ADDR=${2:-$(hostname -I | cut -d' ' -f1)}
+WORK=$(mktemp -d)
+A=$WORK/a
+B=$WORK/b
+A_DIR=$A/Dispatch/localhost/foo/$ADDR/alice
+B_DIR=$B/Dispatch/$ADDR/alice/bar.com/foo
+B_KEY=$B/Dispatch/$ADDR/alice/bar.com/.pubkey
+PIDS=
+
+cleanup() {
+	[ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+
+fail() {
+	echo "FAIL: $1"
+	echo "--- A"; cat "$A/out.txt" "$A/.dispatch/dp.log" 2>/dev/null | tail -20
+	echo "--- B"; cat "$B/out.txt" "$B/.dispatch/dp.log" 2>/dev/null | tail -20
+	exit 1
+}
+
+# Asks the daemon listening on the port to sync a contact.
+sync_request() {
+	exec 3<>/dev/tcp/127.0.0.1/$1 || fail "no daemon on port $1"
+	printf '!DP1\r\n-s %s\r\n\r\n' "$2" >&3
+	exec 3>&-
+}
+
+# Waits for the file to show up in B's copy.
+wait_for() {
+	for i in $(seq 1 50); do
+		[ -f "$B_DIR/$1" ] && return 0
+		sleep 0.2
+	done
+	
+	return 1
+}
+
+trap cleanup EXIT
+
+[ -n "$ADDR" ] || fail "no address to reach B on"
+mkdir -p "$A/.dispatch" "$B/.dispatch" "$A_DIR/a/b" "$(dirname "$B_KEY")"
+printf '!DP_CONFIG\nDOCROOT %s\nSIGN 16\nPORT %s 1993\n' "$A/Dispatch" "$ADDR" > "$A/.dispatch/dp.conf"
+printf '!DP_CONFIG\nDOCROOT %s\nPORT localhost 1993\n' "$B/Dispatch" > "$B/.dispatch/dp.conf"
+
+openssl genpkey -algorithm ed25519 -out "$A/Dispatch/id.pem" 2>/dev/null || fail "unable to make a key"
+openssl pkey -in "$A/Dispatch/id.pem" -pubout -out "$B_KEY" 2>/dev/null
+
+echo "first file" > "$A_DIR/f1.txt"
+echo "deep down" > "$A_DIR/a/b/deep.txt"
+head -c 2000000 /dev/urandom > "$A_DIR/a/big.bin"
+
+(cd "$A" && HOME=$A exec "$DISPATCHD" > "$A/out.txt" 2>&1) &
+PIDS="$PIDS $!"
+(cd "$B" && HOME=$B exec "$DISPATCHD" > "$B/out.txt" 2>&1) &
+PIDS="$PIDS $!"
+sleep 1
+
+sync_request 1992 "alice@$ADDR"
+wait_for a/big.bin || fail "the files did not arrive"
+sleep 1
+diff -r -x '.*' "$A_DIR" "$B_DIR" > /dev/null || fail "the copies differ"
+echo "ok: synced"
+
+# Without A's key, B answers no questions and takes no files.
+rm "$B_KEY"
+sleep 3
+echo "late" > "$A_DIR/late.txt"
+sync_request 1992 "alice@$ADDR"
+wait_for late.txt && fail "a sync went through without the key"
+echo "ok: refused without the key"